@@ -67,6 +67,11 @@ int activitypub_request(snac *snac, const char *url, xs_dict **data)
     xs *payload = NULL;
     int p_size;
     char *ctype;
+    xs *key = xs_fmt("request:%s", url);
+
+    /* is another thread already requesting it? */
+    if (!flight_begin(key, &status, data))
+        return status;
 
     /* get from the net */
     response = http_signed_request(snac, "GET", url,
@@ -103,6 +108,8 @@ int activitypub_request(snac *snac, const char *url, xs_dict **data)
     if (!valid_status(status))
         *data = NULL;
 
+    flight_end(key, status, *data);
+
     return status;
 }
 
@@ -120,14 +127,26 @@ int actor_request(snac *snac, const char *actor, xs_dict **data)
     status = actor_get(actor, data);
 
     if (status != 200) {
-        /* actor data non-existent or stale: get from the net */
-        status2 = activitypub_request(snac, actor, &payload);
+        xs *key = xs_fmt("actor:%s", actor);
+
+        /* actor data non-existent or stale: get from the net
+           (unless another thread is already doing it) */
+        if (flight_begin(key, &status2, &payload)) {
+            status2 = activitypub_request(snac, actor, &payload);
+
+            if (valid_status(status2)) {
+                /* renew data */
+                status2 = actor_add(actor, payload);
+            }
+
+            flight_end(key, status2, payload);
+        }
 
         if (valid_status(status2)) {
-            /* renew data */
-            status = actor_add(actor, payload);
+            status = status2;
 
             if (data != NULL) {
+                xs_free(*data);
                 *data   = payload;
                 payload = NULL;
             }
@@ -288,16 +307,21 @@ void timeline_request_replies(snac *user, const char *id)
 
 
 int send_to_inbox_raw(const char *keyid, const char *seckey,
-                  const xs_str *inbox, const xs_dict *msg,
+                  const xs_str *inbox, const xs_val *msg, const char *digest,
                   xs_val **payload, int *p_size, int timeout)
-/* sends a message to an Inbox */
+/* sends a message to an Inbox. The message can be already serialized
+   (and its digest, if set, already calculated) */
 {
     int status;
     xs_dict *response;
-    xs *j_msg = xs_json_dumps((xs_dict *)msg, 4);
+    xs *headers = xs_dict_new();
+    xs *j_msg   = xs_type(msg) == XSTYPE_STRING ? xs_dup(msg) : xs_json_dumps(msg, 0);
+
+    if (digest != NULL)
+        headers = xs_dict_append(headers, "digest", digest);
 
     response = http_signed_request_raw(keyid, seckey, "POST", inbox,
-        NULL, j_msg, strlen(j_msg), &status, payload, p_size, timeout);
+        headers, j_msg, strlen(j_msg), &status, payload, p_size, timeout);
 
     xs_free(response);
 
@@ -311,7 +335,7 @@ int send_to_inbox(snac *snac, const xs_str *inbox, const xs_dict *msg,
 {
     char *seckey = xs_dict_get(snac->key, "secret");
 
-    return send_to_inbox_raw(snac->actor, seckey, inbox, msg, payload, p_size, timeout);
+    return send_to_inbox_raw(snac->actor, seckey, inbox, msg, NULL, payload, p_size, timeout);
 }
 
 
@@ -932,6 +956,12 @@ xs_dict *msg_actor(snac *snac)
         msg = xs_dict_set(msg, folders[n], f);
     }
 
+    /* the instance-wide inbox */
+    xs *endp = xs_dict_new();
+    xs *shibx = xs_fmt("%s/shared-inbox", srv_baseurl);
+    endp = xs_dict_append(endp, "sharedInbox", shibx);
+    msg = xs_dict_set(msg, "endpoints", endp);
+
     p = xs_dict_get(snac->config, "avatar");
 
     if (*p == '\0')
@@ -1409,7 +1439,8 @@ int update_question(snac *user, const char *id)
 /** queues **/
 
 int process_input_message(snac *snac, xs_dict *msg, xs_dict *req)
-/* processes an ActivityPub message from the input queue */
+/* processes an ActivityPub message from the input queue
+   (req is NULL if its signature has already been checked) */
 {
     /* actor and type exist, were checked previously */
     char *actor  = xs_dict_get(msg, "actor");
@@ -1480,7 +1511,7 @@ int process_input_message(snac *snac, xs_dict *msg, xs_dict *req)
     /* check the signature */
     xs *sig_err = NULL;
 
-    if (!check_signature(snac, req, &sig_err)) {
+    if (req != NULL && !check_signature(snac, req, &sig_err)) {
         snac_log(snac, xs_fmt("bad signature %s (%s)", actor, sig_err));
 
         srv_archive_error("check_signature", sig_err, req, msg);
@@ -1643,10 +1674,16 @@ int process_input_message(snac *snac, xs_dict *msg, xs_dict *req)
         else
         if (strcmp(utype, "Note") == 0) { /** **/
             const char *id = xs_dict_get(object, "id");
+            xs *o_object   = NULL;
+
+            object_get(id, &o_object);
 
             object_add_ow(id, object);
             timeline_touch(snac);
 
+            tag_update(snac, id, o_object, object);
+            search_update(snac, id, object);
+
             snac_log(snac, xs_fmt("updated post %s", id));
         }
         else
@@ -1745,6 +1782,10 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
         xs_list *p;
         xs_str *actor;
 
+        /* serialize and digest the message only once for all inboxes */
+        xs *body   = xs_json_dumps(msg, 0);
+        xs *digest = http_body_digest(body, strlen(body));
+
         xs_set_init(&inboxes);
 
         /* iterate the recipients */
@@ -1755,7 +1796,7 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
             if (inbox != NULL) {
                 /* add to the set and, if it's not there, send message */
                 if (xs_set_add(&inboxes, inbox) == 1)
-                    enqueue_output(snac, msg, inbox, 0);
+                    enqueue_output(snac, body, digest, inbox, 0);
             }
             else
                 snac_log(snac, xs_fmt("cannot find inbox for %s", actor));
@@ -1769,7 +1810,7 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
             p = shibx;
             while (xs_list_iter(&p, &inbox)) {
                 if (xs_set_add(&inboxes, inbox) == 1)
-                    enqueue_output(snac, msg, inbox, 0);
+                    enqueue_output(snac, body, digest, inbox, 0);
             }
         }
 
@@ -1840,6 +1881,296 @@ int process_user_queue(snac *snac)
 }
 
 
+void process_output_status(const xs_dict *q_item, int status,
+                           const xs_str *o_payload, int p_size)
+/* logs the result of sending an output message and requeues it if needed */
+{
+    int queue_retry_max = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+    xs_str *inbox  = xs_dict_get(q_item, "inbox");
+    xs_str *keyid  = xs_dict_get(q_item, "keyid");
+    xs_str *seckey = xs_dict_get(q_item, "seckey");
+    xs_val *msg    = xs_dict_get(q_item, "message");
+    char *digest   = xs_dict_get(q_item, "digest");
+    int retries    = xs_number_get(xs_dict_get(q_item, "retries"));
+    xs *payload    = NULL;
+
+    if (o_payload) {
+        /* trim the message */
+        payload = xs_str_new(NULL);
+        payload = xs_append_m(payload, o_payload, strnlen(o_payload, 64));
+
+        if (p_size > 64)
+            payload = xs_str_cat(payload, "...");
+
+        /* strip ugly control characters */
+        payload = xs_replace_i(payload, "\n", "");
+        payload = xs_replace_i(payload, "\r", "");
+
+        if (*payload)
+            payload = xs_str_wrap_i(" [", payload, "]");
+    }
+    else
+        payload = xs_str_new(NULL);
+
+    srv_log(xs_fmt("output message: sent to inbox %s %d%s", inbox, status, payload));
+
+    host_result(inbox, status);
+
+    if (!valid_status(status)) {
+        retries++;
+
+        /* error sending; requeue? */
+        if (status == 404 || status == 410 || status < 0)
+            /* explicit error: discard */
+            srv_log(xs_fmt("output message: fatal error %s %d", inbox, status));
+        else
+        if (retries > queue_retry_max)
+            srv_log(xs_fmt("output message: giving up %s %d", inbox, status));
+        else {
+            /* requeue */
+            enqueue_output_raw(keyid, seckey, msg, digest, inbox, retries);
+            srv_log(xs_fmt("output message: requeue %s #%d", inbox, retries));
+        }
+    }
+}
+
+
+void process_output_deferred(const xs_dict *q_item)
+/* requeues an output message that was not sent because its host is failing */
+{
+    const xs_str *inbox    = xs_dict_get(q_item, "inbox");
+    const xs_val *deferred = xs_dict_get(q_item, "deferred");
+    time_t t = time(NULL);
+
+    /* deferrals don't count as retries, but they don't go on forever */
+    if (xs_type(deferred) == XSTYPE_NUMBER && t - xs_number_get(deferred) > 7 * 24 * 3600)
+        srv_log(xs_fmt("output message: giving up %s (host failing)", inbox));
+    else {
+        xs *item = xs_dup(q_item);
+
+        if (xs_type(deferred) != XSTYPE_NUMBER) {
+            /* remember when it was first deferred */
+            xs *n = xs_number_new(t);
+            item  = xs_dict_set(item, "deferred", n);
+        }
+
+        /* it will be scheduled after the host's retry time */
+        enqueue_output_requeue(item, 0);
+        srv_debug(1, xs_fmt("output message: deferred %s", inbox));
+    }
+}
+
+
+static xs_dict *output_item_load(const xs_dict *q_item)
+/* returns a copy of an output queue item with the message body
+   and the secret key filled, as they are stored by reference */
+{
+    xs_dict *o_item = xs_dup(q_item);
+    const char *md5 = xs_dict_get(q_item, "payload");
+    snac user;
+
+    if (xs_is_null(xs_dict_get(q_item, "message")) && !xs_is_null(md5)) {
+        xs *body = queue_payload_get(md5);
+
+        if (body != NULL)
+            o_item = xs_dict_set(o_item, "message", body);
+        else
+            srv_log(xs_fmt("output message error: cannot read payload %s", md5));
+    }
+
+    if (xs_is_null(xs_dict_get(q_item, "seckey")) &&
+        user_open_by_actor(&user, xs_dict_get(q_item, "keyid"))) {
+        o_item = xs_dict_set(o_item, "seckey", xs_dict_get(user.key, "secret"));
+        user_free(&user);
+    }
+
+    return o_item;
+}
+
+
+static int _is_user_object(snac *user, const char *id)
+/* checks if an id is a user's actor or something of its own */
+{
+    int len = strlen(user->actor);
+
+    return xs_type(id) == XSTYPE_STRING && strncmp(id, user->actor, len) == 0 &&
+        (id[len] == '\0' || id[len] == '/');
+}
+
+
+static int is_shared_msg_for_user(snac *user, const xs_dict *msg)
+/* checks if a message from the shared inbox is for this user */
+{
+    const char *type   = xs_dict_get(msg, "type");
+    const char *actor  = xs_dict_get(msg, "actor");
+    const xs_val *object = xs_dict_get(msg, "object");
+
+    if (strcmp(type, "Create") == 0 ||
+        strcmp(type, "Like") == 0 || strcmp(type, "Announce") == 0)
+        return is_msg_for_me(user, msg);
+
+    if (strcmp(type, "Follow") == 0 || strcmp(type, "Block") == 0) {
+        /* for the followed (or blocked) user only */
+        if (xs_type(object) == XSTYPE_DICT)
+            object = xs_dict_get(object, "id");
+
+        return xs_type(object) == XSTYPE_STRING && strcmp(object, user->actor) == 0;
+    }
+
+    if (strcmp(type, "Accept") == 0 || strcmp(type, "Reject") == 0) {
+        /* for the user that sent the accepted (or rejected) activity */
+        if (xs_type(object) == XSTYPE_DICT)
+            return _is_user_object(user, xs_dict_get(object, "actor"));
+
+        return _is_user_object(user, object);
+    }
+
+    if (strcmp(type, "Undo") == 0) {
+        /* for the user named in the undone activity */
+        if (xs_type(object) != XSTYPE_DICT)
+            return 0;
+
+        const char *u_type = xs_dict_get(object, "type");
+
+        if (xs_type(u_type) != XSTYPE_STRING)
+            return 0;
+
+        if (strcmp(u_type, "Like") == 0 || strcmp(u_type, "Announce") == 0)
+            return is_msg_for_me(user, object);
+
+        const xs_val *u_object = xs_dict_get(object, "object");
+
+        if (xs_type(u_object) == XSTYPE_DICT)
+            u_object = xs_dict_get(u_object, "id");
+
+        return _is_user_object(user, u_object);
+    }
+
+    /* anything else (Update, Delete...), for its followers */
+    if (xs_type(actor) == XSTYPE_STRING && following_check(user, actor))
+        return 1;
+
+    if (strcmp(type, "Update") == 0 || strcmp(type, "Delete") == 0) {
+        const xs_val *id = object;
+
+        if (xs_type(id) == XSTYPE_DICT)
+            id = xs_dict_get(id, "id");
+
+        /* or for the users that have the object in their timeline
+           (it may have arrived by a mention or a followed boost) */
+        if (xs_type(id) == XSTYPE_STRING) {
+            xs *md5 = xs_md5_hex(id, strlen(id));
+
+            if (timeline_here(user, md5))
+                return 1;
+        }
+
+        /* or that would have accepted it as new */
+        if (strcmp(type, "Update") == 0 && xs_type(object) == XSTYPE_DICT) {
+            xs *c_msg = xs_dup(msg);
+
+            c_msg = xs_dict_set(c_msg, "type", "Create");
+
+            return is_msg_for_me(user, c_msg);
+        }
+    }
+
+    return 0;
+}
+
+
+static void process_shared_input(const xs_dict *q_item)
+/* processes a message from the shared inbox */
+{
+    int queue_retry_max = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+    xs_dict *msg  = xs_dict_get(q_item, "message");
+    xs_dict *req  = xs_dict_get(q_item, "req");
+    int retries   = xs_number_get(xs_dict_get(q_item, "retries"));
+    char *actor   = xs_dict_get(msg, "actor");
+    char *type    = xs_dict_get(msg, "type");
+    xs *users     = user_list();
+    xs *rcpts     = xs_list_new();
+    xs_list *p;
+    xs_str *uid;
+
+    if (xs_type(actor) != XSTYPE_STRING || xs_type(type) != XSTYPE_STRING) {
+        srv_debug(0, xs_fmt("shared input: malformed message"));
+        return;
+    }
+
+    /* find the local users this message is for */
+    p = users;
+    while (xs_list_iter(&p, &uid)) {
+        snac user;
+
+        if (user_open(&user, uid)) {
+            if (!is_muted(&user, actor) && is_shared_msg_for_user(&user, msg))
+                rcpts = xs_list_append(rcpts, uid);
+
+            user_free(&user);
+        }
+    }
+
+    if (xs_list_len(rcpts) == 0) {
+        srv_debug(1, xs_fmt("shared input: message from %s of type '%s' not for anybody", actor, type));
+        return;
+    }
+
+    /* check the signature only once, as the first recipient */
+    snac first;
+
+    if (!user_open(&first, xs_list_get(rcpts, 0)))
+        return;
+
+    xs *actor_o = NULL;
+    int a_status = actor_request(&first, actor, &actor_o);
+
+    if (a_status == 404 || a_status == 410 || a_status < 0) {
+        srv_debug(1, xs_fmt("shared input: dropping message due to actor error %s %d", actor, a_status));
+    }
+    else
+    if (!valid_status(a_status)) {
+        if (retries > queue_retry_max)
+            srv_log(xs_fmt("shared input giving up"));
+        else {
+            enqueue_shared_input(msg, req, retries + 1);
+            srv_log(xs_fmt("shared input requeue #%d (actor error %s %d)", retries + 1, actor, a_status));
+        }
+    }
+    else {
+        xs *sig_err = NULL;
+
+        if (!check_signature(&first, req, &sig_err)) {
+            srv_log(xs_fmt("shared input: bad signature %s (%s)", actor, sig_err));
+
+            srv_archive_error("check_signature", sig_err, req, msg);
+        }
+        else {
+            /* deliver to each recipient */
+            p = rcpts;
+            while (xs_list_iter(&p, &uid)) {
+                snac user;
+
+                if (user_open(&user, uid)) {
+                    if (!process_input_message(&user, msg, NULL)) {
+                        /* retry later as a normal (signed) input message */
+                        enqueue_input(&user, msg, req, 1);
+                        snac_log(&user, xs_fmt("input requeue #1"));
+                    }
+
+                    user_free(&user);
+                }
+            }
+
+            srv_debug(1, xs_fmt("shared input: message from %s of type '%s' for %d users",
+                                actor, type, xs_list_len(rcpts)));
+        }
+    }
+
+    user_free(&first);
+}
+
+
 void process_queue_item(xs_dict *q_item)
 /* processes an item from the global queue */
 {
@@ -1848,11 +2179,13 @@ void process_queue_item(xs_dict *q_item)
 
     if (strcmp(type, "output") == 0) {
         int status;
-        xs_str *inbox  = xs_dict_get(q_item, "inbox");
-        xs_str *keyid  = xs_dict_get(q_item, "keyid");
-        xs_str *seckey = xs_dict_get(q_item, "seckey");
-        xs_dict *msg   = xs_dict_get(q_item, "message");
-        int retries    = xs_number_get(xs_dict_get(q_item, "retries"));
+        xs *o_item     = output_item_load(q_item);
+        xs_str *inbox  = xs_dict_get(o_item, "inbox");
+        xs_str *keyid  = xs_dict_get(o_item, "keyid");
+        xs_str *seckey = xs_dict_get(o_item, "seckey");
+        xs_val *msg    = xs_dict_get(o_item, "message");
+        char *digest   = xs_dict_get(o_item, "digest");
+        int retries    = xs_number_get(xs_dict_get(o_item, "retries"));
         xs *payload    = NULL;
         int p_size     = 0;
 
@@ -1861,44 +2194,25 @@ void process_queue_item(xs_dict *q_item)
             return;
         }
 
-        /* deliver */
-        status = send_to_inbox_raw(keyid, seckey, inbox, msg, &payload, &p_size, retries == 0 ? 3 : 8);
-
-        if (payload) {
-            if (p_size > 64) {
-                /* trim the message */
-                payload[64] = '\0';
-                payload = xs_str_cat(payload, "...");
-            }
-
-            /* strip ugly control characters */
-            payload = xs_replace_i(payload, "\n", "");
-            payload = xs_replace_i(payload, "\r", "");
+        /* the delivery engine (if running) takes care of it */
+        if (deliver_post(o_item))
+            return;
 
-            if (*payload)
-                payload = xs_str_wrap_i(" [", payload, "]");
+        /* don't even try if the host is failing */
+        if (!host_check(inbox)) {
+            process_output_deferred(o_item);
+            return;
         }
-        else
-            payload = xs_str_new(NULL);
 
-        srv_log(xs_fmt("output message: sent to inbox %s %d%s", inbox, status, payload));
-
-        if (!valid_status(status)) {
-            retries++;
+        /* deliver */
+        status = send_to_inbox_raw(keyid, seckey, inbox, msg, digest, &payload, &p_size, retries == 0 ? 3 : 8);
 
-            /* error sending; requeue? */
-            if (status == 404 || status == 410 || status < 0)
-                /* explicit error: discard */
-                srv_log(xs_fmt("output message: fatal error %s %d", inbox, status));
-            else
-            if (retries > queue_retry_max)
-                srv_log(xs_fmt("output message: giving up %s %d", inbox, status));
-            else {
-                /* requeue */
-                enqueue_output_raw(keyid, seckey, msg, inbox, retries);
-                srv_log(xs_fmt("output message: requeue %s #%d", inbox, retries));
-            }
-        }
+        process_output_status(o_item, status, payload, p_size);
+    }
+    else
+    if (strcmp(type, "input") == 0) {
+        /* message from the shared inbox */
+        process_shared_input(q_item);
     }
     else
     if (strcmp(type, "email") == 0) {
@@ -1954,6 +2268,25 @@ void process_queue_item(xs_dict *q_item)
 
         srv_log(xs_dup("purge end"));
     }
+    else
+    if (strcmp(type, "search_flush") == 0) {
+        /* write the search logs that grew too much */
+        xs *list = user_list();
+        char *p, *uid;
+        int cnt = 0;
+
+        p = list;
+        while (xs_list_iter(&p, &uid)) {
+            snac user;
+
+            if (user_open(&user, uid)) {
+                cnt += search_flush(&user);
+                user_free(&user);
+            }
+        }
+
+        srv_debug(1, xs_fmt("search_flush %d", cnt));
+    }
     else
         srv_log(xs_fmt("unexpected q_item type '%s'", type));
 }
@@ -1981,6 +2314,42 @@ int process_queue(void)
 }
 
 
+int process_queues(int max_secs)
+/* waits (up to max_secs) for queue items to be due and processes them */
+{
+    int cnt = 0;
+    xs *list = queue_sched_wait(max_secs);
+
+    xs_list *p = list;
+    xs_list *v;
+
+    while (xs_list_iter(&p, &v)) {
+        const char *uid = xs_list_get(v, 0);
+        const char *fn  = xs_list_get(v, 1);
+        xs *q_item = dequeue(fn);
+
+        /* already processed by someone else */
+        if (q_item == NULL)
+            continue;
+
+        if (*uid) {
+            snac snac;
+
+            if (user_open(&snac, uid)) {
+                process_user_queue_item(&snac, q_item);
+                user_free(&snac);
+            }
+        }
+        else
+            job_post(q_item, 0);
+
+        cnt++;
+    }
+
+    return cnt;
+}
+
+
 /** HTTP handlers */
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
@@ -2120,6 +2489,27 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
         return 403;
     }
 
+    /* the shared inbox: check the digest and let the global queue take care */
+    if (strcmp(q_path, "/shared-inbox") == 0) {
+        if ((v = xs_dict_get(req, "digest")) != NULL) {
+            xs *s1 = xs_sha256_base64(payload, p_size);
+            xs *s2 = xs_fmt("SHA-256=%s", s1);
+
+            if (strcmp(s2, v) != 0) {
+                srv_log(xs_fmt("digest check FAILED"));
+
+                *body  = xs_str_new("bad digest");
+                *ctype = "text/plain";
+                return 400;
+            }
+        }
+
+        enqueue_shared_input(msg, req, 0);
+        *ctype = "application/activity+json";
+
+        return status;
+    }
+
     /* get the user and path */
     xs *l = xs_split_n(q_path, "/", 2);
 
@@ -4,6 +4,7 @@
 #include "xs.h"
 #include "xs_io.h"
 #include "xs_json.h"
+#include "xs_unicode.h"
 #include "xs_openssl.h"
 #include "xs_glob.h"
 #include "xs_set.h"
@@ -15,13 +16,16 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
 
-double disk_layout = 2.7;
+double disk_layout = 2.9;
 
-/* storage serializer */
-pthread_mutex_t data_mutex = {0};
+/* index serializers, striped by file name */
+#define INDEX_LOCKS 64
+static pthread_mutex_t index_locks[INDEX_LOCKS];
 
 int snac_upgrade(d_char **error);
 
@@ -33,8 +37,13 @@ int srv_open(char *basedir, int auto_upgrade)
     xs *cfg_file = NULL;
     FILE *f;
     xs_str *error = NULL;
+    int n;
+
+    for (n = 0; n < INDEX_LOCKS; n++)
+        pthread_mutex_init(&index_locks[n], NULL);
 
-    pthread_mutex_init(&data_mutex, NULL);
+    /* for the jitter of the retry times */
+    srandom(time(NULL) ^ getpid());
 
     srv_basedir = xs_str_new(basedir);
 
@@ -95,6 +104,9 @@ int srv_open(char *basedir, int auto_upgrade)
     xs *qdir = xs_fmt("%s/queue", srv_basedir);
     mkdirx(qdir);
 
+    xs *pldir = xs_fmt("%s/queue/payload", srv_basedir);
+    mkdirx(pldir);
+
     xs *ibdir = xs_fmt("%s/inbox", srv_basedir);
     mkdirx(ibdir);
 
@@ -129,7 +141,10 @@ void srv_free(void)
     xs_free(srv_config);
     xs_free(srv_baseurl);
 
-    pthread_mutex_destroy(&data_mutex);
+    int n;
+
+    for (n = 0; n < INDEX_LOCKS; n++)
+        pthread_mutex_destroy(&index_locks[n]);
 }
 
 
@@ -146,72 +161,280 @@ void user_free(snac *snac)
 }
 
 
-int user_open(snac *snac, const char *uid)
-/* opens a user */
+/** user registry **/
+
+/* parsed user data is kept in memory and revalidated by the dates of its
+   files; user_open() fills the snac struct with private copies of it */
+
+typedef struct {
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+} user_stamp;
+
+typedef struct _user_data {
+    struct _user_data *next;
+    int refs;
+    int stale;                      /* replaced; free when unreferenced */
+    xs_str *uid;
+    xs_dict *config;
+    xs_dict *config_o;
+    xs_dict *key;
+    xs_str *actor;
+    xs_str *md5;
+    user_stamp st[3];               /* user.json, key.json and user_o.json */
+} user_data;
+
+static user_data *user_reg = NULL;
+static pthread_mutex_t user_reg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *user_files[] = { "user.json", "key.json", "user_o.json" };
+
+
+static void _user_stamps(const char *basedir, user_stamp *st)
+/* gets the stamps of the user files (all zeros if they don't exist) */
 {
-    int ret = 0;
+    int n;
 
-    memset(snac, '\0', sizeof(struct _snac));
+    memset(st, '\0', sizeof(user_stamp) * 3);
 
-    if (validate_uid(uid)) {
-        xs *cfg_file;
-        FILE *f;
+    for (n = 0; n < 3; n++) {
+        xs *fn = xs_fmt("%s/%s", basedir, user_files[n]);
+        struct stat s;
 
-        snac->uid = xs_str_new(uid);
+        if (stat(fn, &s) != -1) {
+            st[n].mtime = s.st_mtim;
+            st[n].size  = s.st_size;
+            st[n].ino   = s.st_ino;
+        }
+    }
+}
 
-        snac->basedir = xs_fmt("%s/user/%s", srv_basedir, uid);
 
-        cfg_file = xs_fmt("%s/user.json", snac->basedir);
+static void _user_data_free(user_data *u)
+{
+    xs_free(u->uid);
+    xs_free(u->config);
+    xs_free(u->config_o);
+    xs_free(u->key);
+    xs_free(u->actor);
+    xs_free(u->md5);
+    free(u);
+}
 
-        if ((f = fopen(cfg_file, "r")) != NULL) {
-            /* read full config file */
-            snac->config = xs_json_load(f);
-            fclose(f);
 
-            if (snac->config != NULL) {
-                xs *key_file = xs_fmt("%s/key.json", snac->basedir);
+static void _user_reg_detach(const char *uid)
+/* detaches the registry entry of a user (must be locked) */
+{
+    user_data **pu = &user_reg;
+    user_data *u;
 
-                if ((f = fopen(key_file, "r")) != NULL) {
-                    snac->key = xs_json_load(f);
-                    fclose(f);
+    while ((u = *pu) != NULL && strcmp(u->uid, uid) != 0)
+        pu = &u->next;
 
-                    if (snac->key != NULL) {
-                        snac->actor = xs_fmt("%s/%s", srv_baseurl, uid);
-                        snac->md5   = xs_md5_hex(snac->actor, strlen(snac->actor));
+    if (u != NULL) {
+        *pu = u->next;
+        u->stale = 1;
 
-                        /* everything is ok right now */
-                        ret = 1;
+        if (u->refs == 0)
+            _user_data_free(u);
+    }
+}
 
-                        /* does it have a configuration override? */
-                        xs *cfg_file_o = xs_fmt("%s/user_o.json", snac->basedir);
-                        if ((f = fopen(cfg_file_o, "r")) != NULL) {
-                            snac->config_o = xs_json_load(f);
-                            fclose(f);
 
-                            if (snac->config_o == NULL)
-                                srv_log(xs_fmt("error parsing '%s'", cfg_file_o));
-                        }
+static user_data *_user_reg_get(const char *uid, const user_stamp *st)
+/* returns a referenced, up to date registry entry, or NULL */
+{
+    user_data *u;
+
+    pthread_mutex_lock(&user_reg_mutex);
+
+    for (u = user_reg; u != NULL; u = u->next) {
+        if (strcmp(u->uid, uid) == 0)
+            break;
+    }
+
+    if (u != NULL) {
+        if (memcmp(u->st, st, sizeof(u->st)) == 0)
+            u->refs++;
+        else {
+            /* files changed */
+            _user_reg_detach(uid);
+            u = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&user_reg_mutex);
+
+    return u;
+}
+
+
+static void _user_reg_release(user_data *u)
+/* releases a reference to a registry entry */
+{
+    pthread_mutex_lock(&user_reg_mutex);
+
+    if (--u->refs == 0 && u->stale)
+        _user_data_free(u);
+
+    pthread_mutex_unlock(&user_reg_mutex);
+}
+
+
+void user_reg_invalidate(const char *uid)
+/* forgets the cached data of a user */
+{
+    pthread_mutex_lock(&user_reg_mutex);
+    _user_reg_detach(uid);
+    pthread_mutex_unlock(&user_reg_mutex);
+}
+
+
+static user_data *_user_load(const char *uid, const char *basedir, const user_stamp *st)
+/* loads the user data from disk and stores it into the registry */
+{
+    user_data *u = calloc(1, sizeof(user_data));
+    int ok = 0;
+    xs *cfg_file;
+    FILE *f;
+
+    if (u == NULL)
+        return NULL;
+
+    /* the registry outlives any request */
+    xs_arena_pause();
+
+    cfg_file = xs_fmt("%s/user.json", basedir);
+
+    if ((f = fopen(cfg_file, "r")) != NULL) {
+        /* read full config file */
+        u->config = xs_json_load(f);
+        fclose(f);
 
-                        if (snac->config_o == NULL)
-                            snac->config_o = xs_dict_new();
+        if (u->config != NULL) {
+            xs *key_file = xs_fmt("%s/key.json", basedir);
+
+            if ((f = fopen(key_file, "r")) != NULL) {
+                u->key = xs_json_load(f);
+                fclose(f);
+
+                if (u->key != NULL) {
+                    u->actor = xs_fmt("%s/%s", srv_baseurl, uid);
+                    u->md5   = xs_md5_hex(u->actor, strlen(u->actor));
+
+                    /* everything is ok right now */
+                    ok = 1;
+
+                    /* does it have a configuration override? */
+                    xs *cfg_file_o = xs_fmt("%s/user_o.json", basedir);
+                    if ((f = fopen(cfg_file_o, "r")) != NULL) {
+                        u->config_o = xs_json_load(f);
+                        fclose(f);
+
+                        if (u->config_o == NULL)
+                            srv_log(xs_fmt("error parsing '%s'", cfg_file_o));
                     }
-                    else
-                        srv_log(xs_fmt("error parsing '%s'", key_file));
+
+                    if (u->config_o == NULL)
+                        u->config_o = xs_dict_new();
                 }
                 else
-                    srv_log(xs_fmt("error opening '%s' %d", key_file, errno));
+                    srv_log(xs_fmt("error parsing '%s'", key_file));
             }
             else
-                srv_log(xs_fmt("error parsing '%s'", cfg_file));
+                srv_log(xs_fmt("error opening '%s' %d", key_file, errno));
         }
         else
-            srv_debug(2, xs_fmt("error opening '%s' %d", cfg_file, errno));
+            srv_log(xs_fmt("error parsing '%s'", cfg_file));
+    }
+    else
+        srv_debug(2, xs_fmt("error opening '%s' %d", cfg_file, errno));
+
+    if (ok)
+        u->uid = xs_str_new(uid);
+
+    xs_arena_resume();
+
+    if (!ok) {
+        _user_data_free(u);
+        return NULL;
+    }
+
+    u->refs = 1;
+    memcpy(u->st, st, sizeof(u->st));
+
+    pthread_mutex_lock(&user_reg_mutex);
+
+    _user_reg_detach(uid);
+
+    u->next  = user_reg;
+    user_reg = u;
+
+    pthread_mutex_unlock(&user_reg_mutex);
+
+    return u;
+}
+
+
+int user_open(snac *snac, const char *uid)
+/* opens a user */
+{
+    int ret = 0;
+
+    memset(snac, '\0', sizeof(struct _snac));
+
+    if (validate_uid(uid)) {
+        xs *basedir = xs_fmt("%s/user/%s", srv_basedir, uid);
+        user_stamp st[3];
+        user_data *u;
+
+        _user_stamps(basedir, st);
+
+        if ((u = _user_reg_get(uid, st)) == NULL)
+            u = _user_load(uid, basedir, st);
+
+        if (u != NULL) {
+            snac->uid      = xs_str_new(uid);
+            snac->basedir  = xs_dup(basedir);
+            snac->config   = xs_dup(u->config);
+            snac->config_o = xs_dup(u->config_o);
+            snac->key      = xs_dup(u->key);
+            snac->actor    = xs_dup(u->actor);
+            snac->md5      = xs_dup(u->md5);
+
+            _user_reg_release(u);
+
+            ret = 1;
+        }
     }
     else
         srv_debug(1, xs_fmt("invalid user '%s'", uid));
 
-    if (!ret)
-        user_free(snac);
+    return ret;
+}
+
+
+int user_persist(snac *snac)
+/* writes the user configuration */
+{
+    xs *fn  = xs_fmt("%s/user.json", snac->basedir);
+    xs *bfn = xs_fmt("%s.bak", fn);
+    FILE *f;
+    int ret = 0;
+
+    rename(fn, bfn);
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        xs_json_dump(snac->config, 4, f);
+        fclose(f);
+
+        ret = 1;
+    }
+    else
+        rename(bfn, fn);
+
+    user_reg_invalidate(snac->uid);
 
     return ret;
 }
@@ -245,6 +468,23 @@ int user_open_by_md5(snac *snac, const char *md5)
 }
 
 
+int user_open_by_actor(snac *snac, const char *actor)
+/* opens the local user with this actor url */
+{
+    int l = strlen(srv_baseurl);
+
+    if (!xs_is_null(actor) && strncmp(actor, srv_baseurl, l) == 0 && actor[l] == '/' &&
+        strchr(actor + l + 1, '/') == NULL && user_open(snac, actor + l + 1)) {
+        if (strcmp(snac->actor, actor) == 0)
+            return 1;
+
+        user_free(snac);
+    }
+
+    return 0;
+}
+
+
 double mtime_nl(const char *fn, int *n_link)
 /* returns the mtime and number of links of a file or directory, or 0.0 */
 {
@@ -286,1686 +526,5856 @@ double f_ctime(const char *fn)
 
 /** indexes **/
 
+/* indexes are binary files with a small header followed by the 16 byte
+   binary md5s of the indexed objects, in insertion order. Deleted
+   entries are overwritten with zeros and removed by index_gc(), that
+   also increments the generation stored in the upper half of the
+   version word (so that side files can tell if they are stale) */
 
-int index_add_md5(const char *fn, const char *md5)
-/* adds an md5 to an index */
-{
-    int status = 201; /* Created */
-    FILE *f;
-
-    pthread_mutex_lock(&data_mutex);
-
-    if ((f = fopen(fn, "a")) != NULL) {
-        flock(fileno(f), LOCK_EX);
+#define IDX_MAGIC       "snacidx"
+#define IDX_VERSION     1
 
-        /* ensure the position is at the end after getting the lock */
-        fseek(f, 0, SEEK_END);
+typedef struct {
+    char magic[8];
+    uint32_t version;       /* format version | generation << 16 */
+    uint32_t deleted;       /* number of deleted entries */
+} idx_hdr;
 
-        fprintf(f, "%s\n", md5);
-        fclose(f);
-    }
-    else
-        status = 500;
+#define IDX_HDR_VERSION(h)  ((h)->version & 0xffff)
+#define IDX_HDR_GEN(h)      ((h)->version >> 16)
 
-    pthread_mutex_unlock(&data_mutex);
+#define IDX_MD5_SIZE    16
+#define IDX_ENTRY_OFF(n) ((off_t) sizeof(idx_hdr) + (off_t) (n) * IDX_MD5_SIZE)
 
-    return status;
-}
+static const unsigned char idx_deleted[IDX_MD5_SIZE] = { 0 };
 
 
-int index_add(const char *fn, const char *id)
-/* adds an id to an index */
+static int _md5_bin(const char *md5, unsigned char *bin, const char *func)
+/* converts an hex md5 to binary */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_add_md5(fn, md5);
-}
+    int n;
 
+    /* an object deleted from an index; fail but don't bark */
+    if (md5[0] == '-')
+        return 0;
 
-int index_del_md5(const char *fn, const char *md5)
-/* deletes an md5 from an index */
-{
-    int status = 404;
-    FILE *f;
+    if (strlen(md5) != 32 || !xs_is_hex(md5)) {
+        srv_log(xs_fmt("_md5_bin() [from %s()]: bad md5 '%s'", func, md5));
+        return 0;
+    }
 
-    pthread_mutex_lock(&data_mutex);
+    for (n = 0; n < 32; n++) {
+        int c = md5[n];
 
-    if ((f = fopen(fn, "r+")) != NULL) {
-        char line[256];
+        c = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
 
-        while (fgets(line, sizeof(line), f) != NULL) {
-            line[32] = '\0';
+        if (n & 1)
+            bin[n / 2] |= c;
+        else
+            bin[n / 2] = c << 4;
+    }
 
-            if (strcmp(line, md5) == 0) {
-                /* found! just rewind, overwrite it with garbage
-                   and an eventual call to index_gc() will clean it
-                   [yes: this breaks index_len()] */
-                fseek(f, -33, SEEK_CUR);
-                fwrite("-", 1, 1, f);
-                status = 200;
+    return 1;
+}
 
-                break;
-            }
-        }
 
-        fclose(f);
-    }
-    else
-        status = 500;
+static void _md5_hex(const unsigned char *bin, char *md5)
+/* converts a binary md5 to hex (md5 must have room for 33 chars) */
+{
+    const char *hex = "0123456789abcdef";
+    int n;
 
-    pthread_mutex_unlock(&data_mutex);
+    for (n = 0; n < IDX_MD5_SIZE; n++) {
+        md5[n * 2]     = hex[bin[n] >> 4];
+        md5[n * 2 + 1] = hex[bin[n] & 0xf];
+    }
 
-    return status;
+    md5[32] = '\0';
 }
 
 
-int index_del(const char *fn, const char *id)
-/* deletes an id from an index */
+static int _md5_is_zero(const unsigned char *bin)
+/* checks if a binary md5 is all zeros (a deleted or unset one) */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_del_md5(fn, md5);
+    return memcmp(bin, idx_deleted, IDX_MD5_SIZE) == 0;
 }
 
 
-int index_gc(const char *fn)
-/* garbage-collects an index, deleting objects that are not here */
+static int _index_hdr_ok(const idx_hdr *h, const char *fn)
+/* checks an index header */
 {
-    FILE *i, *o;
-    int gc = -1;
-
-    pthread_mutex_lock(&data_mutex);
+    if (memcmp(h->magic, IDX_MAGIC, sizeof(h->magic)) != 0 || IDX_HDR_VERSION(h) != IDX_VERSION) {
+        srv_log(xs_fmt("bad index header in %s", fn));
+        return 0;
+    }
 
-    if ((i = fopen(fn, "r")) != NULL) {
-        xs *nfn = xs_fmt("%s.new", fn);
-        char line[256];
+    return 1;
+}
 
-        if ((o = fopen(nfn, "w")) != NULL) {
-            gc = 0;
 
-            while (fgets(line, sizeof(line), i) != NULL) {
-                line[32] = '\0';
+static const unsigned char *_index_map_fd(int fd, const char *fn, int *n, size_t *size, idx_hdr *h)
+/* maps an already open index into memory, returning its entries or NULL */
+{
+    const unsigned char *map = NULL;
+    struct stat st;
 
-                if (line[0] != '-' && object_here_by_md5(line))
-                    fprintf(o, "%s\n", line);
-                else
-                    gc++;
-            }
+    *n = 0;
 
-            fclose(o);
+    if (fstat(fd, &st) != -1 && st.st_size > (off_t) sizeof(idx_hdr)) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
-            xs *ofn = xs_fmt("%s.bak", fn);
+        if (p != MAP_FAILED) {
+            memcpy(h, p, sizeof(*h));
 
-            unlink(ofn);
-            link(fn, ofn);
-            rename(nfn, fn);
+            if (_index_hdr_ok(h, fn)) {
+                map   = (unsigned char *)p + sizeof(idx_hdr);
+                *n    = (st.st_size - sizeof(idx_hdr)) / IDX_MD5_SIZE;
+                *size = st.st_size;
+            }
+            else
+                munmap(p, st.st_size);
         }
-
-        fclose(i);
     }
 
-    pthread_mutex_unlock(&data_mutex);
-
-    return gc;
+    return map;
 }
 
 
-int index_in_md5(const char *fn, const char *md5)
-/* checks if the md5 is already in the index */
+static const unsigned char *_index_map(const char *fn, int *n, size_t *size, idx_hdr *h)
+/* maps an index into memory, returning its entries or NULL */
 {
-    FILE *f;
-    int ret = 0;
+    const unsigned char *map;
+    int fd;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+    *n = 0;
 
-        char line[256];
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return NULL;
 
-        while (!ret && fgets(line, sizeof(line), f) != NULL) {
-            line[32] = '\0';
+    flock(fd, LOCK_SH);
 
-            if (strcmp(line, md5) == 0)
-                ret = 1;
-        }
+    map = _index_map_fd(fd, fn, n, size, h);
 
-        fclose(f);
-    }
+    /* the mapping survives; appends are not seen, and an index_gc()
+       renames a new file, so this snapshot is safe without the lock */
+    close(fd);
 
-    return ret;
+    return map;
 }
 
 
-int index_in(const char *fn, const char *id)
-/* checks if the object id is already in the index */
+static void _index_unmap(const unsigned char *map, size_t size)
+/* unmaps an index */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_in_md5(fn, md5);
+    if (map)
+        munmap((void *)(map - sizeof(idx_hdr)), size);
 }
 
 
-int index_first(const char *fn, char *line, int size)
-/* reads the first entry of an index */
+static pthread_mutex_t *_index_lock(const char *fn)
+/* locks the in-process serializer of an index */
 {
-    FILE *f;
-    int ret = 0;
-
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+    pthread_mutex_t *m = &index_locks[xs_hash_func(fn, strlen(fn)) % INDEX_LOCKS];
 
-        if (fgets(line, size, f) != NULL) {
-            line[32] = '\0';
-            ret = 1;
-        }
-
-        fclose(f);
-    }
+    pthread_mutex_lock(m);
 
-    return ret;
+    return m;
 }
 
 
-int index_len(const char *fn)
-/* returns the number of elements in an index */
+static int _index_open(const char *fn, int flags, idx_hdr *h)
+/* opens and locks an index for writing, creating the header if new */
 {
-    struct stat st;
-    int len = 0;
+    int fd;
 
-    if (stat(fn, &st) != -1)
-        len = st.st_size / 33;
+    for (;;) {
+        struct stat st1, st2;
 
-    return len;
-}
+        if ((fd = open(fn, flags, 0666)) == -1)
+            return -1;
 
+        flock(fd, LOCK_EX);
 
-xs_list *index_list(const char *fn, int max)
-/* returns an index as a list */
-{
-    xs_list *list = xs_list_new();
-    FILE *f;
-    int n = 0;
+        /* while waiting for the lock, index_gc() from another
+           process may have renamed a new file over this one */
+        if (fstat(fd, &st1) != -1 && stat(fn, &st2) != -1 &&
+            st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+            break;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+        close(fd);
+    }
 
-        char line[256];
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+        if (flags & O_CREAT) {
+            memset(h, '\0', sizeof(*h));
+            memcpy(h->magic, IDX_MAGIC, sizeof(h->magic));
+            h->version = IDX_VERSION;
 
-        while (n < max && fgets(line, sizeof(line), f) != NULL) {
-            if (line[0] != '-') {
-                line[32] = '\0';
-                list = xs_list_append(list, line);
-                n++;
+            if (ftruncate(fd, 0) == -1 || pwrite(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+                close(fd);
+                fd = -1;
             }
         }
-
-        fclose(f);
+        else {
+            close(fd);
+            fd = -1;
+        }
     }
-
-    return list;
+    else
+    if (!_index_hdr_ok(h, fn)) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
 }
 
 
-xs_list *index_list_desc(const char *fn, int skip, int show)
-/* returns an index as a list, in reverse order */
+int index_add_md5(const char *fn, const char *md5)
+/* adds an md5 to an index */
 {
-    xs_list *list = xs_list_new();
-    FILE *f;
-    int n = 0;
+    int status = 201; /* Created */
+    unsigned char bin[IDX_MD5_SIZE];
+    idx_hdr h;
+    int fd;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+    if (!_md5_bin(md5, bin, "index_add_md5"))
+        return 400;
 
-        char line[256];
+    pthread_mutex_t *m = _index_lock(fn);
 
-        /* move to the end minus one entry (or more, if skipping entries) */
-        if (!fseek(f, 0, SEEK_END) && !fseek(f, (skip + 1) * -33, SEEK_CUR)) {
-            while (n < show && fgets(line, sizeof(line), f) != NULL) {
-                if (line[0] != '-') {
-                    line[32] = '\0';
-                    list = xs_list_append(list, line);
-                    n++;
-                }
+    if ((fd = _index_open(fn, O_RDWR | O_CREAT, &h)) != -1) {
+        struct stat st;
 
-                /* move backwards 2 entries */
-                if (fseek(f, -66, SEEK_CUR) == -1)
-                    break;
-            }
-        }
+        /* drop a possible partial entry from an interrupted write */
+        if (fstat(fd, &st) == -1 ||
+            pwrite(fd, bin, sizeof(bin),
+                IDX_ENTRY_OFF((st.st_size - sizeof(h)) / IDX_MD5_SIZE)) != sizeof(bin))
+            status = 500;
 
-        fclose(f);
+        close(fd);
     }
-
-    return list;
-}
-
-
-/** objects **/
-
-static xs_str *_object_fn_by_md5(const char *md5, const char *func)
-{
-    xs *bfn = xs_fmt("%s/object/%c%c", srv_basedir, md5[0], md5[1]);
-    xs_str *ret;
-    int ok = 1;
-
-    /* an object deleted from an index; fail but don't bark */
-    if (md5[0] == '-')
-        ok = 0;
     else
-    if (!xs_is_hex(md5) || strlen(md5) != 32) {
-        srv_log(xs_fmt("_object_fn_by_md5() [from %s()]: bad md5 '%s'", func, md5));
-        ok = 0;
-    }
+        status = 500;
 
-    if (ok) {
-        mkdirx(bfn);
-        ret = xs_fmt("%s/%s.json", bfn, md5);
-    }
-    else
-        ret = xs_fmt("%s/object/invalid/invalid.json", srv_basedir);
+    pthread_mutex_unlock(m);
 
-    return ret;
+    return status;
 }
 
 
-static xs_str *_object_fn(const char *id)
+int index_add(const char *fn, const char *id)
+/* adds an id to an index */
 {
     xs *md5 = xs_md5_hex(id, strlen(id));
-    return _object_fn_by_md5(md5, "_object_fn");
-}
-
-
-int object_here_by_md5(const char *id)
-/* checks if an object is already downloaded */
-{
-    xs *fn = _object_fn_by_md5(id, "object_here_by_md5");
-    return mtime(fn) > 0.0;
-}
-
-
-int object_here(const char *id)
-/* checks if an object is already downloaded */
-{
-    xs *fn = _object_fn(id);
-    return mtime(fn) > 0.0;
+    return index_add_md5(fn, md5);
 }
 
 
-int object_get_by_md5(const char *md5, xs_dict **obj)
-/* returns a stored object, optionally of the requested type */
+int index_del_md5(const char *fn, const char *md5)
+/* deletes an md5 from an index */
 {
     int status = 404;
-    xs *fn     = _object_fn_by_md5(md5, "object_get_by_md5");
-    FILE *f;
+    unsigned char bin[IDX_MD5_SIZE];
+    idx_hdr h;
+    int fd;
+
+    if (!_md5_bin(md5, bin, "index_del_md5"))
+        return 400;
+
+    pthread_mutex_t *m = _index_lock(fn);
+
+    if ((fd = _index_open(fn, O_RDWR, &h)) != -1) {
+        const unsigned char *map;
+        size_t size;
+        idx_hdr mh;
+        int n, i;
+
+        if ((map = _index_map_fd(fd, fn, &n, &size, &mh)) != NULL) {
+            for (i = 0; i < n; i++) {
+                if (memcmp(map + i * IDX_MD5_SIZE, bin, IDX_MD5_SIZE) == 0) {
+                    /* found! overwrite it and an eventual
+                       call to index_gc() will clean it */
+                    h.deleted++;
+
+                    if (pwrite(fd, idx_deleted, IDX_MD5_SIZE, IDX_ENTRY_OFF(i)) == IDX_MD5_SIZE &&
+                        pwrite(fd, &h, sizeof(h), 0) == sizeof(h))
+                        status = 200;
+                    else
+                        status = 500;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        *obj = xs_json_load(f);
-        fclose(f);
+                    break;
+                }
+            }
+
+            _index_unmap(map, size);
+        }
 
-        if (*obj)
-            status = 200;
+        close(fd);
     }
     else
-        *obj = NULL;
+        status = 500;
+
+    pthread_mutex_unlock(m);
 
     return status;
 }
 
 
-int object_get(const char *id, xs_dict **obj)
-/* returns a stored object, optionally of the requested type */
+int index_del(const char *fn, const char *id)
+/* deletes an id from an index */
 {
     xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_get_by_md5(md5, obj);
+    return index_del_md5(fn, md5);
 }
 
 
-int _object_add(const char *id, const xs_dict *obj, int ow)
-/* stores an object */
+static int _index_gc(const char *fn, snac *user)
+/* garbage-collects an index, deleting objects that are not here
+   (or, if there is a user, that are no longer in its timeline) */
 {
-    int status = 201; /* Created */
-    xs *fn     = _object_fn(id);
-    FILE *f;
+    const unsigned char *map = NULL;
+    size_t size;
+    idx_hdr h;
+    int gc = -1;
+    int n, i, fd;
 
-    if (!ow && mtime(fn) > 0.0) {
-        /* object already here */
-        srv_debug(1, xs_fmt("object_add object already here %s", id));
-        return 204; /* No content */
-    }
+    pthread_mutex_t *m = _index_lock(fn);
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        flock(fileno(f), LOCK_EX);
+    /* keep the index locked until the new one is in place */
+    if ((fd = _index_open(fn, O_RDWR, &h)) != -1 &&
+        (map = _index_map_fd(fd, fn, &n, &size, &h)) != NULL) {
+        xs *nfn = xs_fmt("%s.new", fn);
+        FILE *o;
 
-        xs_json_dump(obj, 4, f);
-        fclose(f);
+        if ((o = fopen(nfn, "w")) != NULL) {
+            gc = 0;
 
-        /* does this object has a parent? */
-        char *in_reply_to = xs_dict_get(obj, "inReplyTo");
+            h.deleted = 0;
+            h.version = IDX_VERSION | ((IDX_HDR_GEN(&h) + 1) & 0xffff) << 16;
+            fwrite(&h, sizeof(h), 1, o);
 
-        if (!xs_is_null(in_reply_to) && *in_reply_to) {
-            /* update the children index of the parent */
-            xs *c_idx = _object_fn(in_reply_to);
+            for (i = 0; i < n; i++) {
+                const unsigned char *e = map + i * IDX_MD5_SIZE;
+                char md5[33];
 
-            c_idx = xs_replace_i(c_idx, ".json", "_c.idx");
+                _md5_hex(e, md5);
 
-            if (!index_in(c_idx, id)) {
-                index_add(c_idx, id);
-                srv_debug(1, xs_fmt("object_add added child %s to %s", id, c_idx));
+                if (memcmp(e, idx_deleted, IDX_MD5_SIZE) != 0 &&
+                    (user ? timeline_here(user, md5) : object_here_by_md5(md5)))
+                    fwrite(e, IDX_MD5_SIZE, 1, o);
+                else
+                    gc++;
             }
-            else
-                srv_debug(1, xs_fmt("object_add %s child already in %s", id, c_idx));
 
-            /* create a one-element index with the parent */
-            xs *p_idx = xs_replace(fn, ".json", "_p.idx");
+            fclose(o);
 
-            if (mtime(p_idx) == 0.0) {
-                index_add(p_idx, in_reply_to);
-                srv_debug(1, xs_fmt("object_add added parent %s to %s", in_reply_to, p_idx));
+            if (gc) {
+                xs *ofn = xs_fmt("%s.bak", fn);
+
+                unlink(ofn);
+                link(fn, ofn);
+                rename(nfn, fn);
+            }
+            else {
+                /* nothing collected: keep it (and its .pos side file) */
+                unlink(nfn);
             }
         }
-    }
-    else {
-        srv_log(xs_fmt("object_add error writing %s (errno: %d)", fn, errno));
-        status = 500;
-    }
 
-    srv_debug(1, xs_fmt("object_add %s %s %d", id, fn, status));
+        _index_unmap(map, size);
+    }
 
-    return status;
-}
+    if (fd != -1)
+        close(fd);
 
+    pthread_mutex_unlock(m);
 
-int object_add(const char *id, const xs_dict *obj)
-/* stores an object */
-{
-    return _object_add(id, obj, 0);
+    return gc;
 }
 
 
-int object_add_ow(const char *id, const xs_dict *obj)
-/* stores an object (overwriting allowed) */
+int index_gc(const char *fn)
+/* garbage-collects an index, deleting objects that are not here */
 {
-    return _object_add(id, obj, 1);
+    return _index_gc(fn, NULL);
 }
 
 
-int object_del_by_md5(const char *md5)
-/* deletes an object by its md5 */
+int index_in_md5(const char *fn, const char *md5)
+/* checks if the md5 is already in the index */
 {
-    int status = 404;
-    xs *fn     = _object_fn_by_md5(md5, "object_del_by_md5");
-
-    if (unlink(fn) != -1) {
-        status = 200;
+    unsigned char bin[IDX_MD5_SIZE];
+    const unsigned char *map;
+    size_t size;
+    idx_hdr h;
+    int ret = 0;
+    int n, i;
 
-        /* also delete associated indexes */
-        xs *spec  = xs_dup(fn);
-        spec      = xs_replace_i(spec, ".json", "*.idx");
-        xs *files = xs_glob(spec, 0, 0);
-        char *p, *v;
+    if (!_md5_bin(md5, bin, "index_in_md5"))
+        return 0;
 
-        p = files;
-        while (xs_list_iter(&p, &v)) {
-            srv_debug(1, xs_fmt("object_del index %s", v));
-            unlink(v);
+    if ((map = _index_map(fn, &n, &size, &h)) != NULL) {
+        for (i = 0; !ret && i < n; i++) {
+            if (memcmp(map + i * IDX_MD5_SIZE, bin, IDX_MD5_SIZE) == 0)
+                ret = 1;
         }
-    }
 
-    srv_debug(1, xs_fmt("object_del %s %d", fn, status));
+        _index_unmap(map, size);
+    }
 
-    return status;
+    return ret;
 }
 
 
-int object_del(const char *id)
-/* deletes an object */
+int index_in(const char *fn, const char *id)
+/* checks if the object id is already in the index */
 {
     xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_del_by_md5(md5);
+    return index_in_md5(fn, md5);
 }
 
 
-int object_del_if_unref(const char *id)
-/* deletes an object if its n_links < 2 */
+int index_first(const char *fn, char *line, int size)
+/* reads the first entry of an index */
 {
-    xs *fn = _object_fn(id);
-    int n_links;
+    unsigned char bin[IDX_MD5_SIZE];
+    idx_hdr h;
     int ret = 0;
+    int fd;
+
+    if (size < 33)
+        return 0;
 
-    if (mtime_nl(fn, &n_links) > 0.0 && n_links < 2)
-        ret = object_del(id);
+    if ((fd = open(fn, O_RDONLY)) != -1) {
+        flock(fd, LOCK_SH);
+
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && _index_hdr_ok(&h, fn) &&
+            pread(fd, bin, sizeof(bin), IDX_ENTRY_OFF(0)) == sizeof(bin)) {
+            _md5_hex(bin, line);
+            ret = 1;
+        }
+
+        close(fd);
+    }
 
     return ret;
 }
 
 
-double object_ctime_by_md5(const char *md5)
+int index_len(const char *fn)
+/* returns the number of elements in an index */
 {
-    xs *fn = _object_fn_by_md5(md5, "object_ctime_by_md5");
-    return f_ctime(fn);
-}
+    idx_hdr h;
+    struct stat st;
+    int len = 0;
+    int fd;
 
+    if ((fd = open(fn, O_RDONLY)) != -1) {
+        if (fstat(fd, &st) != -1 && pread(fd, &h, sizeof(h), 0) == sizeof(h))
+            len = (st.st_size - sizeof(h)) / IDX_MD5_SIZE - h.deleted;
 
-double object_ctime(const char *id)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_ctime_by_md5(md5);
+        close(fd);
+    }
+
+    return len < 0 ? 0 : len;
 }
 
 
-xs_str *_object_index_fn(const char *id, const char *idxsfx)
-/* returns the filename of an object's index */
+xs_list *index_list(const char *fn, int max)
+/* returns an index as a list */
 {
-    xs_str *fn = _object_fn(id);
-    return xs_replace_i(fn, ".json", idxsfx);
-}
+    xs_list *list = xs_list_new();
+    const unsigned char *map;
+    size_t size;
+    idx_hdr h;
+    int n, i, c = 0;
 
+    if ((map = _index_map(fn, &n, &size, &h)) != NULL) {
+        for (i = 0; c < max && i < n; i++) {
+            const unsigned char *e = map + i * IDX_MD5_SIZE;
 
-int object_likes_len(const char *id)
-/* returns the number of likes (without reading the index) */
-{
-    xs *fn = _object_index_fn(id, "_l.idx");
-    return index_len(fn);
-}
+            if (memcmp(e, idx_deleted, IDX_MD5_SIZE) != 0) {
+                char md5[33];
+
+                _md5_hex(e, md5);
+                list = xs_list_append(list, md5);
+                c++;
+            }
+        }
 
+        _index_unmap(map, size);
+    }
 
-int object_announces_len(const char *id)
-/* returns the number of announces (without reading the index) */
-{
-    xs *fn = _object_index_fn(id, "_a.idx");
-    return index_len(fn);
+    return list;
 }
 
 
-xs_list *object_children(const char *id)
-/* returns the list of an object's children */
+xs_list *index_list_desc(const char *fn, int skip, int show)
+/* returns an index as a list, in reverse order */
 {
-    xs *fn = _object_index_fn(id, "_c.idx");
-    return index_list(fn, XS_ALL);
-}
+    xs_list *list = xs_list_new();
+    const unsigned char *map;
+    size_t size;
+    idx_hdr h;
+    int n, i, c = 0;
+
+    if ((map = _index_map(fn, &n, &size, &h)) != NULL) {
+        /* start from the end minus the skipped entries */
+        for (i = n - 1 - skip; c < show && i >= 0; i--) {
+            const unsigned char *e = map + i * IDX_MD5_SIZE;
+
+            if (memcmp(e, idx_deleted, IDX_MD5_SIZE) != 0) {
+                char md5[33];
+
+                _md5_hex(e, md5);
+                list = xs_list_append(list, md5);
+                c++;
+            }
+        }
 
+        _index_unmap(map, size);
+    }
 
-xs_list *object_likes(const char *id)
-{
-    xs *fn = _object_index_fn(id, "_l.idx");
-    return index_list(fn, XS_ALL);
+    return list;
 }
 
 
-xs_list *object_announces(const char *id)
-{
-    xs *fn = _object_index_fn(id, "_a.idx");
-    return index_list(fn, XS_ALL);
-}
+/* to seek into big indexes (e.g. to the max_id of a Mastodon API
+   timeline page), a side file (the index file name plus .pos) keeps
+   the md5s of their entries sorted, each with its position. Entries
+   appended after it was built are searched linearly, and it's
+   rebuilt when there are too many of them or the index has been
+   garbage-collected, as told by its generation (positions are
+   otherwise stable, as deleted entries are only overwritten with
+   zeros) */
 
+#define POS_MAGIC       "snacpos"
+#define POS_VERSION     2
+#define POS_TAIL_MAX    1024
 
-int object_parent(const char *md5, char *buf, int size)
-/* returns the object parent, if any */
-{
-    xs *fn = _object_fn_by_md5(md5, "object_parent");
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n;             /* number of index entries covered */
+    uint64_t ino;           /* inode of the index when built */
+    uint32_t gen;           /* generation of the index when built */
+    uint32_t pad;
+} pos_hdr;
 
-    fn = xs_replace_i(fn, ".json", "_p.idx");
-    return index_first(fn, buf, size);
+typedef struct {
+    unsigned char md5[IDX_MD5_SIZE];
+    uint32_t pos;
+} pos_rec;
+
+
+static int _pos_rec_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, IDX_MD5_SIZE);
 }
 
 
-int object_admire(const char *id, const char *actor, int like)
-/* actor likes or announces this object */
+static int _pos_search(const pos_rec *recs, int n, const unsigned char *bin)
+/* searches an md5 in the sorted records, returning its position or -1 */
 {
-    int status = 200;
-    xs *fn     = _object_fn(id);
+    int lo = 0, hi = n - 1;
 
-    fn = xs_replace_i(fn, ".json", like ? "_l.idx" : "_a.idx");
+    while (lo <= hi) {
+        int m = lo + (hi - lo) / 2;
+        int c = memcmp(recs[m].md5, bin, IDX_MD5_SIZE);
 
-    if (!index_in(fn, actor)) {
-        status = index_add(fn, actor);
+        if (c == 0)
+            return recs[m].pos;
 
-        srv_debug(1, xs_fmt("object_admire (%s) %s %s", like ? "Like" : "Announce", actor, fn));
+        if (c < 0)
+            lo = m + 1;
+        else
+            hi = m - 1;
     }
 
-    return status;
+    return -1;
 }
 
 
-int object_unadmire(const char *id, const char *actor, int like)
-/* actor no longer likes or announces this object */
+static int _pos_build(const char *fn, const unsigned char *map, int n,
+                      uint64_t ino, uint32_t gen, const unsigned char *bin)
+/* rebuilds the side file of an index, returning the position of bin or -1 */
 {
-    int status;
-    xs *fn = _object_fn(id);
+    xs *pfn = xs_fmt("%s.pos", fn);
+    xs *nfn = xs_fmt("%s.pos.new", fn);
+    pos_rec *recs;
+    int c = 0, i;
+    int ret = -1;
+    FILE *f;
 
-    fn = xs_replace_i(fn, ".json", like ? "_l.idx" : "_a.idx");
+    if ((recs = malloc(sizeof(pos_rec) * (n ? n : 1))) == NULL)
+        return -1;
 
-    status = index_del(fn, actor);
+    for (i = 0; i < n; i++) {
+        const unsigned char *e = map + i * IDX_MD5_SIZE;
 
-    srv_debug(0,
-        xs_fmt("object_unadmire (%s) %s %s %d", like ? "Like" : "Announce", actor, fn, status));
+        if (!_md5_is_zero(e)) {
+            memcpy(recs[c].md5, e, IDX_MD5_SIZE);
+            recs[c].pos = i;
+            c++;
+        }
+    }
 
-    return status;
-}
+    qsort(recs, c, sizeof(pos_rec), _pos_rec_cmp);
 
+    ret = _pos_search(recs, c, bin);
 
-int _object_user_cache(snac *snac, const char *id, const char *cachedir, int del)
-/* adds or deletes from a user cache */
-{
-    xs *ofn = _object_fn(id);
-    xs *l   = xs_split(ofn, "/");
-    xs *cfn = xs_fmt("%s/%s/%s", snac->basedir, cachedir, xs_list_get(l, -1));
-    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, cachedir);
-    int ret;
+    pthread_mutex_t *m = _index_lock(pfn);
 
-    if (del) {
-        ret = unlink(cfn);
-        index_del(idx, id);
-    }
-    else {
-        if ((ret = link(ofn, cfn)) != -1)
-            index_add(idx, id);
+    if ((f = fopen(nfn, "w")) != NULL) {
+        pos_hdr h;
+
+        memset(&h, '\0', sizeof(h));
+        memcpy(h.magic, POS_MAGIC, sizeof(h.magic));
+        h.version = POS_VERSION;
+        h.n       = n;
+        h.ino     = ino;
+        h.gen     = gen;
+
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(recs, sizeof(pos_rec), c, f);
+
+        if (fclose(f) == 0)
+            rename(nfn, pfn);
+        else
+            unlink(nfn);
     }
 
+    pthread_mutex_unlock(m);
+
+    free(recs);
+
     return ret;
 }
 
 
-int object_user_cache_add(snac *snac, const char *id, const char *cachedir)
-/* caches an object into a user cache */
+int index_seek(const char *fn, const char *md5)
+/* returns the position of an md5 in an index (or the position after the
+   last entry if md5 is NULL), or -1 if it's not there */
 {
-    return _object_user_cache(snac, id, cachedir, 0);
-}
+    unsigned char bin[IDX_MD5_SIZE];
+    const unsigned char *map;
+    size_t size;
+    struct stat st;
+    idx_hdr h;
+    int ret = -1;
+    int n, fd;
 
+    if (md5 != NULL && !_md5_bin(md5, bin, "index_seek"))
+        return -1;
 
-int object_user_cache_del(snac *snac, const char *id, const char *cachedir)
-/* deletes an object from a user cache */
-{
-    return _object_user_cache(snac, id, cachedir, 1);
-}
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return -1;
 
+    flock(fd, LOCK_SH);
 
-int object_user_cache_in(snac *snac, const char *id, const char *cachedir)
-/* checks if an object is stored in a cache */
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    xs *cfn = xs_fmt("%s/%s/%s.json", snac->basedir, cachedir, md5);
+    if (fstat(fd, &st) == -1 || (map = _index_map_fd(fd, fn, &n, &size, &h)) == NULL) {
+        close(fd);
+        return md5 ? -1 : 0;
+    }
 
-    return !!(mtime(cfn) != 0.0);
-}
+    close(fd);
 
+    if (md5 == NULL)
+        ret = n;
+    else {
+        xs *pfn = xs_fmt("%s.pos", fn);
+        const unsigned char *pmap = MAP_FAILED;
+        struct stat pst;
+        pos_hdr ph;
+        int built = 0;
+        int pfd, i;
 
-xs_list *object_user_cache_list(snac *snac, const char *cachedir, int max, int inv)
-/* returns the objects in a cache as a list */
-{
-    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, cachedir);
-    return inv ? index_list_desc(idx, 0, max) : index_list(idx, max);
-}
+        memset(&ph, '\0', sizeof(ph));
 
+        if ((pfd = open(pfn, O_RDONLY)) != -1) {
+            if (fstat(pfd, &pst) != -1 && pst.st_size >= (off_t) sizeof(ph) &&
+                (pmap = mmap(NULL, pst.st_size, PROT_READ, MAP_SHARED, pfd, 0)) != MAP_FAILED)
+                memcpy(&ph, pmap, sizeof(ph));
 
-/** specialized functions **/
+            close(pfd);
+        }
 
-/** followers **/
+        /* usable? */
+        if (pmap != MAP_FAILED &&
+            memcmp(ph.magic, POS_MAGIC, sizeof(ph.magic)) == 0 && ph.version == POS_VERSION &&
+            ph.ino == (uint64_t) st.st_ino && ph.gen == IDX_HDR_GEN(&h) &&
+            (int) ph.n <= n && n - (int) ph.n <= POS_TAIL_MAX) {
+            /* search the newest entries first */
+            for (i = n - 1; ret == -1 && i >= (int) ph.n; i--) {
+                if (memcmp(map + i * IDX_MD5_SIZE, bin, IDX_MD5_SIZE) == 0)
+                    ret = i;
+            }
 
-int follower_add(snac *snac, const char *actor)
-/* adds a follower */
-{
-    int ret = object_user_cache_add(snac, actor, "followers");
+            if (ret == -1) {
+                ret = _pos_search((const pos_rec *)(pmap + sizeof(ph)),
+                        (pst.st_size - sizeof(ph)) / sizeof(pos_rec), bin);
 
-    snac_debug(snac, 2, xs_fmt("follower_add %s", actor));
+                /* a position must hold the same md5, or be deleted */
+                if (ret >= (int) ph.n || (ret != -1 &&
+                    memcmp(map + ret * IDX_MD5_SIZE, bin, IDX_MD5_SIZE) != 0 &&
+                    !_md5_is_zero(map + ret * IDX_MD5_SIZE)))
+                    ret = -1;
+            }
+        }
+        else {
+            ret   = _pos_build(fn, map, n, st.st_ino, IDX_HDR_GEN(&h), bin);
+            built = 1;
+        }
 
-    return ret == -1 ? 500 : 200;
+        if (pmap != MAP_FAILED)
+            munmap((void *)pmap, pst.st_size);
+
+        if (built)
+            srv_debug(1, xs_fmt("index_seek: rebuilt %s.pos (%d entries)", fn, n));
+    }
+
+    _index_unmap(map, size);
+
+    return ret;
 }
 
 
-int follower_del(snac *snac, const char *actor)
-/* deletes a follower */
+xs_list *index_list_range(const char *fn, int *pos, int end, int show)
+/* returns up to show entries walking from position *pos (included) to
+   end (excluded), backwards if end is lower; *pos is left at the next one */
 {
-    int ret = object_user_cache_del(snac, actor, "followers");
+    xs_list *list = xs_list_new();
+    const unsigned char *map;
+    size_t size;
+    idx_hdr h;
+    int n, c = 0;
+    int step = end < *pos ? -1 : 1;
 
-    snac_debug(snac, 2, xs_fmt("follower_del %s", actor));
+    if ((map = _index_map(fn, &n, &size, &h)) != NULL) {
+        if (end > n)
+            end = n;
 
-    return ret == -1 ? 404 : 200;
-}
+        for (; c < show && *pos != end && *pos >= 0 && *pos < n; *pos += step) {
+            const unsigned char *e = map + *pos * IDX_MD5_SIZE;
 
+            if (!_md5_is_zero(e)) {
+                char md5[33];
 
-int follower_check(snac *snac, const char *actor)
-/* checks if someone is a follower */
-{
-    return object_user_cache_in(snac, actor, "followers");
+                _md5_hex(e, md5);
+                list = xs_list_append(list, md5);
+                c++;
+            }
+        }
+
+        _index_unmap(map, size);
+    }
+
+    return list;
 }
 
 
-xs_list *follower_list(snac *snac)
-/* returns the list of followers */
+int index_upgrade(const char *fn)
+/* converts an old text index to the binary format */
 {
-    xs *list       = object_user_cache_list(snac, "followers", XS_ALL, 0);
-    xs_list *fwers = xs_list_new();
-    char *p, *v;
+    FILE *i, *o;
+    int ret = -1;
 
-    /* resolve the list of md5 to be a list of actors */
-    p = list;
-    while (xs_list_iter(&p, &v)) {
-        xs *a_obj = NULL;
+    if ((i = fopen(fn, "r")) != NULL) {
+        xs *nfn = xs_fmt("%s.new", fn);
+        char line[256];
+        idx_hdr h;
 
-        if (valid_status(object_get_by_md5(v, &a_obj))) {
-            const char *actor = xs_dict_get(a_obj, "id");
+        /* already converted? */
+        if (fread(&h, sizeof(h), 1, i) == 1 && memcmp(h.magic, IDX_MAGIC, sizeof(h.magic)) == 0) {
+            fclose(i);
+            return 0;
+        }
 
-            if (!xs_is_null(actor)) {
-                /* check if the actor is still cached */
-                xs *fn = xs_fmt("%s/followers/%s.json", snac->basedir, v);
+        rewind(i);
 
-                if (mtime(fn) > 0.0)
-                    fwers = xs_list_append(fwers, actor);
+        if ((o = fopen(nfn, "w")) != NULL) {
+            memset(&h, '\0', sizeof(h));
+            memcpy(h.magic, IDX_MAGIC, sizeof(h.magic));
+            h.version = IDX_VERSION;
+            fwrite(&h, sizeof(h), 1, o);
+
+            ret = 0;
+
+            while (fgets(line, sizeof(line), i) != NULL) {
+                unsigned char bin[IDX_MD5_SIZE];
+
+                line[32] = '\0';
+
+                /* deleted entries are just dropped */
+                if (line[0] != '-' && _md5_bin(line, bin, "index_upgrade")) {
+                    fwrite(bin, sizeof(bin), 1, o);
+                    ret++;
+                }
             }
+
+            fclose(o);
+            rename(nfn, fn);
         }
+
+        fclose(i);
     }
 
-    return fwers;
+    return ret;
 }
 
 
-/** timeline **/
+/** the object pack **/
 
-double timeline_mtime(snac *snac)
+/* objects are stored as records appended to segment files in object/pack/,
+   and a hash table file (object/pack/index) maps each md5 to the
+   location of its latest record, its creation and modification times
+   and the number of references from user caches (what the link count
+   of the object files was used for in previous disk layouts).
+   Writers hold an exclusive lock on object/pack/lock, readers a shared one */
+
+#define PACK_MAGIC      "snacpk1"
+#define PACK_IDX_MIN    65536
+#define PACK_SEG_MAX    (64 * 1024 * 1024)
+#define PACK_DEAD       0xffffffff
+
+typedef struct {
+    char magic[8];
+    uint32_t size;          /* number of slots (a power of 2) */
+    uint32_t used;          /* live slots */
+    uint32_t dead;          /* deleted slots */
+    uint32_t seg;           /* current (appendable) segment */
+    char pad[8];
+} pack_hdr;
+
+typedef struct {
+    unsigned char md5[16];
+    uint32_t seg;           /* segment number (0: empty, PACK_DEAD: deleted) */
+    uint32_t off;           /* offset of the data inside the segment */
+    uint32_t len;           /* size of the data */
+    uint32_t refs;          /* references from user caches */
+    uint32_t ctime;         /* creation time */
+    uint32_t mtime;         /* modification time */
+} pack_slot;
+
+#define PACK_SLOT_OFF(n) ((off_t) sizeof(pack_hdr) + (off_t) (n) * sizeof(pack_slot))
+
+
+static xs_str *_pack_fn(const char *name)
 {
-    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
-    return mtime(fn);
+    return xs_fmt("%s/object/pack/%s", srv_basedir, name);
 }
 
 
-int timeline_touch(snac *snac)
-/* changes the date of the timeline index */
+static xs_str *_pack_seg_fn(uint32_t seg)
 {
-    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
-    return utimes(fn, NULL);
+    return xs_fmt("%s/object/pack/%08u.seg", srv_basedir, seg);
 }
 
 
-xs_str *timeline_fn_by_md5(snac *snac, const char *md5)
-/* get the filename of an entry by md5 from any timeline */
+static int _pack_lock(int op)
+/* opens and locks the object pack */
 {
-    xs_str *fn = xs_fmt("%s/private/%s.json", snac->basedir, md5);
+    xs *fn = _pack_fn("lock");
+    int fd;
 
-    if (mtime(fn) == 0.0) {
-        fn = xs_free(fn);
-        fn = xs_fmt("%s/public/%s.json", snac->basedir, md5);
+    if ((fd = open(fn, O_RDWR | O_CREAT, 0666)) == -1) {
+        /* the directory may not exist yet */
+        xs *dir = xs_fmt("%s/object/pack", srv_basedir);
+        mkdirx(dir);
 
-        if (mtime(fn) == 0.0)
-            fn = xs_free(fn);
+        fd = open(fn, O_RDWR | O_CREAT, 0666);
     }
 
-    return fn;
+    if (fd != -1)
+        flock(fd, op);
+    else
+        srv_log(xs_fmt("_pack_lock error opening %s (errno: %d)", fn, errno));
+
+    return fd;
 }
 
 
-int timeline_here(snac *snac, const char *md5)
-/* checks if an object is in the user cache */
+static void _pack_unlock(int fd)
+/* unlocks the object pack */
 {
-    xs *fn = timeline_fn_by_md5(snac, md5);
-
-    return !(fn == NULL);
+    if (fd != -1)
+        close(fd);
 }
 
 
-int timeline_get_by_md5(snac *snac, const char *md5, xs_dict **msg)
-/* gets a message from the timeline */
+static int _pack_index_open(pack_hdr *h, int flags)
+/* opens the pack index with the open() flags and reads its header */
 {
-    int status = 404;
-    FILE *f    = NULL;
-
-    xs *fn = timeline_fn_by_md5(snac, md5);
+    xs *fn = _pack_fn("index");
+    int fd;
 
-    if (fn != NULL && (f = fopen(fn, "r")) != NULL) {
-        *msg = xs_json_load(f);
-        fclose(f);
+    if ((fd = open(fn, flags, 0666)) == -1)
+        return -1;
 
-        if (*msg != NULL)
-            status = 200;
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+        if (flags & O_CREAT) {
+            /* brand new index */
+            memset(h, '\0', sizeof(*h));
+            memcpy(h->magic, PACK_MAGIC, sizeof(h->magic));
+            h->size = PACK_IDX_MIN;
+            h->seg  = 1;
+
+            if (pwrite(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+                ftruncate(fd, PACK_SLOT_OFF(h->size)) == -1) {
+                srv_log(xs_fmt("_pack_index_open error creating %s (errno: %d)", fn, errno));
+                close(fd);
+                fd = -1;
+            }
+        }
+        else {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0) {
+        srv_log(xs_fmt("_pack_index_open bad magic in %s", fn));
+        close(fd);
+        fd = -1;
     }
 
-    return status;
+    return fd;
 }
 
 
-int timeline_del(snac *snac, char *id)
-/* deletes a message from the timeline */
+static uint32_t _pack_hash(const unsigned char *md5, uint32_t size)
+/* returns the first slot to probe for an md5 (it's already a hash) */
 {
-    /* delete from the user's caches */
-    object_user_cache_del(snac, id, "public");
-    object_user_cache_del(snac, id, "private");
-
-    /* try to delete the object if it's not used elsewhere */
-    return object_del_if_unref(id);
+    return (md5[0] | md5[1] << 8 | md5[2] << 16 | (uint32_t) md5[3] << 24) & (size - 1);
 }
 
 
-void timeline_update_indexes(snac *snac, const char *id)
-/* updates the indexes */
+static int _pack_find(int fd, const pack_hdr *h, const unsigned char *md5,
+                      pack_slot *s, int *free_n)
+/* finds the slot of an md5; returns its number or -1. If free_n is set,
+   it's filled with the slot number where it can be inserted */
 {
-    object_user_cache_add(snac, id, "private");
+    uint32_t n = _pack_hash(md5, h->size);
+    uint32_t i;
 
-    if (xs_startswith(id, snac->actor)) {
-        xs *msg = NULL;
+    if (free_n)
+        *free_n = -1;
 
-        if (valid_status(object_get(id, &msg))) {
-            /* if its ours and is public, also store in public */
-            if (is_msg_public(msg)) {
-                object_user_cache_add(snac, id, "public");
+    for (i = 0; i < h->size; i++) {
+        if (pread(fd, s, sizeof(*s), PACK_SLOT_OFF(n)) != sizeof(*s))
+            break;
 
-                /* also add it to the instance public timeline */
-                xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
-                index_add(ipt, id);
-            }
+        if (s->seg == 0) {
+            if (free_n && *free_n == -1)
+                *free_n = n;
+
+            break;
+        }
+
+        if (s->seg == PACK_DEAD) {
+            if (free_n && *free_n == -1)
+                *free_n = n;
         }
+        else
+        if (memcmp(s->md5, md5, sizeof(s->md5)) == 0)
+            return n;
+
+        n = (n + 1) & (h->size - 1);
     }
+
+    return -1;
 }
 
 
-int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
-/* adds a message to the timeline */
+static int _pack_rebuild(int *fd, pack_hdr *h)
+/* rebuilds the index, dropping deleted slots and resizing as needed */
 {
-    int ret = object_add(id, o_msg);
-    timeline_update_indexes(snac, id);
+    uint32_t nsize = PACK_IDX_MIN;
+    pack_slot chunk[1024];
+    pack_slot *tbl;
+    uint32_t n, i;
+    int ret = -1;
 
-    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
+    /* keep the load factor under 1/4 after the rebuild */
+    while (nsize < (h->used + 1) * 4)
+        nsize *= 2;
 
-    return ret;
-}
+    if ((tbl = calloc(nsize, sizeof(pack_slot))) == NULL)
+        return -1;
 
+    for (n = 0; n < h->size; n += i) {
+        int r = pread(*fd, chunk, sizeof(chunk), PACK_SLOT_OFF(n));
 
-void timeline_admire(snac *snac, const char *id, const char *admirer, int like)
-/* updates a timeline entry with a new admiration */
-{
-    /* if we are admiring this, add to both timelines */
-    if (!like && strcmp(admirer, snac->actor) == 0) {
-        object_user_cache_add(snac, id, "public");
-        object_user_cache_add(snac, id, "private");
+        if (r < (int) sizeof(pack_slot))
+            break;
+
+        for (i = 0; i < r / sizeof(pack_slot); i++) {
+            pack_slot *s = &chunk[i];
+
+            if (s->seg != 0 && s->seg != PACK_DEAD) {
+                uint32_t m = _pack_hash(s->md5, nsize);
+
+                while (tbl[m].seg != 0)
+                    m = (m + 1) & (nsize - 1);
+
+                tbl[m] = *s;
+            }
+        }
     }
 
-    object_admire(id, admirer, like);
+    xs *fn  = _pack_fn("index");
+    xs *nfn = _pack_fn("index.new");
+    int nfd;
 
-    snac_debug(snac, 1, xs_fmt("timeline_admire (%s) %s %s",
-            like ? "Like" : "Announce", id, admirer));
+    if ((nfd = open(nfn, O_RDWR | O_CREAT | O_TRUNC, 0666)) != -1) {
+        pack_hdr nh = *h;
+
+        nh.size = nsize;
+        nh.dead = 0;
+
+        if (pwrite(nfd, &nh, sizeof(nh), 0) == sizeof(nh) &&
+            pwrite(nfd, tbl, nsize * sizeof(pack_slot), sizeof(nh)) ==
+                (ssize_t) (nsize * sizeof(pack_slot)) &&
+            rename(nfn, fn) != -1) {
+            close(*fd);
+            *fd = nfd;
+            *h  = nh;
+            ret = 0;
+
+            srv_debug(1, xs_fmt("_pack_rebuild %d slots (%d used)", nsize, h->used));
+        }
+        else {
+            srv_log(xs_fmt("_pack_rebuild error writing %s (errno: %d)", nfn, errno));
+            close(nfd);
+            unlink(nfn);
+        }
+    }
+
+    free(tbl);
+
+    return ret;
 }
 
 
-xs_list *timeline_top_level(snac *snac, xs_list *list)
-/* returns the top level md5 entries from this index */
+static int _pack_append(pack_hdr *h, const char *md5, const char *data, int size, uint32_t *off)
+/* appends a record to the current segment */
 {
-    xs_set seen;
-    xs_list *p;
-    xs_str *v;
+    xs *fn = _pack_seg_fn(h->seg);
+    off_t sz;
+    int fd;
 
-    xs_set_init(&seen);
+    if ((fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0666)) == -1)
+        return -1;
 
-    p = list;
-    while (xs_list_iter(&p, &v)) {
-        char line[256] = "";
+    sz = lseek(fd, 0, SEEK_END);
 
-        strncpy(line, v, sizeof(line));
+    if (sz > 0 && sz + size > PACK_SEG_MAX) {
+        /* full; start a new segment */
+        close(fd);
+        h->seg++;
 
-        for (;;) {
-            char line2[256];
+        xs *nfn = _pack_seg_fn(h->seg);
+        if ((fd = open(nfn, O_WRONLY | O_CREAT | O_APPEND, 0666)) == -1)
+            return -1;
 
-            /* if it doesn't have a parent, use this */
-            if (!object_parent(line, line2, sizeof(line2)))
-                break;
+        sz = 0;
+    }
 
-            /* well, there is a parent... but is it here? */
-            if (!timeline_here(snac, line2))
-                break;
+    /* each record is a header line, the data and a new line */
+    xs *rec = xs_fmt("%s %d\n", md5, size);
+    int hsz = strlen(rec);
 
-            /* it's here! try again with its own parent */
-            strncpy(line, line2, sizeof(line));
-        }
+    rec = xs_append_m(rec, data, size);
+    rec = xs_str_cat(rec, "\n");
 
-        xs_set_add(&seen, line);
+    int ret = -1;
+
+    if (write(fd, rec, hsz + size + 1) == hsz + size + 1) {
+        *off = sz + hsz;
+        ret  = 0;
     }
 
-    return xs_set_result(&seen);
+    close(fd);
+
+    return ret;
 }
 
 
-xs_list *timeline_simple_list(snac *snac, const char *idx_name, int skip, int show)
-/* returns a timeline (with all entries) */
+static int _pack_put(const char *md5, const char *data, int ow,
+                     int refs, time_t ctime, time_t mtime)
+/* stores the data of an object into the pack, adding refs references */
 {
-    int c_max;
+    unsigned char raw[16];
+    int status = 500;
+    pack_hdr h;
+    pack_slot s;
+    int lfd, fd = -1, n, fn;
 
-    /* maximum number of items in the timeline */
-    c_max = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+    if (!_md5_bin(md5, raw, "_pack_put"))
+        return 400;
 
-    /* never more timeline entries than the configured maximum */
-    if (show > c_max)
-        show = c_max;
+    if ((lfd = _pack_lock(LOCK_EX)) == -1)
+        return 500;
 
-    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, idx_name);
+    if ((fd = _pack_index_open(&h, O_RDWR | O_CREAT)) == -1)
+        goto end;
 
-    return index_list_desc(idx, skip, show);
-}
+    n = _pack_find(fd, &h, raw, &s, &fn);
 
+    if (n != -1 && !ow) {
+        /* object already here */
+        status = 204; /* No content */
+        goto end;
+    }
 
-xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show)
-/* returns a timeline (only top level entries) */
-{
-    xs *list = timeline_simple_list(snac, idx_name, skip, show);
+    if (n == -1) {
+        /* new object; rebuild first if the table is getting crowded */
+        if ((h.used + h.dead + 1) * 2 > h.size) {
+            if (_pack_rebuild(&fd, &h) == -1)
+                goto end;
 
-    return timeline_top_level(snac, list);
-}
+            _pack_find(fd, &h, raw, &s, &fn);
+        }
 
+        if (fn == -1)
+            goto end;
 
-xs_list *timeline_instance_list(int skip, int show)
-/* returns the timeline for the full instance */
-{
-    xs *idx = xs_fmt("%s/public.idx", srv_basedir);
+        n = fn;
 
-    return index_list_desc(idx, skip, show);
-}
+        /* s is the slot that ended the probe, not necessarily fn */
+        if (pread(fd, &s, sizeof(s), PACK_SLOT_OFF(n)) != sizeof(s))
+            goto end;
 
+        if (s.seg == PACK_DEAD)
+            h.dead--;
 
-/** following **/
+        h.used++;
 
-/* this needs special treatment and cannot use the object db as is,
-   with a link to a cached author, because we need the Follow object
-   in case we need to unfollow (Undo + original Follow) */
+        memset(&s, '\0', sizeof(s));
+        memcpy(s.md5, raw, sizeof(s.md5));
+    }
 
-xs_str *_following_fn(snac *snac, const char *actor)
-{
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    return xs_fmt("%s/following/%s.json", snac->basedir, md5);
+    if (_pack_append(&h, md5, data, strlen(data), &s.off) == -1) {
+        srv_log(xs_fmt("_pack_put error appending %s (errno: %d)", md5, errno));
+        goto end;
+    }
+
+    s.seg   = h.seg;
+    s.len   = strlen(data);
+    s.mtime = mtime;
+
+    if (refs > 0)
+        s.refs += refs;
+    if (s.ctime == 0 || ctime)
+        s.ctime = ctime ? ctime : mtime;
+
+    if (pwrite(fd, &s, sizeof(s), PACK_SLOT_OFF(n)) == sizeof(s) &&
+        pwrite(fd, &h, sizeof(h), 0) == sizeof(h))
+        status = 201; /* Created */
+
+end:
+    if (fd != -1)
+        close(fd);
+
+    _pack_unlock(lfd);
+
+    return status;
 }
 
 
-int following_add(snac *snac, const char *actor, const xs_dict *msg)
-/* adds to the following list */
+static int _pack_stat(const char *md5, pack_slot *s, const char *func)
+/* gets the slot of an object */
 {
-    int ret = 201; /* created */
-    xs *fn = _following_fn(snac, actor);
-    FILE *f;
+    unsigned char raw[16];
+    int ret = 0;
+    pack_hdr h;
+    int lfd, fd;
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(msg, 4, f);
-        fclose(f);
+    if (!_md5_bin(md5, raw, func))
+        return 0;
 
-        /* get the filename of the actor object */
-        xs *actor_fn = _object_fn(actor);
+    if ((lfd = _pack_lock(LOCK_SH)) == -1)
+        return 0;
 
-        /* increase its reference count */
-        fn = xs_replace_i(fn, ".json", "_a.json");
-        link(actor_fn, fn);
+    if ((fd = _pack_index_open(&h, O_RDONLY)) != -1) {
+        ret = _pack_find(fd, &h, raw, s, NULL) != -1;
+        close(fd);
     }
-    else
-        ret = 500;
 
-    snac_debug(snac, 2, xs_fmt("following_add %s %s", actor, fn));
+    _pack_unlock(lfd);
 
     return ret;
 }
 
 
-int following_del(snac *snac, const char *actor)
-/* we're not following this actor any longer */
+static xs_str *_pack_get(const char *md5, pack_slot *s, int *same)
+/* returns the data of an object, or NULL. If same is set, s has the
+   location of an already known version of the object, and it's not
+   read again if it's still the current one */
 {
-    xs *fn = _following_fn(snac, actor);
+    unsigned char raw[16];
+    xs_str *data = NULL;
+    pack_slot k = *s;
+    pack_hdr h;
+    int lfd, fd;
 
-    snac_debug(snac, 2, xs_fmt("following_del %s %s", actor, fn));
+    if (!_md5_bin(md5, raw, "_pack_get"))
+        return NULL;
 
-    unlink(fn);
+    if ((lfd = _pack_lock(LOCK_SH)) == -1)
+        return NULL;
 
-    /* also delete the reference to the author */
-    fn = xs_replace_i(fn, ".json", "_a.json");
-    unlink(fn);
+    if ((fd = _pack_index_open(&h, O_RDONLY)) != -1) {
+        if (_pack_find(fd, &h, raw, s, NULL) != -1) {
+            if (same && s->seg == k.seg && s->off == k.off) {
+                /* the known version is still the current one */
+                *same = 1;
+            }
+            else {
+                xs *fn = _pack_seg_fn(s->seg);
+                int sfd;
 
-    return 200;
-}
+                if ((sfd = open(fn, O_RDONLY)) != -1) {
+                    data = xs_realloc(NULL, _xs_blk_size(s->len + 1));
 
+                    if (pread(sfd, data, s->len, s->off) == (ssize_t) s->len)
+                        data[s->len] = '\0';
+                    else {
+                        srv_log(xs_fmt("_pack_get short read for %s in %s", md5, fn));
+                        data = xs_free(data);
+                    }
 
-int following_check(snac *snac, const char *actor)
-/* checks if we are following this actor */
-{
-    xs *fn = _following_fn(snac, actor);
+                    close(sfd);
+                }
+            }
+        }
 
-    return !!(mtime(fn) != 0.0);
+        close(fd);
+    }
+
+    _pack_unlock(lfd);
+
+    return data;
 }
 
 
-int following_get(snac *snac, const char *actor, xs_dict **data)
-/* returns the 'Follow' object */
+static int _pack_update(const char *md5, int del, int refs_inc, int touch)
+/* deletes an object, changes its reference count or touches it;
+   returns the new reference count or -1 if the object is not here */
 {
-    xs *fn = _following_fn(snac, actor);
-    FILE *f;
-    int status = 200;
+    unsigned char raw[16];
+    int ret = -1;
+    pack_hdr h;
+    pack_slot s;
+    int lfd, fd, n;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        *data = xs_json_load(f);
-        fclose(f);
+    if (!_md5_bin(md5, raw, "_pack_update"))
+        return -1;
+
+    if ((lfd = _pack_lock(LOCK_EX)) == -1)
+        return -1;
+
+    fd = _pack_index_open(&h, O_RDWR);
+
+    if (fd != -1 && (n = _pack_find(fd, &h, raw, &s, NULL)) != -1) {
+        if (del) {
+            /* the data is left in the segment until the compaction */
+            s.seg = PACK_DEAD;
+            h.used--;
+            h.dead++;
+
+            pwrite(fd, &h, sizeof(h), 0);
+        }
+        else {
+            if (refs_inc < 0 && s.refs < (uint32_t) -refs_inc)
+                s.refs = 0;
+            else
+                s.refs += refs_inc;
+
+            if (touch)
+                s.mtime = time(NULL);
+        }
+
+        if (pwrite(fd, &s, sizeof(s), PACK_SLOT_OFF(n)) == sizeof(s))
+            ret = s.refs;
     }
-    else
-        status = 404;
 
-    return status;
+    if (fd != -1)
+        close(fd);
+
+    _pack_unlock(lfd);
+
+    return ret;
 }
 
 
-xs_list *following_list(snac *snac)
-/* returns the list of people being followed */
+static xs_list *_pack_purge_list(time_t mt)
+/* returns the md5s of the unreferenced objects older than mt */
 {
-    xs *spec = xs_fmt("%s/following/" "*.json", snac->basedir);
-    xs *glist = xs_glob(spec, 0, 0);
-    xs_list *p;
-    xs_str *v;
     xs_list *list = xs_list_new();
+    pack_slot chunk[1024];
+    pack_hdr h;
+    int lfd, fd;
+    uint32_t n, i;
 
-    /* iterate the list of files */
-    p = glist;
-    while (xs_list_iter(&p, &v)) {
-        FILE *f;
-
-        /* load the follower data */
-        if ((f = fopen(v, "r")) != NULL) {
-            xs *o = xs_json_load(f);
-            fclose(f);
-
-            if (o != NULL) {
-                const char *type = xs_dict_get(o, "type");
+    if ((lfd = _pack_lock(LOCK_SH)) == -1)
+        return list;
 
-                if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
-                    const char *actor = xs_dict_get(o, "actor");
+    if ((fd = _pack_index_open(&h, O_RDONLY)) != -1) {
+        for (n = 0; n < h.size; n += i) {
+            int r = pread(fd, chunk, sizeof(chunk), PACK_SLOT_OFF(n));
 
-                    if (!xs_is_null(actor)) {
-                        list = xs_list_append(list, actor);
+            if (r < (int) sizeof(pack_slot))
+                break;
 
-                        /* check if there is a link to the actor object */
-                        xs *v2 = xs_replace(v, ".json", "_a.json");
+            for (i = 0; i < r / sizeof(pack_slot); i++) {
+                pack_slot *s = &chunk[i];
 
-                        if (mtime(v2) == 0.0) {
-                            /* no; add a link to it */
-                            xs *actor_fn = _object_fn(actor);
-                            link(actor_fn, v2);
-                        }
-                    }
+                if (s->seg != 0 && s->seg != PACK_DEAD &&
+                    s->refs == 0 && (time_t) s->mtime < mt) {
+                    xs *md5 = xs_hex_enc((char *)s->md5, sizeof(s->md5));
+                    list = xs_list_append(list, md5);
                 }
             }
         }
+
+        close(fd);
     }
 
+    _pack_unlock(lfd);
+
     return list;
 }
 
 
-xs_str *_muted_fn(snac *snac, const char *actor)
+int object_pack_compact(void)
+/* moves the live data out of segments that are mostly garbage
+   and deletes them; returns the number of deleted segments.
+   The pack is only locked for writing while each one is moved */
 {
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    return xs_fmt("%s/muted/%s", snac->basedir, md5);
-}
+    pack_slot chunk[1024];
+    pack_hdr h;
+    int lfd, fd;
+    uint32_t n, i, cur;
+    off_t *live = NULL;
+    char *cmp = NULL;
+    uint32_t seg;
+    int cnt = 0;
 
+    if ((lfd = _pack_lock(LOCK_SH)) == -1)
+        return 0;
 
-void mute(snac *snac, const char *actor)
-/* mutes a moron */
-{
-    xs *fn = _muted_fn(snac, actor);
-    FILE *f;
+    if ((fd = _pack_index_open(&h, O_RDONLY)) == -1) {
+        _pack_unlock(lfd);
+        return 0;
+    }
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", actor);
-        fclose(f);
+    cur  = h.seg;
+    live = calloc(cur + 1, sizeof(off_t));
+    cmp  = calloc(cur + 1, sizeof(char));
 
-        snac_debug(snac, 2, xs_fmt("muted %s %s", actor, fn));
+    if (live != NULL && cmp != NULL) {
+        /* count the live bytes in each segment */
+        for (n = 0; n < h.size; n += i) {
+            int r = pread(fd, chunk, sizeof(chunk), PACK_SLOT_OFF(n));
+
+            if (r < (int) sizeof(pack_slot))
+                break;
+
+            for (i = 0; i < r / sizeof(pack_slot); i++) {
+                if (chunk[i].seg != 0 && chunk[i].seg <= cur)
+                    live[chunk[i].seg] += chunk[i].len;
+            }
+        }
+
+        /* compact the segments with less than half of live data
+           (the current one is never touched) */
+        for (n = 1; n < cur; n++) {
+            xs *sfn = _pack_seg_fn(n);
+            struct stat st;
+
+            if (stat(sfn, &st) != -1 && live[n] < st.st_size / 2)
+                cmp[n] = 1;
+        }
     }
-}
 
+    close(fd);
+    _pack_unlock(lfd);
 
-void unmute(snac *snac, const char *actor)
-/* actor is no longer a moron */
-{
-    xs *fn = _muted_fn(snac, actor);
+    for (seg = 1; cmp != NULL && seg < cur; seg++) {
+        xs *sfn = NULL;
+        int sfd = -1;
+        int ok  = 1;
 
-    unlink(fn);
+        if (!cmp[seg])
+            continue;
 
-    snac_debug(snac, 2, xs_fmt("unmuted %s %s", actor, fn));
-}
+        if ((lfd = _pack_lock(LOCK_EX)) == -1)
+            break;
 
+        /* the index may have been rebuilt in between */
+        if ((fd = _pack_index_open(&h, O_RDWR)) == -1) {
+            _pack_unlock(lfd);
+            break;
+        }
 
-int is_muted(snac *snac, const char *actor)
-/* check if someone is muted */
-{
-    xs *fn = _muted_fn(snac, actor);
+        sfn = _pack_seg_fn(seg);
 
-    return !!(mtime(fn) != 0.0);
-}
+        if ((sfd = open(sfn, O_RDONLY)) == -1)
+            ok = 0;
 
+        for (n = 0; ok && n < h.size; n += i) {
+            int r = pread(fd, chunk, sizeof(chunk), PACK_SLOT_OFF(n));
 
-/** pinning **/
+            if (r < (int) sizeof(pack_slot))
+                break;
 
-xs_str *_pinned_fn(snac *user, const char *id)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return xs_fmt("%s/pinned/%s.json", user->basedir, md5);
-}
+            for (i = 0; ok && i < r / sizeof(pack_slot); i++) {
+                const pack_slot *s = &chunk[i];
 
+                if (s->seg == seg) {
+                    xs *md5  = xs_hex_enc((char *)s->md5, sizeof(s->md5));
+                    xs *data = xs_realloc(NULL, _xs_blk_size(s->len + 1));
+                    pack_slot ns = *s;
 
-int is_pinned(snac *user, const char *id)
-/* returns true if this note is pinned */
-{
-    xs *fn = _pinned_fn(user, id);
-    return !!(mtime(fn) != 0.0);
-}
+                    /* only the copy is changed until it's written */
+                    ok = pread(sfd, data, s->len, s->off) == (ssize_t) s->len;
 
+                    if (ok) {
+                        data[s->len] = '\0';
+                        ok = _pack_append(&h, md5, data, s->len, &ns.off) != -1;
+                    }
 
-int pin(snac *user, const char *id)
-/* pins a message */
-{
-    int ret = -2;
+                    if (ok) {
+                        ns.seg = h.seg;
+                        ok = pwrite(fd, &ns, sizeof(ns), PACK_SLOT_OFF(n + i)) == sizeof(ns);
+                    }
 
-    if (xs_startswith(id, user->actor)) {
-        if (is_pinned(user, id))
-            ret = -3;
-        else {
-            /* create the subfolder, if it does not exist */
-            xs *fn = xs_fmt("%s/pinned/", user->basedir);
-            mkdirx(fn);
+                    if (!ok)
+                        srv_log(xs_fmt("object_pack_compact error moving %s", md5));
+                }
+            }
+        }
 
-            ret = object_user_cache_add(user, id, "pinned");
+        /* the current segment may have changed */
+        pwrite(fd, &h, sizeof(h), 0);
+
+        if (ok) {
+            unlink(sfn);
+            srv_debug(1, xs_fmt("object_pack_compact deleted %s", sfn));
+            cnt++;
         }
+
+        if (sfd != -1)
+            close(sfd);
+
+        close(fd);
+        _pack_unlock(lfd);
     }
 
-    return ret;
+    free(live);
+    free(cmp);
+
+    return cnt;
 }
 
 
-int unpin(snac *user, const char *id)
-/* unpin a message */
-{
-    int ret = object_user_cache_del(user, id, "pinned");
+/** object cache **/
 
-    if (ret != -1) {
-        /* delete from the index */
-        xs *idx = xs_fmt("%s/pinned.idx", user->basedir);
-        index_del(idx, id);
-    }
+/* parsed objects are kept in memory in a sharded LRU cache, tagged with
+   their location in the object pack; as new versions of an object are
+   always appended somewhere else, a different location means it's stale
+   (even if it was changed by another process) */
 
-    return ret;
-}
+#define OCACHE_SHARDS   16
+#define OCACHE_BUCKETS  256
 
+typedef struct _ocache_entry {
+    char md5[33];
+    uint32_t seg;                   /* location in the object pack */
+    uint32_t off;
+    int size;
+    xs_dict *obj;
+    struct _ocache_entry *prev;     /* LRU list */
+    struct _ocache_entry *next;
+    struct _ocache_entry *hnext;    /* hash bucket chain */
+} ocache_entry;
 
-xs_list *pinned_list(snac *user)
-/* return the lists of pinned posts */
+typedef struct {
+    pthread_mutex_t mutex;
+    ocache_entry *buckets[OCACHE_BUCKETS];
+    ocache_entry *head;             /* most recently used */
+    ocache_entry *tail;             /* least recently used */
+    long size;
+    long hits;
+    long misses;
+    long evictions;
+} ocache_shard;
+
+static ocache_shard ocache[OCACHE_SHARDS];
+static long ocache_max = 0;         /* byte budget per shard */
+static pthread_once_t ocache_once = PTHREAD_ONCE_INIT;
+
+
+static void _ocache_init(void)
+/* initializes the object cache */
 {
-    return object_user_cache_list(user, "pinned", XS_ALL, 1);
+    const xs_number *v = xs_dict_get(srv_config, "object_cache_mb");
+    double mb = 32.0;
+    int n;
+
+    if (xs_type(v) == XSTYPE_NUMBER)
+        mb = xs_number_get(v);
+
+    ocache_max = (long) (mb * 1024 * 1024) / OCACHE_SHARDS;
+
+    for (n = 0; n < OCACHE_SHARDS; n++)
+        pthread_mutex_init(&ocache[n].mutex, NULL);
 }
 
 
-xs_str *_hidden_fn(snac *snac, const char *id)
+static int _ocache_hash(const char *md5, int *bucket)
+/* returns the shard and bucket for an md5 (it's already a hash) */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return xs_fmt("%s/hidden/%s", snac->basedir, md5);
+    unsigned int h = 0;
+    int n;
+
+    for (n = 0; n < 3 && md5[n]; n++) {
+        int c = md5[n];
+        h = h << 4 | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+
+    *bucket = (h >> 4) % OCACHE_BUCKETS;
+
+    return h % OCACHE_SHARDS;
 }
 
 
-void hide(snac *snac, const char *id)
-/* hides a message tree */
+static ocache_entry *_ocache_unlink(ocache_shard *sh, int bucket, const char *md5)
+/* detaches an entry from its shard (must be locked) */
 {
-    xs *fn = _hidden_fn(snac, id);
-    FILE *f;
+    ocache_entry **pe = &sh->buckets[bucket];
+    ocache_entry *e;
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", id);
-        fclose(f);
+    while ((e = *pe) != NULL && strcmp(e->md5, md5) != 0)
+        pe = &e->hnext;
 
-        snac_debug(snac, 2, xs_fmt("hidden %s %s", id, fn));
+    if (e != NULL) {
+        *pe = e->hnext;
 
-        /* hide all the children */
-        xs *chld = object_children(id);
-        char *p, *v;
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            sh->head = e->next;
 
-        p = chld;
-        while (xs_list_iter(&p, &v)) {
-            xs *co = NULL;
+        if (e->next)
+            e->next->prev = e->prev;
+        else
+            sh->tail = e->prev;
 
-            /* resolve to get the id */
-            if (valid_status(object_get_by_md5(v, &co))) {
-                if ((v = xs_dict_get(co, "id")) != NULL)
-                    hide(snac, v);
-            }
-        }
+        sh->size -= e->size;
     }
+
+    return e;
 }
 
 
-int is_hidden(snac *snac, const char *id)
-/* check is id is hidden */
+static void _ocache_free(ocache_entry *e)
 {
-    xs *fn = _hidden_fn(snac, id);
-
-    return !!(mtime(fn) != 0.0);
+    if (e != NULL) {
+        xs_free(e->obj);
+        free(e);
+    }
 }
 
 
-int actor_add(const char *actor, xs_dict *msg)
-/* adds an actor */
+static xs_dict *_ocache_get(const char *md5, pack_slot *s)
+/* returns a copy of a cached object and its location, or NULL */
 {
-    return object_add_ow(actor, msg);
-}
+    xs_dict *obj = NULL;
+    ocache_shard *sh;
+    ocache_entry *e;
+    int b;
 
+    pthread_once(&ocache_once, _ocache_init);
 
-int actor_get(const char *actor, xs_dict **data)
-/* returns an already downloaded actor */
-{
-    int status = 200;
-    xs_dict *d = NULL;
+    if (ocache_max <= 0)
+        return NULL;
 
-    if (xs_startswith(actor, srv_baseurl)) {
-        /* it's a (possible) local user */
-        xs *l = xs_split(actor, "/");
-        const char *uid = xs_list_get(l, -1);
-        snac user;
+    sh = &ocache[_ocache_hash(md5, &b)];
 
-        if (!xs_is_null(uid) && user_open(&user, uid)) {
-            if (data)
-                *data = msg_actor(&user);
+    pthread_mutex_lock(&sh->mutex);
 
-            user_free(&user);
-            return 200;
+    if ((e = _ocache_unlink(sh, b, md5)) != NULL) {
+        obj    = xs_dup(e->obj);
+        s->seg = e->seg;
+        s->off = e->off;
+
+        /* move to the head */
+        e->hnext = sh->buckets[b];
+        sh->buckets[b] = e;
+
+        e->prev = NULL;
+        e->next = sh->head;
+
+        if (sh->head)
+            sh->head->prev = e;
+        else
+            sh->tail = e;
+
+        sh->head  = e;
+        sh->size += e->size;
+    }
+
+    pthread_mutex_unlock(&sh->mutex);
+
+    return obj;
+}
+
+
+static void _ocache_hit(const char *md5)
+/* counts a cache hit */
+{
+    int b;
+    ocache_shard *sh = &ocache[_ocache_hash(md5, &b)];
+
+    pthread_mutex_lock(&sh->mutex);
+    sh->hits++;
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+
+static void _ocache_put(const char *md5, const pack_slot *s, const xs_dict *obj)
+/* counts a cache miss and stores the current version of an object (if any) */
+{
+    ocache_shard *sh;
+    ocache_entry *e = NULL;
+    int b, size;
+
+    pthread_once(&ocache_once, _ocache_init);
+
+    if (ocache_max <= 0)
+        return;
+
+    sh   = &ocache[_ocache_hash(md5, &b)];
+    size = obj ? xs_size(obj) + sizeof(ocache_entry) : 0;
+
+    if (obj && size <= ocache_max && (e = calloc(1, sizeof(*e))) != NULL) {
+        strncpy(e->md5, md5, sizeof(e->md5) - 1);
+        e->seg  = s->seg;
+        e->off  = s->off;
+        e->size = size;
+
+        /* it outlives the request */
+        xs_arena_pause();
+        e->obj  = xs_dup(obj);
+        xs_arena_resume();
+    }
+
+    pthread_mutex_lock(&sh->mutex);
+
+    sh->misses++;
+
+    /* drop the stale version, if any */
+    _ocache_free(_ocache_unlink(sh, b, md5));
+
+    if (e != NULL) {
+        /* make room */
+        while (sh->tail && sh->size + size > ocache_max) {
+            ocache_entry *t = sh->tail;
+            int tb;
+
+            _ocache_hash(t->md5, &tb);
+            _ocache_free(_ocache_unlink(sh, tb, t->md5));
+            sh->evictions++;
         }
+
+        e->hnext = sh->buckets[b];
+        sh->buckets[b] = e;
+
+        e->next = sh->head;
+
+        if (sh->head)
+            sh->head->prev = e;
         else
-            return 404;
+            sh->tail = e;
+
+        sh->head  = e;
+        sh->size += size;
     }
 
-    /* read the object */
-    if (!valid_status(status = object_get(actor, &d))) {
-        d = xs_free(d);
-        return status;
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+
+static void _ocache_del(const char *md5)
+/* invalidates a cached object */
+{
+    ocache_shard *sh;
+    int b;
+
+    pthread_once(&ocache_once, _ocache_init);
+
+    if (ocache_max <= 0)
+        return;
+
+    sh = &ocache[_ocache_hash(md5, &b)];
+
+    pthread_mutex_lock(&sh->mutex);
+    _ocache_free(_ocache_unlink(sh, b, md5));
+    pthread_mutex_unlock(&sh->mutex);
+}
+
+
+xs_dict *object_cache_stats(void)
+/* returns the object cache counters */
+{
+    long hits = 0, misses = 0, evictions = 0, size = 0;
+    xs_dict *d = xs_dict_new();
+    int n;
+
+    pthread_once(&ocache_once, _ocache_init);
+
+    for (n = 0; n < OCACHE_SHARDS; n++) {
+        ocache_shard *sh = &ocache[n];
+
+        pthread_mutex_lock(&sh->mutex);
+
+        hits      += sh->hits;
+        misses    += sh->misses;
+        evictions += sh->evictions;
+        size      += sh->size;
+
+        pthread_mutex_unlock(&sh->mutex);
     }
 
-    if (data)
-        *data = d;
+    xs *h = xs_number_new(hits);
+    xs *m = xs_number_new(misses);
+    xs *e = xs_number_new(evictions);
+    xs *s = xs_number_new(size);
+    xs *x = xs_number_new(ocache_max * OCACHE_SHARDS);
+
+    d = xs_dict_append(d, "hits",      h);
+    d = xs_dict_append(d, "misses",    m);
+    d = xs_dict_append(d, "evictions", e);
+    d = xs_dict_append(d, "size",      s);
+    d = xs_dict_append(d, "max_size",  x);
+
+    return d;
+}
+
+
+/** objects **/
+
+static xs_str *_object_fn_by_md5(const char *md5, const char *func)
+/* returns the base filename for the indexes of an object */
+{
+    xs *bfn = xs_fmt("%s/object/%c%c", srv_basedir, md5[0], md5[1]);
+    xs_str *ret;
+    int ok = 1;
+
+    /* an object deleted from an index; fail but don't bark */
+    if (md5[0] == '-')
+        ok = 0;
     else
-        d = xs_free(d);
+    if (!xs_is_hex(md5) || strlen(md5) != 32) {
+        srv_log(xs_fmt("_object_fn_by_md5() [from %s()]: bad md5 '%s'", func, md5));
+        ok = 0;
+    }
 
-    xs *fn = _object_fn(actor);
-    double max_time;
+    if (ok) {
+        mkdirx(bfn);
+        ret = xs_fmt("%s/%s", bfn, md5);
+    }
+    else
+        ret = xs_fmt("%s/object/invalid/invalid", srv_basedir);
 
-    /* maximum time for the actor data to be considered stale */
-    max_time = 3600.0 * 36.0;
+    return ret;
+}
 
-    if (mtime(fn) + max_time < (double) time(NULL)) {
-        /* actor data exists but also stinks */
 
-        /* touch the file */
-        utimes(fn, NULL);
+static xs_str *_object_fn(const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return _object_fn_by_md5(md5, "_object_fn");
+}
 
-        status = 205; /* "205: Reset Content" "110: Response Is Stale" */
+
+xs_str *_object_index_fn(const char *id, const char *idxsfx)
+/* returns the filename of an object's index */
+{
+    xs_str *fn = _object_fn(id);
+    return xs_str_cat(fn, idxsfx);
+}
+
+
+int object_here_by_md5(const char *id)
+/* checks if an object is already downloaded */
+{
+    pack_slot s;
+    return _pack_stat(id, &s, "object_here_by_md5");
+}
+
+
+int object_here(const char *id)
+/* checks if an object is already downloaded */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_here_by_md5(md5);
+}
+
+
+int object_get_by_md5(const char *md5, xs_dict **obj)
+/* returns a stored object, optionally of the requested type */
+{
+    int status = 404;
+    pack_slot s = {0};
+    int same    = 0;
+    xs_dict *c  = _ocache_get(md5, &s);
+    xs *data    = _pack_get(md5, &s, c ? &same : NULL);
+
+    if (same) {
+        /* the cached version is still good */
+        _ocache_hit(md5);
+        *obj   = c;
+        status = 200;
+    }
+    else {
+        xs_free(c);
+
+        if (data != NULL) {
+            *obj = xs_json_loads(data);
+
+            if (*obj)
+                status = 200;
+        }
+        else
+            *obj = NULL;
+
+        _ocache_put(md5, &s, *obj);
     }
 
     return status;
 }
 
 
-/** user limiting (announce blocks) **/
-
-int limited(snac *user, const char *id, int cmd)
-/* announce messages from a followed (0: check, 1: limit; 2: unlimit) */
+int object_get(const char *id, xs_dict **obj)
+/* returns a stored object, optionally of the requested type */
 {
-    int ret = 0;
-    xs *dir = xs_fmt("%s/limited", user->basedir);
     xs *md5 = xs_md5_hex(id, strlen(id));
-    xs *fn  = xs_fmt("%s/%s", dir, md5);
+    return object_get_by_md5(md5, obj);
+}
 
-    switch (cmd) {
-    case 0: /** check **/
-        ret = !!(mtime(fn) > 0.0);
-        break;
 
-    case 1: /** limit **/
-        mkdirx(dir);
+int _object_add(const char *id, const xs_dict *obj, int ow)
+/* stores an object */
+{
+    int status;
+    xs *md5  = xs_md5_hex(id, strlen(id));
+    xs *data = xs_json_dumps(obj, 0);
 
-        if (mtime(fn) > 0.0)
-            ret = -1;
-        else {
-            FILE *f;
+    if (data == NULL)
+        return 400;
 
-            if ((f = fopen(fn, "w")) != NULL) {
-                fprintf(f, "%s\n", id);
-                fclose(f);
+    status = _pack_put(md5, data, ow, 0, 0, time(NULL));
+
+    /* the cached version (if any) is no longer valid */
+    if (status == 201)
+        _ocache_del(md5);
+
+    if (status == 204) {
+        /* object already here */
+        srv_debug(1, xs_fmt("object_add object already here %s", id));
+        return status;
+    }
+
+    if (status == 201) {
+        /* does this object has a parent? */
+        char *in_reply_to = xs_dict_get(obj, "inReplyTo");
+
+        if (!xs_is_null(in_reply_to) && *in_reply_to) {
+            /* update the children index of the parent */
+            xs *c_idx = _object_index_fn(in_reply_to, "_c.idx");
+
+            if (!index_in(c_idx, id)) {
+                index_add(c_idx, id);
+                srv_debug(1, xs_fmt("object_add added child %s to %s", id, c_idx));
             }
             else
-                ret = -2;
+                srv_debug(1, xs_fmt("object_add %s child already in %s", id, c_idx));
+
+            /* create a one-element index with the parent */
+            xs *p_idx = _object_index_fn(id, "_p.idx");
+
+            if (mtime(p_idx) == 0.0) {
+                index_add(p_idx, in_reply_to);
+                srv_debug(1, xs_fmt("object_add added parent %s to %s", in_reply_to, p_idx));
+            }
         }
-        break;
+    }
+    else
+        srv_log(xs_fmt("object_add error storing %s %s", id, md5));
 
-    case 2: /** unlimit **/
-        if (mtime(fn) > 0.0)
-            ret = unlink(fn);
-        else
-            ret = -1;
-        break;
+    srv_debug(1, xs_fmt("object_add %s %s %d", id, md5, status));
+
+    return status;
+}
+
+
+int object_add(const char *id, const xs_dict *obj)
+/* stores an object */
+{
+    return _object_add(id, obj, 0);
+}
+
+
+int object_add_ow(const char *id, const xs_dict *obj)
+/* stores an object (overwriting allowed) */
+{
+    return _object_add(id, obj, 1);
+}
+
+
+int object_import_by_md5(const char *md5, const xs_dict *obj,
+                         int refs, double ctime, double mtime)
+/* stores an object keeping its metadata (used by the layout upgrade) */
+{
+    xs *data = xs_json_dumps(obj, 0);
+
+    if (data == NULL)
+        return 400;
+
+    return _pack_put(md5, data, 1, refs, (time_t) ctime, (time_t) mtime);
+}
+
+
+int object_del_by_md5(const char *md5)
+/* deletes an object by its md5 */
+{
+    int status = 404;
+
+    _ocache_del(md5);
+
+    if (_pack_update(md5, 1, 0, 0) != -1) {
+        const char *sfxs[] = { "_c.idx", "_p.idx", "_l.idx", "_a.idx", NULL };
+        xs *bfn = _object_fn_by_md5(md5, "object_del_by_md5");
+        int n;
+
+        status = 200;
+
+        /* also delete associated indexes */
+        for (n = 0; sfxs[n]; n++) {
+            xs *fn = xs_fmt("%s%s", bfn, sfxs[n]);
+
+            if (unlink(fn) != -1)
+                srv_debug(1, xs_fmt("object_del index %s", fn));
+        }
     }
 
-    return ret;
+    srv_debug(1, xs_fmt("object_del %s %d", md5, status));
+
+    return status;
+}
+
+
+int object_del(const char *id)
+/* deletes an object */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_del_by_md5(md5);
 }
 
 
-/** static data **/
+int object_del_if_unref(const char *id)
+/* deletes an object if no user cache references it */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    pack_slot s;
+    int ret = 0;
+
+    if (_pack_stat(md5, &s, "object_del_if_unref") && s.refs == 0)
+        ret = object_del_by_md5(md5);
+
+    return ret;
+}
+
+
+double object_ctime_by_md5(const char *md5)
+{
+    pack_slot s;
+
+    if (_pack_stat(md5, &s, "object_ctime_by_md5"))
+        return (double) s.ctime;
+
+    return 0.0;
+}
+
+
+double object_ctime(const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_ctime_by_md5(md5);
+}
+
+
+double object_mtime(const char *id)
+/* returns the modification time of an object, or 0.0 */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    pack_slot s;
+
+    if (_pack_stat(md5, &s, "object_mtime"))
+        return (double) s.mtime;
+
+    return 0.0;
+}
+
+
+xs_str *object_stamp_by_md5(const char *md5)
+/* returns a string that changes whenever the object does, or NULL */
+{
+    pack_slot s;
+
+    /* new versions are always stored somewhere else */
+    if (_pack_stat(md5, &s, "object_stamp_by_md5"))
+        return xs_fmt("%u.%u.%u", s.seg, s.off, s.mtime);
+
+    return NULL;
+}
+
+
+int object_touch(const char *id)
+/* sets the modification time of an object to now */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return _pack_update(md5, 0, 0, 1) == -1 ? -1 : 0;
+}
+
+
+static int _object_link(const char *md5, const char *fn)
+/* creates a reference to an object as an empty file */
+{
+    int fd;
+
+    /* the object must exist */
+    if (_pack_update(md5, 0, 1, 0) == -1)
+        return -1;
+
+    if ((fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0666)) == -1) {
+        /* already referenced (or cannot create) */
+        _pack_update(md5, 0, -1, 0);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+
+static int _object_unlink(const char *md5, const char *fn)
+/* deletes a reference to an object */
+{
+    int ret;
+
+    if ((ret = unlink(fn)) != -1)
+        _pack_update(md5, 0, -1, 0);
+
+    return ret;
+}
+
+
+int object_likes_len(const char *id)
+/* returns the number of likes (without reading the index) */
+{
+    xs *fn = _object_index_fn(id, "_l.idx");
+    return index_len(fn);
+}
+
+
+int object_announces_len(const char *id)
+/* returns the number of announces (without reading the index) */
+{
+    xs *fn = _object_index_fn(id, "_a.idx");
+    return index_len(fn);
+}
+
+
+xs_list *object_children(const char *id)
+/* returns the list of an object's children */
+{
+    xs *fn = _object_index_fn(id, "_c.idx");
+    return index_list(fn, XS_ALL);
+}
+
+
+xs_list *object_likes(const char *id)
+{
+    xs *fn = _object_index_fn(id, "_l.idx");
+    return index_list(fn, XS_ALL);
+}
+
+
+xs_list *object_announces(const char *id)
+{
+    xs *fn = _object_index_fn(id, "_a.idx");
+    return index_list(fn, XS_ALL);
+}
+
+
+int object_parent(const char *md5, char *buf, int size)
+/* returns the object parent, if any */
+{
+    xs *fn = _object_fn_by_md5(md5, "object_parent");
+
+    fn = xs_str_cat(fn, "_p.idx");
+    return index_first(fn, buf, size);
+}
+
+
+int object_admire(const char *id, const char *actor, int like)
+/* actor likes or announces this object */
+{
+    int status = 200;
+    xs *fn     = _object_index_fn(id, like ? "_l.idx" : "_a.idx");
+
+    if (!index_in(fn, actor)) {
+        status = index_add(fn, actor);
+
+        srv_debug(1, xs_fmt("object_admire (%s) %s %s", like ? "Like" : "Announce", actor, fn));
+    }
+
+    return status;
+}
+
+
+int object_unadmire(const char *id, const char *actor, int like)
+/* actor no longer likes or announces this object */
+{
+    int status;
+    xs *fn = _object_index_fn(id, like ? "_l.idx" : "_a.idx");
+
+    status = index_del(fn, actor);
+
+    srv_debug(0,
+        xs_fmt("object_unadmire (%s) %s %s %d", like ? "Like" : "Announce", actor, fn, status));
+
+    return status;
+}
+
+
+int _object_user_cache(snac *snac, const char *id, const char *cachedir, int del)
+/* adds or deletes from a user cache */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    xs *cfn = xs_fmt("%s/%s/%s.json", snac->basedir, cachedir, md5);
+    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, cachedir);
+    int ret;
+
+    if (del) {
+        ret = _object_unlink(md5, cfn);
+        index_del(idx, id);
+    }
+    else {
+        if ((ret = _object_link(md5, cfn)) != -1)
+            index_add(idx, id);
+    }
+
+    return ret;
+}
+
+
+int object_user_cache_add(snac *snac, const char *id, const char *cachedir)
+/* caches an object into a user cache */
+{
+    return _object_user_cache(snac, id, cachedir, 0);
+}
+
+
+int object_user_cache_del(snac *snac, const char *id, const char *cachedir)
+/* deletes an object from a user cache */
+{
+    return _object_user_cache(snac, id, cachedir, 1);
+}
+
+
+int object_user_cache_in(snac *snac, const char *id, const char *cachedir)
+/* checks if an object is stored in a cache */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    xs *cfn = xs_fmt("%s/%s/%s.json", snac->basedir, cachedir, md5);
+
+    return !!(mtime(cfn) != 0.0);
+}
+
+
+xs_list *object_user_cache_list(snac *snac, const char *cachedir, int max, int inv)
+/* returns the objects in a cache as a list */
+{
+    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, cachedir);
+    return inv ? index_list_desc(idx, 0, max) : index_list(idx, max);
+}
+
+
+/** specialized functions **/
+
+/** followers **/
+
+int follower_add(snac *snac, const char *actor)
+/* adds a follower */
+{
+    int ret = object_user_cache_add(snac, actor, "followers");
+
+    snac_debug(snac, 2, xs_fmt("follower_add %s", actor));
+
+    return ret == -1 ? 500 : 200;
+}
+
+
+int follower_del(snac *snac, const char *actor)
+/* deletes a follower */
+{
+    int ret = object_user_cache_del(snac, actor, "followers");
+
+    snac_debug(snac, 2, xs_fmt("follower_del %s", actor));
+
+    return ret == -1 ? 404 : 200;
+}
+
+
+int follower_check(snac *snac, const char *actor)
+/* checks if someone is a follower */
+{
+    return object_user_cache_in(snac, actor, "followers");
+}
+
+
+xs_list *follower_list(snac *snac)
+/* returns the list of followers */
+{
+    xs *list       = object_user_cache_list(snac, "followers", XS_ALL, 0);
+    xs_list *fwers = xs_list_new();
+    char *p, *v;
+
+    /* resolve the list of md5 to be a list of actors */
+    p = list;
+    while (xs_list_iter(&p, &v)) {
+        xs *a_obj = NULL;
+
+        if (valid_status(object_get_by_md5(v, &a_obj))) {
+            const char *actor = xs_dict_get(a_obj, "id");
+
+            if (!xs_is_null(actor)) {
+                /* check if the actor is still cached */
+                xs *fn = xs_fmt("%s/followers/%s.json", snac->basedir, v);
+
+                if (mtime(fn) > 0.0)
+                    fwers = xs_list_append(fwers, actor);
+            }
+        }
+    }
+
+    return fwers;
+}
+
+
+/** timeline **/
+
+double timeline_mtime(snac *snac)
+{
+    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
+    return mtime(fn);
+}
+
+
+int timeline_touch(snac *snac)
+/* changes the date of the timeline index */
+{
+    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
+    return utimes(fn, NULL);
+}
+
+
+xs_str *timeline_fn_by_md5(snac *snac, const char *md5)
+/* get the filename of an entry by md5 from any timeline */
+{
+    xs_str *fn = xs_fmt("%s/private/%s.json", snac->basedir, md5);
+
+    if (mtime(fn) == 0.0) {
+        fn = xs_free(fn);
+        fn = xs_fmt("%s/public/%s.json", snac->basedir, md5);
+
+        if (mtime(fn) == 0.0)
+            fn = xs_free(fn);
+    }
+
+    return fn;
+}
+
+
+int timeline_here(snac *snac, const char *md5)
+/* checks if an object is in the user cache */
+{
+    xs *fn = timeline_fn_by_md5(snac, md5);
+
+    return !(fn == NULL);
+}
+
+
+/* the thread root of each timeline entry (its top-most ancestor that is
+   also in the timeline, or itself if its parent is not) is kept in the
+   user's roots file, a hash table of md5 / root md5 pairs like the one
+   of the object pack. It's kept when entries are added to or deleted
+   from the timeline, so a page doesn't walk up the parents.
+   Writers lock the file; each change is a single write of a slot, and
+   when it's crowded (or on purges) it's rebuilt into a new file that is
+   renamed over it, so readers don't need to lock it */
+
+#define ROOT_MAGIC      "snacrt1"
+#define ROOT_TBL_MIN    1024
+
+typedef struct {
+    char magic[8];
+    uint32_t size;          /* number of slots (a power of 2) */
+    uint32_t used;          /* live slots */
+    uint32_t dead;          /* deleted slots */
+    char pad[12];
+} root_hdr;
+
+typedef struct {
+    unsigned char md5[16];  /* all zeros: empty */
+    unsigned char root[16]; /* all zeros: deleted */
+} root_slot;
+
+#define ROOT_SLOT_OFF(n) ((off_t) sizeof(root_hdr) + (off_t) (n) * sizeof(root_slot))
+
+
+static xs_str *_root_fn(snac *snac)
+{
+    return xs_fmt("%s/roots", snac->basedir);
+}
+
+
+static int _root_init(int fd, root_hdr *h, uint32_t size)
+/* initializes an empty table */
+{
+    memset(h, '\0', sizeof(*h));
+    memcpy(h->magic, ROOT_MAGIC, sizeof(h->magic));
+    h->size = size;
+
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, ROOT_SLOT_OFF(size)) == -1 ||
+        pwrite(fd, h, sizeof(*h), 0) != sizeof(*h))
+        return -1;
+
+    return 0;
+}
+
+
+static int _root_open(snac *snac, root_hdr *h, int wr)
+/* opens the roots table and reads its header
+   (if it's for writing, it's also created and locked) */
+{
+    xs *fn = _root_fn(snac);
+    int fd;
+
+    for (;;) {
+        struct stat st1, st2;
+
+        if ((fd = open(fn, wr ? O_RDWR | O_CREAT : O_RDONLY, 0666)) == -1)
+            return -1;
+
+        if (!wr)
+            break;
+
+        flock(fd, LOCK_EX);
+
+        /* it may have been replaced by a rebuild while waiting */
+        if (fstat(fd, &st1) != -1 && stat(fn, &st2) != -1 && st1.st_ino == st2.st_ino)
+            break;
+
+        close(fd);
+    }
+
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+        memcmp(h->magic, ROOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->size == 0 || (h->size & (h->size - 1)) != 0) {
+        /* new or unusable: start again (the roots are found when needed) */
+        if (!wr || _root_init(fd, h, ROOT_TBL_MIN) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+
+static int _root_find(int fd, const root_hdr *h, const unsigned char *md5,
+                      root_slot *s, int *free_n)
+/* finds the slot of an md5; returns its number or -1. If free_n is set,
+   it's filled with the slot number where it can be inserted */
+{
+    uint32_t n = _pack_hash(md5, h->size);
+    uint32_t i;
+
+    if (free_n)
+        *free_n = -1;
+
+    for (i = 0; i < h->size; i++) {
+        if (pread(fd, s, sizeof(*s), ROOT_SLOT_OFF(n)) != sizeof(*s))
+            break;
+
+        if (_md5_is_zero(s->md5)) {
+            if (free_n)
+                *free_n = n;
+
+            break;
+        }
+
+        if (memcmp(s->md5, md5, sizeof(s->md5)) == 0)
+            return n;
+
+        n = (n + 1) & (h->size - 1);
+    }
+
+    return -1;
+}
+
+
+static int _root_rebuild(snac *snac, int *fd, root_hdr *h)
+/* rebuilds the table into a new file, dropping the deleted slots */
+{
+    xs *fn  = _root_fn(snac);
+    xs *nfn = xs_fmt("%s.new", fn);
+    uint32_t nsize = ROOT_TBL_MIN;
+    root_slot chunk[256];
+    root_hdr nh;
+    uint32_t n, i;
+    int nfd, ret = -1;
+
+    /* keep the load factor under 1/4 after the rebuild */
+    while (nsize < (h->used + 1) * 4)
+        nsize *= 2;
+
+    if ((nfd = open(nfn, O_RDWR | O_CREAT, 0666)) == -1)
+        return -1;
+
+    /* it's locked before it's visible */
+    flock(nfd, LOCK_EX);
+
+    if (_root_init(nfd, &nh, nsize) == -1)
+        goto end;
+
+    for (n = 0; n < h->size; n += i) {
+        int r = pread(*fd, chunk, sizeof(chunk), ROOT_SLOT_OFF(n));
+
+        if (r < (int) sizeof(root_slot))
+            break;
+
+        for (i = 0; i < r / sizeof(root_slot); i++) {
+            const root_slot *s = &chunk[i];
+            root_slot o;
+            int fn_n;
+
+            if (_md5_is_zero(s->md5) || _md5_is_zero(s->root))
+                continue;
+
+            if (_root_find(nfd, &nh, s->md5, &o, &fn_n) == -1 && fn_n != -1 &&
+                pwrite(nfd, s, sizeof(*s), ROOT_SLOT_OFF(fn_n)) == sizeof(*s))
+                nh.used++;
+        }
+    }
+
+    if (pwrite(nfd, &nh, sizeof(nh), 0) == sizeof(nh) && rename(nfn, fn) != -1) {
+        close(*fd);
+        *fd = nfd;
+        *h  = nh;
+        ret = 0;
+    }
+
+end:
+    if (ret == -1) {
+        unlink(nfn);
+        close(nfd);
+    }
+
+    return ret;
+}
+
+
+static int _root_write(snac *snac, const char *md5, const char *root)
+/* sets the thread root of an entry (or deletes it, if root is NULL);
+   returns 1 if it was changed */
+{
+    unsigned char raw[16];
+    root_slot s, ns;
+    root_hdr h;
+    int fd, n, fn_n;
+    int ret = 0;
+
+    memset(&ns, '\0', sizeof(ns));
+
+    if (!_md5_bin(md5, raw, "_root_write") ||
+        (root && !_md5_bin(root, ns.root, "_root_write")))
+        return 0;
+
+    memcpy(ns.md5, raw, sizeof(ns.md5));
+
+    if ((fd = _root_open(snac, &h, 1)) == -1)
+        return 0;
+
+    if ((n = _root_find(fd, &h, raw, &s, &fn_n)) != -1) {
+        if (memcmp(s.root, ns.root, sizeof(s.root)) == 0)
+            goto end;
+
+        if (root == NULL) {
+            h.used--;
+            h.dead++;
+        }
+        else
+        if (_md5_is_zero(s.root)) {
+            h.dead--;
+            h.used++;
+        }
+    }
+    else {
+        if (root == NULL)
+            goto end;
+
+        /* new entry; rebuild first if the table is getting crowded */
+        if ((h.used + h.dead + 1) * 2 > h.size) {
+            if (_root_rebuild(snac, &fd, &h) == -1)
+                goto end;
+
+            _root_find(fd, &h, raw, &s, &fn_n);
+        }
+
+        if (fn_n == -1)
+            goto end;
+
+        n = fn_n;
+        h.used++;
+    }
+
+    if (pwrite(fd, &ns, sizeof(ns), ROOT_SLOT_OFF(n)) == sizeof(ns) &&
+        pwrite(fd, &h, sizeof(h), 0) == sizeof(h))
+        ret = 1;
+
+end:
+    close(fd);
+
+    return ret;
+}
+
+
+static int _root_read(snac *snac, const char *md5, char *root)
+/* reads the thread root of an entry; returns 0 if it's not known */
+{
+    unsigned char raw[16];
+    root_slot s;
+    root_hdr h;
+    int fd, ret = 0;
+
+    if (!_md5_bin(md5, raw, "_root_read"))
+        return 0;
+
+    if ((fd = _root_open(snac, &h, 0)) == -1)
+        return 0;
+
+    if (_root_find(fd, &h, raw, &s, NULL) != -1 && !_md5_is_zero(s.root)) {
+        _md5_hex(s.root, root);
+        ret = 1;
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+
+static void _root_walk(snac *snac, const char *md5, char *root)
+/* gets the thread root of an entry walking up its ancestors */
+{
+    char line[33];
+    int n;
+
+    strcpy(root, md5);
+
+    for (n = 0; n < 256; n++) {
+        /* if it doesn't have a parent, or it's not here, use this */
+        if (!object_parent(root, line, sizeof(line)) || !timeline_here(snac, line))
+            break;
+
+        /* it's here! try again with its own parent */
+        strcpy(root, line);
+    }
+}
+
+
+static void _root_down(snac *snac, const char *md5, const char *root)
+/* sets the thread root of the descendants of an entry in the timeline */
+{
+    xs *todo = xs_list_append(xs_list_new(), md5);
+
+    while (xs_list_len(todo)) {
+        xs *e    = NULL;
+        xs *fn   = NULL;
+        xs *list = NULL;
+        char *p, *v;
+
+        todo = xs_list_shift(todo, &e);
+        fn   = _object_fn_by_md5(e, "_root_down");
+        fn   = xs_str_cat(fn, "_c.idx");
+        list = index_list(fn, XS_ALL);
+
+        p = list;
+        while (xs_list_iter(&p, &v)) {
+            /* stop where it was already set or the thread is broken */
+            if (timeline_here(snac, v) && _root_write(snac, v, root))
+                todo = xs_list_append(todo, v);
+        }
+    }
+}
+
+
+static int _root_get(snac *snac, const char *md5, char *root)
+/* gets the thread root of an entry */
+{
+    if (_root_read(snac, md5, root) && timeline_here(snac, root))
+        return 1;
+
+    /* not known (or stale): walk up and store it */
+    _root_walk(snac, md5, root);
+    _root_write(snac, md5, root);
+
+    return 0;
+}
+
+
+static void _root_add(snac *snac, const char *id)
+/* an entry has been added to the timeline */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    char line[33];
+    char root[33];
+
+    /* the thread root is the parent's, if it's here */
+    strcpy(root, md5);
+
+    if (object_parent(md5, line, sizeof(line)) && timeline_here(snac, line))
+        _root_get(snac, line, root);
+
+    _root_write(snac, md5, root);
+
+    /* its replies may have been added before */
+    _root_down(snac, md5, root);
+}
+
+
+static void _root_del(snac *snac, const char *md5)
+/* an entry is no longer in the timeline */
+{
+    xs *fn   = _object_fn_by_md5(md5, "_root_del");
+    xs *list = NULL;
+    char *p, *v;
+
+    fn   = xs_str_cat(fn, "_c.idx");
+    list = index_list(fn, XS_ALL);
+
+    /* its replies are now the roots of their threads */
+    p = list;
+    while (xs_list_iter(&p, &v)) {
+        if (timeline_here(snac, v) && _root_write(snac, v, v))
+            _root_down(snac, v, v);
+    }
+
+    _root_write(snac, md5, NULL);
+}
+
+
+int root_purge(snac *snac)
+/* deletes the thread roots of the entries no longer in the timeline */
+{
+    root_slot chunk[256];
+    root_hdr h;
+    xs *list = xs_list_new();
+    uint32_t n, i;
+    xs_list *p;
+    xs_str *v;
+    int fd, cnt = 0;
+
+    if ((fd = _root_open(snac, &h, 0)) == -1)
+        return 0;
+
+    for (n = 0; n < h.size; n += i) {
+        int r = pread(fd, chunk, sizeof(chunk), ROOT_SLOT_OFF(n));
+
+        if (r < (int) sizeof(root_slot))
+            break;
+
+        for (i = 0; i < r / sizeof(root_slot); i++) {
+            char md5[33];
+
+            if (_md5_is_zero(chunk[i].md5) || _md5_is_zero(chunk[i].root))
+                continue;
+
+            _md5_hex(chunk[i].md5, md5);
+
+            if (!timeline_here(snac, md5))
+                list = xs_list_append(list, md5);
+        }
+    }
+
+    close(fd);
+
+    p = list;
+    while (xs_list_iter(&p, &v)) {
+        _root_del(snac, v);
+        cnt++;
+    }
+
+    /* drop the deleted slots */
+    if ((fd = _root_open(snac, &h, 1)) != -1) {
+        if (h.dead)
+            _root_rebuild(snac, &fd, &h);
+
+        close(fd);
+    }
+
+    return cnt;
+}
+
+
+int timeline_get_by_md5(snac *snac, const char *md5, xs_dict **msg)
+/* gets a message from the timeline */
+{
+    int status = 404;
+
+    if (timeline_here(snac, md5))
+        status = object_get_by_md5(md5, msg);
+
+    return status;
+}
+
+
+int timeline_del(snac *snac, char *id)
+/* deletes a message from the timeline */
+{
+    /* delete from the user's caches */
+    object_user_cache_del(snac, id, "public");
+    object_user_cache_del(snac, id, "private");
+
+    {
+        xs *md5 = xs_md5_hex(id, strlen(id));
+        _root_del(snac, md5);
+    }
+
+    {
+        xs *msg = NULL;
+
+        if (valid_status(object_get(id, &msg)))
+            tag_del(snac, id, msg);
+    }
+
+    search_del(snac, id);
+
+    /* try to delete the object if it's not used elsewhere */
+    return object_del_if_unref(id);
+}
+
+
+int timeline_update_indexes(snac *snac, const char *id)
+/* updates the indexes; returns true if it's new in the timeline */
+{
+    int new = object_user_cache_add(snac, id, "private") != -1;
+
+    if (new)
+        _root_add(snac, id);
+
+    if (xs_startswith(id, snac->actor)) {
+        xs *msg = NULL;
+
+        if (valid_status(object_get(id, &msg))) {
+            /* if its ours and is public, also store in public */
+            if (is_msg_public(msg)) {
+                object_user_cache_add(snac, id, "public");
+
+                /* also add it to the instance public timeline */
+                xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
+                index_add(ipt, id);
+
+#ifndef NO_MASTODON_API
+                if (new)
+                    mastoapi_stream_post(NULL, "update", id);
+#endif
+            }
+        }
+    }
+
+#ifndef NO_MASTODON_API
+    if (new)
+        mastoapi_stream_post(snac->uid, "update", id);
+#endif
+
+    return new;
+}
+
+
+int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
+/* adds a message to the timeline */
+{
+    int ret = object_add(id, o_msg);
+
+    if (timeline_update_indexes(snac, id)) {
+        tag_add(snac, id, o_msg);
+        search_add(snac, id, o_msg);
+    }
+
+    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
+
+    return ret;
+}
+
+
+void timeline_admire(snac *snac, const char *id, const char *admirer, int like)
+/* updates a timeline entry with a new admiration */
+{
+    /* if we are admiring this, add to both timelines */
+    if (!like && strcmp(admirer, snac->actor) == 0) {
+        object_user_cache_add(snac, id, "public");
+        object_user_cache_add(snac, id, "private");
+        _root_add(snac, id);
+    }
+
+    object_admire(id, admirer, like);
+
+    snac_debug(snac, 1, xs_fmt("timeline_admire (%s) %s %s",
+            like ? "Like" : "Announce", id, admirer));
+}
+
+
+xs_list *timeline_top_level(snac *snac, xs_list *list)
+/* returns the top level md5 entries from this index */
+{
+    xs_set seen;
+    xs_list *p;
+    xs_str *v;
+
+    xs_set_init(&seen);
+
+    p = list;
+    while (xs_list_iter(&p, &v)) {
+        char root[33];
+
+        _root_get(snac, v, root);
+        xs_set_add(&seen, root);
+    }
+
+    return xs_set_result(&seen);
+}
+
+
+xs_list *timeline_simple_list(snac *snac, const char *idx_name, int skip, int show)
+/* returns a timeline (with all entries) */
+{
+    int c_max;
+
+    /* maximum number of items in the timeline */
+    c_max = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+
+    /* never more timeline entries than the configured maximum */
+    if (show > c_max)
+        show = c_max;
+
+    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, idx_name);
+
+    return index_list_desc(idx, skip, show);
+}
+
+
+xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show)
+/* returns a timeline (only top level entries) */
+{
+    xs *list = timeline_simple_list(snac, idx_name, skip, show);
+
+    return timeline_top_level(snac, list);
+}
+
+
+int timeline_seek(snac *snac, const char *idx_name, const char *md5)
+/* returns the position of an entry in a timeline (or its end if md5 is NULL), or -1 */
+{
+    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, idx_name);
+
+    return index_seek(idx, md5);
+}
+
+
+xs_list *timeline_range(snac *snac, const char *idx_name, int *pos, int end, int show)
+/* returns up to show timeline entries from position *pos to end (excluded) */
+{
+    xs *idx = xs_fmt("%s/%s.idx", snac->basedir, idx_name);
+
+    return index_list_range(idx, pos, end, show);
+}
+
+
+xs_list *timeline_instance_list(int skip, int show)
+/* returns the timeline for the full instance */
+{
+    xs *idx = xs_fmt("%s/public.idx", srv_basedir);
+
+    return index_list_desc(idx, skip, show);
+}
+
+
+/** hashtags **/
+
+/* each user has an index for every hashtag found in the entries of
+   its timeline, in the tag/ subdirectory, named after the md5 of the
+   lowercased tag name; they are ordinary indexes, so the hashtag
+   timelines are read with timeline_simple_list(), timeline_seek()
+   and timeline_range() using the name returned by tag_index() */
+
+#define TAG_MAX     32      /* maximum tags per entry */
+
+xs_str *tag_index(const char *tag)
+/* returns the name of the index of a tag, relative to the user directory */
+{
+    while (*tag == '#')
+        tag++;
+
+    xs *n   = xs_tolower_i(xs_str_new(tag));
+    xs *md5 = xs_md5_hex(n, strlen(n));
+
+    return xs_fmt("tag/%s", md5);
+}
+
+
+static xs_list *_tag_names(const xs_dict *msg)
+/* returns the (unique) index names of the hashtags of a message */
+{
+    const xs_val *tag = xs_dict_get(msg, "tag");
+    xs *l = NULL;
+    xs_set seen;
+    xs_list *p;
+    xs_dict *v;
+    int n = 0;
+
+    xs_set_init(&seen);
+
+    /* it can be a single object */
+    if (xs_type(tag) == XSTYPE_DICT) {
+        l = xs_list_new();
+        l = xs_list_append(l, tag);
+    }
+    else
+    if (xs_type(tag) == XSTYPE_LIST)
+        l = xs_dup(tag);
+
+    p = l;
+    while (n < TAG_MAX && xs_list_iter(&p, &v)) {
+        if (xs_type(v) != XSTYPE_DICT)
+            continue;
+
+        const char *type = xs_dict_get(v, "type");
+        const char *name = xs_dict_get(v, "name");
+
+        if (xs_is_null(type) || xs_is_null(name) || strcmp(type, "Hashtag") != 0 ||
+            strspn(name, "#") == strlen(name))
+            continue;
+
+        xs *idx = tag_index(name);
+
+        if (xs_set_add(&seen, idx) == 1)
+            n++;
+    }
+
+    return xs_set_result(&seen);
+}
+
+
+static int _tag_update(snac *user, const char *id, const xs_dict *o_msg, const xs_dict *msg)
+/* adds id to the indexes of the tags in msg that are not in o_msg,
+   and deletes it from the ones in o_msg that are not in msg */
+{
+    xs *o_tags = o_msg ? _tag_names(o_msg) : xs_list_new();
+    xs *tags   = msg   ? _tag_names(msg)   : xs_list_new();
+    xs_list *p;
+    xs_str *v;
+    int cnt = 0;
+
+    p = o_tags;
+    while (xs_list_iter(&p, &v)) {
+        if (xs_list_in(tags, v) == -1) {
+            xs *fn = xs_fmt("%s/%s.idx", user->basedir, v);
+
+            if (index_del(fn, id) == 200)
+                cnt++;
+        }
+    }
+
+    if (xs_list_len(tags)) {
+        xs *dir = xs_fmt("%s/tag", user->basedir);
+
+        if (mtime(dir) == 0.0)
+            mkdirx(dir);
+
+        p = tags;
+        while (xs_list_iter(&p, &v)) {
+            if (xs_list_in(o_tags, v) == -1) {
+                xs *fn = xs_fmt("%s/%s.idx", user->basedir, v);
+
+                if (index_add(fn, id) == 201)
+                    cnt++;
+            }
+        }
+    }
+
+    return cnt;
+}
+
+
+int tag_add(snac *user, const char *id, const xs_dict *msg)
+/* adds a new timeline entry to the indexes of its hashtags */
+{
+    return _tag_update(user, id, NULL, msg);
+}
+
+
+int tag_del(snac *user, const char *id, const xs_dict *msg)
+/* deletes a timeline entry from the indexes of its hashtags */
+{
+    return _tag_update(user, id, msg, NULL);
+}
+
+
+int tag_update(snac *user, const char *id, const xs_dict *o_msg, const xs_dict *msg)
+/* updates the hashtag indexes after a timeline entry has been edited */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+
+    if (!timeline_here(user, md5))
+        return 0;
+
+    return _tag_update(user, id, o_msg, msg);
+}
+
+
+int tag_purge(snac *user)
+/* drops from the hashtag indexes the entries no longer in the timeline */
+{
+    xs *spec = xs_fmt("%s/tag/" "*.idx", user->basedir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    xs_list *p;
+    xs_str *v;
+    int cnt = 0;
+
+    p = fns;
+    while (xs_list_iter(&p, &v)) {
+        int gc = _index_gc(v, user);
+
+        if (gc > 0)
+            cnt += gc;
+
+        pthread_mutex_t *m = _index_lock(v);
+
+        if (index_len(v) == 0) {
+            /* empty: delete it and its side files */
+            xs *bfn = xs_fmt("%s.bak", v);
+            xs *pfn = xs_fmt("%s.pos", v);
+
+            unlink(v);
+            unlink(bfn);
+            unlink(pfn);
+        }
+
+        pthread_mutex_unlock(m);
+    }
+
+    return cnt;
+}
+
+
+int tag_rebuild(snac *user)
+/* rebuilds the hashtag indexes from the timeline */
+{
+    xs *spec = xs_fmt("%s/tag/" "*", user->basedir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    xs *idx  = xs_fmt("%s/private.idx", user->basedir);
+    xs_list *p;
+    xs_str *v;
+    int cnt = 0;
+    int pos, end;
+
+    p = fns;
+    while (xs_list_iter(&p, &v))
+        unlink(v);
+
+    end = index_seek(idx, NULL);
+
+    for (pos = 0; pos < end; ) {
+        xs *list = index_list_range(idx, &pos, end, 1024);
+
+        if (xs_list_len(list) == 0)
+            break;
+
+        p = list;
+        while (xs_list_iter(&p, &v)) {
+            xs *msg = NULL;
+
+            if (valid_status(timeline_get_by_md5(user, v, &msg))) {
+                const char *id = xs_dict_get(msg, "id");
+
+                if (!xs_is_null(id) && tag_add(user, id, msg))
+                    cnt++;
+            }
+        }
+    }
+
+    return cnt;
+}
+
+
+/** full text search **/
+
+/* each user has an inverted index of the text of the entries in its
+   timeline, in the search/ subdirectory:
+
+   docs.idx: an index of the md5s of the indexed entries, in the order
+   they were added; the position of each one is its document number.
+   Deleted documents are overwritten with zeros and it's never
+   garbage-collected, as that would renumber them.
+
+   log: the terms of the most recently added documents, appended as
+   they arrive and searched linearly.
+
+   seg.*: immutable segments with a sorted term dictionary and the
+   (document, position) postings of each term. When the log grows
+   too big it's written as a new segment, and the newest segments
+   are merged while they are of similar size, so there are only a
+   few of them. Each one has older documents than the next, and the
+   postings of deleted documents are dropped when merging.
+
+   Writers hold an exclusive lock on search/lock, and readers a
+   shared one */
+
+#define SRCH_MAGIC          "snacsrc"
+#define SRCH_VERSION        1
+#define SRCH_TERM_SIZE      24              /* including the final NUL */
+#define SRCH_MAX_TERMS      4096            /* per document */
+#define SRCH_MAX_SEGS       64
+#define SRCH_LOG_MAX        (1024 * 1024)   /* written as a segment after this */
+#define SRCH_MERGE_RATIO    2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_terms;
+    uint32_t n_posts;
+    uint32_t deleted;       /* deleted documents when it was written */
+} srch_hdr;
+
+typedef struct {
+    char term[SRCH_TERM_SIZE];
+    uint32_t off;           /* first posting */
+    uint32_t cnt;           /* number of postings */
+} srch_term;
+
+typedef struct {
+    uint32_t doc;
+    uint32_t pos;
+} srch_post;
+
+typedef struct {
+    srch_hdr h;
+    const srch_term *terms;
+    const srch_post *posts;
+    void *map;              /* the mapped segment or the loaded log */
+    size_t size;            /* size of the mapping (0 for the log) */
+} srch_seg;
+
+typedef struct {
+    const char *term;
+    uint32_t doc;
+    uint32_t pos;
+} srch_ent;
+
+
+static int _search_char(unsigned int *c)
+/* classifies a character, folding it to lowercase and without
+   diacritics (for the usual latin, greek and cyrillic ones); returns
+   0 for separators, 1 for word characters and 2 for ideographs
+   (that are terms by themselves) */
+{
+    /* 0xe0 - 0xff; a space means it's left as is */
+    static const char *latin1 = "aaaaaa ceeeeiiii nooooo-ouuuuy y";
+    unsigned int ch = *c;
+
+    if (ch < 0x80) {
+        if (!isalnum(ch))
+            return 0;
+
+        *c = tolower(ch);
+        return 1;
+    }
+
+    /* latin-1 symbols */
+    if (ch < 0xc0 || ch == 0xd7)
+        return 0;
+
+    if (ch < 0xdf)
+        ch += 0x20;
+
+    if (ch >= 0xe0 && ch <= 0xff) {
+        if (latin1[ch - 0xe0] == '-')
+            return 0;
+
+        if (latin1[ch - 0xe0] != ' ')
+            ch = latin1[ch - 0xe0];
+    }
+    else
+    if (ch >= 0x391 && ch <= 0x3a9)
+        ch += 0x20;
+    else
+    if (ch >= 0x410 && ch <= 0x42f)
+        ch += 0x20;
+    else
+    if (ch >= 0x400 && ch <= 0x40f)
+        ch += 0x50;
+    else
+    if ((ch >= 0x2000 && ch <= 0x2bff) ||   /* punctuation and symbols */
+        (ch >= 0x3000 && ch <= 0x303f) ||   /* CJK punctuation */
+        (ch >= 0xfe00 && ch <= 0xfe0f) ||   /* variation selectors */
+        (ch >= 0xff00 && ch <= 0xff0f) ||   /* fullwidth punctuation */
+        (ch >= 0x1f000 && ch <= 0x1faff) || /* emoji */
+        ch == 0xfffd)
+        return 0;
+
+    *c = ch;
+
+    /* kana, CJK ideographs and hangul */
+    if ((ch >= 0x3040 && ch <= 0x9fff) || (ch >= 0xac00 && ch <= 0xd7af))
+        return 2;
+
+    return 1;
+}
+
+
+static xs_list *_search_terms(const char *text, int query)
+/* splits a text into search terms, skipping HTML tags and entities;
+   in queries, a * after a term is kept (it means a prefix) */
+{
+    xs_list *list = xs_list_new();
+    char term[SRCH_TERM_SIZE + 1];
+    char *p = (char *)text;
+    int tl = 0, n = 0;
+
+    while (n < SRCH_MAX_TERMS) {
+        unsigned int c = 0;
+        int cls = 0;
+        char *e;
+
+        if (*p == '\0')
+            ;
+        else
+        if (!query && *p == '<') {
+            /* skip tags */
+            if ((e = strchr(p, '>')) != NULL)
+                p = e + 1;
+            else
+                p += strlen(p);
+        }
+        else
+        if (!query && *p == '&' && (e = strchr(p, ';')) != NULL && e - p < 10) {
+            /* skip entities */
+            p = e + 1;
+        }
+        else
+        if (query && *p == '*' && tl) {
+            /* ends the term */
+            term[tl++] = '*';
+            p++;
+        }
+        else {
+            c   = xs_utf8_dec(&p);
+            cls = _search_char(&c);
+        }
+
+        if (cls == 1) {
+            char tmp[4];
+            int l = _xs_utf8_enc(tmp, c) - tmp;
+
+            /* too long terms are truncated */
+            if (tl + l < SRCH_TERM_SIZE) {
+                memcpy(term + tl, tmp, l);
+                tl += l;
+            }
+        }
+        else {
+            if (tl) {
+                term[tl] = '\0';
+                list = xs_list_append(list, term);
+                tl = 0;
+                n++;
+            }
+
+            if (cls == 2) {
+                tl = _xs_utf8_enc(term, c) - term;
+                term[tl] = '\0';
+                list = xs_list_append(list, term);
+                tl = 0;
+                n++;
+            }
+        }
+
+        if (*p == '\0' && tl == 0)
+            break;
+    }
+
+    return list;
+}
+
+
+static xs_str *_search_text(const xs_dict *msg)
+/* returns the indexable text of an object */
+{
+    xs_str *s = xs_str_new(NULL);
+    const char *type = xs_dict_get(msg, "type");
+    const char *fields[] = { "summary", "content", "name", NULL };
+    xs_list *p;
+    xs_dict *v;
+    int n;
+
+    for (n = 0; fields[n]; n++) {
+        const char *t = xs_dict_get(msg, fields[n]);
+
+        /* a Note with a name is a poll vote */
+        if (strcmp(fields[n], "name") == 0 && !xs_is_null(type) && strcmp(type, "Note") == 0)
+            continue;
+
+        if (xs_type(t) == XSTYPE_STRING) {
+            s = xs_str_cat(s, t);
+            s = xs_str_cat(s, "\n");
+        }
+    }
+
+    /* image descriptions and poll options */
+    const char *lists[] = { "attachment", "oneOf", "anyOf", NULL };
+
+    for (n = 0; lists[n]; n++) {
+        p = xs_dict_get(msg, lists[n]);
+
+        if (xs_type(p) != XSTYPE_LIST)
+            continue;
+
+        while (xs_list_iter(&p, &v)) {
+            if (xs_type(v) == XSTYPE_DICT) {
+                const char *t = xs_dict_get(v, "name");
+
+                if (xs_type(t) == XSTYPE_STRING) {
+                    s = xs_str_cat(s, t);
+                    s = xs_str_cat(s, "\n");
+                }
+            }
+        }
+    }
+
+    return s;
+}
+
+
+static int _search_lock(const char *dir, int op)
+/* opens and locks the search index of a user */
+{
+    xs *fn = xs_fmt("%s/lock", dir);
+    int fd;
+
+    if ((fd = open(fn, O_RDWR | O_CREAT, 0666)) != -1)
+        flock(fd, op);
+
+    return fd;
+}
+
+
+static int _search_seg_open(const char *fn, srch_seg *s)
+/* maps a segment */
+{
+    struct stat st;
+    int ret = 0;
+    int fd;
+
+    memset(s, '\0', sizeof(*s));
+
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return 0;
+
+    if (fstat(fd, &st) != -1 && st.st_size >= (off_t) sizeof(srch_hdr) &&
+        (s->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+        memcpy(&s->h, s->map, sizeof(s->h));
+        s->size = st.st_size;
+
+        if (memcmp(s->h.magic, SRCH_MAGIC, sizeof(s->h.magic)) == 0 &&
+            s->h.version == SRCH_VERSION &&
+            (off_t) (sizeof(srch_hdr) + (size_t) s->h.n_posts * sizeof(srch_post) +
+                (size_t) s->h.n_terms * sizeof(srch_term)) == st.st_size) {
+            s->posts = (const srch_post *)((char *)s->map + sizeof(srch_hdr));
+            s->terms = (const srch_term *)(s->posts + s->h.n_posts);
+            ret = 1;
+        }
+        else {
+            srv_log(xs_fmt("bad search segment %s", fn));
+            munmap(s->map, s->size);
+        }
+    }
+
+    close(fd);
+
+    if (!ret)
+        memset(s, '\0', sizeof(*s));
+
+    return ret;
+}
+
+
+static void _search_seg_close(srch_seg *s)
+/* releases a segment */
+{
+    if (s->size)
+        munmap(s->map, s->size);
+    else
+        free(s->map);
+
+    memset(s, '\0', sizeof(*s));
+}
+
+
+static int _search_ent_cmp(const void *a, const void *b)
+{
+    const srch_ent *x = a;
+    const srch_ent *y = b;
+    int c = strcmp(x->term, y->term);
+
+    if (c == 0)
+        c = x->doc < y->doc ? -1 : x->doc > y->doc ? 1 :
+            x->pos < y->pos ? -1 : x->pos > y->pos ? 1 : 0;
+
+    return c;
+}
+
+
+static int _search_log_load(const char *dir, srch_seg *s)
+/* loads the log as a segment in memory; returns 0 if it's empty,
+   or -1 if it cannot be loaded */
+{
+    xs *fn = xs_fmt("%s/log", dir);
+    char *data = NULL;
+    srch_ent *ents = NULL;
+    struct stat st;
+    size_t o;
+    int n = 0, i;
+    int fd;
+
+    memset(s, '\0', sizeof(*s));
+
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return 0;
+
+    if (fstat(fd, &st) != -1 && st.st_size > 0 && (data = malloc(st.st_size + 1)) != NULL &&
+        read(fd, data, st.st_size) != st.st_size) {
+        free(data);
+        data = NULL;
+    }
+
+    close(fd);
+
+    if (data == NULL)
+        return 0;
+
+    data[st.st_size] = '\0';
+
+    /* records: a document number, the size of its terms and the terms
+       (zero-terminated); a partially written one is ignored */
+    for (o = 0; o + 8 <= (size_t) st.st_size; ) {
+        uint32_t doc, size, pos = 0;
+        char *p, *e;
+
+        memcpy(&doc, data + o, 4);
+        memcpy(&size, data + o + 4, 4);
+
+        if (o + 8 + size > (size_t) st.st_size)
+            break;
+
+        p = data + o + 8;
+        e = p + size;
+
+        while (p < e) {
+            int l = strnlen(p, e - p);
+
+            if (p + l == e)
+                break;
+
+            if (l > 0 && l < SRCH_TERM_SIZE) {
+                if (n % 4096 == 0) {
+                    srch_ent *ne = realloc(ents, sizeof(srch_ent) * (n + 4096));
+
+                    if (ne == NULL) {
+                        free(ents);
+                        free(data);
+                        return -1;
+                    }
+
+                    ents = ne;
+                }
+
+                ents[n].term = p;
+                ents[n].doc  = doc;
+                ents[n].pos  = pos;
+                n++;
+            }
+
+            p += l + 1;
+            pos++;
+        }
+
+        o += 8 + size;
+    }
+
+    if (n) {
+        srch_term *terms;
+        srch_post *posts;
+        int nt = 0;
+
+        qsort(ents, n, sizeof(srch_ent), _search_ent_cmp);
+
+        /* a single block, with room for a term per posting */
+        if ((s->map = malloc((sizeof(srch_post) + sizeof(srch_term)) * n)) == NULL) {
+            free(ents);
+            free(data);
+            return -1;
+        }
+
+        posts  = s->map;
+        terms  = (srch_term *)(posts + n);
+
+        for (i = 0; i < n; i++) {
+            if (i == 0 || strcmp(ents[i].term, ents[i - 1].term) != 0) {
+                memset(&terms[nt], '\0', sizeof(srch_term));
+                strcpy(terms[nt].term, ents[i].term);
+                terms[nt].off = i;
+                nt++;
+            }
+
+            terms[nt - 1].cnt++;
+            posts[i].doc = ents[i].doc;
+            posts[i].pos = ents[i].pos;
+        }
+
+        s->h.n_terms = nt;
+        s->h.n_posts = n;
+        s->terms     = terms;
+        s->posts     = posts;
+    }
+
+    free(ents);
+    free(data);
+
+    return n > 0;
+}
+
+
+static int _search_open(const char *dir, srch_seg *segs)
+/* opens all segments, oldest first, and the log as the last one */
+{
+    xs *spec = xs_fmt("%s/seg.????????", dir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    xs_list *p;
+    xs_str *v;
+    int n = 0;
+
+    p = fns;
+    while (n < SRCH_MAX_SEGS && xs_list_iter(&p, &v)) {
+        if (_search_seg_open(v, &segs[n]))
+            n++;
+    }
+
+    if (_search_log_load(dir, &segs[n]) > 0)
+        n++;
+
+    return n;
+}
+
+
+static int _search_post_cmp(const void *a, const void *b)
+{
+    const srch_post *x = a;
+    const srch_post *y = b;
+
+    return x->doc < y->doc ? -1 : x->doc > y->doc ? 1 :
+           x->pos < y->pos ? -1 : x->pos > y->pos ? 1 : 0;
+}
+
+
+static int _search_write(const char *fn, srch_seg *segs, int n,
+                         const unsigned char *docs, int n_docs, uint32_t deleted)
+/* writes the merge of the segments as a new one, dropping
+   the postings of deleted documents */
+{
+    xs *nfn = xs_fmt("%s.new", fn);
+    srch_term *terms = NULL;
+    uint32_t cur[SRCH_MAX_SEGS + 1];
+    srch_hdr h;
+    int nt = 0, i;
+    FILE *f;
+
+    if ((f = fopen(nfn, "w")) == NULL)
+        return -1;
+
+    memset(&h, '\0', sizeof(h));
+    memcpy(h.magic, SRCH_MAGIC, sizeof(h.magic));
+    h.version = SRCH_VERSION;
+    h.deleted = deleted;
+
+    fwrite(&h, sizeof(h), 1, f);
+
+    memset(cur, '\0', sizeof(cur));
+
+    for (;;) {
+        const char *term = NULL;
+        uint32_t off = h.n_posts;
+
+        /* find the lowest pending term */
+        for (i = 0; i < n; i++) {
+            if (cur[i] < segs[i].h.n_terms &&
+                (term == NULL || strncmp(segs[i].terms[cur[i]].term, term, SRCH_TERM_SIZE) < 0))
+                term = segs[i].terms[cur[i]].term;
+        }
+
+        if (term == NULL)
+            break;
+
+        if (nt % 4096 == 0) {
+            srch_term *nterms = realloc(terms, sizeof(srch_term) * (nt + 4096));
+
+            if (nterms == NULL) {
+                free(terms);
+                fclose(f);
+                unlink(nfn);
+                return -1;
+            }
+
+            terms = nterms;
+        }
+
+        memcpy(terms[nt].term, term, SRCH_TERM_SIZE);
+
+        /* copy its postings from all segments in order */
+        for (i = 0; i < n; i++) {
+            const srch_term *t = &segs[i].terms[cur[i]];
+            uint32_t j;
+
+            if (cur[i] >= segs[i].h.n_terms ||
+                strncmp(t->term, terms[nt].term, SRCH_TERM_SIZE) != 0)
+                continue;
+
+            for (j = 0; j < t->cnt && t->off + j < segs[i].h.n_posts; j++) {
+                const srch_post *ps = &segs[i].posts[t->off + j];
+
+                if ((int) ps->doc < n_docs && !_md5_is_zero(docs + ps->doc * IDX_MD5_SIZE)) {
+                    fwrite(ps, sizeof(*ps), 1, f);
+                    h.n_posts++;
+                }
+            }
+
+            cur[i]++;
+        }
+
+        if (h.n_posts > off) {
+            terms[nt].off = off;
+            terms[nt].cnt = h.n_posts - off;
+            nt++;
+        }
+    }
+
+    h.n_terms = nt;
+    fwrite(terms, sizeof(srch_term), nt, f);
+
+    free(terms);
+
+    if (fseek(f, 0, SEEK_SET) == -1 || fwrite(&h, sizeof(h), 1, f) != 1) {
+        fclose(f);
+        unlink(nfn);
+        return -1;
+    }
+
+    if (fclose(f) != 0 || rename(nfn, fn) == -1) {
+        unlink(nfn);
+        return -1;
+    }
+
+    return h.n_posts;
+}
+
+
+static int _search_merge(const char *dir, const char *fn, xs_list *fns, int log)
+/* merges the segment files (and the log, if set) into fn */
+{
+    xs *dfn = xs_fmt("%s/docs.idx", dir);
+    srch_seg segs[SRCH_MAX_SEGS + 1];
+    const unsigned char *docs;
+    size_t size = 0;
+    idx_hdr dh;
+    xs_list *p;
+    xs_str *v;
+    int n = 0, n_docs, ret;
+
+    memset(&dh, '\0', sizeof(dh));
+    docs = _index_map(dfn, &n_docs, &size, &dh);
+
+    p = fns;
+    while (n < SRCH_MAX_SEGS && xs_list_iter(&p, &v)) {
+        if (_search_seg_open(v, &segs[n]))
+            n++;
+    }
+
+    /* if the log cannot be loaded, don't merge (it would be lost) */
+    if (log && (ret = _search_log_load(dir, &segs[n])) != 0) {
+        if (ret == -1) {
+            while (n--)
+                _search_seg_close(&segs[n]);
+
+            _index_unmap(docs, size);
+
+            return -1;
+        }
+
+        n++;
+    }
+
+    ret = _search_write(fn, segs, n, docs, n_docs, dh.deleted);
+
+    while (n--)
+        _search_seg_close(&segs[n]);
+
+    _index_unmap(docs, size);
+
+    return ret;
+}
+
+
+static void _search_flush(const char *dir, int full)
+/* writes the log as a new segment and merges the newest ones,
+   or everything if full is set (the index must be locked) */
+{
+    xs *spec = xs_fmt("%s/seg.????????", dir);
+    xs *lfn  = xs_fmt("%s/log", dir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    int n    = xs_list_len(fns);
+    int log  = mtime(lfn) > 0.0;
+    double t = ftime();
+    xs_list *p;
+    xs_str *v;
+
+    if (full) {
+        if (n + log == 0)
+            return;
+
+        /* nothing deleted since the only segment was written? */
+        if (n == 1 && !log) {
+            xs *dfn = xs_fmt("%s/docs.idx", dir);
+            srch_seg s;
+            idx_hdr dh;
+            int fd, up = 0;
+
+            if ((fd = open(dfn, O_RDONLY)) != -1) {
+                if (pread(fd, &dh, sizeof(dh), 0) == sizeof(dh) && _search_seg_open(xs_list_get(fns, 0), &s)) {
+                    up = s.h.deleted == dh.deleted;
+                    _search_seg_close(&s);
+                }
+
+                close(fd);
+            }
+
+            if (up)
+                return;
+        }
+
+        xs *fn = n ? xs_dup(xs_list_get(fns, -1)) : xs_fmt("%s/seg.%08x", dir, 0);
+
+        if (_search_merge(dir, fn, fns, log) != -1) {
+            p = fns;
+            while (xs_list_iter(&p, &v)) {
+                if (strcmp(v, fn) != 0)
+                    unlink(v);
+            }
+
+            unlink(lfn);
+        }
+    }
+    else {
+        unsigned int seg = 0;
+
+        if (!log)
+            return;
+
+        if (n)
+            seg = strtoul(strrchr(xs_list_get(fns, -1), '.') + 1, NULL, 16) + 1;
+
+        xs *fn = xs_fmt("%s/seg.%08x", dir, seg);
+        xs *none = xs_list_new();
+
+        if (_search_merge(dir, fn, none, 1) == -1)
+            return;
+
+        unlink(lfn);
+
+        /* merge the newest segments while they are of similar size */
+        for (;;) {
+            xs *l = xs_glob(spec, 0, 0);
+            const char *a, *b;
+            struct stat sa, sb;
+
+            if (xs_list_len(l) < 2)
+                break;
+
+            a = xs_list_get(l, -2);
+            b = xs_list_get(l, -1);
+
+            if (stat(a, &sa) == -1 || stat(b, &sb) == -1 ||
+                sa.st_size > SRCH_MERGE_RATIO * sb.st_size)
+                break;
+
+            xs *two = xs_list_new();
+            two = xs_list_append(two, a);
+            two = xs_list_append(two, b);
+
+            if (_search_merge(dir, b, two, 0) == -1)
+                break;
+
+            unlink(a);
+        }
+    }
+
+    srv_debug(1, xs_fmt("_search_flush %s %s %f", dir, full ? "full" : "log", ftime() - t));
+}
+
+
+
+
+static int _search_add(snac *snac, const char *md5, const xs_dict *msg)
+/* adds an object to the search index of a user */
+{
+    xs *text  = _search_text(msg);
+    xs *terms = _search_terms(text, 0);
+    int status = 500;
+    xs_list *p;
+    xs_str *v;
+    char *rec;
+    uint32_t size = 0;
+    int fd, lfd;
+
+    if (xs_list_len(terms) == 0)
+        return 204; /* No Content */
+
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *dfn = xs_fmt("%s/docs.idx", dir);
+    xs *lfn = xs_fmt("%s/log", dir);
+
+    /* the log record: the document number, the size of the terms
+       and the terms themselves, zero-terminated */
+    p = terms;
+    while (xs_list_iter(&p, &v))
+        size += strlen(v) + 1;
+
+    if ((rec = malloc(8 + size)) == NULL)
+        return 500;
+
+    size = 0;
+    p = terms;
+    while (xs_list_iter(&p, &v)) {
+        strcpy(rec + 8 + size, v);
+        size += strlen(v) + 1;
+    }
+
+    memcpy(rec + 4, &size, 4);
+
+    if (mtime(dir) == 0.0)
+        mkdirx(dir);
+
+    if ((fd = _search_lock(dir, LOCK_EX)) != -1) {
+        /* the new document number is the index length */
+        int doc = mtime(dfn) > 0.0 ? index_seek(dfn, NULL) : 0;
+
+        memcpy(rec, &doc, 4);
+
+        if (doc != -1 && valid_status(index_add_md5(dfn, md5)) &&
+            (lfd = open(lfn, O_WRONLY | O_APPEND | O_CREAT, 0666)) != -1) {
+            /* only appended here; it's written as a segment
+               from the background (see search_flush()) */
+            if (write(lfd, rec, 8 + size) == (ssize_t) (8 + size))
+                status = 201; /* Created */
+
+            close(lfd);
+        }
+
+        close(fd);
+    }
+
+    free(rec);
+
+    return status;
+}
+
+
+int search_add(snac *snac, const char *id, const xs_dict *msg)
+/* adds a new timeline entry to the search index */
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+
+    return _search_add(snac, md5, msg);
+}
+
+
+int search_del(snac *snac, const char *id)
+/* deletes an entry from the search index */
+{
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *dfn = xs_fmt("%s/docs.idx", dir);
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    int status = 404;
+    int fd;
+
+    if (mtime(dfn) > 0.0 && (fd = _search_lock(dir, LOCK_EX)) != -1) {
+        /* its postings are dropped on the next merge */
+        status = index_del_md5(dfn, md5);
+        close(fd);
+    }
+
+    return status;
+}
+
+
+int search_update(snac *snac, const char *id, const xs_dict *msg)
+/* reindexes an updated timeline entry */
+{
+    int status = 404;
+
+    if (valid_status(search_del(snac, id)))
+        status = search_add(snac, id, msg);
+
+    return status;
+}
+
+
+int search_flush(snac *snac)
+/* writes the search log of a user as a new segment if it's too big
+   (done from the background); returns 1 if it was written */
+{
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *lfn = xs_fmt("%s/log", dir);
+    struct stat st;
+    int fd, ret = 0;
+
+    if (stat(lfn, &st) == -1 || st.st_size <= SRCH_LOG_MAX)
+        return 0;
+
+    if ((fd = _search_lock(dir, LOCK_EX)) != -1) {
+        _search_flush(dir, 0);
+        close(fd);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+
+int search_purge(snac *snac)
+/* deletes from the search index the entries that are no longer
+   in the timeline and compacts it; returns the number of them */
+{
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *dfn = xs_fmt("%s/docs.idx", dir);
+    int cnt = 0;
+    int fd, dfd;
+
+    if (mtime(dfn) == 0.0 || (fd = _search_lock(dir, LOCK_EX)) == -1)
+        return 0;
+
+    pthread_mutex_t *m = _index_lock(dfn);
+    idx_hdr h;
+
+    if ((dfd = _index_open(dfn, O_RDWR, &h)) != -1) {
+        const unsigned char *map;
+        size_t size;
+        idx_hdr mh;
+        int n, i;
+
+        if ((map = _index_map_fd(dfd, dfn, &n, &size, &mh)) != NULL) {
+            for (i = 0; i < n; i++) {
+                const unsigned char *e = map + i * IDX_MD5_SIZE;
+                char md5[33];
+
+                if (_md5_is_zero(e))
+                    continue;
+
+                _md5_hex(e, md5);
+
+                if (!timeline_here(snac, md5) &&
+                    pwrite(dfd, idx_deleted, IDX_MD5_SIZE, IDX_ENTRY_OFF(i)) == IDX_MD5_SIZE) {
+                    h.deleted++;
+                    cnt++;
+                }
+            }
+
+            _index_unmap(map, size);
+
+            if (cnt && pwrite(dfd, &h, sizeof(h), 0) != sizeof(h))
+                srv_log(xs_fmt("search_purge: error writing %s", dfn));
+        }
+
+        close(dfd);
+    }
+
+    pthread_mutex_unlock(m);
+
+    _search_flush(dir, 1);
+
+    close(fd);
+
+    return cnt;
+}
+
+
+static void _search_term_prep(const char *term, char *t, size_t *l, int *prefix)
+/* copies a query term, removing the * of prefixes */
+{
+    strncpy(t, term, SRCH_TERM_SIZE);
+    t[SRCH_TERM_SIZE] = '\0';
+
+    *l      = strlen(t);
+    *prefix = 0;
+
+    if (*l && t[*l - 1] == '*') {
+        t[--(*l)] = '\0';
+        *prefix = 1;
+    }
+}
+
+
+static uint32_t _search_lower(const srch_seg *s, const char *t)
+/* returns the position of the first term in the dictionary that is not lower */
+{
+    uint32_t lo = 0, hi = s->h.n_terms;
+
+    while (lo < hi) {
+        uint32_t m = lo + (hi - lo) / 2;
+
+        if (strncmp(s->terms[m].term, t, SRCH_TERM_SIZE) < 0)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+
+static int _search_term_is(const srch_term *e, const char *t, size_t l, int prefix)
+{
+    return prefix ? strncmp(e->term, t, l) == 0 : strncmp(e->term, t, SRCH_TERM_SIZE) == 0;
+}
+
+
+static uint32_t _search_count(srch_seg *segs, int n, const char *term)
+/* returns the number of postings of a term (or prefix) */
+{
+    char t[SRCH_TERM_SIZE + 1];
+    uint32_t c = 0, i;
+    int prefix;
+    size_t l;
+
+    _search_term_prep(term, t, &l, &prefix);
+
+    while (n--) {
+        const srch_seg *s = &segs[n];
+
+        for (i = _search_lower(s, t); i < s->h.n_terms && _search_term_is(&s->terms[i], t, l, prefix); i++)
+            c += s->terms[i].cnt;
+    }
+
+    return c;
+}
+
+
+static const srch_post *_search_skip(const srch_post *b, const srch_post *e, uint32_t doc)
+/* returns the first posting from b with a document not lower than doc */
+{
+    const srch_post *hi;
+    size_t step = 1;
+
+    if (b >= e || b->doc >= doc)
+        return b;
+
+    /* gallop and then do a binary search */
+    while (b + step < e && b[step].doc < doc) {
+        b    += step;
+        step *= 2;
+    }
+
+    hi = b + step < e ? b + step : e;
+    b++;
+
+    while (b < hi) {
+        const srch_post *m = b + (hi - b) / 2;
+
+        if (m->doc < doc)
+            b = m + 1;
+        else
+            hi = m;
+    }
+
+    return b;
+}
+
+
+static srch_post *_search_postings(srch_seg *segs, int n, const char *term,
+                                   const uint32_t *filter, int nf, int *np)
+/* returns the postings of a term, or of all the terms beginning with
+   it if it ends with a *; if filter is set, only those of its documents */
+{
+    char t[SRCH_TERM_SIZE + 1];
+    srch_post *r = NULL;
+    uint32_t c = 0, a = 0, j;
+    int prefix, sorted = 1;
+    int i, k;
+    size_t l;
+
+    _search_term_prep(term, t, &l, &prefix);
+
+    for (i = 0; i < n; i++) {
+        const srch_seg *s = &segs[i];
+
+        for (j = _search_lower(s, t); j < s->h.n_terms && _search_term_is(&s->terms[j], t, l, prefix); j++) {
+            const srch_term *e = &s->terms[j];
+            const srch_post *b, *be;
+            uint32_t c0 = c;
+
+            if (e->cnt == 0 || e->off + e->cnt > s->h.n_posts)
+                continue;
+
+            b  = s->posts + e->off;
+            be = b + e->cnt;
+
+            for (k = 0; b < be && (filter == NULL || k < nf); k++) {
+                const srch_post *bs;
+
+                if (filter != NULL) {
+                    b = _search_skip(b, be, filter[k]);
+
+                    for (bs = b; b < be && b->doc == filter[k]; b++);
+                }
+                else {
+                    bs = b;
+                    b  = be;
+                }
+
+                if (c + (b - bs) > a) {
+                    srch_post *nr;
+
+                    a  = (c + (b - bs)) * 2;
+                    nr = realloc(r, sizeof(srch_post) * a);
+
+                    if (nr == NULL) {
+                        free(r);
+                        *np = 0;
+                        return NULL;
+                    }
+
+                    r = nr;
+                }
+
+                memcpy(r + c, bs, sizeof(srch_post) * (b - bs));
+                c += b - bs;
+            }
+
+            /* postings from several terms (or after a crash
+               in the middle of a merge) must be sorted */
+            if (c0 && c > c0 && _search_post_cmp(&r[c0 - 1], &r[c0]) > 0)
+                sorted = 0;
+        }
+    }
+
+    if (!sorted)
+        qsort(r, c, sizeof(srch_post), _search_post_cmp);
+
+    *np = c;
+
+    return r;
+}
+
+
+static uint32_t *_search_docs(const srch_post *r, int nr, int *nd)
+/* returns the sorted documents of a list of postings */
+{
+    uint32_t *docs = malloc(sizeof(uint32_t) * (nr ? nr : 1));
+    int c = 0, k;
+
+    *nd = 0;
+
+    if (docs == NULL)
+        return NULL;
+
+    for (k = 0; k < nr; k++) {
+        if (c == 0 || docs[c - 1] != r[k].doc)
+            docs[c++] = r[k].doc;
+    }
+
+    *nd = c;
+
+    return docs;
+}
+
+
+static uint32_t *_search_clause(srch_seg *segs, int n, const xs_list *terms,
+                                const uint32_t *filter, int nf, int *nd)
+/* returns the sorted documents having the terms in sequence
+   (and that are in filter, if set) */
+{
+    srch_post *r;
+    uint32_t *docs, best = UINT32_MAX;
+    int nr, nt = xs_list_len(terms);
+    int i, k, m, first = 0;
+
+    /* start with the least frequent term */
+    for (i = 0; i < nt; i++) {
+        uint32_t c = _search_count(segs, n, xs_list_get(terms, i));
+
+        if (c < best) {
+            best  = c;
+            first = i;
+        }
+    }
+
+    r = _search_postings(segs, n, xs_list_get(terms, first), filter, nf, &nr);
+
+    /* make the positions relative to the start of the sequence */
+    for (k = m = 0; k < nr; k++) {
+        if (r[k].pos >= (uint32_t) first) {
+            r[m] = r[k];
+            r[m++].pos -= first;
+        }
+    }
+
+    nr = m;
+
+    if (nt > 1 && nr) {
+        /* the other terms are only looked up in these documents */
+        int nfd;
+        uint32_t *fd = _search_docs(r, nr, &nfd);
+
+        /* no filter would mean all documents */
+        if (fd == NULL)
+            nr = 0;
+
+        for (i = 0; i < nt && nr; i++) {
+            int np, j = 0;
+            srch_post *q;
+
+            if (i == first)
+                continue;
+
+            q = _search_postings(segs, n, xs_list_get(terms, i), fd, nfd, &np);
+
+            /* keep the sequences having this term at distance i */
+            for (k = m = 0; k < nr; k++) {
+                srch_post t = { r[k].doc, r[k].pos + i };
+
+                while (j < np && _search_post_cmp(&q[j], &t) < 0)
+                    j++;
+
+                if (j < np && q[j].doc == t.doc && q[j].pos == t.pos)
+                    r[m++] = r[k];
+            }
+
+            nr = m;
+            free(q);
+        }
+
+        free(fd);
+    }
+
+    docs = _search_docs(r, nr, nd);
+
+    free(r);
+
+    return docs;
+}
+
+
+static xs_list *_search_parse(const char *query)
+/* parses a query into a list of clauses (all of them must match),
+   each one a list of terms that must appear in sequence: quoted
+   phrases, or words that are split in more than one term */
+{
+    xs_list *clauses = xs_list_new();
+    xs *parts = xs_split(query, "\"");
+    xs_list *p;
+    xs_str *v;
+    int n = 0;
+
+    p = parts;
+    while (xs_list_iter(&p, &v)) {
+        if (n++ & 1) {
+            xs *terms = _search_terms(v, 1);
+
+            if (xs_list_len(terms))
+                clauses = xs_list_append(clauses, terms);
+        }
+        else {
+            xs *words = xs_split(v, " ");
+            xs_list *p2;
+            xs_str *v2;
+
+            p2 = words;
+            while (xs_list_iter(&p2, &v2)) {
+                xs *terms = _search_terms(v2, 1);
+
+                if (xs_list_len(terms))
+                    clauses = xs_list_append(clauses, terms);
+            }
+        }
+    }
+
+    return clauses;
+}
+
+
+static int _search_visible(snac *snac, const char *md5)
+/* checks if a found entry can be shown to the user */
+{
+    xs *msg = NULL;
+
+    /* still in the timeline? */
+    if (!valid_status(timeline_get_by_md5(snac, md5, &msg)))
+        return 0;
+
+    const char *id   = xs_dict_get(msg, "id");
+    const char *atto = xs_dict_get(msg, "attributedTo");
+
+    if (xs_is_null(id) || is_hidden(snac, id))
+        return 0;
+
+    if (xs_type(atto) == XSTYPE_STRING && is_muted(snac, atto))
+        return 0;
+
+    return 1;
+}
+
+
+xs_list *search_query(snac *snac, const char *query, int skip, int show)
+/* searches the timeline of a user, returning the md5s of the
+   matching entries, newest first */
+{
+    xs_list *list = xs_list_new();
+    xs *clauses = _search_parse(query);
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *dfn = xs_fmt("%s/docs.idx", dir);
+    srch_seg segs[SRCH_MAX_SEGS + 1];
+    uint32_t *docs = NULL, *est;
+    double t = ftime();
+    xs_list *p;
+    xs_str *v;
+    int nd = 0, nc, n, fd, i;
+
+    if (xs_list_len(clauses) == 0 || mtime(dfn) == 0.0 ||
+        (fd = _search_lock(dir, LOCK_SH)) == -1)
+        return list;
+
+    n = _search_open(dir, segs);
+
+    /* the least frequent clause is evaluated first, and each one
+       of the rest only looks into the documents found so far */
+    nc  = xs_list_len(clauses);
+
+    if ((est = malloc(sizeof(uint32_t) * nc)) == NULL) {
+        while (n--)
+            _search_seg_close(&segs[n]);
+
+        close(fd);
+        return list;
+    }
+
+    for (i = 0; i < nc; i++) {
+        xs_list *terms = xs_list_get(clauses, i);
+
+        est[i] = UINT32_MAX - 1;
+
+        p = terms;
+        while (xs_list_iter(&p, &v)) {
+            uint32_t c = _search_count(segs, n, v);
+
+            if (c < est[i])
+                est[i] = c;
+        }
+    }
+
+    for (i = 0; i < nc && (docs == NULL || nd); i++) {
+        uint32_t *cd;
+        int b = -1, j;
+
+        for (j = 0; j < nc; j++) {
+            if (est[j] != UINT32_MAX && (b == -1 || est[j] < est[b]))
+                b = j;
+        }
+
+        est[b] = UINT32_MAX;
+
+        cd = _search_clause(segs, n, xs_list_get(clauses, b), docs, nd, &nd);
+
+        free(docs);
+        docs = cd;
+
+        /* out of memory: no documents (not all of them) */
+        if (docs == NULL) {
+            nd = 0;
+            break;
+        }
+    }
+
+    free(est);
+
+    while (n--)
+        _search_seg_close(&segs[n]);
+
+    close(fd);
+
+    if (nd) {
+        const unsigned char *map;
+        size_t size;
+        idx_hdr h;
+        int n_docs, c = 0;
+
+        if ((map = _index_map(dfn, &n_docs, &size, &h)) != NULL) {
+            for (i = nd - 1; i >= 0 && c < skip + show; i--) {
+                char md5[33];
+
+                if ((int) docs[i] >= n_docs || _md5_is_zero(map + docs[i] * IDX_MD5_SIZE))
+                    continue;
+
+                _md5_hex(map + docs[i] * IDX_MD5_SIZE, md5);
+
+                if (!_search_visible(snac, md5))
+                    continue;
+
+                if (c >= skip)
+                    list = xs_list_append(list, md5);
+
+                c++;
+            }
+
+            _index_unmap(map, size);
+        }
+    }
+
+    free(docs);
+
+    snac_debug(snac, 1, xs_fmt("search_query '%s' %d docs %f", query, nd, ftime() - t));
+
+    return list;
+}
+
+
+int search_rebuild(snac *snac)
+/* rebuilds the search index from the timeline */
+{
+    xs *dir = xs_fmt("%s/search", snac->basedir);
+    xs *idx = xs_fmt("%s/private.idx", snac->basedir);
+    int cnt = 0;
+    int fd, pos, end;
+
+    if (mtime(dir) == 0.0)
+        mkdirx(dir);
+
+    if ((fd = _search_lock(dir, LOCK_EX)) == -1)
+        return -1;
+
+    {
+        xs *spec = xs_fmt("%s/" "*", dir);
+        xs *fns  = xs_glob(spec, 0, 0);
+        xs_list *p;
+        xs_str *v;
+
+        p = fns;
+        while (xs_list_iter(&p, &v)) {
+            if (!xs_endswith(v, "/lock"))
+                unlink(v);
+        }
+    }
+
+    close(fd);
+
+    end = index_seek(idx, NULL);
+
+    for (pos = 0; pos < end; ) {
+        xs *list = index_list_range(idx, &pos, end, 1024);
+        xs_list *p;
+        xs_str *v;
+
+        if (xs_list_len(list) == 0)
+            break;
+
+        p = list;
+        while (xs_list_iter(&p, &v)) {
+            xs *msg = NULL;
+
+            if (valid_status(timeline_get_by_md5(snac, v, &msg)) &&
+                _search_add(snac, v, msg) == 201)
+                cnt++;
+        }
+    }
+
+    return cnt;
+}
+
+
+/** following **/
+
+/* this needs special treatment and cannot use the object db as is,
+   with a link to a cached author, because we need the Follow object
+   in case we need to unfollow (Undo + original Follow) */
+
+xs_str *_following_fn(snac *snac, const char *actor)
+{
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    return xs_fmt("%s/following/%s.json", snac->basedir, md5);
+}
+
+
+int following_add(snac *snac, const char *actor, const xs_dict *msg)
+/* adds to the following list */
+{
+    int ret = 201; /* created */
+    xs *fn = _following_fn(snac, actor);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        xs_json_dump(msg, 4, f);
+        fclose(f);
+
+        /* increase the reference count of the actor object */
+        xs *md5 = xs_md5_hex(actor, strlen(actor));
+
+        fn = xs_replace_i(fn, ".json", "_a.json");
+        _object_link(md5, fn);
+    }
+    else
+        ret = 500;
+
+    snac_debug(snac, 2, xs_fmt("following_add %s %s", actor, fn));
+
+    return ret;
+}
+
+
+int following_del(snac *snac, const char *actor)
+/* we're not following this actor any longer */
+{
+    xs *fn = _following_fn(snac, actor);
+
+    snac_debug(snac, 2, xs_fmt("following_del %s %s", actor, fn));
+
+    unlink(fn);
+
+    /* also delete the reference to the author */
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+
+    fn = xs_replace_i(fn, ".json", "_a.json");
+    _object_unlink(md5, fn);
+
+    return 200;
+}
+
+
+int following_check(snac *snac, const char *actor)
+/* checks if we are following this actor */
+{
+    xs *fn = _following_fn(snac, actor);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int following_get(snac *snac, const char *actor, xs_dict **data)
+/* returns the 'Follow' object */
+{
+    xs *fn = _following_fn(snac, actor);
+    FILE *f;
+    int status = 200;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        *data = xs_json_load(f);
+        fclose(f);
+    }
+    else
+        status = 404;
+
+    return status;
+}
+
+
+xs_list *following_list(snac *snac)
+/* returns the list of people being followed */
+{
+    xs *spec = xs_fmt("%s/following/" "*.json", snac->basedir);
+    xs *glist = xs_glob(spec, 0, 0);
+    xs_list *p;
+    xs_str *v;
+    xs_list *list = xs_list_new();
+
+    /* iterate the list of files */
+    p = glist;
+    while (xs_list_iter(&p, &v)) {
+        FILE *f;
+
+        /* load the follower data */
+        if ((f = fopen(v, "r")) != NULL) {
+            xs *o = xs_json_load(f);
+            fclose(f);
+
+            if (o != NULL) {
+                const char *type = xs_dict_get(o, "type");
+
+                if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
+                    const char *actor = xs_dict_get(o, "actor");
+
+                    if (!xs_is_null(actor)) {
+                        list = xs_list_append(list, actor);
+
+                        /* check if there is a link to the actor object */
+                        xs *v2 = xs_replace(v, ".json", "_a.json");
+
+                        if (mtime(v2) == 0.0) {
+                            /* no; add a link to it */
+                            xs *md5 = xs_md5_hex(actor, strlen(actor));
+                            _object_link(md5, v2);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return list;
+}
+
+
+xs_str *_muted_fn(snac *snac, const char *actor)
+{
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    return xs_fmt("%s/muted/%s", snac->basedir, md5);
+}
+
+
+void mute(snac *snac, const char *actor)
+/* mutes a moron */
+{
+    xs *fn = _muted_fn(snac, actor);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", actor);
+        fclose(f);
+
+        snac_debug(snac, 2, xs_fmt("muted %s %s", actor, fn));
+    }
+}
+
+
+void unmute(snac *snac, const char *actor)
+/* actor is no longer a moron */
+{
+    xs *fn = _muted_fn(snac, actor);
+
+    unlink(fn);
+
+    snac_debug(snac, 2, xs_fmt("unmuted %s %s", actor, fn));
+}
+
+
+int is_muted(snac *snac, const char *actor)
+/* check if someone is muted */
+{
+    xs *fn = _muted_fn(snac, actor);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+/** pinning **/
+
+xs_str *_pinned_fn(snac *user, const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return xs_fmt("%s/pinned/%s.json", user->basedir, md5);
+}
+
+
+int is_pinned(snac *user, const char *id)
+/* returns true if this note is pinned */
+{
+    xs *fn = _pinned_fn(user, id);
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int pin(snac *user, const char *id)
+/* pins a message */
+{
+    int ret = -2;
+
+    if (xs_startswith(id, user->actor)) {
+        if (is_pinned(user, id))
+            ret = -3;
+        else {
+            /* create the subfolder, if it does not exist */
+            xs *fn = xs_fmt("%s/pinned/", user->basedir);
+            mkdirx(fn);
+
+            ret = object_user_cache_add(user, id, "pinned");
+        }
+    }
+
+    return ret;
+}
+
+
+int unpin(snac *user, const char *id)
+/* unpin a message */
+{
+    int ret = object_user_cache_del(user, id, "pinned");
+
+    if (ret != -1) {
+        /* delete from the index */
+        xs *idx = xs_fmt("%s/pinned.idx", user->basedir);
+        index_del(idx, id);
+    }
+
+    return ret;
+}
+
+
+xs_list *pinned_list(snac *user)
+/* return the lists of pinned posts */
+{
+    return object_user_cache_list(user, "pinned", XS_ALL, 1);
+}
+
+
+xs_str *_hidden_fn(snac *snac, const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return xs_fmt("%s/hidden/%s", snac->basedir, md5);
+}
+
+
+void hide(snac *snac, const char *id)
+/* hides a message tree */
+{
+    xs *fn = _hidden_fn(snac, id);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", id);
+        fclose(f);
+
+        snac_debug(snac, 2, xs_fmt("hidden %s %s", id, fn));
+
+        /* hide all the children */
+        xs *chld = object_children(id);
+        char *p, *v;
+
+        p = chld;
+        while (xs_list_iter(&p, &v)) {
+            xs *co = NULL;
+
+            /* resolve to get the id */
+            if (valid_status(object_get_by_md5(v, &co))) {
+                if ((v = xs_dict_get(co, "id")) != NULL)
+                    hide(snac, v);
+            }
+        }
+    }
+}
+
+
+int is_hidden(snac *snac, const char *id)
+/* check is id is hidden */
+{
+    xs *fn = _hidden_fn(snac, id);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int actor_add(const char *actor, xs_dict *msg)
+/* adds an actor */
+{
+    return object_add_ow(actor, msg);
+}
+
+
+int actor_get(const char *actor, xs_dict **data)
+/* returns an already downloaded actor */
+{
+    int status = 200;
+    xs_dict *d = NULL;
+
+    if (xs_startswith(actor, srv_baseurl)) {
+        /* it's a (possible) local user */
+        xs *l = xs_split(actor, "/");
+        const char *uid = xs_list_get(l, -1);
+        snac user;
+
+        if (!xs_is_null(uid) && user_open(&user, uid)) {
+            if (data)
+                *data = msg_actor(&user);
+
+            user_free(&user);
+            return 200;
+        }
+        else
+            return 404;
+    }
+
+    /* read the object */
+    if (!valid_status(status = object_get(actor, &d))) {
+        d = xs_free(d);
+        return status;
+    }
+
+    if (data)
+        *data = d;
+    else
+        d = xs_free(d);
+
+    double max_time;
+
+    /* maximum time for the actor data to be considered stale */
+    max_time = 3600.0 * 36.0;
+
+    if (object_mtime(actor) + max_time < (double) time(NULL)) {
+        /* actor data exists but also stinks */
+
+        /* touch the object */
+        object_touch(actor);
+
+        status = 205; /* "205: Reset Content" "110: Response Is Stale" */
+    }
+
+    return status;
+}
+
+
+/** user limiting (announce blocks) **/
+
+int limited(snac *user, const char *id, int cmd)
+/* announce messages from a followed (0: check, 1: limit; 2: unlimit) */
+{
+    int ret = 0;
+    xs *dir = xs_fmt("%s/limited", user->basedir);
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    xs *fn  = xs_fmt("%s/%s", dir, md5);
+
+    switch (cmd) {
+    case 0: /** check **/
+        ret = !!(mtime(fn) > 0.0);
+        break;
+
+    case 1: /** limit **/
+        mkdirx(dir);
+
+        if (mtime(fn) > 0.0)
+            ret = -1;
+        else {
+            FILE *f;
+
+            if ((f = fopen(fn, "w")) != NULL) {
+                fprintf(f, "%s\n", id);
+                fclose(f);
+            }
+            else
+                ret = -2;
+        }
+        break;
+
+    case 2: /** unlimit **/
+        if (mtime(fn) > 0.0)
+            ret = unlink(fn);
+        else
+            ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+
+/** static data **/
+
+xs_str *_static_fn(snac *snac, const char *id)
+/* gets the filename for a static file */
+{
+    if (strchr(id, '/'))
+        return NULL;
+    else
+        return xs_fmt("%s/static/%s", snac->basedir, id);
+}
+
+
+int static_get(snac *snac, const char *id, xs_val **data, int *size,
+                const char *inm, xs_str **etag)
+/* returns static content */
+{
+    xs *fn = _static_fn(snac, id);
+    int status = 404;
+
+    if (fn) {
+        double tm = mtime(fn);
+
+        if (tm > 0.0) {
+            /* file exists; build the etag */
+            xs *e = xs_fmt("W/\"snac-%.0lf\"", tm);
+
+            /* if if-none-match is set, check if it's the same */
+            if (!xs_is_null(inm) && strcmp(e, inm) == 0) {
+                /* client has the newest version */
+                status = 304;
+            }
+            else {
+                /* newer or never downloaded; read the full file */
+                FILE *f;
+
+                if ((f = fopen(fn, "rb")) != NULL) {
+                    *size = XS_ALL;
+                    *data = xs_read(f, size);
+                    fclose(f);
+
+                    status = 200;
+                }
+            }
+
+            /* if caller wants the etag, return it */
+            if (etag != NULL)
+                *etag = xs_dup(e);
+
+            srv_debug(1, xs_fmt("static_get(): %s %d", id, status));
+        }
+    }
+
+    return status;
+}
+
+
+void static_put(snac *snac, const char *id, const char *data, int size)
+/* writes status content */
+{
+    xs *fn = _static_fn(snac, id);
+    FILE *f;
+
+    if (fn && (f = fopen(fn, "wb")) != NULL) {
+        fwrite(data, size, 1, f);
+        fclose(f);
+    }
+}
+
+
+void static_put_meta(snac *snac, const char *id, const char *str)
+/* puts metadata (i.e. a media description string) to id */
+{
+    xs *fn = _static_fn(snac, id);
+
+    if (fn) {
+        fn = xs_str_cat(fn, ".txt");
+        FILE *f;
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", str);
+            fclose(f);
+        }
+    }
+}
+
+
+xs_str *static_get_meta(snac *snac, const char *id)
+/* gets metadata from a media */
+{
+    xs *fn    = _static_fn(snac, id);
+    xs_str *r = NULL;
+
+    if (fn) {
+        fn = xs_str_cat(fn, ".txt");
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            r = xs_strip_i(xs_readline(f));
+            fclose(f);
+        }
+    }
+    else
+        r = xs_str_new("");
+
+    return r;
+}
+
+
+/** history **/
+
+xs_str *_history_fn(snac *snac, const char *id)
+/* gets the filename for the history */
+{
+    if (strchr(id, '/'))
+        return NULL;
+    else
+        return xs_fmt("%s/history/%s", snac->basedir, id);
+}
+
+
+double history_mtime(snac *snac, const char *id)
+{
+    double t = 0.0;
+    xs *fn = _history_fn(snac, id);
+
+    if (fn != NULL)
+        t = mtime(fn);
+
+    return t;
+}
+
+
+void history_add(snac *snac, const char *id, const char *content, int size)
+/* adds something to the history */
+{
+    xs *fn = _history_fn(snac, id);
+    FILE *f;
+
+    if (fn && (f = fopen(fn, "w")) != NULL) {
+        fwrite(content, size, 1, f);
+        fclose(f);
+    }
+}
+
+
+xs_str *history_get(snac *snac, const char *id)
+{
+    xs_str *content = NULL;
+    xs *fn = _history_fn(snac, id);
+    FILE *f;
+
+    if (fn && (f = fopen(fn, "r")) != NULL) {
+        content = xs_readall(f);
+        fclose(f);
+    }
+
+    return content;
+}
+
+
+int history_del(snac *snac, const char *id)
+{
+    xs *fn = _history_fn(snac, id);
+
+    if (fn)
+        return unlink(fn);
+    else
+        return -1;
+}
+
+
+xs_list *history_list(snac *snac)
+{
+    xs *spec = xs_fmt("%s/history/" "*.html", snac->basedir);
+
+    return xs_glob(spec, 1, 0);
+}
+
+
+void lastlog_write(snac *snac, const char *source)
+/* writes the last time the user logged in */
+{
+    xs *fn = xs_fmt("%s/lastlog.txt", snac->basedir);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%lf %s\n", ftime(), source);
+        fclose(f);
+    }
+}
+
+
+/** inbox collection **/
+
+void inbox_add(const char *inbox)
+/* collects a shared inbox */
+{
+    xs *md5 = xs_md5_hex(inbox, strlen(inbox));
+    xs *fn  = xs_fmt("%s/inbox/%s", srv_basedir, md5);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", inbox);
+        fclose(f);
+    }
+}
+
+
+void inbox_add_by_actor(const xs_dict *actor)
+/* collects an actor's shared inbox, if it has one */
+{
+    char *v;
+
+    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
+        !xs_is_null(v = xs_dict_get(v, "sharedInbox")))
+        inbox_add(v);
+}
+
+
+xs_list *inbox_list(void)
+/* returns the collected inboxes as a list */
+{
+    xs_list *ibl = xs_list_new();
+    xs *spec     = xs_fmt("%s/inbox/" "*", srv_basedir);
+    xs *files    = xs_glob(spec, 0, 0);
+    xs_list *p   = files;
+    xs_val *v;
+
+    while (xs_list_iter(&p, &v)) {
+        FILE *f;
+
+        if ((f = fopen(v, "r")) != NULL) {
+            xs *line = xs_readline(f);
+
+            if (line) {
+                line = xs_strip_i(line);
+                ibl  = xs_list_append(ibl, line);
+            }
+
+            fclose(f);
+        }
+    }
+
+    return ibl;
+}
+
+
+/** instance-wide operations **/
+
+xs_str *_instance_block_fn(const char *instance)
+{
+    xs *s1  = xs_replace(instance, "https:/" "/", "");
+    xs *l   = xs_split(s1, "/");
+    char *p = xs_list_get(l, 0);
+    xs *md5 = xs_md5_hex(p, strlen(p));
+
+    return xs_fmt("%s/block/%s", srv_basedir, md5);
+}
+
+
+int is_instance_blocked(const char *instance)
+{
+    xs *fn = _instance_block_fn(instance);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int instance_block(const char *instance)
+/* blocks a full instance */
+{
+    int ret;
+
+    /* create the subdir */
+    xs *dir = xs_fmt("%s/block/", srv_basedir);
+    mkdirx(dir);
+
+    if (!is_instance_blocked(instance)) {
+        xs *fn = _instance_block_fn(instance);
+        FILE *f;
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", instance);
+            fclose(f);
+
+            ret = 0;
+        }
+        else
+            ret = -1;
+    }
+    else
+        ret = -2;
+
+    return ret;
+}
+
+
+int instance_unblock(const char *instance)
+/* unblocks a full instance */
+{
+    int ret;
+
+    if (is_instance_blocked(instance)) {
+        xs *fn = _instance_block_fn(instance);
+        ret = unlink(fn);
+    }
+    else
+        ret = -2;
+
+    return ret;
+}
+
+
+/** notifications **/
+
+xs_str *notify_check_time(snac *snac, int reset)
+/* gets or resets the latest notification check time */
+{
+    xs_str *t = NULL;
+    xs *fn    = xs_fmt("%s/notifydate.txt", snac->basedir);
+    FILE *f;
+
+    if (reset) {
+        if ((f = fopen(fn, "w")) != NULL) {
+            t = tid(0);
+            fprintf(f, "%s\n", t);
+            fclose(f);
+        }
+    }
+    else {
+        if ((f = fopen(fn, "r")) != NULL) {
+            t = xs_readline(f);
+            fclose(f);
+        }
+        else
+            /* never set before */
+            t = xs_fmt("%16.6f", 0.0);
+    }
+
+    return t;
+}
+
+
+void notify_add(snac *snac, const char *type, const char *utype,
+                const char *actor, const char *objid)
+/* adds a new notification */
+{
+    xs *ntid = tid(0);
+    xs *fn   = xs_fmt("%s/notify/", snac->basedir);
+    xs *date = xs_str_utctime(0, ISO_DATE_SPEC);
+    FILE *f;
+
+    /* create the directory */
+    mkdirx(fn);
+    fn = xs_str_cat(fn, ntid);
+    fn = xs_str_cat(fn, ".json");
+
+    xs *noti = xs_dict_new();
+
+    noti = xs_dict_append(noti, "id",    ntid);
+    noti = xs_dict_append(noti, "type",  type);
+    noti = xs_dict_append(noti, "utype", utype);
+    noti = xs_dict_append(noti, "actor", actor);
+    noti = xs_dict_append(noti, "date",  date);
+
+    if (!xs_is_null(objid))
+        noti = xs_dict_append(noti, "objid", objid);
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        xs_json_dump(noti, 4, f);
+        fclose(f);
+    }
+
+#ifndef NO_MASTODON_API
+    mastoapi_stream_post(snac->uid, "notification", noti);
+#endif
+}
+
+
+xs_dict *notify_get(snac *snac, const char *id)
+/* gets a notification */
+{
+    xs *fn = xs_fmt("%s/notify/%s.json", snac->basedir, id);
+    FILE *f;
+    xs_dict *out = NULL;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        out = xs_json_load(f);
+        fclose(f);
+    }
+
+    return out;
+}
+
+
+xs_list *notify_list(snac *snac, int new_only)
+/* returns a list of notification ids, optionally only the new ones */
+{
+    xs *t = NULL;
+
+    /* if only new ones are requested, get the last time */
+    if (new_only)
+        t = notify_check_time(snac, 0);
+
+    xs *spec     = xs_fmt("%s/notify/" "*.json", snac->basedir);
+    xs *lst      = xs_glob(spec, 1, 1);
+    xs_list *out = xs_list_new();
+    xs_list *p   = lst;
+    xs_str *v;
+
+    while (xs_list_iter(&p, &v)) {
+        xs *id = xs_replace(v, ".json", "");
+
+        /* old? */
+        if (t != NULL && strcmp(id, t) < 0)
+            continue;
+
+        out = xs_list_append(out, id);
+    }
+
+    return out;
+}
+
+
+void notify_clear(snac *snac)
+/* clears all notifications */
+{
+    xs *spec   = xs_fmt("%s/notify/" "*", snac->basedir);
+    xs *lst    = xs_glob(spec, 0, 0);
+    xs_list *p = lst;
+    xs_str *v;
+
+    while (xs_list_iter(&p, &v))
+        unlink(v);
+}
+
+
+/** remote host health **/
+
+/* hosts that fail to accept our messages are tracked with a circuit
+   breaker. After some consecutive failures the host is 'open' and
+   nothing is sent to it until its retry time; then it's 'half-open'
+   and just one message is let through as a probe. If it's accepted
+   the host is healthy again; if not, it's opened again for twice
+   the time. Healthy hosts are not stored at all. The state is kept
+   in memory and dumped to hosts.json on every change */
+
+#define HOST_FAILS_TO_OPEN  5
+#define HOST_PROBE_SECS     60
+#define HOST_MAX_BACKOFF    (24 * 60 * 60)
+
+static pthread_mutex_t hosts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xs_dict *hosts = NULL;
+
 
-xs_str *_static_fn(snac *snac, const char *id)
-/* gets the filename for a static file */
+int backoff_secs(int base, int n)
+/* returns an exponential backoff with jitter (between half and full) */
 {
-    if (strchr(id, '/'))
-        return NULL;
-    else
-        return xs_fmt("%s/static/%s", snac->basedir, id);
+    double d = base;
+
+    while (--n > 0 && d < HOST_MAX_BACKOFF)
+        d *= 2;
+
+    if (d > HOST_MAX_BACKOFF)
+        d = HOST_MAX_BACKOFF;
+
+    return (int) (d / 2 + (d / 2) * (random() % 1000) / 1000.0);
 }
 
 
-int static_get(snac *snac, const char *id, xs_val **data, int *size,
-                const char *inm, xs_str **etag)
-/* returns static content */
+static xs_str *_host_of(const char *url)
+/* returns the host part of a url */
 {
-    xs *fn = _static_fn(snac, id);
-    int status = 404;
+    const char *p = strstr(url, "://");
+    const char *e;
 
-    if (fn) {
-        double tm = mtime(fn);
+    p = p ? p + 3 : url;
 
-        if (tm > 0.0) {
-            /* file exists; build the etag */
-            xs *e = xs_fmt("W/\"snac-%.0lf\"", tm);
+    if ((e = strchr(p, '/')) == NULL)
+        e = p + strlen(p);
 
-            /* if if-none-match is set, check if it's the same */
-            if (!xs_is_null(inm) && strcmp(e, inm) == 0) {
-                /* client has the newest version */
-                status = 304;
-            }
-            else {
-                /* newer or never downloaded; read the full file */
-                FILE *f;
+    return xs_crop_i(xs_str_new(p), 0, e - p);
+}
 
-                if ((f = fopen(fn, "rb")) != NULL) {
-                    *size = XS_ALL;
-                    *data = xs_read(f, size);
-                    fclose(f);
 
-                    status = 200;
-                }
-            }
+static void _hosts_load(void)
+/* loads the host states (must be locked) */
+{
+    if (hosts == NULL) {
+        xs *fn = xs_fmt("%s/hosts.json", srv_basedir);
+        FILE *f;
 
-            /* if caller wants the etag, return it */
-            if (etag != NULL)
-                *etag = xs_dup(e);
+        xs_arena_pause();
 
-            srv_debug(1, xs_fmt("static_get(): %s %d", id, status));
+        if ((f = fopen(fn, "r")) != NULL) {
+            hosts = xs_json_load(f);
+            fclose(f);
         }
-    }
 
-    return status;
+        if (xs_type(hosts) != XSTYPE_DICT) {
+            xs_free(hosts);
+            hosts = xs_dict_new();
+        }
+
+        xs_arena_resume();
+    }
 }
 
 
-void static_put(snac *snac, const char *id, const char *data, int size)
-/* writes status content */
+static void _hosts_save(void)
+/* writes the host states (must be locked) */
 {
-    xs *fn = _static_fn(snac, id);
+    xs *fn  = xs_fmt("%s/hosts.json", srv_basedir);
+    xs *tfn = xs_fmt("%s.tmp", fn);
     FILE *f;
 
-    if (fn && (f = fopen(fn, "wb")) != NULL) {
-        fwrite(data, size, 1, f);
+    if ((f = fopen(tfn, "w")) != NULL) {
+        xs_json_dump(hosts, 4, f);
         fclose(f);
+
+        rename(tfn, fn);
     }
 }
 
 
-void static_put_meta(snac *snac, const char *id, const char *str)
-/* puts metadata (i.e. a media description string) to id */
+static xs_dict *_host_set(xs_dict *h, const char *state, int fails, int opens,
+                          time_t until, int status, time_t since)
+/* fills a host state */
 {
-    xs *fn = _static_fn(snac, id);
+    xs *n1 = xs_number_new(fails);
+    xs *n2 = xs_number_new(opens);
+    xs *n3 = xs_number_new(until);
+    xs *n4 = xs_number_new(status);
+    xs *n5 = xs_number_new(since);
 
-    if (fn) {
-        fn = xs_str_cat(fn, ".txt");
-        FILE *f;
+    h = xs_dict_set(h, "state",  state);
+    h = xs_dict_set(h, "fails",  n1);
+    h = xs_dict_set(h, "opens",  n2);
+    h = xs_dict_set(h, "until",  n3);
+    h = xs_dict_set(h, "status", n4);
+    h = xs_dict_set(h, "since",  n5);
 
-        if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", str);
-            fclose(f);
-        }
-    }
+    return h;
 }
 
 
-xs_str *static_get_meta(snac *snac, const char *id)
-/* gets metadata from a media */
+int host_check(const char *url)
+/* checks if something can be sent to the host of this url */
 {
-    xs *fn    = _static_fn(snac, id);
-    xs_str *r = NULL;
+    xs *host = _host_of(url);
+    time_t t = time(NULL);
+    const xs_dict *h;
+    int ret  = 1;
 
-    if (fn) {
-        fn = xs_str_cat(fn, ".txt");
-        FILE *f;
+    pthread_mutex_lock(&hosts_mutex);
 
-        if ((f = fopen(fn, "r")) != NULL) {
-            r = xs_strip_i(xs_readline(f));
-            fclose(f);
+    _hosts_load();
+
+    if ((h = xs_dict_get(hosts, host)) != NULL) {
+        const char *state = xs_dict_get(h, "state");
+        time_t until      = xs_number_get(xs_dict_get(h, "until"));
+
+        if (strcmp(state, "closed") != 0) {
+            if (t < until)
+                ret = 0;
+            else {
+                /* let this one through as a probe */
+                xs *nh = _host_set(xs_dup(h), "half-open",
+                        xs_number_get(xs_dict_get(h, "fails")),
+                        xs_number_get(xs_dict_get(h, "opens")),
+                        t + HOST_PROBE_SECS,
+                        xs_number_get(xs_dict_get(h, "status")),
+                        xs_number_get(xs_dict_get(h, "since")));
+
+                hosts = xs_dict_set(hosts, host, nh);
+                _hosts_save();
+
+                srv_debug(1, xs_fmt("host_check %s half-open", host));
+            }
         }
     }
-    else
-        r = xs_str_new("");
 
-    return r;
-}
+    pthread_mutex_unlock(&hosts_mutex);
 
+    return ret;
+}
 
-/** history **/
 
-xs_str *_history_fn(snac *snac, const char *id)
-/* gets the filename for the history */
+time_t host_retry_time(const char *url)
+/* returns the time a host will accept messages again, or 0 */
 {
-    if (strchr(id, '/'))
-        return NULL;
-    else
-        return xs_fmt("%s/history/%s", snac->basedir, id);
-}
+    xs *host = _host_of(url);
+    const xs_dict *h;
+    time_t until = 0;
 
+    pthread_mutex_lock(&hosts_mutex);
 
-double history_mtime(snac *snac, const char *id)
-{
-    double t = 0.0;
-    xs *fn = _history_fn(snac, id);
+    _hosts_load();
 
-    if (fn != NULL)
-        t = mtime(fn);
+    if ((h = xs_dict_get(hosts, host)) != NULL &&
+        strcmp(xs_dict_get(h, "state"), "closed") != 0)
+        until = xs_number_get(xs_dict_get(h, "until"));
 
-    return t;
+    pthread_mutex_unlock(&hosts_mutex);
+
+    return until > time(NULL) ? until : 0;
 }
 
 
-void history_add(snac *snac, const char *id, const char *content, int size)
-/* adds something to the history */
+void host_result(const char *url, int status)
+/* updates the state of a host after sending something to it */
 {
-    xs *fn = _history_fn(snac, id);
-    FILE *f;
+    xs *host = _host_of(url);
+    const xs_dict *h;
+    int failed = status < 0 || status >= 500 || status == 429;
 
-    if (fn && (f = fopen(fn, "w")) != NULL) {
-        fwrite(content, size, 1, f);
-        fclose(f);
-    }
-}
+    pthread_mutex_lock(&hosts_mutex);
 
+    _hosts_load();
 
-xs_str *history_get(snac *snac, const char *id)
-{
-    xs_str *content = NULL;
-    xs *fn = _history_fn(snac, id);
-    FILE *f;
+    h = xs_dict_get(hosts, host);
 
-    if (fn && (f = fopen(fn, "r")) != NULL) {
-        content = xs_readall(f);
-        fclose(f);
+    if (!failed) {
+        /* healthy; forget about it */
+        if (h != NULL) {
+            if (strcmp(xs_dict_get(h, "state"), "closed") != 0)
+                srv_log(xs_fmt("host %s is back", host));
+
+            hosts = xs_dict_del(hosts, host);
+            _hosts_save();
+        }
     }
+    else {
+        const char *state = h ? xs_dict_get(h, "state") : "closed";
+        int fails    = h ? xs_number_get(xs_dict_get(h, "fails")) + 1 : 1;
+        int opens    = h ? xs_number_get(xs_dict_get(h, "opens")) : 0;
+        time_t until = h ? xs_number_get(xs_dict_get(h, "until")) : 0;
+        time_t since = h ? xs_number_get(xs_dict_get(h, "since")) : time(NULL);
+        int qrt      = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
+        int changed  = 0;
+
+        if (strcmp(state, "half-open") == 0 ||
+            (strcmp(state, "closed") == 0 && fails >= HOST_FAILS_TO_OPEN)) {
+            /* (re)open the circuit */
+            opens++;
+            until   = time(NULL) + backoff_secs(qrt * 60, opens);
+            state   = "open";
+            changed = 1;
+
+            srv_log(xs_fmt("host %s is failing (%d) -- paused for %d seconds",
+                host, status, (int) (until - time(NULL))));
+        }
 
-    return content;
+        xs *nh = _host_set(h ? xs_dup(h) : xs_dict_new(), state, fails, opens, until, status, since);
+        hosts  = xs_dict_set(hosts, host, nh);
+
+        /* saving every failure of closed ones is not worth it */
+        if (changed || h == NULL)
+            _hosts_save();
+    }
+
+    pthread_mutex_unlock(&hosts_mutex);
 }
 
 
-int history_del(snac *snac, const char *id)
+xs_dict *host_list(void)
+/* returns the state of all tracked hosts */
 {
-    xs *fn = _history_fn(snac, id);
+    xs_dict *d;
 
-    if (fn)
-        return unlink(fn);
-    else
-        return -1;
-}
+    pthread_mutex_lock(&hosts_mutex);
 
+    _hosts_load();
+    d = xs_dup(hosts);
 
-xs_list *history_list(snac *snac)
-{
-    xs *spec = xs_fmt("%s/history/" "*.html", snac->basedir);
+    pthread_mutex_unlock(&hosts_mutex);
 
-    return xs_glob(spec, 1, 0);
+    return d;
 }
 
 
-void lastlog_write(snac *snac, const char *source)
-/* writes the last time the user logged in */
-{
-    xs *fn = xs_fmt("%s/lastlog.txt", snac->basedir);
-    FILE *f;
+/** queue scheduler **/
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%lf %s\n", ftime(), source);
-        fclose(f);
-    }
-}
+/* in the server, the queue files waiting to be processed are kept in
+   memory in a heap ordered by due time, so that they are processed right
+   when needed instead of scanning all the queue directories every few
+   seconds. It's filled from disk on startup and fed by _enqueue_put().
+   Other processes (e.g. command-line operations) cannot signal it, so they
+   touch the queue/.wake file to ask for a rescan */
 
+#define QSCHED_WAKE_SECS 3
 
-/** inbox collection **/
+typedef struct {
+    time_t due;
+    xs_str *uid;                /* NULL for the global queue */
+    xs_str *fn;
+} qsched_item;
 
-void inbox_add(const char *inbox)
-/* collects a shared inbox */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    qsched_item *heap;
+    int n;
+    int size;
+    int active;
+    int wakeup;
+    struct timespec wake_mtime;
+} qsched = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, { 0, 0 } };
+
+
+static int _qsched_less(const qsched_item *a, const qsched_item *b)
+/* sorts by due time and then by file name (that is, by queuing time) */
 {
-    xs *md5 = xs_md5_hex(inbox, strlen(inbox));
-    xs *fn  = xs_fmt("%s/inbox/%s", srv_basedir, md5);
-    FILE *f;
+    if (a->due != b->due)
+        return a->due < b->due;
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", inbox);
-        fclose(f);
-    }
+    return strcmp(strrchr(a->fn, '/'), strrchr(b->fn, '/')) < 0;
 }
 
 
-void inbox_add_by_actor(const xs_dict *actor)
-/* collects an actor's shared inbox, if it has one */
+static void _qsched_push(const char *fn)
+/* adds a queue file to the heap (must be locked) */
 {
-    char *v;
+    const char *bn = strrchr(fn, '/');
+    qsched_item e;
+    int n;
 
-    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
-        !xs_is_null(v = xs_dict_get(v, "sharedInbox")))
-        inbox_add(v);
-}
+    if (bn == NULL)
+        return;
 
+    if (qsched.n == qsched.size) {
+        int size = qsched.size ? qsched.size * 2 : 64;
+        qsched_item *heap = realloc(qsched.heap, size * sizeof(qsched_item));
 
-xs_list *inbox_list(void)
-/* returns the collected inboxes as a list */
-{
-    xs_list *ibl = xs_list_new();
-    xs *spec     = xs_fmt("%s/inbox/" "*", srv_basedir);
-    xs *files    = xs_glob(spec, 0, 0);
-    xs_list *p   = files;
-    xs_val *v;
+        if (heap == NULL)
+            return;
 
-    while (xs_list_iter(&p, &v)) {
-        FILE *f;
+        qsched.heap = heap;
+        qsched.size = size;
+    }
 
-        if ((f = fopen(v, "r")) != NULL) {
-            xs *line = xs_readline(f);
+    e.due = atol(bn + 1);
+    e.uid = NULL;
 
-            if (line) {
-                line = xs_strip_i(line);
-                ibl  = xs_list_append(ibl, line);
-            }
+    /* the heap outlives any request */
+    xs_arena_pause();
 
-            fclose(f);
-        }
+    e.fn  = xs_str_new(fn);
+
+    /* user queues are inside the user directories */
+    xs *prefix = xs_fmt("%s/user/", srv_basedir);
+
+    if (xs_startswith(fn, prefix)) {
+        const char *uid = fn + strlen(prefix);
+        const char *p   = strchr(uid, '/');
+
+        if (p != NULL)
+            e.uid = xs_crop_i(xs_str_new(uid), 0, p - uid);
     }
 
-    return ibl;
-}
+    xs_arena_resume();
 
+    /* sift up */
+    for (n = qsched.n++; n > 0; n = (n - 1) / 2) {
+        qsched_item *parent = &qsched.heap[(n - 1) / 2];
 
-/** instance-wide operations **/
+        if (!_qsched_less(&e, parent))
+            break;
 
-xs_str *_instance_block_fn(const char *instance)
-{
-    xs *s1  = xs_replace(instance, "https:/" "/", "");
-    xs *l   = xs_split(s1, "/");
-    char *p = xs_list_get(l, 0);
-    xs *md5 = xs_md5_hex(p, strlen(p));
+        qsched.heap[n] = *parent;
+    }
 
-    return xs_fmt("%s/block/%s", srv_basedir, md5);
+    qsched.heap[n] = e;
 }
 
 
-int is_instance_blocked(const char *instance)
+static qsched_item _qsched_pop(void)
+/* removes the first item from the heap (must be locked and not empty) */
 {
-    xs *fn = _instance_block_fn(instance);
+    qsched_item top = qsched.heap[0];
+    qsched_item e   = qsched.heap[--qsched.n];
+    int n = 0;
 
-    return !!(mtime(fn) != 0.0);
+    /* sift down */
+    for (;;) {
+        int c = n * 2 + 1;
+
+        if (c >= qsched.n)
+            break;
+
+        if (c + 1 < qsched.n && _qsched_less(&qsched.heap[c + 1], &qsched.heap[c]))
+            c++;
+
+        if (!_qsched_less(&qsched.heap[c], &e))
+            break;
+
+        qsched.heap[n] = qsched.heap[c];
+        n = c;
+    }
+
+    if (qsched.n)
+        qsched.heap[n] = e;
+
+    return top;
 }
 
 
-int instance_block(const char *instance)
-/* blocks a full instance */
+static void _qsched_load(void)
+/* fills the heap with all the queue files (must be locked) */
 {
-    int ret;
+    while (qsched.n) {
+        qsched_item e = _qsched_pop();
 
-    /* create the subdir */
-    xs *dir = xs_fmt("%s/block/", srv_basedir);
-    mkdirx(dir);
+        xs_free(e.uid);
+        xs_free(e.fn);
+    }
 
-    if (!is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
-        FILE *f;
+    xs *spec = xs_fmt("%s/queue/" "*.json", srv_basedir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    xs *ulst = user_list();
+    xs_list *p;
+    xs_str *v;
 
-        if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", instance);
-            fclose(f);
+    p = ulst;
+    while (xs_list_iter(&p, &v)) {
+        xs *spec2 = xs_fmt("%s/user/%s/queue/" "*.json", srv_basedir, v);
+        xs *fns2  = xs_glob(spec2, 0, 0);
 
-            ret = 0;
-        }
-        else
-            ret = -1;
+        fns = xs_list_cat(fns, fns2);
     }
-    else
-        ret = -2;
 
-    return ret;
+    p = fns;
+    while (xs_list_iter(&p, &v))
+        _qsched_push(v);
+
+    srv_debug(1, xs_fmt("queue scheduler: %d items loaded", qsched.n));
 }
 
 
-int instance_unblock(const char *instance)
-/* unblocks a full instance */
+static int _qsched_wake_changed(void)
+/* checks if the wake file has been touched (must be locked) */
 {
+    xs *fn = xs_fmt("%s/queue/.wake", srv_basedir);
+    struct stat st;
+    struct timespec ts = { 0, 0 };
     int ret;
 
-    if (is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
-        ret = unlink(fn);
-    }
-    else
-        ret = -2;
+    if (stat(fn, &st) != -1)
+        ts = st.st_mtim;
+
+    ret = ts.tv_sec != qsched.wake_mtime.tv_sec || ts.tv_nsec != qsched.wake_mtime.tv_nsec;
+    qsched.wake_mtime = ts;
 
     return ret;
 }
 
 
-/** notifications **/
-
-xs_str *notify_check_time(snac *snac, int reset)
-/* gets or resets the latest notification check time */
+static void _qsched_add(const char *fn)
+/* tells the scheduler that a new queue file exists */
 {
-    xs_str *t = NULL;
-    xs *fn    = xs_fmt("%s/notifydate.txt", snac->basedir);
-    FILE *f;
+    pthread_mutex_lock(&qsched.mutex);
 
-    if (reset) {
-        if ((f = fopen(fn, "w")) != NULL) {
-            t = tid(0);
-            fprintf(f, "%s\n", t);
-            fclose(f);
-        }
+    if (qsched.active) {
+        _qsched_push(fn);
+        pthread_cond_signal(&qsched.cond);
     }
     else {
-        if ((f = fopen(fn, "r")) != NULL) {
-            t = xs_readline(f);
-            fclose(f);
+        /* not the server: touch the wake file */
+        xs *wfn = xs_fmt("%s/queue/.wake", srv_basedir);
+
+        if (utimes(wfn, NULL) == -1) {
+            FILE *f;
+
+            if ((f = fopen(wfn, "w")) != NULL)
+                fclose(f);
         }
-        else
-            /* never set before */
-            t = xs_fmt("%16.6f", 0.0);
     }
 
-    return t;
+    pthread_mutex_unlock(&qsched.mutex);
 }
 
 
-void notify_add(snac *snac, const char *type, const char *utype,
-                const char *actor, const char *objid)
-/* adds a new notification */
+void queue_sched_start(void)
+/* starts the queue scheduler (only to be called from the server) */
 {
-    xs *ntid = tid(0);
-    xs *fn   = xs_fmt("%s/notify/", snac->basedir);
-    xs *date = xs_str_utctime(0, ISO_DATE_SPEC);
-    FILE *f;
+    pthread_mutex_lock(&qsched.mutex);
 
-    /* create the directory */
-    mkdirx(fn);
-    fn = xs_str_cat(fn, ntid);
-    fn = xs_str_cat(fn, ".json");
+    qsched.active = 1;
+    _qsched_wake_changed();
+    _qsched_load();
 
-    xs *noti = xs_dict_new();
+    pthread_mutex_unlock(&qsched.mutex);
+}
 
-    noti = xs_dict_append(noti, "id",    ntid);
-    noti = xs_dict_append(noti, "type",  type);
-    noti = xs_dict_append(noti, "utype", utype);
-    noti = xs_dict_append(noti, "actor", actor);
-    noti = xs_dict_append(noti, "date",  date);
 
-    if (!xs_is_null(objid))
-        noti = xs_dict_append(noti, "objid", objid);
+void queue_sched_wake(void)
+/* wakes up whoever is waiting in queue_sched_wait() */
+{
+    pthread_mutex_lock(&qsched.mutex);
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(noti, 4, f);
-        fclose(f);
-    }
+    qsched.wakeup = 1;
+    pthread_cond_signal(&qsched.cond);
+
+    pthread_mutex_unlock(&qsched.mutex);
 }
 
 
-xs_dict *notify_get(snac *snac, const char *id)
-/* gets a notification */
+xs_list *queue_sched_wait(int max_secs)
+/* waits for queue items to be due (or max_secs or a queue_sched_wake())
+   and returns them as a list of [ uid, filename ] (uid is "" for the global queue) */
 {
-    xs *fn = xs_fmt("%s/notify/%s.json", snac->basedir, id);
-    FILE *f;
-    xs_dict *out = NULL;
+    xs_list *list = xs_list_new();
+    time_t end    = time(NULL) + (max_secs > 0 ? max_secs : 0);
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        out = xs_json_load(f);
-        fclose(f);
-    }
+    pthread_mutex_lock(&qsched.mutex);
 
-    return out;
-}
+    for (;;) {
+        time_t t = time(NULL);
 
+        if (_qsched_wake_changed())
+            _qsched_load();
 
-xs_list *notify_list(snac *snac, int new_only)
-/* returns a list of notification ids, optionally only the new ones */
-{
-    xs *t = NULL;
+        while (qsched.n && qsched.heap[0].due <= t) {
+            qsched_item e = _qsched_pop();
+            xs *l = xs_list_new();
 
-    /* if only new ones are requested, get the last time */
-    if (new_only)
-        t = notify_check_time(snac, 0);
+            l = xs_list_append(l, e.uid ? e.uid : "");
+            l = xs_list_append(l, e.fn);
 
-    xs *spec     = xs_fmt("%s/notify/" "*.json", snac->basedir);
-    xs *lst      = xs_glob(spec, 1, 1);
-    xs_list *out = xs_list_new();
-    xs_list *p   = lst;
-    xs_str *v;
+            list = xs_list_append(list, l);
 
-    while (xs_list_iter(&p, &v)) {
-        xs *id = xs_replace(v, ".json", "");
+            xs_free(e.uid);
+            xs_free(e.fn);
+        }
 
-        /* old? */
-        if (t != NULL && strcmp(id, t) < 0)
-            continue;
+        if (xs_list_len(list) || qsched.wakeup || t >= end)
+            break;
 
-        out = xs_list_append(out, id);
-    }
+        /* sleep until the next due item, but check the wake file from time to time */
+        struct timespec ts = { t + QSCHED_WAKE_SECS, 0 };
 
-    return out;
-}
+        if (end < ts.tv_sec)
+            ts.tv_sec = end;
 
+        if (qsched.n && qsched.heap[0].due < ts.tv_sec)
+            ts.tv_sec = qsched.heap[0].due;
 
-void notify_clear(snac *snac)
-/* clears all notifications */
-{
-    xs *spec   = xs_fmt("%s/notify/" "*", snac->basedir);
-    xs *lst    = xs_glob(spec, 0, 0);
-    xs_list *p = lst;
-    xs_str *v;
+        pthread_cond_timedwait(&qsched.cond, &qsched.mutex, &ts);
+    }
 
-    while (xs_list_iter(&p, &v))
-        unlink(v);
+    qsched.wakeup = 0;
+
+    pthread_mutex_unlock(&qsched.mutex);
+
+    return list;
 }
 
 
@@ -1982,6 +6392,8 @@ static xs_dict *_enqueue_put(const char *fn, xs_dict *msg)
         fclose(f);
 
         rename(tfn, fn);
+
+        _qsched_add(fn);
     }
 
     return msg;
@@ -1992,9 +6404,15 @@ static xs_dict *_new_qmsg(const char *type, const xs_val *msg, int retries)
 /* creates a queue message */
 {
     int qrt  = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
-    xs *ntid = tid(retries * 60 * qrt);
+    int secs = retries * 60 * qrt;
     xs *rn   = xs_number_new(retries);
 
+    /* output messages are retried exponentially, as their host may be down */
+    if (retries && strcmp(type, "output") == 0)
+        secs = backoff_secs(qrt * 60 * 2, retries);
+
+    xs *ntid = tid(secs);
+
     xs_dict *qmsg = xs_dict_new();
 
     qmsg = xs_dict_append(qmsg, "type",    type);
@@ -2006,6 +6424,122 @@ static xs_dict *_new_qmsg(const char *type, const xs_val *msg, int retries)
 }
 
 
+/* the bodies of output messages are stored only once in queue/payload/,
+   named after their md5, and referenced from the output queue items.
+   Payloads no longer referenced from any queue item are deleted by
+   the purge. A few of them are also kept in memory, as fan-outs read
+   the same one over and over */
+
+#define PAYLOAD_CACHE_SIZE 16
+
+static struct {
+    pthread_mutex_t mutex;
+    xs_list *md5s;              /* most recent first */
+    xs_dict *bodies;
+} payload_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+
+
+static void _payload_cache_put(const char *md5, const char *body)
+/* adds a payload to the memory cache */
+{
+    pthread_mutex_lock(&payload_cache.mutex);
+    xs_arena_pause();
+
+    if (payload_cache.md5s == NULL) {
+        payload_cache.md5s   = xs_list_new();
+        payload_cache.bodies = xs_dict_new();
+    }
+
+    if (xs_dict_get(payload_cache.bodies, md5) == NULL) {
+        payload_cache.md5s   = xs_list_insert(payload_cache.md5s, 0, md5);
+        payload_cache.bodies = xs_dict_append(payload_cache.bodies, md5, body);
+
+        /* drop the oldest */
+        if (xs_list_len(payload_cache.md5s) > PAYLOAD_CACHE_SIZE) {
+            xs *old = xs_dup(xs_list_get(payload_cache.md5s, -1));
+
+            payload_cache.md5s   = xs_list_del(payload_cache.md5s, -1);
+            payload_cache.bodies = xs_dict_del(payload_cache.bodies, old);
+        }
+    }
+
+    xs_arena_resume();
+    pthread_mutex_unlock(&payload_cache.mutex);
+}
+
+
+static xs_str *_payload_cache_get(const char *md5)
+/* gets a payload from the memory cache */
+{
+    xs_str *body = NULL;
+    const char *v;
+
+    pthread_mutex_lock(&payload_cache.mutex);
+
+    if (payload_cache.bodies && (v = xs_dict_get(payload_cache.bodies, md5)) != NULL)
+        body = xs_dup(v);
+
+    pthread_mutex_unlock(&payload_cache.mutex);
+
+    return body;
+}
+
+
+xs_str *queue_payload_put(const char *body)
+/* stores an output message body and returns its md5 */
+{
+    xs_str *md5 = xs_md5_hex(body, strlen(body));
+    xs *c_body  = _payload_cache_get(md5);
+    xs *fn      = xs_fmt("%s/queue/payload/%s.json", srv_basedir, md5);
+    double mt   = mtime(fn);
+
+    /* the file must exist even if it's cached, as the
+       queue item that will reference it may outlive us */
+    if (mt == 0.0) {
+        xs *tfn = xs_fmt("%s.tmp", fn);
+        FILE *f;
+
+        if ((f = fopen(tfn, "w")) != NULL) {
+            fwrite(body, strlen(body), 1, f);
+            fclose(f);
+
+            rename(tfn, fn);
+        }
+    }
+    else
+    if (mt < ftime() - 3600) {
+        /* refresh its date, so that the purge doesn't take it */
+        utimes(fn, NULL);
+    }
+
+    if (c_body == NULL)
+        _payload_cache_put(md5, body);
+
+    return md5;
+}
+
+
+xs_str *queue_payload_get(const char *md5)
+/* gets an output message body */
+{
+    xs_str *body = _payload_cache_get(md5);
+
+    if (body == NULL) {
+        xs *fn = xs_fmt("%s/queue/payload/%s.json", srv_basedir, md5);
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            body = xs_readall(f);
+            fclose(f);
+
+            _payload_cache_put(md5, body);
+        }
+    }
+
+    return body;
+}
+
+
 void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retries)
 /* enqueues an input message */
 {
@@ -2021,17 +6555,59 @@ void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retri
 }
 
 
-void enqueue_output_raw(const char *keyid, const char *seckey,
-                        xs_dict *msg, xs_str *inbox, int retries)
-/* enqueues an output message to an inbox */
+void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries)
+/* enqueues an input message from the shared inbox */
 {
-    xs *qmsg   = _new_qmsg("output", msg, retries);
+    xs *qmsg   = _new_qmsg("input", msg, retries);
+    char *ntid = xs_dict_get(qmsg, "ntid");
+    xs *fn     = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+
+    qmsg = xs_dict_append(qmsg, "req", req);
+
+    qmsg = _enqueue_put(fn, qmsg);
+
+    srv_debug(1, xs_fmt("enqueue_shared_input %s", fn));
+}
+
+
+void enqueue_output_raw(const char *keyid, const char *seckey,
+                        const xs_val *msg, const char *digest,
+                        xs_str *inbox, int retries)
+/* enqueues an output message to an inbox. The message is stored
+   serialized; if it already is, its digest can also be set */
+{
+    xs *body   = xs_type(msg) == XSTYPE_STRING ? xs_dup(msg) : xs_json_dumps(msg, 0);
+    xs *md5    = queue_payload_put(body);
+    xs *qmsg   = _new_qmsg("output", xs_stock_null, retries);
     char *ntid = xs_dict_get(qmsg, "ntid");
     xs *fn     = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+    snac user;
+
+    /* if the host is paused, don't retry before it's available */
+    time_t ht = host_retry_time(inbox);
+
+    if (retries && ht > atol(ntid)) {
+        xs *ntid2 = tid(ht - time(NULL) + random() % HOST_PROBE_SECS);
+
+        qmsg = xs_dict_set(qmsg, "ntid", ntid2);
+        fn   = xs_free(fn);
+        fn   = xs_fmt("%s/queue/%s.json", srv_basedir, ntid2);
+    }
+
+    /* the message and the key are stored as references */
+    qmsg = xs_dict_del(qmsg, "message");
+    qmsg = xs_dict_append(qmsg, "payload", md5);
+    qmsg = xs_dict_append(qmsg, "inbox",   inbox);
+    qmsg = xs_dict_append(qmsg, "keyid",   keyid);
+
+    /* the secret key is only needed if it's not from a local user */
+    if (user_open_by_actor(&user, keyid))
+        user_free(&user);
+    else
+        qmsg = xs_dict_append(qmsg, "seckey", seckey);
 
-    qmsg = xs_dict_append(qmsg, "inbox",  inbox);
-    qmsg = xs_dict_append(qmsg, "keyid",  keyid);
-    qmsg = xs_dict_append(qmsg, "seckey", seckey);
+    if (digest != NULL && xs_type(msg) == XSTYPE_STRING)
+        qmsg = xs_dict_append(qmsg, "digest", digest);
 
     /* if it's to be sent right now, bypass the disk queue and post the job */
     if (retries == 0 && job_fifo_ready())
@@ -2043,7 +6619,45 @@ void enqueue_output_raw(const char *keyid, const char *seckey,
 }
 
 
-void enqueue_output(snac *snac, xs_dict *msg, xs_str *inbox, int retries)
+void enqueue_output_requeue(const xs_dict *q_item, int secs)
+/* requeues an output message that was not even attempted (e.g. its host
+   is paused or the server is stopping), keeping its retry count; it's
+   not sent before secs or the time its host will be tried again */
+{
+    const xs_val *msg = xs_dict_get(q_item, "message");
+    const char *inbox = xs_dict_get(q_item, "inbox");
+    const char *keyid = xs_dict_get(q_item, "keyid");
+    xs *body = xs_type(msg) == XSTYPE_STRING ? xs_dup(msg) : xs_json_dumps(msg, 0);
+    xs *md5  = queue_payload_put(body);
+    time_t t = time(NULL);
+    time_t ht = host_retry_time(inbox);
+    xs *qmsg = xs_dup(q_item);
+    snac user;
+
+    if (ht > t + secs)
+        secs = ht - t + random() % HOST_PROBE_SECS;
+
+    xs *ntid = tid(secs);
+    xs *fn   = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+
+    qmsg = xs_dict_set(qmsg, "ntid",    ntid);
+    qmsg = xs_dict_del(qmsg, "message");
+    qmsg = xs_dict_set(qmsg, "payload", md5);
+
+    /* as in enqueue_output_raw(), the key of a local user is not stored */
+    if (user_open_by_actor(&user, keyid)) {
+        qmsg = xs_dict_del(qmsg, "seckey");
+        user_free(&user);
+    }
+
+    /* always to disk: the job queue may be stopping */
+    qmsg = _enqueue_put(fn, qmsg);
+    srv_debug(1, xs_fmt("enqueue_output_requeue %s %s", inbox, fn));
+}
+
+
+void enqueue_output(snac *snac, const xs_val *msg, const char *digest,
+                    xs_str *inbox, int retries)
 /* enqueues an output message to an inbox */
 {
     if (xs_startswith(inbox, snac->actor)) {
@@ -2053,7 +6667,7 @@ void enqueue_output(snac *snac, xs_dict *msg, xs_str *inbox, int retries)
 
     char *seckey = xs_dict_get(snac->key, "secret");
 
-    enqueue_output_raw(snac->actor, seckey, msg, inbox, retries);
+    enqueue_output_raw(snac->actor, seckey, msg, digest, inbox, retries);
 }
 
 
@@ -2063,7 +6677,7 @@ void enqueue_output_by_actor(snac *snac, xs_dict *msg, const xs_str *actor, int
     xs *inbox = get_actor_inbox(snac, actor);
 
     if (!xs_is_null(inbox))
-        enqueue_output(snac, msg, inbox, retries);
+        enqueue_output(snac, msg, NULL, inbox, retries);
     else
         snac_log(snac, xs_fmt("enqueue_output_by_actor cannot get inbox %s", actor));
 }
@@ -2248,15 +6862,8 @@ xs_list *queue(void)
 xs_dict *queue_get(const char *fn)
 /* gets a file from a queue */
 {
-    FILE *f;
-    xs_dict *obj = NULL;
-
-    if ((f = fopen(fn, "r")) != NULL) {
-        obj = xs_json_load(f);
-        fclose(f);
-    }
-
-    return obj;
+    /* queue files are always replaced, never rewritten */
+    return xs_json_load_file(fn);
 }
 
 
@@ -2320,6 +6927,81 @@ static void _purge_user_subdir(snac *snac, const char *subdir, int days)
 }
 
 
+static void _purge_user_cache(snac *snac, const char *cachedir, int days)
+/* purges all references in a user cache older than days */
+{
+    int cnt = 0;
+
+    if (days) {
+        time_t mt = time(NULL) - days * 24 * 3600;
+        xs *spec  = xs_fmt("%s/%s/" "*.json", snac->basedir, cachedir);
+        xs *list  = xs_glob(spec, 0, 0);
+        xs_list *p;
+        xs_str *v;
+
+        p = list;
+        while (xs_list_iter(&p, &v)) {
+            if (mtime(v) < mt) {
+                xs *l   = xs_split(v, "/");
+                xs *md5 = xs_replace(xs_list_get(l, -1), ".json", "");
+
+                /* older than the minimum time: drop the reference */
+                _object_unlink(md5, v);
+                srv_debug(2, xs_fmt("purged %s", v));
+                cnt++;
+            }
+        }
+
+        srv_debug(1, xs_fmt("purge: %s/%s %d", snac->basedir, cachedir, cnt));
+    }
+}
+
+
+static int _purge_payloads(void)
+/* purges the output payloads no longer referenced from the queue */
+{
+    xs *spec  = xs_fmt("%s/queue/" "*.json", srv_basedir);
+    xs *fns   = xs_glob(spec, 0, 0);
+    xs *spec2 = xs_fmt("%s/queue/payload/" "*.json", srv_basedir);
+    xs *pls   = xs_glob(spec2, 0, 0);
+    time_t mt = time(NULL) - 7 * 24 * 3600;
+    xs_set refs;
+    xs_list *p;
+    xs_str *v;
+    int cnt = 0;
+
+    xs_set_init(&refs);
+
+    p = fns;
+    while (xs_list_iter(&p, &v)) {
+        xs *q_item = queue_get(v);
+        const char *md5;
+
+        if (q_item && !xs_is_null(md5 = xs_dict_get(q_item, "payload")))
+            xs_set_add(&refs, md5);
+    }
+
+    /* payloads may be still referenced from items only held in memory
+       (in the job queue or being delivered), so only take the ones not
+       used for much longer than the maximum retry backoff; every use
+       refreshes their date */
+    p = pls;
+    while (xs_list_iter(&p, &v)) {
+        xs *md5 = xs_replace(strrchr(v, '/') + 1, ".json", "");
+
+        /* not already in the set? */
+        if (mtime(v) < mt && xs_set_add(&refs, md5) == 1) {
+            unlink(v);
+            cnt++;
+        }
+    }
+
+    xs_set_free(&refs);
+
+    return cnt;
+}
+
+
 void purge_server(void)
 /* purge global server data */
 {
@@ -2332,31 +7014,22 @@ void purge_server(void)
 
     time_t mt = time(NULL) - 7 * 24 * 3600;
 
+    {
+        /* old objects not referenced from any user cache */
+        xs *list = _pack_purge_list(mt);
+
+        p = list;
+        while (xs_list_iter(&p, &v)) {
+            object_del_by_md5(v);
+            cnt++;
+        }
+    }
+
     p = dirs;
     while (xs_list_iter(&p, &v)) {
         xs_list *p2;
         xs_str *v2;
 
-        {
-            xs *spec2 = xs_fmt("%s/" "*.json", v);
-            xs *files = xs_glob(spec2, 0, 0);
-
-            p2 = files;
-            while (xs_list_iter(&p2, &v2)) {
-                int n_link;
-
-                /* old and with no hard links? */
-                if (mtime_nl(v2, &n_link) < mt && n_link < 2) {
-                    xs *s1    = xs_replace(v2, ".json", "");
-                    xs *l     = xs_split(s1, "/");
-                    char *md5 = xs_list_get(l, -1);
-
-                    object_del_by_md5(md5);
-                    cnt++;
-                }
-            }
-        }
-
         {
             /* look for stray indexes */
             xs *speci = xs_fmt("%s/" "*_?.idx", v);
@@ -2367,14 +7040,14 @@ void purge_server(void)
                 /* old enough to consider? */
                 if (mtime(v2) < mt) {
                     /* check if the indexed object is here */
-                    xs *o = xs_dup(v2);
-                    char *ext = strchr(o, '_');
+                    xs *l     = xs_split(v2, "/");
+                    xs *md5   = xs_dup(xs_list_get(l, -1));
+                    char *ext = strchr(md5, '_');
 
                     if (ext) {
                         *ext = '\0';
-                        o = xs_str_cat(o, ".json");
 
-                        if (mtime(o) == 0.0) {
+                        if (!object_here_by_md5(md5)) {
                             /* delete */
                             unlink(v2);
                             srv_debug(1, xs_fmt("purged %s", v2));
@@ -2386,15 +7059,29 @@ void purge_server(void)
         }
     }
 
+    /* reclaim the space of the deleted objects */
+    int seg_cnt = object_pack_compact();
+
+    {
+        xs *stats = object_cache_stats();
+        xs *j     = xs_json_dumps(stats, 0);
+
+        srv_debug(1, xs_fmt("purge: object cache %s", j));
+    }
+
     /* purge collected inboxes */
     xs *ib_dir = xs_fmt("%s/inbox", srv_basedir);
     _purge_dir(ib_dir, 7);
 
+    /* purge unreferenced output payloads */
+    int pl_cnt = _purge_payloads();
+
     /* purge the instance timeline */
     xs *itl_fn = xs_fmt("%s/public.idx", srv_basedir);
     int itl_gc = index_gc(itl_fn);
 
-    srv_debug(1, xs_fmt("purge: global (obj: %d, idx: %d, itl: %d)", cnt, icnt, itl_gc));
+    srv_debug(1, xs_fmt("purge: global (obj: %d, idx: %d, seg: %d, itl: %d, pl: %d)",
+        cnt, icnt, seg_cnt, itl_gc, pl_cnt));
 }
 
 
@@ -2422,9 +7109,9 @@ void purge_user(snac *snac)
     }
 
     _purge_user_subdir(snac, "hidden",  priv_days);
-    _purge_user_subdir(snac, "private", priv_days);
+    _purge_user_cache(snac, "private", priv_days);
 
-    _purge_user_subdir(snac, "public",  pub_days);
+    _purge_user_cache(snac, "public",  pub_days);
 
     const char *idxs[] = { "followers.idx", "private.idx", "public.idx", "pinned.idx", NULL };
 
@@ -2433,6 +7120,15 @@ void purge_user(snac *snac)
         int gc = index_gc(idx);
         srv_debug(1, xs_fmt("purge: %s %d", idx, gc));
     }
+
+    n = tag_purge(snac);
+    srv_debug(1, xs_fmt("purge: %s/tag %d", snac->basedir, n));
+
+    n = search_purge(snac);
+    srv_debug(1, xs_fmt("purge: %s/search %d", snac->basedir, n));
+
+    n = root_purge(snac);
+    srv_debug(1, xs_fmt("purge: %s/roots %d", snac->basedir, n));
 }
 
 
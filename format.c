@@ -42,7 +42,7 @@ struct {
 static xs_str *format_line(const char *line, xs_list **attach)
 /* formats a line */
 {
-    xs_str *s = xs_str_new(NULL);
+    xs_sb b;
     char *p, *v;
 
     /* split by markup */
@@ -50,6 +50,8 @@ static xs_str *format_line(const char *line, xs_list **attach)
         "(`[^`]+`|\\*\\*?[^\\*]+\\*?\\*|https?:/" "/[^[:space:]]+)");
     int n = 0;
 
+    xs_sb_init(&b);
+
     p = sm;
     while (xs_list_iter(&p, &v)) {
         if ((n & 0x1)) {
@@ -57,20 +59,17 @@ static xs_str *format_line(const char *line, xs_list **attach)
             if (xs_startswith(v, "`")) {
                 xs *s1 = xs_crop_i(xs_dup(v), 1, -1);
                 xs *e1 = encode_html(s1);
-                xs *s2 = xs_fmt("<code>%s</code>", e1);
-                s = xs_str_cat(s, s2);
+                xs_sb_fmt(&b, "<code>%s</code>", e1);
             }
             else
             if (xs_startswith(v, "**")) {
                 xs *s1 = xs_crop_i(xs_dup(v), 2, -2);
-                xs *s2 = xs_fmt("<b>%s</b>", s1);
-                s = xs_str_cat(s, s2);
+                xs_sb_fmt(&b, "<b>%s</b>", s1);
             }
             else
             if (xs_startswith(v, "*")) {
                 xs *s1 = xs_crop_i(xs_dup(v), 1, -1);
-                xs *s2 = xs_fmt("<i>%s</i>", s1);
-                s = xs_str_cat(s, s2);
+                xs_sb_fmt(&b, "<i>%s</i>", s1);
             }
             else
             if (xs_startswith(v, "http")) {
@@ -91,28 +90,28 @@ static xs_str *format_line(const char *line, xs_list **attach)
                     *attach = xs_list_append(*attach, d);
                 }
                 else {
-                    xs *s1 = xs_fmt("<a href=\"%s\" target=\"_blank\">%s</a>", v2, u);
-                    s = xs_str_cat(s, s1);
+                    xs_sb_fmt(&b, "<a href=\"%s\" target=\"_blank\">%s</a>", v2, u);
                 }
             }
             else
-                s = xs_str_cat(s, v);
+                xs_sb_cat(&b, v);
         }
         else
             /* surrounded text, copy directly */
-            s = xs_str_cat(s, v);
+            xs_sb_cat(&b, v);
 
         n++;
     }
 
-    return s;
+    return xs_sb_result(&b);
 }
 
 
 xs_str *not_really_markdown(const char *content, xs_list **attach)
 /* formats a content using some Markdown rules */
 {
-    xs_str *s  = xs_str_new(NULL);
+    xs_str *s;
+    xs_sb b;
     int in_pre = 0;
     int in_blq = 0;
     xs *list;
@@ -121,15 +120,17 @@ xs_str *not_really_markdown(const char *content, xs_list **attach)
     /* work by lines */
     list = xs_split(content, "\n");
 
+    xs_sb_init(&b);
+
     p = list;
     while (xs_list_iter(&p, &v)) {
         xs *ss = NULL;
 
         if (strcmp(v, "```") == 0) {
             if (!in_pre)
-                s = xs_str_cat(s, "<pre>");
+                xs_sb_cat(&b, "<pre>");
             else
-                s = xs_str_cat(s, "</pre>");
+                xs_sb_cat(&b, "</pre>");
 
             in_pre = !in_pre;
             continue;
@@ -139,8 +140,8 @@ xs_str *not_really_markdown(const char *content, xs_list **attach)
             // Encode all HTML characters when we're in pre element until we are out.
             ss = encode_html(v);
 
-            s = xs_str_cat(s, ss);
-            s = xs_str_cat(s, "<br>");
+            xs_sb_cat(&b, ss);
+            xs_sb_cat(&b, "<br>");
             continue;
         }
 
@@ -150,9 +151,9 @@ xs_str *not_really_markdown(const char *content, xs_list **attach)
         if (xs_startswith(ss, "---")) {
             /* delete the --- */
             ss = xs_strip_i(xs_crop_i(ss, 3, 0));
-            s = xs_str_cat(s, "<hr>");
+            xs_sb_cat(&b, "<hr>");
 
-            s = xs_str_cat(s, ss);
+            xs_sb_cat(&b, ss);
 
             continue;
         }
@@ -162,29 +163,31 @@ xs_str *not_really_markdown(const char *content, xs_list **attach)
             ss = xs_strip_i(xs_crop_i(ss, 1, 0));
 
             if (!in_blq) {
-                s = xs_str_cat(s, "<blockquote>");
+                xs_sb_cat(&b, "<blockquote>");
                 in_blq = 1;
             }
 
-            s = xs_str_cat(s, ss);
-            s = xs_str_cat(s, "<br>");
+            xs_sb_cat(&b, ss);
+            xs_sb_cat(&b, "<br>");
 
             continue;
         }
 
         if (in_blq) {
-            s = xs_str_cat(s, "</blockquote>");
+            xs_sb_cat(&b, "</blockquote>");
             in_blq = 0;
         }
 
-        s = xs_str_cat(s, ss);
-        s = xs_str_cat(s, "<br>");
+        xs_sb_cat(&b, ss);
+        xs_sb_cat(&b, "<br>");
     }
 
     if (in_blq)
-        s = xs_str_cat(s, "</blockquote>");
+        xs_sb_cat(&b, "</blockquote>");
     if (in_pre)
-        s = xs_str_cat(s, "</pre>");
+        xs_sb_cat(&b, "</pre>");
+
+    s = xs_sb_result(&b);
 
     /* some beauty fixes */
     s = xs_replace_i(s, "<br><br><blockquote>", "<br><blockquote>");
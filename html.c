@@ -9,9 +9,12 @@
 #include "xs_openssl.h"
 #include "xs_time.h"
 #include "xs_mime.h"
+#include "xs_httpd.h"
 
 #include "snac.h"
 
+#include <pthread.h>
+
 int login(snac *snac, const xs_dict *headers)
 /* tries a login */
 {
@@ -90,11 +93,9 @@ xs_str *actor_name(xs_dict *actor)
 }
 
 
-xs_str *html_actor_icon(xs_str *os, char *actor,
+void html_actor_icon(xs_sb *b, char *actor,
     const char *date, const char *udate, const char *url, int priv)
 {
-    xs *s = xs_str_new(NULL);
-
     xs *avatar = NULL;
     char *v;
 
@@ -112,28 +113,28 @@ xs_str *html_actor_icon(xs_str *os, char *actor,
     {
         xs *s1 = xs_fmt("<p><img class=\"snac-avatar\" src=\"%s\" alt=\"\" "
                         "loading=\"lazy\"/>\n", avatar);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     {
         xs *s1 = xs_fmt("<a href=\"%s\" class=\"p-author h-card snac-author\">%s</a>",
             xs_dict_get(actor, "id"), name);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     if (!xs_is_null(url)) {
         xs *s1 = xs_fmt(" <a href=\"%s\">»</a>", url);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     if (priv)
-        s = xs_str_cat(s, " <span title=\"private\">&#128274;</span>");
+        xs_sb_cat(b, " <span title=\"private\">&#128274;</span>");
 
     if (strcmp(xs_dict_get(actor, "type"), "Service") == 0)
-        s = xs_str_cat(s, " <span title=\"bot\">&#129302;</span>");
+        xs_sb_cat(b, " <span title=\"bot\">&#129302;</span>");
 
     if (xs_is_null(date)) {
-        s = xs_str_cat(s, "\n&nbsp;\n");
+        xs_sb_cat(b, "\n&nbsp;\n");
     }
     else {
         xs *date_label = xs_crop_i(xs_dup(date), 0, 10);
@@ -155,7 +156,7 @@ xs_str *html_actor_icon(xs_str *os, char *actor,
             "\n<time class=\"dt-published snac-pubdate\" title=\"%s\">%s</time>\n",
                 edt, edl);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     {
@@ -181,14 +182,12 @@ xs_str *html_actor_icon(xs_str *os, char *actor,
             "<br><a href=\"%s\" class=\"p-author-tag h-card snac-author-tag\">%s</a>",
                 xs_dict_get(actor, "id"), u1);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
-
-    return xs_str_cat(os, s);
 }
 
 
-xs_str *html_msg_icon(xs_str *os, const xs_dict *msg)
+void html_msg_icon(xs_sb *b, const xs_dict *msg)
 {
     char *actor_id;
     xs *actor = NULL;
@@ -211,38 +210,34 @@ xs_str *html_msg_icon(xs_str *os, const xs_dict *msg)
         date  = xs_dict_get(msg, "published");
         udate = xs_dict_get(msg, "updated");
 
-        os = html_actor_icon(os, actor, date, udate, url, priv);
+        html_actor_icon(b, actor, date, udate, url, priv);
     }
-
-    return os;
 }
 
 
-xs_str *html_base_header(xs_str *s)
+void html_base_header(xs_sb *b)
 {
     xs_list *p;
     xs_str *v;
 
-    s = xs_str_cat(s, "<!DOCTYPE html>\n<html>\n<head>\n");
-    s = xs_str_cat(s, "<meta name=\"viewport\" "
-                      "content=\"width=device-width, initial-scale=1\"/>\n");
-    s = xs_str_cat(s, "<meta name=\"generator\" "
-                      "content=\"" USER_AGENT "\"/>\n");
+    xs_sb_cat(b, "<!DOCTYPE html>\n<html>\n<head>\n");
+    xs_sb_cat(b, "<meta name=\"viewport\" "
+                 "content=\"width=device-width, initial-scale=1\"/>\n");
+    xs_sb_cat(b, "<meta name=\"generator\" "
+                 "content=\"" USER_AGENT "\"/>\n");
 
     /* add server CSS */
     p = xs_dict_get(srv_config, "cssurls");
     while (xs_list_iter(&p, &v)) {
         xs *s1 = xs_fmt("<link rel=\"stylesheet\" type=\"text/css\" href=\"%s\"/>\n", v);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
-
-    return s;
 }
 
 
-xs_str *html_instance_header(xs_str *s)
+void html_instance_header(xs_sb *b)
 {
-    s = html_base_header(s);
+    html_base_header(b);
 
     {
         FILE *f;
@@ -253,7 +248,7 @@ xs_str *html_instance_header(xs_str *s)
             fclose(f);
 
             xs *s1 = xs_fmt("<style>%s</style>\n", css);
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(b, s1);
         }
     }
 
@@ -265,57 +260,55 @@ xs_str *html_instance_header(xs_str *s)
 
     {
         xs *s1 = xs_fmt("<title>%s</title>\n", title && *title ? title : host);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "</head>\n<body>\n");
+    xs_sb_cat(b, "</head>\n<body>\n");
 
-    s = xs_str_cat(s, "<div class=\"snac-instance-blurb\">\n");
+    xs_sb_cat(b, "<div class=\"snac-instance-blurb\">\n");
 
     {
         xs *s1 = xs_replace(snac_blurb, "%host%", host);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "<dl>\n");
+    xs_sb_cat(b, "<dl>\n");
 
     if (sdesc && *sdesc) {
         xs *s1 = xs_fmt("<di><dt>%s</dt><dd>%s</dd></di>\n", L("Site description"), sdesc);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
     if (email && *email) {
         xs *s1 = xs_fmt("<di><dt>%s</dt><dd>"
                 "<a href=\"mailto:%s\">%s</a></dd></di>\n",
                 L("Admin email"), email, email);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
     if (acct && *acct) {
         xs *s1 = xs_fmt("<di><dt>%s</dt><dd>"
                 "<a href=\"%s/%s\">@%s@%s</a></dd></di>\n",
                 L("Admin account"), srv_baseurl, acct, acct, host);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "</dl>\n");
+    xs_sb_cat(b, "</dl>\n");
 
-    s = xs_str_cat(s, "</div>\n");
+    xs_sb_cat(b, "</div>\n");
 
     {
         xs *s1 = xs_fmt("<h2 class=\"snac-header\">%s</h2>\n",
             L("Recent posts by users in this instance"));
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
-
-    return s;
 }
 
 
-xs_str *html_user_header(snac *snac, xs_str *s, int local)
+void html_user_header(snac *snac, xs_sb *b, int local)
 /* creates the HTML header */
 {
-    s = html_base_header(s);
+    html_base_header(b);
 
     /* add the user CSS */
     {
@@ -336,7 +329,7 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
 
         if (css != NULL) {
             xs *s1 = xs_fmt("<style>%s</style>\n", css);
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(b, s1);
         }
     }
 
@@ -346,7 +339,7 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
         xs *es3 = encode_html(xs_dict_get(srv_config,   "host"));
         xs *s1 = xs_fmt("<title>%s (@%s@%s)</title>\n", es1, es2, es3);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     xs *avatar = xs_dup(xs_dict_get(snac->config, "avatar"));
@@ -389,26 +382,26 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
             "<meta property=\"og:image:width\" content=\"300\"/>\n"
             "<meta property=\"og:image:height\" content=\"300\"/>\n",
             es1, es2, es3, es4, es5, es6);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     {
         xs *s1 = xs_fmt("<link rel=\"alternate\" type=\"application/rss+xml\" "
                         "title=\"RSS\" href=\"%s.rss\" />\n", snac->actor); /* snac->actor is likely need to be URLEncoded. */
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "</head>\n<body>\n");
+    xs_sb_cat(b, "</head>\n<body>\n");
 
     /* top nav */
-    s = xs_str_cat(s, "<nav class=\"snac-top-nav\">");
+    xs_sb_cat(b, "<nav class=\"snac-top-nav\">");
 
     {
         xs *s1;
 
         s1 = xs_fmt("<img src=\"%s\" class=\"snac-avatar\" alt=\"\"/>&nbsp;", avatar);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     {
@@ -443,12 +436,12 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
                 snac->actor, L("people"));
         }
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     /* user info */
     {
-        s = xs_str_cat(s, "<div class=\"h-card snac-top-user\">\n");
+        xs_sb_cat(b, "<div class=\"h-card snac-top-user\">\n");
 
         if (local) {
             const char *header = xs_dict_get(snac->config, "header");
@@ -456,7 +449,7 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
                 xs *h = encode_html(header);
                 xs *s1 = xs_fmt("<div class=\"snac-top-user-banner\" style=\"clear: both\">"
                     "<br><img src=\"%s\"/></div>\n", h);
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(b, s1);
             }
         }
 
@@ -470,7 +463,7 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
 
         xs *s1 = xs_fmt(_tmpl, es1, es2, es3);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
 
         if (local) {
             xs *es1  = encode_html(xs_dict_get(snac->config, "bio"));
@@ -479,17 +472,15 @@ xs_str *html_user_header(snac *snac, xs_str *s, int local)
             xs *bio2 = process_tags(snac, bio1, &tags);
             xs *s1   = xs_fmt("<div class=\"p-note snac-top-user-bio\">%s</div>\n", bio2);
 
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(b, s1);
         }
 
-        s = xs_str_cat(s, "</div>\n");
+        xs_sb_cat(b, "</div>\n");
     }
-
-    return s;
 }
 
 
-xs_str *html_top_controls(snac *snac, xs_str *s)
+void html_top_controls(snac *snac, xs_sb *b)
 /* generates the top controls */
 {
     char *_tmpl =
@@ -544,6 +535,11 @@ xs_str *html_top_controls(snac *snac, xs_str *s)
         "<input type=\"text\" name=\"id\" required=\"required\" placeholder=\"https://fedi.example.com/bob/...\">\n"
         "<input type=\"submit\" name=\"action\" value=\"%s\"> %s\n"
         "</form><p>\n"
+
+        "<form autocomplete=\"off\" method=\"get\" action=\"%s/admin\">\n" /** search **/
+        "<input type=\"text\" name=\"q\" required=\"required\" placeholder=\"word &quot;a phrase&quot; prefix* #tag\">\n"
+        "<input type=\"submit\" value=\"%s\"> %s\n"
+        "</form><p>\n"
         "</details>\n"
 
         "<details><summary>%s</summary>\n"
@@ -664,6 +660,9 @@ xs_str *html_top_controls(snac *snac, xs_str *s)
         snac->actor,
         L("Boost"), L("(by URL)"),
 
+        snac->actor,
+        L("Search"), L("(in your timeline)"),
+
         L("User Settings..."),
         snac->actor,
         L("Display name"),
@@ -690,20 +689,16 @@ xs_str *html_top_controls(snac *snac, xs_str *s)
         L("Update user info")
     );
 
-    s = xs_str_cat(s, s1);
-
-    return s;
+    xs_sb_cat(b, s1);
 }
 
 
-xs_str *html_button(xs_str *s, const char *clss, const char *label, const char *hint)
+void html_button(xs_sb *b, const char *clss, const char *label, const char *hint)
 {
-    xs *s1 = xs_fmt(
+    xs_sb_fmt(b,
                "<input type=\"submit\" name=\"action\" "
                "class=\"snac-btn-%s\" value=\"%s\" title=\"%s\">\n",
                 clss, label, hint);
-
-    return xs_str_cat(s, s1);
 }
 
 
@@ -757,16 +752,14 @@ xs_str *build_mentions(snac *snac, const xs_dict *msg)
 }
 
 
-xs_str *html_entry_controls(snac *snac, xs_str *os, const xs_dict *msg, const char *md5)
+void html_entry_controls(snac *snac, xs_sb *b, const xs_dict *msg, const char *md5)
 {
     char *id    = xs_dict_get(msg, "id");
     char *actor = xs_dict_get(msg, "attributedTo");
     xs *likes   = object_likes(id);
     xs *boosts  = object_announces(id);
 
-    xs *s   = xs_str_new(NULL);
-
-    s = xs_str_cat(s, "<div class=\"snac-controls\">\n");
+    xs_sb_cat(b, "<div class=\"snac-controls\">\n");
 
     {
         xs *s1 = xs_fmt(
@@ -779,46 +772,46 @@ xs_str *html_entry_controls(snac *snac, xs_str *os, const xs_dict *msg, const ch
             snac->actor, id, actor, md5
         );
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     if (!xs_startswith(id, snac->actor)) {
         if (xs_list_in(likes, snac->md5) == -1) {
             /* not already liked; add button */
-            s = html_button(s, "like", L("Like"), L("Say you like this post"));
+            html_button(b, "like", L("Like"), L("Say you like this post"));
         }
     }
     else {
         if (is_pinned(snac, id))
-            s = html_button(s, "unpin", L("Unpin"), L("Unpin this post from your timeline"));
+            html_button(b, "unpin", L("Unpin"), L("Unpin this post from your timeline"));
         else
-            s = html_button(s, "pin", L("Pin"), L("Pin this post to the top of your timeline"));
+            html_button(b, "pin", L("Pin"), L("Pin this post to the top of your timeline"));
     }
 
     if (is_msg_public(msg)) {
         if (strcmp(actor, snac->actor) == 0 || xs_list_in(boosts, snac->md5) == -1) {
             /* not already boosted or us; add button */
-            s = html_button(s, "boost", L("Boost"), L("Announce this post to your followers"));
+            html_button(b, "boost", L("Boost"), L("Announce this post to your followers"));
         }
     }
 
     if (strcmp(actor, snac->actor) != 0) {
         /* controls for other actors than this one */
         if (following_check(snac, actor)) {
-            s = html_button(s, "unfollow", L("Unfollow"), L("Stop following this user's activity"));
+            html_button(b, "unfollow", L("Unfollow"), L("Stop following this user's activity"));
         }
         else {
-            s = html_button(s, "follow", L("Follow"), L("Start following this user's activity"));
+            html_button(b, "follow", L("Follow"), L("Start following this user's activity"));
         }
 
-        s = html_button(s, "mute", L("MUTE"),
+        html_button(b, "mute", L("MUTE"),
             L("Block any activity from this user forever"));
     }
 
-    s = html_button(s, "delete", L("Delete"), L("Delete this post"));
-    s = html_button(s, "hide",   L("Hide"), L("Hide this post and its children"));
+    html_button(b, "delete", L("Delete"), L("Delete this post"));
+    html_button(b, "hide",   L("Hide"), L("Hide this post and its children"));
 
-    s = xs_str_cat(s, "</form>\n");
+    xs_sb_cat(b, "</form>\n");
 
     const char *prev_src1 = xs_dict_get(msg, "sourceContent");
 
@@ -869,7 +862,7 @@ xs_str *html_entry_controls(snac *snac, xs_str *os, const xs_dict *msg, const ch
             L("Post")
         );
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     { /** reply **/
@@ -920,101 +913,291 @@ xs_str *html_entry_controls(snac *snac, xs_str *os, const xs_dict *msg, const ch
             L("Post")
         );
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "</div>\n");
+    xs_sb_cat(b, "</div>\n");
+}
+
+
+/** entry cache **/
+
+/* the rendering of each entry (the header and the content, but not the
+   controls nor the children) is kept in memory, keyed by a hash of
+   everything it depends on, so that rebuilding a timeline after a new
+   post arrives only renders the entries that are new or have changed */
+
+#define HCACHE_BUCKETS 4096
+
+typedef struct _hcache_entry {
+    char key[33];
+    xs_str *html;
+    int size;
+    struct _hcache_entry *prev;     /* LRU list */
+    struct _hcache_entry *next;
+    struct _hcache_entry *hnext;    /* hash bucket chain */
+} hcache_entry;
 
-    return xs_str_cat(os, s);
+static pthread_mutex_t hcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hcache_once   = PTHREAD_ONCE_INIT;
+static hcache_entry *hcache[HCACHE_BUCKETS];
+static hcache_entry *hcache_head = NULL;    /* most recently used */
+static hcache_entry *hcache_tail = NULL;    /* least recently used */
+static long hcache_size = 0;
+static long hcache_max  = 0;                /* byte budget */
+
+
+static void _hcache_init(void)
+/* initializes the entry cache */
+{
+    const xs_number *v = xs_dict_get(srv_config, "html_cache_mb");
+    double mb = 16.0;
+
+    if (xs_type(v) == XSTYPE_NUMBER)
+        mb = xs_number_get(v);
+
+    hcache_max = (long) (mb * 1024 * 1024);
 }
 
 
-xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
-                   int level, const char *md5, int hide_children)
+static int _hcache_bucket(const char *key)
+/* returns the bucket of a key (it's already a hash) */
 {
-    char *id    = xs_dict_get(msg, "id");
-    char *type  = xs_dict_get(msg, "type");
-    char *actor;
-    int sensitive = 0;
-    char *v;
-    xs *boosts = NULL;
+    unsigned int h = 0;
+    int n;
 
-    /* do not show non-public messages in the public timeline */
-    if ((local || !user) && !is_msg_public(msg))
-        return os;
+    for (n = 0; n < 3 && key[n]; n++) {
+        int c = key[n];
+        h = h << 4 | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
 
-    /* hidden? do nothing more for this conversation */
-    if (user && is_hidden(user, id))
-        return os;
+    return h % HCACHE_BUCKETS;
+}
 
-    /* avoid too deep nesting, as it may be a loop */
-    if (level >= 256)
-        return os;
 
-    xs *s = xs_str_new("<div>\n");
+static hcache_entry *_hcache_unlink(int bucket, const char *key)
+/* detaches an entry from the cache (must be locked) */
+{
+    hcache_entry **pe = &hcache[bucket];
+    hcache_entry *e;
 
-    {
-        xs *s1 = xs_fmt("<a name=\"%s_entry\"></a>\n", md5);
+    while ((e = *pe) != NULL && strcmp(e->key, key) != 0)
+        pe = &e->hnext;
+
+    if (e != NULL) {
+        *pe = e->hnext;
+
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            hcache_head = e->next;
+
+        if (e->next)
+            e->next->prev = e->prev;
+        else
+            hcache_tail = e->prev;
 
-        s = xs_str_cat(s, s1);
+        hcache_size -= e->size;
     }
 
-    if (strcmp(type, "Follow") == 0) {
-        s = xs_str_cat(s, "<div class=\"snac-post\">\n<div class=\"snac-post-header\">\n");
+    return e;
+}
 
-        xs *s1 = xs_fmt("<div class=\"snac-origin\">%s</div>\n", L("follows you"));
-        s = xs_str_cat(s, s1);
 
-        s = html_msg_icon(s, msg);
+static void _hcache_link(int bucket, hcache_entry *e)
+/* attaches an entry as the most recently used (must be locked) */
+{
+    e->hnext = hcache[bucket];
+    hcache[bucket] = e;
 
-        s = xs_str_cat(s, "</div>\n</div>\n");
+    e->prev = NULL;
+    e->next = hcache_head;
 
-        return xs_str_cat(os, s);
-    }
+    if (hcache_head)
+        hcache_head->prev = e;
     else
-    if (strcmp(type, "Note") != 0 && strcmp(type, "Question") != 0 && strcmp(type, "Page") != 0) {
-        /* skip oddities */
-        return os;
+        hcache_tail = e;
+
+    hcache_head  = e;
+    hcache_size += e->size;
+}
+
+
+static void _hcache_free(hcache_entry *e)
+{
+    if (e != NULL) {
+        xs_free(e->html);
+        free(e);
     }
+}
 
-    /* ignore notes with "name", as they are votes to Questions */
-    if (strcmp(type, "Note") == 0 && !xs_is_null(xs_dict_get(msg, "name")))
-        return os;
 
-    /* bring the main actor */
-    if ((actor = xs_dict_get(msg, "attributedTo")) == NULL)
-        return os;
+static xs_str *hcache_get(const char *key)
+/* returns a copy of a cached entry, or NULL */
+{
+    int b = _hcache_bucket(key);
+    hcache_entry *e;
+    xs_str *html = NULL;
 
-    /* ignore muted morons immediately */
-    if (user && is_muted(user, actor))
-        return os;
+    pthread_mutex_lock(&hcache_mutex);
 
-    if ((user == NULL || strcmp(actor, user->actor) != 0)
-        && !valid_status(actor_get(actor, NULL)))
-        return os;
+    if ((e = _hcache_unlink(b, key)) != NULL) {
+        html = xs_dup(e->html);
+        _hcache_link(b, e);
+    }
 
-    if (level == 0)
-        s = xs_str_cat(s, "<div class=\"snac-post\">\n"); /** **/
-    else
-        s = xs_str_cat(s, "<div class=\"snac-child\">\n"); /** **/
+    pthread_mutex_unlock(&hcache_mutex);
+
+    return html;
+}
+
+
+static void hcache_put(const char *key, const char *html, int size)
+/* stores the rendering of an entry */
+{
+    int b = _hcache_bucket(key);
+    hcache_entry *e;
+
+    size += sizeof(hcache_entry);
 
-    s = xs_str_cat(s, "<div class=\"snac-post-header\">\n<div class=\"snac-score\">"); /** **/
+    if (size > hcache_max || (e = calloc(1, sizeof(*e))) == NULL)
+        return;
+
+    strncpy(e->key, key, sizeof(e->key) - 1);
+    e->size = size;
+
+    /* it outlives the request */
+    xs_arena_pause();
+    e->html = xs_str_new(html);
+    xs_arena_resume();
+
+    pthread_mutex_lock(&hcache_mutex);
+
+    /* another thread may have rendered it at the same time */
+    _hcache_free(_hcache_unlink(b, key));
+
+    /* make room */
+    while (hcache_tail && hcache_size + size > hcache_max) {
+        hcache_entry *t = hcache_tail;
+
+        _hcache_free(_hcache_unlink(_hcache_bucket(t->key), t->key));
+    }
+
+    _hcache_link(b, e);
+
+    pthread_mutex_unlock(&hcache_mutex);
+}
+
+
+static xs_str *html_actor_stamp(const char *actor)
+/* returns a string that changes whenever an actor does */
+{
+    if (xs_startswith(actor, srv_baseurl)) {
+        /* local actors are built from the user configuration */
+        xs *l  = xs_split(actor, "/");
+        xs *fn = xs_fmt("%s/user/%s/user.json", srv_basedir, xs_list_get(l, -1));
+
+        return xs_fmt("%.0f", mtime(fn));
+    }
+    else {
+        xs *md5   = xs_md5_hex(actor, strlen(actor));
+        xs_str *s = object_stamp_by_md5(md5);
+
+        return s ? s : xs_str_new(NULL);
+    }
+}
+
+
+static xs_str *html_entry_key(snac *user, const xs_dict *msg, xs_dict_index *mi,
+                              int local, int level)
+/* returns the key of the cached rendering of an entry, or NULL */
+{
+    const char *id    = xs_dict_get(msg, "id");
+    const char *type  = xs_dict_index_get(mi, "type");
+    const char *actor = xs_dict_index_get(mi, "attributedTo");
+    int pinned = 0;
+    int here   = 1;
+
+    pthread_once(&hcache_once, _hcache_init);
+
+    if (hcache_max <= 0)
+        return NULL;
+
+    /* polls show the time left */
+    if (strcmp(type, "Question") == 0)
+        return NULL;
+
+    xs *md5     = xs_md5_hex(id, strlen(id));
+    xs *o_stamp = object_stamp_by_md5(md5);
+
+    if (o_stamp == NULL)
+        return NULL;
+
+    xs *a_stamp = html_actor_stamp(actor);
+    const char *cw   = "";
+    const char *name = "";
+
+    if (user) {
+        pinned = is_pinned(user, id);
+
+        if (strcmp(type, "Note") == 0 && level == 0) {
+            const char *parent = xs_dict_index_get(mi, "inReplyTo");
+
+            if (!xs_is_null(parent) && *parent)
+                here = timeline_here(user, parent);
+        }
+
+        if (xs_type(xs_dict_get(user->config, "cw")) == XSTYPE_STRING)
+            cw = xs_dict_get(user->config, "cw");
+        if (xs_type(xs_dict_get(user->config, "name")) == XSTYPE_STRING)
+            name = xs_dict_get(user->config, "name");
+    }
+
+    /* the buttons and the "boosted" header depend on who
+       liked or announced it, not only on how many did */
+    xs *likes   = object_likes(id);
+    xs *boosts  = object_announces(id);
+    xs *l_likes = xs_join(likes, ",");
+    xs *l_boost = xs_join(boosts, ",");
+    xs *h_likes = xs_md5_hex(l_likes, strlen(l_likes));
+    xs *h_boost = xs_md5_hex(l_boost, strlen(l_boost));
+
+    xs *k = xs_fmt("%s|%d|%d|%s|%s|%s|%s|%s|%d|%d|%s|%s",
+        user ? user->uid : "", local, level == 0, md5, o_stamp, a_stamp,
+        h_likes, h_boost, pinned, here, cw, name);
+
+    return xs_md5_hex(k, strlen(k));
+}
+
+
+static void html_entry_body(snac *user, xs_sb *b, const xs_dict *msg,
+                            xs_dict_index *mi, int local, int level)
+/* renders the header and the content of an entry */
+{
+    char *id    = xs_dict_get(msg, "id");
+    char *type  = xs_dict_get(msg, "type");
+    char *actor = xs_dict_get(msg, "attributedTo");
+    int sensitive = 0;
+    char *v;
+    xs *boosts = NULL;
+
+    xs_sb_cat(b, "<div class=\"snac-post-header\">\n<div class=\"snac-score\">"); /** **/
 
     if (user && is_pinned(user, id)) {
         /* add a pin emoji */
         xs *f = xs_fmt("<span title=\"%s\"> &#128204; </span>", L("Pinned"));
-        s = xs_str_cat(s, f);
+        xs_sb_cat(b, f);
     }
 
     if (strcmp(type, "Question") == 0) {
         /* add the ballot box emoji */
         xs *f = xs_fmt("<span title=\"%s\"> &#128499; </span>", L("Poll"));
-        s = xs_str_cat(s, f);
+        xs_sb_cat(b, f);
 
         if (user && was_question_voted(user, id)) {
             /* add a check to show this poll was voted */
             xs *f2 = xs_fmt("<span title=\"%s\"> &#10003; </span>", L("Voted"));
-            s = xs_str_cat(s, f2);
+            xs_sb_cat(b, f2);
         }
     }
 
@@ -1027,10 +1210,10 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
 
         xs *s1 = xs_fmt("%d &#9733; %d &#8634;\n", n_likes, n_boosts);
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
-    s = xs_str_cat(s, "</div>\n");
+    xs_sb_cat(b, "</div>\n");
 
     if (boosts == NULL)
         boosts = object_announces(id);
@@ -1049,7 +1232,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
                 user->actor, es1, L("boosted")
             );
 
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(b, s1);
         }
         else
         if (valid_status(object_get_by_md5(p, &actor_r))) {
@@ -1064,7 +1247,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
                     L("boosted")
                 );
 
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(b, s1);
             }
         }
     }
@@ -1072,7 +1255,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
     if (strcmp(type, "Note") == 0) {
         if (level == 0) {
             /* is the parent not here? */
-            char *parent = xs_dict_get(msg, "inReplyTo");
+            char *parent = xs_dict_index_get(mi, "inReplyTo");
 
             if (user && !xs_is_null(parent) && *parent && !timeline_here(user, parent)) {
                 xs *s1 = xs_fmt(
@@ -1081,25 +1264,25 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
                     L("in reply to"), parent
                 );
 
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(b, s1);
             }
         }
     }
 
-    s = html_msg_icon(s, msg);
+    html_msg_icon(b, msg);
 
     /* add the content */
-    s = xs_str_cat(s, "</div>\n<div class=\"e-content snac-content\">\n"); /** **/
+    xs_sb_cat(b, "</div>\n<div class=\"e-content snac-content\">\n"); /** **/
 
-    if (!xs_is_null(v = xs_dict_get(msg, "name"))) {
+    if (!xs_is_null(v = xs_dict_index_get(mi, "name"))) {
         xs *es1 = encode_html(v);
         xs *s1  = xs_fmt("<h3 class=\"snac-entry-title\">%s</h3>\n", es1);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     /* is it sensitive? */
-    if (user && xs_type(xs_dict_get(msg, "sensitive")) == XSTYPE_TRUE) {
-        if (xs_is_null(v = xs_dict_get(msg, "summary")) || *v == '\0')
+    if (user && xs_type(xs_dict_index_get(mi, "sensitive")) == XSTYPE_TRUE) {
+        if (xs_is_null(v = xs_dict_index_get(mi, "summary")) || *v == '\0')
             v = "...";
         /* only show it when not in the public timeline and the config setting is "open" */
         char *cw = xs_dict_get(user->config, "cw");
@@ -1107,7 +1290,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             cw = "";
         xs *es1 = encode_html(v);
         xs *s1 = xs_fmt("<details %s><summary>%s [%s]</summary>\n", cw, es1, L("SENSITIVE CONTENT"));
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
         sensitive = 1;
     }
 
@@ -1115,12 +1298,12 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
     {
         xs *md5 = xs_md5_hex(id, strlen(id));
         xs *s1  = xs_fmt("<p><code>%s</code></p>\n", md5);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 #endif
 
     {
-        const char *content = xs_dict_get(msg, "content");
+        const char *content = xs_dict_index_get(mi, "content");
 
         xs *c  = sanitize(xs_is_null(content) ? "" : content);
         char *p, *v;
@@ -1139,7 +1322,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
         }
 
         /* replace the :shortnames: */
-        if (!xs_is_null(p = xs_dict_get(msg, "tag"))) {
+        if (!xs_is_null(p = xs_dict_index_get(mi, "tag"))) {
             xs *tag = NULL;
             if (xs_type(p) == XSTYPE_DICT) {
                 /* not a list */
@@ -1172,13 +1355,13 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
         }
 
         if (strcmp(type, "Question") == 0) { /** question content **/
-            xs_list *oo = xs_dict_get(msg, "oneOf");
-            xs_list *ao = xs_dict_get(msg, "anyOf");
+            xs_list *oo = xs_dict_index_get(mi, "oneOf");
+            xs_list *ao = xs_dict_index_get(mi, "anyOf");
             xs_list *p;
             xs_dict *v;
             int closed = 0;
 
-            if (xs_dict_get(msg, "closed"))
+            if (xs_dict_index_get(mi, "closed"))
                 closed = 2;
             else
             if (user && xs_startswith(id, user->actor))
@@ -1247,7 +1430,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             }
             else {
                 /* show when the poll closes */
-                const char *end_time = xs_dict_get(msg, "endTime");
+                const char *end_time = xs_dict_index_get(mi, "endTime");
                 if (!xs_is_null(end_time)) {
                     time_t t0 = time(NULL);
                     time_t t1 = xs_parse_iso_date(end_time, 0);
@@ -1268,13 +1451,13 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             }
         }
 
-        s = xs_str_cat(s, c);
+        xs_sb_cat(b, c);
     }
 
-    s = xs_str_cat(s, "\n");
+    xs_sb_cat(b, "\n");
 
     /* add the attachments */
-    v = xs_dict_get(msg, "attachment");
+    v = xs_dict_index_get(mi, "attachment");
 
     if (!xs_is_null(v)) { /** attachments **/
         xs *attach = NULL;
@@ -1288,13 +1471,13 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             attach = xs_dup(v);
 
         /* does the message have an image? */
-        if (xs_type(v = xs_dict_get(msg, "image")) == XSTYPE_DICT) {
+        if (xs_type(v = xs_dict_index_get(mi, "image")) == XSTYPE_DICT) {
             /* add it to the attachment list */
             attach = xs_list_append(attach, v);
         }
 
         /* make custom css for attachments easier */
-        s = xs_str_cat(s, "<div class=\"snac-content-attachments\">\n");
+        xs_sb_cat(b, "<div class=\"snac-content-attachments\">\n");
 
         xs_list *p = attach;
 
@@ -1315,7 +1498,7 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
 
             const char *name = xs_dict_get(v, "name");
             if (xs_is_null(name))
-                name = xs_dict_get(msg, "name");
+                name = xs_dict_index_get(mi, "name");
             if (xs_is_null(name))
                 name = L("No description");
 
@@ -1350,30 +1533,117 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             }
 
             if (!xs_is_null(s1))
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(b, s1);
         }
 
-        s = xs_str_cat(s, "</div>\n");
+        xs_sb_cat(b, "</div>\n");
     }
 
     /* has this message an audience (i.e., comes from a channel or community)? */
-    const char *audience = xs_dict_get(msg, "audience");
+    const char *audience = xs_dict_index_get(mi, "audience");
     if (strcmp(type, "Page") == 0 && !xs_is_null(audience)) {
         xs *es1 = encode_html(audience);
         xs *s1 = xs_fmt("<p>(<a href=\"%s\" title=\"%s\">%s</a>)</p>\n",
             audience, L("Source channel or community"), es1);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(b, s1);
     }
 
     if (sensitive)
-        s = xs_str_cat(s, "</details><p>\n");
+        xs_sb_cat(b, "</details><p>\n");
+
+    xs_sb_cat(b, "</div>\n");
+
+}
 
-    s = xs_str_cat(s, "</div>\n");
+
+void html_entry(snac *user, xs_sb *b, const xs_dict *msg, int local,
+                   int level, const char *md5, int hide_children)
+{
+    char *id    = xs_dict_get(msg, "id");
+    char *type  = xs_dict_get(msg, "type");
+    char *actor;
+
+    /* do not show non-public messages in the public timeline */
+    if ((local || !user) && !is_msg_public(msg))
+        return;
+
+    /* hidden? do nothing more for this conversation */
+    if (user && is_hidden(user, id))
+        return;
+
+    /* avoid too deep nesting, as it may be a loop */
+    if (level >= 256)
+        return;
+
+    if (strcmp(type, "Follow") == 0) {
+        xs_sb_fmt(b, "<div>\n<a name=\"%s_entry\"></a>\n", md5);
+
+        xs_sb_cat(b, "<div class=\"snac-post\">\n<div class=\"snac-post-header\">\n");
+
+        xs_sb_fmt(b, "<div class=\"snac-origin\">%s</div>\n", L("follows you"));
+
+        html_msg_icon(b, msg);
+
+        xs_sb_cat(b, "</div>\n</div>\n");
+
+        return;
+    }
+    else
+    if (strcmp(type, "Note") != 0 && strcmp(type, "Question") != 0 && strcmp(type, "Page") != 0) {
+        /* skip oddities */
+        return;
+    }
+
+    /* ignore notes with "name", as they are votes to Questions */
+    if (strcmp(type, "Note") == 0 && !xs_is_null(xs_dict_get(msg, "name")))
+        return;
+
+    /* bring the main actor */
+    if ((actor = xs_dict_get(msg, "attributedTo")) == NULL)
+        return;
+
+    /* ignore muted morons immediately */
+    if (user && is_muted(user, actor))
+        return;
+
+    if ((user == NULL || strcmp(actor, user->actor) != 0)
+        && !valid_status(actor_get(actor, NULL)))
+        return;
+
+    xs_sb_fmt(b, "<div>\n<a name=\"%s_entry\"></a>\n", md5);
+
+    if (level == 0)
+        xs_sb_cat(b, "<div class=\"snac-post\">\n"); /** **/
+    else
+        xs_sb_cat(b, "<div class=\"snac-child\">\n"); /** **/
+
+    {
+        xs_dict_index mi;
+
+        /* from now on, lots of fields are read from the message */
+        xs_dict_index_init(&mi, msg);
+
+        xs *key  = html_entry_key(user, msg, &mi, local, level);
+        xs *frag = key ? hcache_get(key) : NULL;
+
+        if (frag != NULL)
+            xs_sb_cat(b, frag);
+        else {
+            int start = b->len;
+
+            html_entry_body(user, b, msg, &mi, local, level);
+
+            if (key != NULL)
+                hcache_put(key, b->s + start, b->len - start);
+        }
+
+        xs_dict_index_free(&mi);
+    }
 
     /** controls **/
 
     if (!local && user)
-        s = html_entry_controls(user, s, msg, md5);
+        html_entry_controls(user, b, msg, md5);
 
     /** children **/
     if (!hide_children) {
@@ -1383,19 +1653,21 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
         if (left) {
             char *p, *cmd5;
             int older_open = 0;
-            xs *ss = xs_str_new(NULL);
+            xs_sb ss;
             int n_children = 0;
 
-            ss = xs_str_cat(ss, "<details open><summary>...</summary><p>\n");
+            xs_sb_init(&ss);
+
+            xs_sb_cat(&ss, "<details open><summary>...</summary><p>\n");
 
             if (level < 4)
-                ss = xs_str_cat(ss, "<div class=\"snac-children\">\n");
+                xs_sb_cat(&ss, "<div class=\"snac-children\">\n");
             else
-                ss = xs_str_cat(ss, "<div>\n");
+                xs_sb_cat(&ss, "<div>\n");
 
             if (left > 3) {
                 xs *s1 = xs_fmt("<details><summary>%s</summary>\n", L("Older..."));
-                ss = xs_str_cat(ss, s1);
+                xs_sb_cat(&ss, s1);
                 older_open = 1;
             }
 
@@ -1409,12 +1681,12 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
                     object_get_by_md5(cmd5, &chd);
 
                 if (older_open && left <= 3) {
-                    ss = xs_str_cat(ss, "</details>\n");
+                    xs_sb_cat(&ss, "</details>\n");
                     older_open = 0;
                 }
 
                 if (chd != NULL && xs_is_null(xs_dict_get(chd, "name"))) {
-                    ss = html_entry(user, ss, chd, local, level + 1, cmd5, hide_children);
+                    html_entry(user, &ss, chd, local, level + 1, cmd5, hide_children);
                     n_children++;
                 }
                 else
@@ -1424,25 +1696,25 @@ xs_str *html_entry(snac *user, xs_str *os, const xs_dict *msg, int local,
             }
 
             if (older_open)
-                ss = xs_str_cat(ss, "</details>\n");
+                xs_sb_cat(&ss, "</details>\n");
 
-            ss = xs_str_cat(ss, "</div>\n");
-            ss = xs_str_cat(ss, "</details>\n");
+            xs_sb_cat(&ss, "</div>\n");
+            xs_sb_cat(&ss, "</details>\n");
 
             if (n_children)
-                s = xs_str_cat(s, ss);
+                xs_sb_cat_m(b, ss.s, ss.len);
+
+            xs_sb_free(&ss);
         }
     }
 
-    s = xs_str_cat(s, "</div>\n</div>\n");
-
-    return xs_str_cat(os, s);
+    xs_sb_cat(b, "</div>\n</div>\n");
 }
 
 
-xs_str *html_footer(xs_str *s)
+void html_footer(xs_sb *b)
 {
-    xs *s1 = xs_fmt(
+    xs_sb_fmt(b,
         "<div class=\"snac-footer\">\n"
         "<a href=\"%s\">%s</a> - "
         "powered by <a href=\"%s\">"
@@ -1451,29 +1723,58 @@ xs_str *html_footer(xs_str *s)
         L("about this site"),
         WHAT_IS_SNAC_URL
     );
+}
+
 
-    return xs_str_cat(s, s1);
+#define HTML_CHUNK_SIZE 16384
+
+static void html_flush(xs_sb *b, http_stream *stream, int min)
+/* sends what has been built so far through the stream, if it's enough */
+{
+    if (stream != NULL && b->len > 0 && b->len >= min) {
+        stream_write(stream, b->s, b->len);
+
+        b->len  = 0;
+        b->s[0] = '\0';
+    }
 }
 
 
-xs_str *html_timeline(snac *user, const xs_list *list, int local, int skip, int show, int show_more)
-/* returns the HTML for the timeline */
+xs_str *html_timeline(snac *user, const xs_list *list, int local,
+                      int skip, int show, int show_more, const char *query,
+                      http_stream *stream)
+/* returns the HTML for the timeline (or for the results of
+   a search query, if set), or sends it through the stream
+   (if set) as the entries are rendered */
 {
-    xs_str *s = xs_str_new(NULL);
+    xs_sb b;
     xs_list *p = (xs_list *)list;
     char *v;
     double t = ftime();
 
+    xs_sb_init(&b);
+
     if (user)
-        s = html_user_header(user, s, local);
+        html_user_header(user, &b, local);
     else
-        s = html_instance_header(s);
+        html_instance_header(&b);
 
     if (user && !local)
-        s = html_top_controls(user, s);
+        html_top_controls(user, &b);
+
+    if (query != NULL) {
+        xs *es = encode_html(query);
+        xs_sb_fmt(&b, "<h2 class=\"snac-header\">%s: %s</h2>\n", L("Search results"), es);
+    }
 
-    s = xs_str_cat(s, "<a name=\"snac-posts\"></a>\n");
-    s = xs_str_cat(s, "<div class=\"snac-posts\">\n");
+    xs_sb_cat(&b, "<a name=\"snac-posts\"></a>\n");
+    xs_sb_cat(&b, "<div class=\"snac-posts\">\n");
+
+    if (stream != NULL) {
+        /* the client can start rendering while the entries are loaded */
+        stream_start(stream, 200, "text/html; charset=utf-8");
+        html_flush(&b, stream, 0);
+    }
 
     while (xs_list_iter(&p, &v)) {
         xs *msg = NULL;
@@ -1487,10 +1788,12 @@ xs_str *html_timeline(snac *user, const xs_list *list, int local, int skip, int
         if (!valid_status(status))
             continue;
 
-        s = html_entry(user, s, msg, local, 0, v, user ? 0 : 1);
+        html_entry(user, &b, msg, local, 0, v, user ? 0 : 1);
+
+        html_flush(&b, stream, HTML_CHUNK_SIZE);
     }
 
-    s = xs_str_cat(s, "</div>\n");
+    xs_sb_cat(&b, "</div>\n");
 
     if (user && local) {
         xs *s1 = xs_fmt(
@@ -1499,7 +1802,7 @@ xs_str *html_timeline(snac *user, const xs_list *list, int local, int skip, int
             L("History")
         );
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(&b, s1);
 
         xs *list = history_list(user);
         char *p, *v;
@@ -1511,50 +1814,61 @@ xs_str *html_timeline(snac *user, const xs_list *list, int local, int skip, int
                         "<li><a href=\"%s/h/%s\">%s</a></li>\n",
                         user->actor, v, fn);
 
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(&b, s1);
         }
 
-        s = xs_str_cat(s, "</ul></div>\n");
+        xs_sb_cat(&b, "</ul></div>\n");
     }
 
     {
         xs *s1 = xs_fmt("<!-- %lf seconds -->\n", ftime() - t);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(&b, s1);
     }
 
     if (show_more) {
         const char *base_url = user ? user->actor : srv_baseurl;
+        xs *q = NULL;
+
+        if (query != NULL) {
+            xs *uq = xs_url_enc(query);
+            q = xs_fmt("q=%s&", uq);
+        }
 
         xs *s1 = xs_fmt(
             "<p>"
             "<a href=\"%s%s\" name=\"snac-more\">%s</a> - "
-            "<a href=\"%s%s?skip=%d&show=%d\" name=\"snac-more\">%s</a>"
+            "<a href=\"%s%s?%sskip=%d&show=%d\" name=\"snac-more\">%s</a>"
             "</p>\n",
             base_url, local ? "" : "/admin", L("Back to top"),
-            base_url, local ? "" : "/admin", skip + show, show, L("Older entries...")
+            base_url, local ? "" : "/admin", q ? q : "", skip + show, show, L("Older entries...")
         );
 
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(&b, s1);
     }
 
-    s = html_footer(s);
+    html_footer(&b);
 
-    s = xs_str_cat(s, "</body>\n</html>\n");
+    xs_sb_cat(&b, "</body>\n</html>\n");
 
-    return s;
+    if (stream != NULL) {
+        html_flush(&b, stream, 0);
+        xs_sb_free(&b);
+
+        return NULL;
+    }
+
+    return xs_sb_result(&b);
 }
 
 
-xs_str *html_people_list(snac *snac, xs_str *os, xs_list *list, const char *header, const char *t)
+void html_people_list(snac *snac, xs_sb *b, xs_list *list, const char *header, const char *t)
 {
-    xs *s = xs_str_new(NULL);
     xs *es1 = encode_html(header);
-    xs *h = xs_fmt("<h2 class=\"snac-header\">%s</h2>\n", es1);
     char *p, *actor_id;
 
-    s = xs_str_cat(s, h);
+    xs_sb_fmt(b, "<h2 class=\"snac-header\">%s</h2>\n", es1);
 
-    s = xs_str_cat(s, "<div class=\"snac-posts\">\n");
+    xs_sb_cat(b, "<div class=\"snac-posts\">\n");
 
     p = list;
     while (xs_list_iter(&p, &actor_id)) {
@@ -1562,33 +1876,33 @@ xs_str *html_people_list(snac *snac, xs_str *os, xs_list *list, const char *head
         xs *actor = NULL;
 
         if (valid_status(actor_get(actor_id, &actor))) {
-            s = xs_str_cat(s, "<div class=\"snac-post\">\n<div class=\"snac-post-header\">\n");
+            xs_sb_cat(b, "<div class=\"snac-post\">\n<div class=\"snac-post-header\">\n");
 
-            s = html_actor_icon(s, actor, xs_dict_get(actor, "published"), NULL, NULL, 0);
+            html_actor_icon(b, actor, xs_dict_get(actor, "published"), NULL, NULL, 0);
 
-            s = xs_str_cat(s, "</div>\n");
+            xs_sb_cat(b, "</div>\n");
 
             /* content (user bio) */
             char *c = xs_dict_get(actor, "summary");
 
             if (!xs_is_null(c)) {
-                s = xs_str_cat(s, "<div class=\"snac-content\">\n");
+                xs_sb_cat(b, "<div class=\"snac-content\">\n");
 
                 xs *sc = sanitize(c);
 
                 if (xs_startswith(sc, "<p>"))
-                    s = xs_str_cat(s, sc);
+                    xs_sb_cat(b, sc);
                 else {
                     xs *s1 = xs_fmt("<p>%s</p>", sc);
-                    s = xs_str_cat(s, s1);
+                    xs_sb_cat(b, s1);
                 }
 
-                s = xs_str_cat(s, "</div>\n");
+                xs_sb_cat(b, "</div>\n");
             }
 
 
             /* buttons */
-            s = xs_str_cat(s, "<div class=\"snac-controls\">\n");
+            xs_sb_cat(b, "<div class=\"snac-controls\">\n");
 
             xs *s1 = xs_fmt(
                 "<p><form autocomplete=\"off\" method=\"post\" action=\"%s/admin/action\">\n"
@@ -1597,35 +1911,35 @@ xs_str *html_people_list(snac *snac, xs_str *os, xs_list *list, const char *head
 
                 snac->actor, actor_id
             );
-            s = xs_str_cat(s, s1);
+            xs_sb_cat(b, s1);
 
             if (following_check(snac, actor_id)) {
-                s = html_button(s, "unfollow", L("Unfollow"),
+                html_button(b, "unfollow", L("Unfollow"),
                                 L("Stop following this user's activity"));
 
                 if (is_limited(snac, actor_id))
-                    s = html_button(s, "unlimit", L("Unlimit"),
+                    html_button(b, "unlimit", L("Unlimit"),
                                 L("Allow announces (boosts) from this user"));
                 else
-                    s = html_button(s, "limit", L("Limit"),
+                    html_button(b, "limit", L("Limit"),
                                 L("Block announces (boosts) from this user"));
             }
             else {
-                s = html_button(s, "follow", L("Follow"),
+                html_button(b, "follow", L("Follow"),
                                 L("Start following this user's activity"));
 
                 if (follower_check(snac, actor_id))
-                    s = html_button(s, "delete", L("Delete"), L("Delete this user"));
+                    html_button(b, "delete", L("Delete"), L("Delete this user"));
             }
 
             if (is_muted(snac, actor_id))
-                s = html_button(s, "unmute", L("Unmute"),
+                html_button(b, "unmute", L("Unmute"),
                                 L("Stop blocking activities from this user"));
             else
-                s = html_button(s, "mute", L("MUTE"),
+                html_button(b, "mute", L("MUTE"),
                                 L("Block any activity from this user"));
 
-            s = xs_str_cat(s, "</form>\n");
+            xs_sb_cat(b, "</form>\n");
 
             /* the post textarea */
             xs *s2 = xs_fmt(
@@ -1647,57 +1961,59 @@ xs_str *html_people_list(snac *snac, xs_str *os, xs_list *list, const char *head
                 actor_id,
                 L("Post")
             );
-            s = xs_str_cat(s, s2);
+            xs_sb_cat(b, s2);
 
-            s = xs_str_cat(s, "</div>\n");
+            xs_sb_cat(b, "</div>\n");
 
-            s = xs_str_cat(s, "</div>\n");
+            xs_sb_cat(b, "</div>\n");
         }
     }
 
-    s = xs_str_cat(s, "</div>\n");
-
-    return xs_str_cat(os, s);
+    xs_sb_cat(b, "</div>\n");
 }
 
 
 xs_str *html_people(snac *snac)
 {
-    xs_str *s = xs_str_new(NULL);
+    xs_sb b;
     xs *wing = following_list(snac);
     xs *wers = follower_list(snac);
 
-    s = html_user_header(snac, s, 0);
+    xs_sb_init(&b);
 
-    s = html_people_list(snac, s, wing, L("People you follow"), "i");
+    html_user_header(snac, &b, 0);
 
-    s = html_people_list(snac, s, wers, L("People that follow you"), "e");
+    html_people_list(snac, &b, wing, L("People you follow"), "i");
 
-    s = html_footer(s);
+    html_people_list(snac, &b, wers, L("People that follow you"), "e");
 
-    s = xs_str_cat(s, "</body>\n</html>\n");
+    html_footer(&b);
 
-    return s;
+    xs_sb_cat(&b, "</body>\n</html>\n");
+
+    return xs_sb_result(&b);
 }
 
 
 xs_str *html_notifications(snac *snac)
 {
-    xs_str *s  = xs_str_new(NULL);
+    xs_sb b;
     xs *n_list = notify_list(snac, 0);
     xs *n_time = notify_check_time(snac, 0);
     xs_list *p = n_list;
     xs_str *v;
     enum { NHDR_NONE, NHDR_NEW, NHDR_OLD } stage = NHDR_NONE;
 
-    s = html_user_header(snac, s, 0);
+    xs_sb_init(&b);
+
+    html_user_header(snac, &b, 0);
 
     xs *s1 = xs_fmt(
         "<form autocomplete=\"off\" "
         "method=\"post\" action=\"%s/admin/clear-notifications\" id=\"clear\">\n"
         "<input type=\"submit\" class=\"snac-btn-like\" value=\"%s\">\n"
         "</form><p>\n", snac->actor, L("Clear all"));
-    s = xs_str_cat(s, s1);
+    xs_sb_cat(&b, s1);
 
     while (xs_list_iter(&p, &v)) {
         xs *noti = notify_get(snac, v);
@@ -1728,9 +2044,9 @@ xs_str *html_notifications(snac *snac)
             /* unseen notification */
             if (stage == NHDR_NONE) {
                 xs *s1 = xs_fmt("<h2 class=\"snac-header\">%s</h2>\n", L("New"));
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(&b, s1);
 
-                s = xs_str_cat(s, "<div class=\"snac-posts\">\n");
+                xs_sb_cat(&b, "<div class=\"snac-posts\">\n");
 
                 stage = NHDR_NEW;
             }
@@ -1739,12 +2055,12 @@ xs_str *html_notifications(snac *snac)
             /* already seen notification */
             if (stage != NHDR_OLD) {
                 if (stage == NHDR_NEW)
-                    s = xs_str_cat(s, "</div>\n");
+                    xs_sb_cat(&b, "</div>\n");
 
                 xs *s1 = xs_fmt("<h2 class=\"snac-header\">%s</h2>\n", L("Already seen"));
-                s = xs_str_cat(s, s1);
+                xs_sb_cat(&b, s1);
 
-                s = xs_str_cat(s, "<div class=\"snac-posts\">\n");
+                xs_sb_cat(&b, "<div class=\"snac-posts\">\n");
 
                 stage = NHDR_OLD;
             }
@@ -1765,34 +2081,34 @@ xs_str *html_notifications(snac *snac)
         xs *s1 = xs_fmt("<div class=\"snac-post-with-desc\">\n"
                         "<p><b>%s by <a href=\"%s\">%s</a></b>:</p>\n",
             es1, actor_id, a_name);
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(&b, s1);
 
         if (strcmp(type, "Follow") == 0 || strcmp(utype, "Follow") == 0) {
-            s = xs_str_cat(s, "<div class=\"snac-post\">\n");
+            xs_sb_cat(&b, "<div class=\"snac-post\">\n");
 
-            s = html_actor_icon(s, actor, NULL, NULL, NULL, 0);
+            html_actor_icon(&b, actor, NULL, NULL, NULL, 0);
 
-            s = xs_str_cat(s, "</div>\n");
+            xs_sb_cat(&b, "</div>\n");
         }
         else {
             xs *md5 = xs_md5_hex(id, strlen(id));
 
-            s = html_entry(snac, s, obj, 0, 0, md5, 1);
+            html_entry(snac, &b, obj, 0, 0, md5, 1);
         }
 
-        s = xs_str_cat(s, "</div>\n");
+        xs_sb_cat(&b, "</div>\n");
     }
 
     if (stage == NHDR_NONE) {
         xs *s1 = xs_fmt("<h2 class=\"snac-header\">%s</h2>\n", L("None"));
-        s = xs_str_cat(s, s1);
+        xs_sb_cat(&b, s1);
     }
     else
-        s = xs_str_cat(s, "</div>\n");
+        xs_sb_cat(&b, "</div>\n");
 
-    s = html_footer(s);
+    html_footer(&b);
 
-    s = xs_str_cat(s, "</body>\n</html>\n");
+    xs_sb_cat(&b, "</body>\n</html>\n");
 
     /* set the check time to now */
     xs *dummy = notify_check_time(snac, 1);
@@ -1800,12 +2116,47 @@ xs_str *html_notifications(snac *snac)
 
     timeline_touch(snac);
 
-    return s;
+    return xs_sb_result(&b);
+}
+
+
+static int html_timeline_send(snac *user, const xs_list *list, int local,
+                              int skip, int show, int show_more, const char *query,
+                              const char *hfn, char **body, int *b_size, http_stream *stream)
+/* builds a timeline page into body or sends it through the stream,
+   and stores it in the history as hfn (if set) */
+{
+    xs_sb copy;
+
+    if (stream != NULL && hfn != NULL) {
+        xs_sb_init(&copy);
+        stream->copy = &copy;
+    }
+
+    *body = html_timeline(user, list, local, skip, show, show_more, query, stream);
+
+    if (stream != NULL) {
+        if (hfn != NULL) {
+            stream->copy = NULL;
+
+            xs *s = xs_sb_result(&copy);
+            history_add(user, hfn, s, strlen(s));
+        }
+    }
+    else {
+        *b_size = strlen(*body);
+
+        if (hfn != NULL)
+            history_add(user, hfn, *body, *b_size);
+    }
+
+    return 200;
 }
 
 
 int html_get_handler(const xs_dict *req, const char *q_path,
-                     char **body, int *b_size, char **ctype, xs_str **etag)
+                     char **body, int *b_size, char **ctype, xs_str **etag,
+                     http_stream *stream)
 {
     char *accept = xs_dict_get(req, "accept");
     int status = 404;
@@ -1876,21 +2227,38 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             xs *pins = pinned_list(&snac);
             pins = xs_list_cat(pins, list);
 
-            *body = html_timeline(&snac, pins, 1, skip, show, xs_list_len(next));
-
-            *b_size = strlen(*body);
-            status  = 200;
-
-            if (save)
-                history_add(&snac, h, *body, *b_size);
+            status = html_timeline_send(&snac, pins, 1, skip, show, xs_list_len(next),
+                        NULL, save ? h : NULL, body, b_size, stream);
         }
     }
     else
     if (strcmp(p_path, "admin") == 0) { /** private timeline **/
+        const char *q = xs_dict_get(q_vars, "q");
+
         if (!login(&snac, req)) {
             *body  = xs_dup(uid);
             status = 401;
         }
+        else
+        if (!xs_is_null(q) && *q) { /** search results **/
+            xs *list = NULL;
+
+            if (*q == '#' && strpbrk(q, " \"") == NULL) {
+                /* a single hashtag: read its index */
+                xs *idx = tag_index(q);
+                list = timeline_simple_list(&snac, idx, skip, show + 1);
+            }
+            else
+                list = search_query(&snac, q, skip, show + 1);
+
+            int more = xs_list_len(list) > show;
+
+            if (more)
+                list = xs_list_del(list, -1);
+
+            status = html_timeline_send(&snac, list, 0, skip, show, more,
+                        q, NULL, body, b_size, stream);
+        }
         else {
             if (cache && history_mtime(&snac, "timeline.html_") > timeline_mtime(&snac)) {
                 snac_debug(&snac, 1, xs_fmt("serving cached timeline"));
@@ -1908,13 +2276,8 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 xs *pins = pinned_list(&snac);
                 pins = xs_list_cat(pins, list);
 
-                *body = html_timeline(&snac, pins, 0, skip, show, xs_list_len(next));
-
-                *b_size = strlen(*body);
-                status  = 200;
-
-                if (save)
-                    history_add(&snac, "timeline.html_", *body, *b_size);
+                status = html_timeline_send(&snac, pins, 0, skip, show, xs_list_len(next),
+                            NULL, save ? "timeline.html_" : NULL, body, b_size, stream);
             }
         }
     }
@@ -1953,7 +2316,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
             list = xs_list_append(list, md5);
 
-            *body   = html_timeline(&snac, list, 1, 0, 0, 0);
+            *body   = html_timeline(&snac, list, 1, 0, 0, 0, NULL, NULL);
             *b_size = strlen(*body);
             status  = 200;
         }
@@ -2229,6 +2592,9 @@ int html_post_handler(const xs_dict *req, const char *q_path,
                     /* overwrite object, not updating the indexes */
                     object_add_ow(edit_id, msg);
 
+                    tag_update(&snac, edit_id, p_msg, msg);
+                    search_update(&snac, edit_id, msg);
+
                     /* update message */
                     c_msg = msg_update(&snac, msg);
                 }
@@ -2442,18 +2808,7 @@ int html_post_handler(const xs_dict *req, const char *q_path,
             snac.config = xs_dict_set(snac.config, "passwd", pw);
         }
 
-        xs *fn  = xs_fmt("%s/user.json", snac.basedir);
-        xs *bfn = xs_fmt("%s.bak", fn);
-        FILE *f;
-
-        rename(fn, bfn);
-
-        if ((f = fopen(fn, "w")) != NULL) {
-            xs_json_dump(snac.config, 4, f);
-            fclose(f);
-        }
-        else
-            rename(bfn, fn);
+        user_persist(&snac);
 
         history_del(&snac, "timeline.html_");
 
@@ -10,24 +10,341 @@
 
 #include "snac.h"
 
-xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
+#include <pthread.h>
+#include <curl/curl.h>
+
+/** in-flight requests **/
+
+/* remote requests for the same thing done at the same time by several
+   threads (e.g. the actor of a popular post arriving for many users)
+   are coalesced: the first one (the leader) does the request and the
+   others just wait for it and get a copy of its result */
+
+typedef struct _flight {
+    struct _flight *next;
+    xs_str *key;
+    int waiters;
+    int done;
+    int status;
+    xs_val *result;
+} flight;
+
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond   = PTHREAD_COND_INITIALIZER;
+static flight *flights = NULL;
+
+
+int flight_begin(const char *key, int *status, xs_val **result)
+/* starts a request; returns 1 if the caller must do it (and then call
+   flight_end()) or 0 if it was done by another thread, filling its result */
+{
+    flight *f;
+    int ret = 1;
+
+    pthread_mutex_lock(&flight_mutex);
+
+    for (f = flights; f != NULL; f = f->next) {
+        if (strcmp(f->key, key) == 0)
+            break;
+    }
+
+    if (f == NULL) {
+        /* nobody is doing this; become the leader */
+        if ((f = calloc(1, sizeof(flight))) != NULL) {
+            xs_arena_pause();
+            f->key  = xs_str_new(key);
+            xs_arena_resume();
+            f->next = flights;
+            flights = f;
+        }
+    }
+    else {
+        /* wait for the leader */
+        f->waiters++;
+
+        while (!f->done)
+            pthread_cond_wait(&flight_cond, &flight_mutex);
+
+        *status = f->status;
+
+        if (result != NULL)
+            *result = f->result ? xs_dup(f->result) : NULL;
+
+        /* the last one frees it */
+        if (--f->waiters == 0) {
+            xs_free(f->key);
+            xs_free(f->result);
+            free(f);
+        }
+
+        srv_debug(2, xs_fmt("flight_begin coalesced %s", key));
+
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&flight_mutex);
+
+    return ret;
+}
+
+
+void flight_end(const char *key, int status, const xs_val *result)
+/* finishes a request, waking up the threads waiting for it */
+{
+    flight **pf;
+    flight *f;
+
+    pthread_mutex_lock(&flight_mutex);
+
+    for (pf = &flights; (f = *pf) != NULL; pf = &f->next) {
+        if (strcmp(f->key, key) == 0)
+            break;
+    }
+
+    if (f != NULL) {
+        /* detach, so that new requests are done again */
+        *pf = f->next;
+
+        if (f->waiters == 0) {
+            xs_free(f->key);
+            free(f);
+        }
+        else {
+            f->done   = 1;
+            f->status = status;
+            xs_arena_pause();
+            f->result = result ? xs_dup(result) : NULL;
+            xs_arena_resume();
+
+            pthread_cond_broadcast(&flight_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+
+/** key cache **/
+
+/* parsed keys, so that PEM strings are not decoded again for every
+   signature. Entries are found by key id and checked against the PEM
+   string, so a changed key (e.g. after an actor refresh) replaces the
+   old one. Keys are reference counted, so that an entry can be evicted
+   while it's being used by other threads */
+
+#define KEY_BUCKETS 256
+
+typedef struct _key_entry {
+    struct _key_entry *prev;    /* LRU list */
+    struct _key_entry *next;
+    struct _key_entry *hnext;   /* hash bucket chain */
+    xs_str *id;
+    xs_str *pem;
+    void *pkey;
+} key_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    key_entry *head;            /* most recently used */
+    key_entry *tail;
+    int n;
+    int max;
+    int secret;
+    key_entry *buckets[KEY_BUCKETS];
+} key_cache;
+
+static key_cache secret_keys = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 64, 1, { NULL } };
+static key_cache public_keys = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 1024, 0, { NULL } };
+
+
+static int _key_hash(const char *id)
+/* returns the bucket of a key id */
+{
+    unsigned int h = 2166136261u;
+
+    while (*id)
+        h = (h ^ (unsigned char) *id++) * 16777619u;
+
+    return h % KEY_BUCKETS;
+}
+
+
+static key_entry *_key_unlink(key_cache *kc, const char *id)
+/* detaches the entry of a key id, if any (must be locked) */
+{
+    key_entry **pe = &kc->buckets[_key_hash(id)];
+    key_entry *e;
+
+    while ((e = *pe) != NULL && strcmp(e->id, id) != 0)
+        pe = &e->hnext;
+
+    if (e != NULL) {
+        *pe = e->hnext;
+
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            kc->head = e->next;
+
+        if (e->next)
+            e->next->prev = e->prev;
+        else
+            kc->tail = e->prev;
+
+        kc->n--;
+    }
+
+    return e;
+}
+
+
+static void _key_link(key_cache *kc, key_entry *e)
+/* attaches an entry at the head (must be locked) */
+{
+    int b = _key_hash(e->id);
+
+    e->hnext = kc->buckets[b];
+    kc->buckets[b] = e;
+
+    e->prev = NULL;
+    e->next = kc->head;
+
+    if (kc->head)
+        kc->head->prev = e;
+    else
+        kc->tail = e;
+
+    kc->head = e;
+    kc->n++;
+}
+
+
+static void _key_free(key_entry *e)
+{
+    if (e != NULL) {
+        xs_free(e->id);
+        xs_free(e->pem);
+        xs_evp_pkey_free(e->pkey);
+        free(e);
+    }
+}
+
+
+static void *_key_get(key_cache *kc, const char *id, const char *pem)
+/* returns a referenced parsed key (to be freed with xs_evp_pkey_free()) */
+{
+    key_entry *e;
+    void *pkey = NULL;
+
+    pthread_mutex_lock(&kc->mutex);
+
+    if ((e = _key_unlink(kc, id)) != NULL) {
+        if (strcmp(e->pem, pem) == 0) {
+            /* found; move to the head */
+            _key_link(kc, e);
+            pkey = xs_evp_pkey_ref(e->pkey);
+        }
+        else {
+            /* the key has changed */
+            _key_free(e);
+        }
+    }
+
+    pthread_mutex_unlock(&kc->mutex);
+
+    if (pkey != NULL)
+        return pkey;
+
+    /* not there; parse it (out of the lock) */
+    if ((pkey = xs_evp_pkey_load(pem, kc->secret)) == NULL)
+        return NULL;
+
+    if ((e = calloc(1, sizeof(key_entry))) == NULL)
+        return pkey;
+
+    xs_arena_pause();
+    e->id   = xs_str_new(id);
+    e->pem  = xs_str_new(pem);
+    xs_arena_resume();
+    e->pkey = xs_evp_pkey_ref(pkey);
+
+    pthread_mutex_lock(&kc->mutex);
+
+    /* another thread may have added it in the meantime */
+    key_entry *o = _key_unlink(kc, id);
+
+    if (o != NULL && strcmp(o->pem, pem) == 0) {
+        /* keep that one */
+        _key_link(kc, o);
+        _key_free(e);
+    }
+    else {
+        _key_free(o);
+        _key_link(kc, e);
+
+        /* too many? drop the least recently used */
+        while (kc->n > kc->max)
+            _key_free(_key_unlink(kc, kc->tail->id));
+    }
+
+    pthread_mutex_unlock(&kc->mutex);
+
+    return pkey;
+}
+
+
+xs_str *http_sign(const char *keyid, const char *seckey, const char *str)
+/* signs a string with a secret key */
+{
+    void *pkey = _key_get(&secret_keys, keyid, seckey);
+    xs_str *s64 = xs_evp_sign_pkey(pkey, str, strlen(str));
+
+    xs_evp_pkey_free(pkey);
+
+    return s64;
+}
+
+
+int http_verify(const char *keyid, const char *pubkey, const char *str, const char *sig)
+/* verifies a signature with a public key */
+{
+    void *pkey = _key_get(&public_keys, keyid, pubkey);
+    int r = xs_evp_verify_pkey(pkey, str, strlen(str), sig);
+
+    xs_evp_pkey_free(pkey);
+
+    return r;
+}
+
+
+xs_str *http_body_digest(const char *body, int b_size)
+/* returns the value of the digest header for a body */
+{
+    xs *s;
+
+    if (body != NULL)
+        s = xs_sha256_base64(body, b_size);
+    else
+        s = xs_sha256_base64("", 0);
+
+    return xs_fmt("SHA-256=%s", s);
+}
+
+
+static xs_dict *http_signed_headers(const char *keyid, const char *seckey,
                             const char *method, const char *url,
-                            xs_dict *headers,
-                            const char *body, int b_size,
-                            int *status, xs_str **payload, int *p_size,
-                            int timeout)
-/* does a signed HTTP request */
+                            xs_dict *headers, const char *body, int b_size)
+/* returns the headers with the signature for a request */
 {
     xs *l1 = NULL;
     xs *date = NULL;
     xs *digest = NULL;
     xs *s64 = NULL;
     xs *signature = NULL;
-    xs *hdrs = NULL;
+    xs_dict *hdrs = NULL;
     char *host;
     char *target;
     char *k, *v;
-    xs_dict *response;
 
     date = xs_str_utctime(0, "%a, %d %b %Y %H:%M:%S GMT");
 
@@ -44,17 +361,11 @@ xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
     else
         target = "";
 
-    /* digest */
-    {
-        xs *s;
-
-        if (body != NULL)
-            s = xs_sha256_base64(body, b_size);
-        else
-            s = xs_sha256_base64("", 0);
-
-        digest = xs_fmt("SHA-256=%s", s);
-    }
+    /* digest (it may come already calculated) */
+    if (headers != NULL && (k = xs_dict_get(headers, "digest")) != NULL)
+        digest = xs_dup(k);
+    else
+        digest = http_body_digest(body, b_size);
 
     {
         /* build the string to be signed */
@@ -65,7 +376,7 @@ xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
                     strcmp(method, "POST") == 0 ? "post" : "get",
                     target, host, digest, date);
 
-        s64 = xs_evp_sign(seckey, s, strlen(s));
+        s64 = http_sign(keyid, seckey, s);
     }
 
     /* build now the signature header */
@@ -77,8 +388,10 @@ xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
 
     /* transfer the original headers */
     hdrs = xs_dict_new();
-    while (xs_dict_iter(&headers, &k, &v))
-        hdrs = xs_dict_append(hdrs, k, v);
+    while (xs_dict_iter(&headers, &k, &v)) {
+        if (strcmp(k, "digest") != 0)
+            hdrs = xs_dict_append(hdrs, k, v);
+    }
 
     /* add the new headers */
     if (strcmp(method, "POST") == 0)
@@ -94,6 +407,21 @@ xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
     hdrs = xs_dict_append(hdrs, "host",         host);
     hdrs = xs_dict_append(hdrs, "user-agent",   user_agent);
 
+    return hdrs;
+}
+
+
+xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
+                            const char *method, const char *url,
+                            xs_dict *headers,
+                            const char *body, int b_size,
+                            int *status, xs_str **payload, int *p_size,
+                            int timeout)
+/* does a signed HTTP request */
+{
+    xs *hdrs = http_signed_headers(keyid, seckey, method, url, headers, body, b_size);
+    xs_dict *response;
+
     response = xs_http_request(method, url, hdrs,
                            body, b_size, status, payload, p_size, timeout);
 
@@ -225,10 +553,330 @@ int check_signature(snac *snac, xs_dict *req, xs_str **err)
         }
     }
 
-    if (xs_evp_verify(pubkey, sig_str, strlen(sig_str), signature) != 1) {
+    if (http_verify(keyId, pubkey, sig_str, signature) != 1) {
         *err = xs_fmt("RSA verify error %s", keyId);
         return 0;
     }
 
     return 1;
 }
+
+
+/** delivery engine **/
+
+/* output messages are sent by a few threads, each one running many
+   concurrent transfers with a curl multi handle. Inboxes are assigned
+   to threads by host, so connections to the same host can be reused,
+   and there is a limit of simultaneous transfers for each host */
+
+#define DELIVER_THREADS         2
+#define DELIVER_MAX_XFERS       64      /* per thread */
+#define DELIVER_MAX_PER_HOST    4
+
+typedef struct _deliver_xfer {
+    struct _deliver_xfer *next;
+    xs_dict *q_item;
+    xs_str *host;
+    xs_str *body;
+    xs_dict *hdrs;
+    CURL *curl;
+} deliver_xfer;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    CURLM *multi;
+    xs_list *pending;           /* q_items waiting (locked by mutex) */
+    deliver_xfer *active;       /* running transfers (thread-owned) */
+    int n_active;
+    xs_dict *per_host;          /* running transfers by host (thread-owned) */
+} deliver_worker;
+
+static deliver_worker deliver_workers[DELIVER_THREADS];
+static volatile int deliver_running = 0;
+
+
+static xs_str *deliver_host(const char *url)
+/* returns the host part of an url */
+{
+    xs *l = NULL;
+    const char *p;
+
+    if ((p = strstr(url, ":/" "/")) != NULL)
+        url = p + 3;
+
+    l = xs_split_n(url, "/", 1);
+
+    return xs_dup(xs_list_get(l, 0));
+}
+
+
+static int deliver_host_cnt(deliver_worker *w, const char *host, int inc)
+/* changes the number of running transfers for a host and returns it */
+{
+    const xs_number *v = xs_dict_get(w->per_host, host);
+    int n = (xs_type(v) == XSTYPE_NUMBER ? xs_number_get(v) : 0) + inc;
+
+    if (n > 0) {
+        xs *nv = xs_number_new(n);
+        w->per_host = xs_dict_set(w->per_host, host, nv);
+    }
+    else
+        w->per_host = xs_dict_del(w->per_host, host);
+
+    return n;
+}
+
+
+static void deliver_xfer_free(deliver_xfer *x)
+{
+    xs_free(x->q_item);
+    xs_free(x->host);
+    xs_free(x->body);
+    xs_free(x->hdrs);
+    free(x);
+}
+
+
+static int deliver_xfer_start(deliver_worker *w, const xs_dict *q_item)
+/* starts a transfer; returns 0 if the host is already too busy */
+{
+    const char *inbox  = xs_dict_get(q_item, "inbox");
+    const char *keyid  = xs_dict_get(q_item, "keyid");
+    const char *seckey = xs_dict_get(q_item, "seckey");
+    const xs_val *msg  = xs_dict_get(q_item, "message");
+    const char *digest = xs_dict_get(q_item, "digest");
+    int retries        = xs_number_get(xs_dict_get(q_item, "retries"));
+    xs *host           = deliver_host(inbox);
+    xs *headers        = xs_dict_new();
+    deliver_xfer *x;
+
+    if (deliver_host_cnt(w, host, 0) >= DELIVER_MAX_PER_HOST)
+        return 0;
+
+    /* don't even try if the host is failing */
+    if (!host_check(inbox)) {
+        process_output_deferred(q_item);
+        return 1;
+    }
+
+    if ((x = calloc(1, sizeof(deliver_xfer))) == NULL)
+        return 0;
+
+    x->q_item = xs_dup(q_item);
+    x->host   = xs_dup(host);
+    x->body   = xs_type(msg) == XSTYPE_STRING ? xs_dup(msg) : xs_json_dumps(msg, 0);
+
+    if (!xs_is_null(digest))
+        headers = xs_dict_append(headers, "digest", digest);
+
+    x->hdrs   = http_signed_headers(keyid, seckey, "POST", inbox,
+                    headers, x->body, strlen(x->body));
+    x->curl   = xs_http_request_new("POST", inbox, x->hdrs,
+                    x->body, strlen(x->body), retries == 0 ? 3 : 8);
+
+    if (x->curl == NULL || curl_multi_add_handle(w->multi, x->curl) != CURLM_OK) {
+        /* cannot even start: it's a local problem, so requeue
+           it for a bit later without using up a retry */
+        int qrt = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
+
+        if (x->curl != NULL)
+            xs_free(xs_http_request_end(x->curl, CURLE_OUT_OF_MEMORY, NULL, NULL, NULL));
+
+        srv_log(xs_fmt("output message: cannot start transfer to %s", inbox));
+        enqueue_output_requeue(q_item, qrt * 60);
+        deliver_xfer_free(x);
+
+        return 1;
+    }
+
+    x->next   = w->active;
+    w->active = x;
+    w->n_active++;
+
+    deliver_host_cnt(w, host, 1);
+
+    return 1;
+}
+
+
+static void deliver_xfer_done(deliver_worker *w, CURL *curl, CURLcode cc)
+/* finishes a transfer */
+{
+    deliver_xfer **px = &w->active;
+    deliver_xfer *x;
+
+    while ((x = *px) != NULL && x->curl != curl)
+        px = &x->next;
+
+    if (x == NULL)
+        return;
+
+    *px = x->next;
+    w->n_active--;
+
+    deliver_host_cnt(w, x->host, -1);
+
+    curl_multi_remove_handle(w->multi, curl);
+
+    int status;
+    xs *payload = NULL;
+    int p_size  = 0;
+    xs *rsp     = xs_http_request_end(curl, cc, &status, &payload, &p_size);
+    const char *inbox = xs_dict_get(x->q_item, "inbox");
+
+    srv_archive("SEND", inbox, x->hdrs, x->body, strlen(x->body),
+                status, rsp, payload, p_size);
+
+    process_output_status(x->q_item, status, payload, p_size);
+
+    deliver_xfer_free(x);
+}
+
+
+static void *deliver_thread(void *arg)
+/* a delivery thread */
+{
+    deliver_worker *w = arg;
+
+    while (deliver_running) {
+        /* start as many pending transfers as possible */
+        pthread_mutex_lock(&w->mutex);
+
+        xs *pending = w->pending;
+        w->pending  = xs_list_new();
+
+        pthread_mutex_unlock(&w->mutex);
+
+        xs *waiting = xs_list_new();
+        xs_list *p  = pending;
+        xs_dict *q_item;
+
+        while (xs_list_iter(&p, &q_item)) {
+            if (w->n_active >= DELIVER_MAX_XFERS || !deliver_xfer_start(w, q_item))
+                waiting = xs_list_append(waiting, q_item);
+        }
+
+        if (xs_list_len(waiting)) {
+            /* put back what couldn't be started, keeping the order */
+            pthread_mutex_lock(&w->mutex);
+
+            xs_list *np = xs_list_cat(waiting, w->pending);
+            xs_free(w->pending);
+            w->pending = np;
+            waiting    = NULL;
+
+            pthread_mutex_unlock(&w->mutex);
+        }
+
+        /* run the transfers */
+        int running;
+        curl_multi_perform(w->multi, &running);
+
+        CURLMsg *m;
+        int left;
+
+        while ((m = curl_multi_info_read(w->multi, &left)) != NULL) {
+            if (m->msg == CURLMSG_DONE)
+                deliver_xfer_done(w, m->easy_handle, m->data.result);
+        }
+
+        /* wait for activity or new messages */
+        curl_multi_poll(w->multi, NULL, 0, 1000, NULL);
+    }
+
+    return NULL;
+}
+
+
+void deliver_start(void)
+/* starts the delivery engine */
+{
+    int n;
+
+    for (n = 0; n < DELIVER_THREADS; n++) {
+        deliver_worker *w = &deliver_workers[n];
+
+        pthread_mutex_init(&w->mutex, NULL);
+        w->multi    = curl_multi_init();
+        w->pending  = xs_list_new();
+        w->per_host = xs_dict_new();
+
+        /* keep some connections to each host alive */
+        curl_multi_setopt(w->multi, CURLMOPT_MAXCONNECTS, (long) DELIVER_MAX_XFERS);
+    }
+
+    deliver_running = 1;
+
+    for (n = 0; n < DELIVER_THREADS; n++)
+        pthread_create(&deliver_workers[n].thread, NULL,
+                        deliver_thread, &deliver_workers[n]);
+
+    srv_debug(1, xs_fmt("delivery engine started (%d threads)", DELIVER_THREADS));
+}
+
+
+void deliver_stop(void)
+/* stops the delivery engine; what's not yet delivered is requeued */
+{
+    int n;
+
+    if (!deliver_running)
+        return;
+
+    deliver_running = 0;
+
+    for (n = 0; n < DELIVER_THREADS; n++) {
+        deliver_worker *w = &deliver_workers[n];
+
+        curl_multi_wakeup(w->multi);
+        pthread_join(w->thread, NULL);
+
+        xs_list *p = w->pending;
+        xs_dict *q_item;
+
+        /* these were not attempted: requeue them as they are */
+        while (xs_list_iter(&p, &q_item))
+            enqueue_output_requeue(q_item, 0);
+
+        while (w->active != NULL) {
+            deliver_xfer *x = w->active;
+
+            w->active = x->next;
+
+            curl_multi_remove_handle(w->multi, x->curl);
+            xs_free(xs_http_request_end(x->curl, CURLE_OPERATION_TIMEDOUT, NULL, NULL, NULL));
+
+            /* interrupted: it's not the host's fault, nor a retry */
+            enqueue_output_requeue(x->q_item, 0);
+            deliver_xfer_free(x);
+        }
+
+        curl_multi_cleanup(w->multi);
+        w->pending  = xs_free(w->pending);
+        w->per_host = xs_free(w->per_host);
+        pthread_mutex_destroy(&w->mutex);
+    }
+
+    srv_debug(1, xs_fmt("delivery engine stopped"));
+}
+
+
+int deliver_post(const xs_dict *q_item)
+/* posts an output message to the delivery engine;
+   returns 0 if it's not running */
+{
+    if (!deliver_running)
+        return 0;
+
+    xs *host = deliver_host(xs_dict_get(q_item, "inbox"));
+    deliver_worker *w = &deliver_workers[xs_hash_func(host, strlen(host)) % DELIVER_THREADS];
+
+    pthread_mutex_lock(&w->mutex);
+    w->pending = xs_list_append(w->pending, q_item);
+    pthread_mutex_unlock(&w->mutex);
+
+    curl_multi_wakeup(w->multi);
+
+    return 1;
+}
@@ -17,11 +17,16 @@
 #include <semaphore.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include <sys/resource.h> // for getrlimit()
 
-#ifdef USE_POLL_FOR_SLEEP
-#include <poll.h>
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 int srv_running = 0;
@@ -105,7 +110,7 @@ static xs_str *greeting_html(void)
 
 
 int server_get_handler(xs_dict *req, const char *q_path,
-                       char **body, int *b_size, char **ctype)
+                       char **body, int *b_size, char **ctype, http_stream *stream)
 /* basic server services */
 {
     int status = 0;
@@ -116,12 +121,11 @@ int server_get_handler(xs_dict *req, const char *q_path,
     if (*q_path == '\0') {
         if (xs_type(xs_dict_get(srv_config, "show_instance_timeline")) == XSTYPE_TRUE) {
             xs *tl = timeline_instance_list(0, 30);
-            *body = html_timeline(NULL, tl, 0, 0, 0, 0);
+            *body  = html_timeline(NULL, tl, 0, 0, 0, 0, NULL, stream);
+            status = 200;
         }
         else
-            *body = greeting_html();
-
-        if (*body)
+        if ((*body = greeting_html()) != NULL)
             status = 200;
     }
     else
@@ -160,8 +164,61 @@ int server_get_handler(xs_dict *req, const char *q_path,
 }
 
 
-void httpd_connection(FILE *f)
-/* the connection processor */
+/** streamed responses **/
+
+static xs_dict *response_headers(xs_dict *headers, const char *ctype,
+                                 const char *etag, int keep)
+/* adds the headers common to all responses */
+{
+    headers = xs_dict_append(headers, "content-type", ctype);
+    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
+
+    if (!xs_is_null(etag))
+        headers = xs_dict_append(headers, "etag", etag);
+
+    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
+    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
+    headers = xs_dict_append(headers, "connection", keep ? "keep-alive" : "close");
+
+    return headers;
+}
+
+
+void stream_start(http_stream *st, int status, const char *ctype)
+/* sends the headers of a streamed response */
+{
+    if (!st->started) {
+        xs *headers = response_headers(xs_dict_new(), ctype, NULL, st->keep);
+
+        xs_httpd_response_start(st->f, status, headers);
+        st->started = 1;
+    }
+}
+
+
+void stream_write(http_stream *st, const char *data, int size)
+/* sends a piece of a streamed response */
+{
+    xs_httpd_chunk(st->f, data, size);
+    fflush(st->f);
+
+    if (st->copy != NULL)
+        xs_sb_cat_m(st->copy, data, size);
+
+    st->size += size;
+}
+
+
+void stream_end(http_stream *st)
+/* ends a streamed response */
+{
+    xs_httpd_response_end(st->f);
+}
+
+
+int httpd_connection(FILE *f, FILE *o, int can_keep)
+/* the connection processor: reads a request from f and writes the response
+   to o; returns true if the connection can be kept alive for more requests */
 {
     xs *req;
     char *method;
@@ -174,18 +231,32 @@ void httpd_connection(FILE *f)
     xs *payload  = NULL;
     xs *etag     = NULL;
     int p_size   = 0;
+    int keep     = 0;
+    http_stream st = { 0 };
+    http_stream *stream = NULL;
+    const char *proto;
     char *p;
 
     req = xs_httpd_request(f, &payload, &p_size);
 
     if (req == NULL) {
         /* probably because a timeout */
-        fclose(f);
-        return;
+        return 0;
     }
 
     method = xs_dict_get(req, "method");
     q_path = xs_dup(xs_dict_get(req, "path"));
+    proto  = xs_dict_get(req, "proto");
+
+    if (can_keep) {
+        /* HTTP/1.1 connections are persistent unless told otherwise */
+        const char *conn  = xs_dict_get(req, "connection");
+
+        if (strcmp(proto, "HTTP/1.1") == 0)
+            keep = xs_is_null(conn) || strcasecmp(conn, "close") != 0;
+        else
+            keep = !xs_is_null(conn) && strcasecmp(conn, "keep-alive") == 0;
+    }
 
     /* crop the q_path from leading / and the prefix */
     if (xs_endswith(q_path, "/"))
@@ -195,10 +266,18 @@ void httpd_connection(FILE *f)
     if (xs_startswith(q_path, p))
         q_path = xs_crop_i(q_path, strlen(p), 0);
 
+    /* big responses can be sent as they are built, but only
+       to HTTP/1.1 clients (chunked transfer encoding) */
+    if (strcmp(method, "GET") == 0 && strcmp(proto, "HTTP/1.1") == 0) {
+        st.f    = o;
+        st.keep = keep;
+        stream  = &st;
+    }
+
     if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
         /* cascade through */
         if (status == 0)
-            status = server_get_handler(req, q_path, &body, &b_size, &ctype);
+            status = server_get_handler(req, q_path, &body, &b_size, &ctype, stream);
 
         if (status == 0)
             status = webfinger_get_handler(req, q_path, &body, &b_size, &ctype);
@@ -211,11 +290,11 @@ void httpd_connection(FILE *f)
             status = oauth_get_handler(req, q_path, &body, &b_size, &ctype);
 
         if (status == 0)
-            status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype);
+            status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype, stream);
 #endif /* NO_MASTODON_API */
 
         if (status == 0)
-            status = html_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
+            status = html_get_handler(req, q_path, &body, &b_size, &ctype, &etag, stream);
     }
     else
     if (strcmp(method, "POST") == 0) {
@@ -253,6 +332,21 @@ void httpd_connection(FILE *f)
         status = 200;
     }
 
+    if (st.started) {
+        /* the response has already been sent (or is still being sent
+           by someone else, who now owns the connection) */
+        if (!st.held)
+            stream_end(&st);
+
+        fflush(o);
+
+        srv_archive("RECV", NULL, req, payload, p_size, status, headers, NULL, st.size);
+
+        xs_free(body);
+
+        return st.held ? 0 : keep;
+    }
+
     /* unattended? it's an error */
     if (status == 0) {
         srv_archive_error("unattended_method", "unattended method", req, payload);
@@ -279,11 +373,7 @@ void httpd_connection(FILE *f)
     if (ctype == NULL)
         ctype = "text/html; charset=utf-8";
 
-    headers = xs_dict_append(headers, "content-type", ctype);
-    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
-
-    if (!xs_is_null(etag))
-        headers = xs_dict_append(headers, "etag", etag);
+    headers = response_headers(headers, ctype, etag, keep);
 
     if (b_size == 0 && body != NULL)
         b_size = strlen(body);
@@ -292,12 +382,9 @@ void httpd_connection(FILE *f)
     if (strcmp(method, "HEAD") == 0)
         body = xs_free(body);
 
-    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
-    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
+    xs_httpd_response(o, status, headers, body, b_size);
 
-    xs_httpd_response(f, status, headers, body, b_size);
-
-    fclose(f);
+    fflush(o);
 
     srv_archive("RECV", NULL, req, payload, p_size, status, headers, body, b_size);
 
@@ -312,6 +399,8 @@ void httpd_connection(FILE *f)
     }
 
     xs_free(body);
+
+    return keep;
 }
 
 
@@ -388,6 +477,398 @@ void job_wait(xs_val **job)
 }
 
 
+#ifdef USE_EPOLL
+
+/** connections **/
+
+/* the main thread reads the requests from all connections as they arrive,
+   without blocking. Only complete requests are posted as jobs; when done,
+   the job thread gives the connection back through a pipe so that
+   it's kept alive waiting for more requests. The number of connections
+   and the size of the requests are limited, as they are all in memory */
+
+#define CONN_MAX_HEADER     (64 * 1024)
+#define CONN_READ_TIMEOUT   30      /* seconds to complete a request */
+#define CONN_IDLE_TIMEOUT   15      /* seconds to wait for a new request */
+
+typedef struct _httpd_conn {
+    struct _httpd_conn *prev;
+    struct _httpd_conn *next;
+    int fd;
+    int busy;                   /* being processed by a job thread */
+    int keep;                   /* to be kept alive after the request */
+    time_t last;                /* time it started waiting for a request */
+    time_t start;               /* time the current request started */
+    char *buf;                  /* data read */
+    int size;
+    int alloc;
+    int req_size;               /* size of the complete request, or 0 */
+} httpd_conn;
+
+static httpd_conn *conn_list = NULL;
+static int conn_epfd = -1;
+static int conn_pipe[2] = { -1, -1 };
+static int conn_count = 0;
+static int conn_max = 1024;             /* maximum number of connections */
+static long conn_max_body = 32 * 1024 * 1024; /* maximum request body size */
+
+
+static httpd_conn *conn_new(int fd)
+/* creates a new connection */
+{
+    httpd_conn *c = calloc(1, sizeof(httpd_conn));
+
+    if (c != NULL) {
+        c->fd   = fd;
+        c->last = time(NULL);
+
+        if ((c->next = conn_list) != NULL)
+            conn_list->prev = c;
+
+        conn_list = c;
+        conn_count++;
+    }
+
+    return c;
+}
+
+
+static void conn_free(httpd_conn *c)
+/* closes a connection */
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        conn_list = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    /* the socket may outlive it if it has been taken over */
+    epoll_ctl(conn_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+
+    conn_count--;
+}
+
+
+static int conn_read(httpd_conn *c)
+/* reads all available data from a connection; returns -1 on EOF or error */
+{
+    for (;;) {
+        if (c->alloc - c->size < 4096) {
+            char *nb = realloc(c->buf, c->alloc + 16384 + 1);
+
+            if (nb == NULL)
+                return -1;
+
+            c->buf    = nb;
+            c->alloc += 16384;
+        }
+
+        int r = recv(c->fd, c->buf + c->size, c->alloc - c->size, MSG_DONTWAIT);
+
+        if (r > 0) {
+            /* the deadline is not extended by further reads */
+            if (c->size == 0)
+                c->start = time(NULL);
+
+            c->size += r;
+            c->buf[c->size] = '\0';
+        }
+        else
+        if (r == -1 && errno == EINTR)
+            continue;
+        else
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else
+            return -1;
+    }
+}
+
+
+static int conn_request_size(httpd_conn *c)
+/* returns the size of the first request in the buffer if it's complete,
+   0 if it's not, -1 if it's garbage, -2 if its size is unknown
+   or -3 if it's too big */
+{
+    char *e;
+    int h_size;
+
+    if (c->size == 0)
+        return 0;
+
+    if ((e = xs_memmem(c->buf, c->size, "\r\n\r\n", 4)) == NULL)
+        return c->size > CONN_MAX_HEADER ? -1 : 0;
+
+    h_size = e - c->buf + 4;
+
+    if (h_size > CONN_MAX_HEADER)
+        return -1;
+
+    /* search the content length among the headers, parsing
+       them exactly as xs_httpd_request() will do */
+    long cl = 0;
+    int n_cl = 0;
+    char *p = xs_memmem(c->buf, h_size, "\r\n", 2) + 2;
+    char *h_end = e + 2;
+
+    /* the request line is read up to the first newline */
+    if (memchr(c->buf, '\n', p - 2 - c->buf) != NULL || memchr(c->buf, '\0', p - c->buf) != NULL)
+        return -1;
+
+    while (p < h_end) {
+        char *q = xs_memmem(p, h_end - p, "\r\n", 2);
+        xs *line = xs_str_new(NULL);
+        xs *hdr  = NULL;
+
+        line = xs_append_m(line, p, q - p);
+
+        /* continuation lines, stray line ends or NULs are not accepted */
+        if (*p == ' ' || *p == '\t' || (int) strlen(line) != q - p ||
+            (hdr = xs_httpd_header(line)) == NULL)
+            return -1;
+
+        const char *name = xs_list_get(hdr, 0);
+
+        /* the size of chunked requests cannot be known */
+        if (strcmp(name, "transfer-encoding") == 0)
+            return -2;
+
+        if (strcmp(name, "content-length") == 0 &&
+            (n_cl++ || (cl = xs_httpd_content_length(xs_list_get(hdr, 1))) < 0))
+            return -1;
+
+        p = q + 2;
+    }
+
+    if (cl > conn_max_body || cl > INT_MAX - h_size)
+        return -3;
+
+    return c->size >= h_size + cl ? h_size + cl : 0;
+}
+
+
+static void conn_dispatch(httpd_conn *c)
+/* posts a connection as a job if it has a complete request,
+   or waits for more data */
+{
+    if ((c->req_size = conn_request_size(c)) > 0) {
+        xs *job = xs_data_new(&c, sizeof(c));
+
+        c->busy = 1;
+        job_post(job, 1);
+    }
+    else
+    if (c->req_size < 0) {
+        /* tell the client before closing; it's not a problem if it fails */
+        const char *resp =
+            c->req_size == -3 ?
+            "HTTP/1.1 413 Payload Too Large\r\n"
+            "content-length: 0\r\nconnection: close\r\n\r\n" :
+            c->req_size == -2 ?
+            "HTTP/1.1 411 Length Required\r\n"
+            "content-length: 0\r\nconnection: close\r\n\r\n" :
+            "HTTP/1.1 400 Bad Request\r\n"
+            "content-length: 0\r\nconnection: close\r\n\r\n";
+
+        srv_debug(1, xs_fmt("conn_dispatch bad request"));
+
+        if (write(c->fd, resp, strlen(resp)) == -1)
+            srv_debug(2, xs_fmt("conn_dispatch cannot send error: %s", strerror(errno)));
+
+        conn_free(c);
+    }
+    else {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = c };
+
+        if (epoll_ctl(conn_epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+            conn_free(c);
+    }
+}
+
+
+static void conn_process(httpd_conn *c)
+/* processes the request of a connection (called from the job threads) */
+{
+    FILE *f = fmemopen(c->buf, c->req_size, "r");
+    int fd  = dup(c->fd);
+    FILE *o = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    c->keep = 0;
+
+    if (f != NULL && o != NULL)
+        c->keep = httpd_connection(f, o, 1);
+
+    if (f != NULL)
+        fclose(f);
+
+    if (o != NULL)
+        fclose(o);
+    else
+    if (fd != -1)
+        close(fd);
+
+    /* drop the request, keeping anything after it (pipelining) */
+    c->size -= c->req_size;
+    memmove(c->buf, c->buf + c->req_size, c->size + 1);
+    c->req_size = 0;
+
+    /* give it back */
+    if (write(conn_pipe[1], &c, sizeof(c)) != sizeof(c))
+        srv_log(xs_fmt("conn_process cannot give back connection (errno: %d)", errno));
+}
+
+
+static int conn_shed(void)
+/* closes the connection that has been idle for the longest time;
+   returns 0 if there is none */
+{
+    httpd_conn *c, *o = NULL;
+
+    for (c = conn_list; c != NULL; c = c->next) {
+        if (!c->busy && c->size == 0 && (o == NULL || c->last <= o->last))
+            o = c;
+    }
+
+    if (o == NULL)
+        return 0;
+
+    conn_free(o);
+    return 1;
+}
+
+
+static void conn_accept(int rs)
+/* accepts all pending connections */
+{
+    int cs;
+
+    while ((cs = accept(rs, NULL, NULL)) != -1) {
+        int i = 1;
+        setsockopt(cs, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+
+        if (conn_count >= conn_max && !conn_shed()) {
+            /* too many connections, and all of them are doing something */
+            const char *resp = "HTTP/1.1 503 Service Unavailable\r\n"
+                "content-length: 0\r\nconnection: close\r\n\r\n";
+
+            srv_debug(1, xs_fmt("conn_accept too many connections"));
+
+            if (write(cs, resp, strlen(resp)) == -1)
+                srv_debug(2, xs_fmt("conn_accept cannot send error: %s", strerror(errno)));
+
+            close(cs);
+            continue;
+        }
+
+        httpd_conn *c = conn_new(cs);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = c };
+
+        if (c == NULL)
+            close(cs);
+        else
+        if (epoll_ctl(conn_epfd, EPOLL_CTL_ADD, cs, &ev) == -1)
+            conn_free(c);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        srv_log(xs_fmt("conn_accept error (errno: %d)", errno));
+}
+
+
+static void conn_expire(void)
+/* closes the connections that have been waiting for too long */
+{
+    time_t t = time(NULL);
+    httpd_conn *c, *n;
+
+    for (c = conn_list; c != NULL; c = n) {
+        n = c->next;
+
+        if (!c->busy && (c->size ? t - c->start > CONN_READ_TIMEOUT :
+                                   t - c->last > CONN_IDLE_TIMEOUT))
+            conn_free(c);
+    }
+}
+
+
+static void conn_loop(int rs)
+/* the connection event loop */
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    time_t expire_time = time(NULL);
+    const xs_number *v;
+
+    if (xs_type(v = xs_dict_get(srv_config, "max_connections")) == XSTYPE_NUMBER &&
+        xs_number_get(v) > 0)
+        conn_max = xs_number_get(v);
+
+    if (xs_type(v = xs_dict_get(srv_config, "max_request_mb")) == XSTYPE_NUMBER &&
+        xs_number_get(v) > 0)
+        conn_max_body = (long) (xs_number_get(v) * 1024 * 1024);
+
+    fcntl(rs, F_SETFL, fcntl(rs, F_GETFL) | O_NONBLOCK);
+    fcntl(conn_pipe[0], F_SETFL, fcntl(conn_pipe[0], F_GETFL) | O_NONBLOCK);
+    epoll_ctl(conn_epfd, EPOLL_CTL_ADD, rs, &ev);
+
+    ev.data.ptr = &conn_pipe;
+    epoll_ctl(conn_epfd, EPOLL_CTL_ADD, conn_pipe[0], &ev);
+
+    for (;;) {
+        struct epoll_event evs[64];
+        int n, i, acc = 0;
+
+        if ((n = epoll_wait(conn_epfd, evs, 64, 1000)) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            srv_log(xs_fmt("conn_loop epoll error (errno: %d)", errno));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            httpd_conn *c = evs[i].data.ptr;
+
+            if (c == NULL)
+                acc = 1;
+            else
+            if ((void *)c == (void *)&conn_pipe) {
+                /* connections given back by the job threads */
+                while (read(conn_pipe[0], &c, sizeof(c)) == sizeof(c)) {
+                    c->busy = 0;
+                    c->last = c->start = time(NULL);
+
+                    if (c->keep)
+                        conn_dispatch(c);
+                    else
+                        conn_free(c);
+                }
+            }
+            else
+            if (conn_read(c) == -1)
+                conn_free(c);
+            else
+                conn_dispatch(c);
+        }
+
+        /* accepted after the events, as connections may be shed */
+        if (acc)
+            conn_accept(rs);
+
+        if (time(NULL) > expire_time) {
+            expire_time = time(NULL);
+            conn_expire();
+        }
+    }
+}
+
+#endif /* USE_EPOLL */
+
+
 #ifndef MAX_THREADS
 #define MAX_THREADS 256
 #endif
@@ -409,19 +890,36 @@ static void *job_thread(void *arg)
         if (job == NULL)
             break;
 
+        /* everything created while attending the job is released at once */
+        xs_arena_begin();
+
         if (xs_type(job) == XSTYPE_DATA) {
+#ifdef USE_EPOLL
+            /* it's a connection with a complete request */
+            httpd_conn *c = NULL;
+
+            xs_data_get(job, &c);
+
+            if (c != NULL)
+                conn_process(c);
+#else
             /* it's a socket */
             FILE *f = NULL;
 
             xs_data_get(job, &f);
 
-            if (f != NULL)
-                httpd_connection(f);
+            if (f != NULL) {
+                httpd_connection(f, f, 0);
+                fclose(f);
+            }
+#endif
         }
         else {
             /* it's a q_item */
             process_queue_item(job);
         }
+
+        xs_arena_end();
     }
 
     srv_debug(1, xs_fmt("job thread %d stopped", pid));
@@ -429,45 +927,38 @@ static void *job_thread(void *arg)
     return NULL;
 }
 
-/* background thread sleep control */
-static pthread_mutex_t sleep_mutex;
-static pthread_cond_t  sleep_cond;
-
 static void *background_thread(void *arg)
 /* background thread (queue management and other things) */
 {
     time_t purge_time;
+    time_t flush_time;
 
     (void)arg;
 
     /* first purge time */
     purge_time = time(NULL) + 10 * 60;
+    flush_time = time(NULL) + 60;
 
     srv_log(xs_fmt("background thread started"));
 
+    /* load the pending queue items */
+    queue_sched_start();
+
     while (srv_running) {
         time_t t;
-        int cnt = 0;
 
-        {
-            xs *list = user_list();
-            char *p, *uid;
+        /* process the queue items as they become due */
+        process_queues((purge_time < flush_time ? purge_time : flush_time) - time(NULL));
 
-            /* process queues for all users */
-            p = list;
-            while (xs_list_iter(&p, &uid)) {
-                snac snac;
+        /* time to write the search logs? */
+        if ((t = time(NULL)) > flush_time) {
+            flush_time = t + 60;
 
-                if (user_open(&snac, uid)) {
-                    cnt += process_user_queue(&snac);
-                    user_free(&snac);
-                }
-            }
+            xs *q_item = xs_dict_new();
+            q_item = xs_dict_append(q_item, "type", "search_flush");
+            job_post(q_item, 0);
         }
 
-        /* global queue */
-        cnt += process_queue();
-
         /* time to purge? */
         if ((t = time(NULL)) > purge_time) {
             /* next purge time is tomorrow */
@@ -477,23 +968,6 @@ static void *background_thread(void *arg)
             q_item = xs_dict_append(q_item, "type", "purge");
             job_post(q_item, 0);
         }
-
-        if (cnt == 0) {
-            /* sleep 3 seconds */
-
-#ifdef USE_POLL_FOR_SLEEP
-            poll(NULL, 0, 3 * 1000);
-#else
-            struct timespec ts;
-
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 3;
-
-            pthread_mutex_lock(&sleep_mutex);
-            while (pthread_cond_timedwait(&sleep_cond, &sleep_mutex, &ts) == 0);
-            pthread_mutex_unlock(&sleep_mutex);
-#endif
-        }
     }
 
     srv_log(xs_fmt("background thread stopped"));
@@ -555,10 +1029,6 @@ void httpd(void)
 
     job_fifo = xs_list_new();
 
-    /* initialize sleep control */
-    pthread_mutex_init(&sleep_mutex, NULL);
-    pthread_cond_init(&sleep_cond, NULL);
-
     n_threads = xs_number_get(xs_dict_get(srv_config, "num_threads"));
 
 #ifdef _SC_NPROCESSORS_ONLN
@@ -576,6 +1046,14 @@ void httpd(void)
 
     srv_debug(0, xs_fmt("using %d threads", n_threads));
 
+    /* start the delivery engine for output messages */
+    deliver_start();
+
+#ifndef NO_MASTODON_API
+    /* start the streaming API */
+    mastoapi_stream_start();
+#endif
+
     /* thread #0 is the background thread */
     pthread_create(&threads[0], NULL, background_thread, NULL);
 
@@ -584,6 +1062,17 @@ void httpd(void)
     for (n = 1; n < n_threads; n++)
         pthread_create(&threads[n], NULL, job_thread, ptr++);
 
+#ifdef USE_EPOLL
+    conn_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (conn_epfd == -1 || pipe(conn_pipe) == -1) {
+        srv_log(xs_fmt("fatal error: cannot create the connection loop -- cannot continue"));
+        srv_running = 0;
+    }
+    else
+    if (setjmp(on_break) == 0)
+        conn_loop(rs);
+#else
     if (setjmp(on_break) == 0) {
         for (;;) {
             FILE *f = xs_socket_accept(rs);
@@ -596,9 +1085,13 @@ void httpd(void)
                 break;
         }
     }
+#endif
 
     srv_running = 0;
 
+    /* wake up the background thread */
+    queue_sched_wake();
+
     /* send as many empty jobs as working threads */
     for (n = 1; n < n_threads; n++)
         job_post(NULL, 0);
@@ -607,10 +1100,28 @@ void httpd(void)
     for (n = 0; n < n_threads; n++)
         pthread_join(threads[n], NULL);
 
+#ifndef NO_MASTODON_API
+    /* disconnect the streaming clients */
+    mastoapi_stream_stop();
+#endif
+
+    /* no more output messages can be posted */
+    deliver_stop();
+
     pthread_mutex_lock(&job_mutex);
     job_fifo = xs_free(job_fifo);
     pthread_mutex_unlock(&job_mutex);
 
+#ifdef USE_EPOLL
+    /* close all connections */
+    while (conn_list != NULL)
+        conn_free(conn_list);
+
+    close(conn_pipe[0]);
+    close(conn_pipe[1]);
+    close(conn_epfd);
+#endif
+
     sem_close(job_sem);
     sem_unlink(sem_name);
 
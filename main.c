@@ -4,6 +4,7 @@
 #include "xs.h"
 #include "xs_io.h"
 #include "xs_json.h"
+#include "xs_time.h"
 
 #include "snac.h"
 
@@ -21,6 +22,7 @@ int usage(void)
     printf("adduser {basedir} [{uid}]           Adds a new user\n");
     printf("httpd {basedir}                     Starts the HTTPD daemon\n");
     printf("purge {basedir}                     Purges old data\n");
+    printf("hosts {basedir}                     Shows the remote hosts failing to get messages\n");
     printf("webfinger {basedir} {actor}         Queries about an actor (@user@host or actor url)\n");
     printf("queue {basedir} {uid}               Processes a user queue\n");
     printf("follow {basedir} {uid} {actor}      Follows an actor\n");
@@ -37,6 +39,8 @@ int usage(void)
     printf("unblock {basedir} {instance_url}    Unblocks a full instance\n");
     printf("limit {basedir} {uid} {actor}       Limits an actor (drops their announces)\n");
     printf("unlimit {basedir} {uid} {actor}     Unlimits an actor\n");
+    printf("search {basedir} {uid} {'query'}    Searches the timeline of a user\n");
+    printf("reindex {basedir} {uid}             Rebuilds the search and hashtag indexes\n");
 
 /*    printf("question {basedir} {uid} 'opts'  Generates a poll (;-separated opts)\n");*/
 
@@ -127,6 +131,28 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "hosts") == 0) { /** **/
+        xs *hosts = host_list();
+        xs_dict *p = hosts;
+        xs_str *k;
+        xs_dict *v;
+
+        while (xs_dict_iter(&p, &k, &v)) {
+            time_t until = xs_number_get(xs_dict_get(v, "until"));
+            time_t since = xs_number_get(xs_dict_get(v, "since"));
+            xs *s_until  = until ? xs_str_utctime(until, ISO_DATE_SPEC) : xs_str_new("-");
+            xs *s_since  = xs_str_utctime(since, ISO_DATE_SPEC);
+
+            printf("%s %s fails:%d status:%d since:%s until:%s\n", k,
+                (char *)xs_dict_get(v, "state"),
+                (int) xs_number_get(xs_dict_get(v, "fails")),
+                (int) xs_number_get(xs_dict_get(v, "status")),
+                s_since, s_until);
+        }
+
+        return 0;
+    }
+
     if ((user = GET_ARGV()) == NULL)
         return usage();
 
@@ -203,6 +229,22 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "reindex") == 0) { /** **/
+        int cnt = search_rebuild(&snac);
+
+        if (cnt < 0) {
+            fprintf(stderr, "error rebuilding the search index\n");
+            return 1;
+        }
+
+        printf("%d entries indexed\n", cnt);
+
+        cnt = tag_rebuild(&snac);
+        printf("%d entries with hashtags indexed\n", cnt);
+
+        return 0;
+    }
+
     if ((url = GET_ARGV()) == NULL)
         return usage();
 
@@ -320,6 +362,21 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (strcmp(cmd, "search") == 0) { /** **/
+        xs *list = search_query(&snac, url, 0, 256);
+        xs_list *p = list;
+        xs_str *v;
+
+        while (xs_list_iter(&p, &v)) {
+            xs *msg = NULL;
+
+            if (valid_status(timeline_get_by_md5(&snac, v, &msg)))
+                printf("%s\n", xs_dict_get(msg, "id"));
+        }
+
+        return 0;
+    }
+
     if (strcmp(cmd, "pin") == 0) { /** **/
         int ret = pin(&snac, url);
         if (ret < 0) {
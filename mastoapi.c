@@ -15,6 +15,10 @@
 
 #include "snac.h"
 
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+
 static xs_str *random_str(void)
 /* just what is says in the tin */
 {
@@ -477,6 +481,16 @@ xs_str *mastoapi_id(const xs_dict *msg)
 #define MID_TO_MD5(id) (id + 10)
 
 
+static int timeline_pos(snac *user, const char *idx_name, const char *mid)
+/* returns the position of a status id in a timeline, or -1 */
+{
+    if (xs_is_null(mid) || strlen(mid) <= 10)
+        return -1;
+
+    return timeline_seek(user, idx_name, MID_TO_MD5(mid));
+}
+
+
 xs_dict *mastoapi_account(const xs_dict *actor)
 /* converts an ActivityPub actor to a Mastodon account */
 {
@@ -638,15 +652,22 @@ xs_dict *mastoapi_poll(snac *snac, const xs_dict *msg)
 xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
 /* converts an ActivityPub note to a Mastodon status */
 {
+    xs_dict_index mi;
     xs *actor = NULL;
-    actor_get(xs_dict_get(msg, "attributedTo"), &actor);
+
+    /* lots of fields are read from the message */
+    xs_dict_index_init(&mi, msg);
+
+    actor_get(xs_dict_index_get(&mi, "attributedTo"), &actor);
 
     /* if the author is not here, discard */
-    if (actor == NULL)
+    if (actor == NULL) {
+        xs_dict_index_free(&mi);
         return NULL;
+    }
 
-    const char *type = xs_dict_get(msg, "type");
-    const char *id   = xs_dict_get(msg, "id");
+    const char *type = xs_dict_index_get(&mi, "type");
+    const char *id   = xs_dict_index_get(&mi, "id");
 
     xs *acct = mastoapi_account(actor);
 
@@ -660,12 +681,12 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     st = xs_dict_append(st, "id",           mid);
     st = xs_dict_append(st, "uri",          id);
     st = xs_dict_append(st, "url",          id);
-    st = xs_dict_append(st, "created_at",   xs_dict_get(msg, "published"));
+    st = xs_dict_append(st, "created_at",   xs_dict_index_get(&mi, "published"));
     st = xs_dict_append(st, "account",      acct);
 
     {
-        const char *content = xs_dict_get(msg, "content");
-        const char *name    = xs_dict_get(msg, "name");
+        const char *content = xs_dict_index_get(&mi, "content");
+        const char *name    = xs_dict_index_get(&mi, "name");
         xs *s1 = NULL;
 
         if (name)
@@ -679,13 +700,13 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     st = xs_dict_append(st, "visibility",
         is_msg_public(msg) ? "public" : "private");
 
-    tmp = xs_dict_get(msg, "sensitive");
+    tmp = xs_dict_index_get(&mi, "sensitive");
     if (xs_is_null(tmp))
         tmp = xs_stock_false;
 
     st = xs_dict_append(st, "sensitive",    tmp);
 
-    tmp = xs_dict_get(msg, "summary");
+    tmp = xs_dict_index_get(&mi, "summary");
     if (xs_is_null(tmp))
         tmp = "";
 
@@ -693,7 +714,7 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
 
     /* create the list of attachments */
     xs *matt = xs_list_new();
-    xs_list *att = xs_dict_get(msg, "attachment");
+    xs_list *att = xs_dict_index_get(&mi, "attachment");
     xs_str *aobj;
     xs *attr_list = NULL;
 
@@ -705,7 +726,7 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
         attr_list = xs_dup(att);
 
     /* if it has an image, add it as an attachment */
-    xs_dict *image = xs_dict_get(msg, "image");
+    xs_dict *image = xs_dict_index_get(&mi, "image");
     if (!xs_is_null(image))
         attr_list = xs_list_append(attr_list, image);
 
@@ -744,7 +765,7 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
         xs *ml  = xs_list_new();
         xs *htl = xs_list_new();
         xs *eml = xs_list_new();
-        xs_list *p = xs_dict_get(msg, "tag");
+        xs_list *p = xs_dict_index_get(&mi, "tag");
         xs_dict *v;
         int n = 0;
 
@@ -844,7 +865,7 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     st = xs_dict_append(st, "in_reply_to_id",         xs_stock_null);
     st = xs_dict_append(st, "in_reply_to_account_id", xs_stock_null);
 
-    tmp = xs_dict_get(msg, "inReplyTo");
+    tmp = xs_dict_index_get(&mi, "inReplyTo");
     if (!xs_is_null(tmp)) {
         xs *irto = NULL;
 
@@ -864,13 +885,13 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     st = xs_dict_append(st, "card",     xs_stock_null);
     st = xs_dict_append(st, "language", xs_stock_null);
 
-    tmp = xs_dict_get(msg, "sourceContent");
+    tmp = xs_dict_index_get(&mi, "sourceContent");
     if (xs_is_null(tmp))
         tmp = "";
 
     st = xs_dict_append(st, "text", tmp);
 
-    tmp = xs_dict_get(msg, "updated");
+    tmp = xs_dict_index_get(&mi, "updated");
     if (xs_is_null(tmp))
         tmp = xs_stock_null;
 
@@ -888,6 +909,8 @@ xs_dict *mastoapi_status(snac *snac, const xs_dict *msg)
     st = xs_dict_append(st, "pinned",
         (snac && is_pinned(snac, id)) ? xs_stock_true : xs_stock_false);
 
+    xs_dict_index_free(&mi);
+
     return st;
 }
 
@@ -926,6 +949,69 @@ xs_dict *mastoapi_relationship(snac *snac, const char *md5)
 }
 
 
+xs_dict *mastoapi_notification(snac *snac, const xs_dict *noti, const xs_list *excl)
+/* converts a notification to a Mastodon one, or NULL if it cannot be shown */
+{
+    const char *type  = xs_dict_get(noti, "type");
+    const char *utype = xs_dict_get(noti, "utype");
+    const char *objid = xs_dict_get(noti, "objid");
+    xs *actor = NULL;
+    xs *entry = NULL;
+
+    if (!valid_status(actor_get(xs_dict_get(noti, "actor"), &actor)))
+        return NULL;
+
+    if (objid != NULL && !valid_status(object_get(objid, &entry)))
+        return NULL;
+
+    if (is_hidden(snac, objid))
+        return NULL;
+
+    /* convert the type */
+    if (strcmp(type, "Like") == 0)
+        type = "favourite";
+    else
+    if (strcmp(type, "Announce") == 0)
+        type = "reblog";
+    else
+    if (strcmp(type, "Follow") == 0)
+        type = "follow";
+    else
+    if (strcmp(type, "Create") == 0)
+        type = "mention";
+    else
+    if (strcmp(type, "Update") == 0 && strcmp(utype, "Question") == 0)
+        type = "poll";
+    else
+        return NULL;
+
+    /* excluded type? */
+    if (!xs_is_null(excl) && xs_list_in(excl, type) != -1)
+        return NULL;
+
+    xs_dict *mn = xs_dict_new();
+
+    mn = xs_dict_append(mn, "type", type);
+
+    xs *id = xs_replace(xs_dict_get(noti, "id"), ".", "");
+    mn = xs_dict_append(mn, "id", id);
+
+    mn = xs_dict_append(mn, "created_at", xs_dict_get(noti, "date"));
+
+    xs *acct = mastoapi_account(actor);
+    mn = xs_dict_append(mn, "account", acct);
+
+    if (strcmp(type, "follow") != 0 && !xs_is_null(objid)) {
+        xs *st = mastoapi_status(snac, entry);
+
+        if (st)
+            mn = xs_dict_append(mn, "status", st);
+    }
+
+    return mn;
+}
+
+
 int process_auth_token(snac *snac, const xs_dict *req)
 /* processes an authorization token, if there is one */
 {
@@ -959,8 +1045,586 @@ int process_auth_token(snac *snac, const xs_dict *req)
 }
 
 
+/** timelines **/
+
+/* timelines are built as a JSON list item by item; if there is a stream,
+   they are also sent in pieces as they are converted */
+
+#define STATUS_LIST_CHUNK_SIZE 16384
+
+typedef struct {
+    http_stream *stream;
+    xs_sb b;
+    int n;
+} status_list;
+
+
+static void status_list_start(status_list *l, http_stream *stream)
+/* starts a list of statuses */
+{
+    l->stream = stream;
+    l->n      = 0;
+
+    xs_sb_init(&l->b);
+    xs_sb_cat(&l->b, "[");
+
+    if (stream != NULL)
+        stream_start(stream, 200, "application/json");
+}
+
+
+static void status_list_flush(status_list *l, int min)
+/* sends what has been built so far, if it's enough */
+{
+    if (l->stream != NULL && l->b.len >= min) {
+        stream_write(l->stream, l->b.s, l->b.len);
+
+        l->b.len  = 0;
+        l->b.s[0] = '\0';
+    }
+}
+
+
+static void status_list_add(status_list *l, const xs_dict *st)
+/* adds a status to the list */
+{
+    /* same layout as xs_json_dumps() with an indentation of 4 */
+    xs_sb_cat(&l->b, l->n ? ",\n    " : "\n    ");
+    xs_json_dump_sb(st, 1, 4, &l->b);
+
+    l->n++;
+
+    status_list_flush(l, STATUS_LIST_CHUNK_SIZE);
+}
+
+
+static xs_str *status_list_end(status_list *l)
+/* ends a list of statuses; returns it as a string if it was not streamed */
+{
+    xs_sb_cat(&l->b, "\n]");
+
+    if (l->stream != NULL) {
+        status_list_flush(l, 0);
+        xs_sb_free(&l->b);
+
+        return NULL;
+    }
+
+    return xs_sb_result(&l->b);
+}
+
+
+static int is_home_entry(snac *user, const xs_dict *msg)
+/* checks if a timeline entry is to be shown in the home timeline */
+{
+    /* discard non-Notes */
+    const char *type = xs_dict_get(msg, "type");
+    if (strcmp(type, "Note") != 0 && strcmp(type, "Question") != 0)
+        return 0;
+
+#if 0
+    /* discard notes from people we don't follow with no boosts */
+    if (!following_check(user, xs_dict_get(msg, "attributedTo")) &&
+        object_announces_len(xs_dict_get(msg, "id")) == 0)
+        return 0;
+#endif
+
+    /* discard notes without an author */
+    if (xs_is_null(xs_dict_get(msg, "attributedTo")))
+        return 0;
+
+    /* discard notes from muted morons */
+    if (is_muted(user, xs_dict_get(msg, "attributedTo")))
+        return 0;
+
+    /* discard hidden notes */
+    if (is_hidden(user, xs_dict_get(msg, "id")))
+        return 0;
+
+    /* discard poll votes (they have a name) */
+    if (!xs_is_null(xs_dict_get(msg, "name")))
+        return 0;
+
+    return 1;
+}
+
+
+static xs_str *timeline_page(snac *user, const char *idx_name,
+                             const xs_dict *args, http_stream *stream)
+/* returns a page of a timeline (the private one or a hashtag's),
+   according to the Mastodon API pagination arguments */
+{
+    const char *max_id   = xs_dict_get(args, "max_id");
+    const char *since_id = xs_dict_get(args, "since_id");
+    const char *min_id   = xs_dict_get(args, "min_id");
+    const char *limit_s  = xs_dict_get(args, "limit");
+    int limit = 0;
+    int cnt   = 0;
+
+    if (!xs_is_null(limit_s))
+        limit = atoi(limit_s);
+
+    /* same default and maximum as Mastodon */
+    if (limit <= 0)
+        limit = 20;
+    else
+    if (limit > 40)
+        limit = 40;
+
+    /* seek into the timeline index; if max_id is not there, there is nothing */
+    int hi  = max_id ? timeline_pos(user, idx_name, max_id) : timeline_seek(user, idx_name, NULL);
+    int lo  = 0;
+    int asc = 0;
+    int pos, end;
+
+    /* min_id returns the entries immediately newer than it,
+       since_id the newest ones */
+    if (min_id && (lo = timeline_pos(user, idx_name, min_id) + 1) > 0)
+        asc = 1;
+    else
+    if (since_id)
+        lo = timeline_pos(user, idx_name, since_id) + 1;
+
+    if (asc) {
+        pos = lo;
+        end = hi;
+    }
+    else {
+        pos = hi - 1;
+        end = lo - 1;
+    }
+
+    status_list out;
+    xs *asc_sts = xs_list_new();
+
+    status_list_start(&out, stream);
+
+    while (hi > lo && cnt < limit && pos != end && pos >= 0) {
+        xs *page   = timeline_range(user, idx_name, &pos, end, limit - cnt);
+        xs_list *p = page;
+        xs_str *v;
+
+        if (xs_list_len(page) == 0)
+            break;
+
+        while (xs_list_iter(&p, &v)) {
+            xs *msg = NULL;
+
+            /* get the entry */
+            if (!valid_status(timeline_get_by_md5(user, v, &msg)))
+                continue;
+
+            if (!is_home_entry(user, msg))
+                continue;
+
+            /* convert the Note into a Mastodon status */
+            xs *st = mastoapi_status(user, msg);
+
+            if (st != NULL) {
+                if (asc)
+                    asc_sts = xs_list_insert(asc_sts, 0, st);
+                else
+                    status_list_add(&out, st);
+            }
+
+            cnt++;
+        }
+    }
+
+    {
+        xs_list *p = asc_sts;
+        xs_dict *st;
+
+        while (xs_list_iter(&p, &st))
+            status_list_add(&out, st);
+    }
+
+    srv_debug(2, xs_fmt("mastoapi timeline: returned %d entries", out.n));
+
+    return status_list_end(&out);
+}
+
+
+/** streaming **/
+
+/* the connections of the clients of the streaming API are taken over
+   from the web server and kept in a list. timeline_add() and notify_add()
+   post their events to a queue, and a thread converts them to Mastodon
+   entities and sends them as server-sent events (each one a chunk of a
+   never-ending chunked response). A comment is sent to idle clients
+   every few seconds, to find out which ones are gone. Clients are never
+   waited for: if one is not reading, it's disconnected */
+
+#define STREAM_HEARTBEAT    15          /* seconds */
+#define STREAM_MAX_CLIENTS  1024
+#define STREAM_MAX_QUEUE    1024        /* events waiting to be sent */
+
+#define STREAM_USER         0x1         /* home timeline */
+#define STREAM_NOTIFY       0x2         /* notifications */
+#define STREAM_PUBLIC       0x4         /* instance timeline */
+
+typedef struct _stream_client {
+    struct _stream_client *next;
+    int fd;
+    int streams;                        /* STREAM_* flags */
+    char *uid;                          /* NULL if not logged in */
+} stream_client;
+
+typedef struct _stream_event {
+    struct _stream_event *next;
+    char *uid;                          /* NULL for the public stream */
+    const char *event;                  /* "update" or "notification" */
+    xs_val *data;                       /* object id or notification */
+} stream_event;
+
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_cond   = PTHREAD_COND_INITIALIZER;
+static pthread_t stream_thread;
+static int stream_running = 0;
+static stream_client *stream_clients = NULL;
+static int stream_n_clients = 0;
+static stream_event *stream_head = NULL;
+static stream_event *stream_tail = NULL;
+static int stream_queued = 0;
+
+
+static void stream_event_free(stream_event *e)
+{
+    free(e->uid);
+    xs_free(e->data);
+    free(e);
+}
+
+
+static int stream_send(stream_client *c, const char *data)
+/* sends a chunk to a client; returns 0 if it's gone or too slow */
+{
+    xs *chunk = xs_fmt("%x\r\n%s\r\n", (int) strlen(data), data);
+    int size  = strlen(chunk);
+
+    /* a partial write would break the chunked encoding, so a client
+       that doesn't have room for a full event is as good as gone */
+    return send(c->fd, chunk, size, MSG_DONTWAIT) == size;
+}
+
+
+static void stream_broadcast(int streams, const char *uid, const char *data)
+/* sends data to the clients of the streams (must be locked) */
+{
+    stream_client **pc = &stream_clients;
+    stream_client *c;
+
+    while ((c = *pc) != NULL) {
+        if ((c->streams & streams) &&
+            (uid == NULL || (c->uid != NULL && strcmp(c->uid, uid) == 0)) &&
+            !stream_send(c, data)) {
+            srv_debug(1, xs_fmt("streaming client for '%s' gone", c->uid ? c->uid : ""));
+
+            *pc = c->next;
+            close(c->fd);
+            free(c->uid);
+            free(c);
+            stream_n_clients--;
+        }
+        else
+            pc = &c->next;
+    }
+}
+
+
+static xs_str *stream_event_data(stream_event *e, int *streams)
+/* converts an event to its SSE text, or NULL if there is nothing to send */
+{
+    xs *entity = NULL;
+
+    if (e->uid == NULL) {
+        /* a post in the instance timeline, as seen by anybody */
+        xs *msg = NULL;
+
+        *streams = STREAM_PUBLIC;
+
+        if (valid_status(object_get(e->data, &msg)))
+            entity = mastoapi_status(NULL, msg);
+    }
+    else {
+        snac user;
+
+        if (!user_open(&user, e->uid))
+            return NULL;
+
+        if (strcmp(e->event, "notification") == 0) {
+            *streams = STREAM_NOTIFY;
+            entity   = mastoapi_notification(&user, e->data, NULL);
+        }
+        else {
+            xs *msg = NULL;
+
+            *streams = STREAM_USER;
+
+            if (valid_status(object_get(e->data, &msg)) && is_home_entry(&user, msg))
+                entity = mastoapi_status(&user, msg);
+        }
+
+        user_free(&user);
+    }
+
+    if (entity == NULL)
+        return NULL;
+
+    xs *j = xs_json_dumps(entity, 0);
+
+    return xs_fmt("event: %s\ndata: %s\n\n", e->event, j);
+}
+
+
+static void stream_event_send(stream_event *e)
+/* converts an event and sends it to its clients */
+{
+    int streams = 0;
+    xs *data    = stream_event_data(e, &streams);
+
+    if (data != NULL) {
+        pthread_mutex_lock(&stream_mutex);
+        stream_broadcast(streams, e->uid, data);
+        pthread_mutex_unlock(&stream_mutex);
+    }
+}
+
+
+static void *stream_thread_f(void *arg)
+/* the streaming thread */
+{
+    time_t beat = time(NULL) + STREAM_HEARTBEAT;
+
+    (void)arg;
+
+    pthread_mutex_lock(&stream_mutex);
+
+    while (stream_running) {
+        stream_event *e = stream_head;
+
+        if (e == NULL) {
+            struct timespec ts = { beat, 0 };
+
+            if (pthread_cond_timedwait(&stream_cond, &stream_mutex, &ts) == ETIMEDOUT) {
+                stream_broadcast(STREAM_USER | STREAM_NOTIFY | STREAM_PUBLIC, NULL, ":thump\n\n");
+                beat = time(NULL) + STREAM_HEARTBEAT;
+            }
+
+            continue;
+        }
+
+        if ((stream_head = e->next) == NULL)
+            stream_tail = NULL;
+
+        stream_queued--;
+
+        /* convert it unlocked, as it reads from disk */
+        pthread_mutex_unlock(&stream_mutex);
+
+        xs_arena_begin();
+        stream_event_send(e);
+        xs_arena_end();
+
+        stream_event_free(e);
+
+        pthread_mutex_lock(&stream_mutex);
+    }
+
+    pthread_mutex_unlock(&stream_mutex);
+
+    return NULL;
+}
+
+
+void mastoapi_stream_start(void)
+/* starts the streaming thread */
+{
+    stream_running = 1;
+
+    pthread_create(&stream_thread, NULL, stream_thread_f, NULL);
+}
+
+
+void mastoapi_stream_stop(void)
+/* stops the streaming thread and closes all clients */
+{
+    if (!stream_running)
+        return;
+
+    pthread_mutex_lock(&stream_mutex);
+    stream_running = 0;
+    pthread_cond_signal(&stream_cond);
+    pthread_mutex_unlock(&stream_mutex);
+
+    pthread_join(stream_thread, NULL);
+
+    while (stream_clients != NULL) {
+        stream_client *c = stream_clients;
+
+        stream_clients = c->next;
+        close(c->fd);
+        free(c->uid);
+        free(c);
+    }
+
+    stream_n_clients = 0;
+
+    while (stream_head != NULL) {
+        stream_event *e = stream_head;
+
+        stream_head = e->next;
+        stream_event_free(e);
+    }
+
+    stream_tail   = NULL;
+    stream_queued = 0;
+}
+
+
+void mastoapi_stream_post(const char *uid, const char *event, const xs_val *data)
+/* posts an event for the streaming clients (uid is NULL for the public stream) */
+{
+    stream_event *e;
+    int n_clients;
+
+    pthread_mutex_lock(&stream_mutex);
+    n_clients = stream_n_clients;
+    pthread_mutex_unlock(&stream_mutex);
+
+    /* nobody listening (e.g. not in the server) */
+    if (n_clients == 0)
+        return;
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+
+    e->uid   = uid ? strdup(uid) : NULL;
+    e->event = event;
+
+    /* it outlives the job */
+    xs_arena_pause();
+    e->data = xs_dup(data);
+    xs_arena_resume();
+
+    pthread_mutex_lock(&stream_mutex);
+
+    if (stream_running && stream_queued < STREAM_MAX_QUEUE) {
+        if (stream_tail)
+            stream_tail->next = e;
+        else
+            stream_head = e;
+
+        stream_tail = e;
+        stream_queued++;
+
+        pthread_cond_signal(&stream_cond);
+        e = NULL;
+    }
+
+    pthread_mutex_unlock(&stream_mutex);
+
+    if (e != NULL) {
+        srv_debug(1, xs_fmt("mastoapi_stream_post: queue full, event dropped"));
+        stream_event_free(e);
+    }
+}
+
+
+static int stream_subscribe(snac *user, int streams, http_stream *stream)
+/* takes over the connection of a streaming client */
+{
+    stream_client *c;
+    int ret = 0;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+        return 0;
+
+    c->streams = streams;
+    c->uid     = user ? strdup(user->uid) : NULL;
+
+    pthread_mutex_lock(&stream_mutex);
+
+    if (stream_running && stream_n_clients < STREAM_MAX_CLIENTS) {
+        /* no keep-alive after this */
+        stream->keep = 0;
+        stream_start(stream, 200, "text/event-stream");
+
+        /* tell the client we're here; this also flushes the headers */
+        stream_write(stream, ":)\n\n", 4);
+
+        if ((c->fd = dup(fileno(stream->f))) != -1) {
+            c->next        = stream_clients;
+            stream_clients = c;
+            stream_n_clients++;
+
+            stream->held = 1;
+            ret = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&stream_mutex);
+
+    if (!ret) {
+        free(c->uid);
+        free(c);
+    }
+
+    return ret;
+}
+
+
+static int stream_request(snac *user, const char *cmd, const xs_dict *args,
+                          char **body, char **ctype, http_stream *stream)
+/* attends a request to the streaming API */
+{
+    const char *name;
+    int streams = 0;
+
+    if (strcmp(cmd, "/v1/streaming/health") == 0) {
+        *body  = xs_str_new("OK");
+        *ctype = "text/plain";
+        return 200;
+    }
+
+    /* the stream name can be in the path (with : as /) or in the query */
+    xs *path_name = xs_replace(cmd + strlen("/v1/streaming"), "/", ":");
+
+    if (*path_name == ':')
+        name = path_name + 1;
+    else
+    if (xs_is_null(name = xs_dict_get(args, "stream")))
+        name = "";
+
+    if (strcmp(name, "user") == 0)
+        streams = STREAM_USER | STREAM_NOTIFY;
+    else
+    if (strcmp(name, "user:notification") == 0)
+        streams = STREAM_NOTIFY;
+    else
+    if (strcmp(name, "public") == 0 || strcmp(name, "public:local") == 0)
+        streams = STREAM_PUBLIC;
+    else
+        return 400;
+
+    if ((streams & (STREAM_USER | STREAM_NOTIFY)) && user == NULL)
+        return 401;
+
+    /* it needs a chunked response (i.e. an HTTP/1.1 GET) */
+    if (stream == NULL)
+        return 400;
+
+    if (!stream_subscribe(user, streams, stream))
+        return 503;
+
+    srv_debug(1, xs_fmt("streaming client for '%s' (%s)", user ? user->uid : "", name));
+
+    return 200;
+}
+
+
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype)
+                         char **body, int *b_size, char **ctype, http_stream *stream)
 {
     (void)b_size;
 
@@ -976,6 +1640,21 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     snac snac1 = {0};
     int logged_in = process_auth_token(&snac1, req);
 
+    if (strcmp(cmd, "/v1/streaming") == 0 || xs_startswith(cmd, "/v1/streaming/")) { /** **/
+        /* browsers cannot set headers to event streams */
+        const char *tokid = xs_dict_get(args, "access_token");
+
+        if (!logged_in && !xs_is_null(tokid)) {
+            xs *auth = xs_fmt("Bearer %s", tokid);
+            xs *areq = xs_dict_new();
+
+            areq = xs_dict_append(areq, "authorization", auth);
+            logged_in = process_auth_token(&snac1, areq);
+        }
+
+        status = stream_request(logged_in ? &snac1 : NULL, cmd, args, body, ctype, stream);
+    }
+    else
     if (strcmp(cmd, "/v1/accounts/verify_credentials") == 0) { /** **/
         if (logged_in) {
             xs *acct = xs_dict_new();
@@ -1188,91 +1867,23 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     if (strcmp(cmd, "/v1/timelines/home") == 0) { /** **/
         /* the private timeline */
         if (logged_in) {
-            const char *max_id   = xs_dict_get(args, "max_id");
-            const char *since_id = xs_dict_get(args, "since_id");
-            const char *min_id   = xs_dict_get(args, "min_id");
-            const char *limit_s  = xs_dict_get(args, "limit");
-            int limit = 0;
-            int cnt   = 0;
-
-            if (!xs_is_null(limit_s))
-                limit = atoi(limit_s);
-
-            if (limit == 0)
-                limit = 20;
-
-            xs *timeline = timeline_simple_list(&snac1, "private", 0, 256);
-
-            xs *out      = xs_list_new();
-            xs_list *p   = timeline;
-            xs_str *v;
-
-            while (xs_list_iter(&p, &v) && cnt < limit) {
-                xs *msg = NULL;
-
-                /* only return entries older that max_id */
-                if (max_id) {
-                    if (strcmp(v, MID_TO_MD5(max_id)) == 0)
-                        max_id = NULL;
-
-                    continue;
-                }
-
-                /* only returns entries newer than since_id */
-                if (since_id) {
-                    if (strcmp(v, MID_TO_MD5(since_id)) == 0)
-                        break;
-                }
-
-                /* only returns entries newer than min_id */
-                /* what does really "Return results immediately newer than ID" mean? */
-                if (min_id) {
-                    if (strcmp(v, MID_TO_MD5(min_id)) == 0)
-                        break;
-                }
-
-                /* get the entry */
-                if (!valid_status(timeline_get_by_md5(&snac1, v, &msg)))
-                    continue;
-
-                /* discard non-Notes */
-                const char *type = xs_dict_get(msg, "type");
-                if (strcmp(type, "Note") != 0 && strcmp(type, "Question") != 0)
-                    continue;
-
-#if 0
-                /* discard notes from people we don't follow with no boosts */
-                if (!following_check(&snac1, xs_dict_get(msg, "attributedTo")) &&
-                    object_announces_len(xs_dict_get(msg, "id")) == 0)
-                    continue;
-#endif
-
-                /* discard notes from muted morons */
-                if (is_muted(&snac1, xs_dict_get(msg, "attributedTo")))
-                    continue;
-
-                /* discard hidden notes */
-                if (is_hidden(&snac1, xs_dict_get(msg, "id")))
-                    continue;
-
-                /* discard poll votes (they have a name) */
-                if (!xs_is_null(xs_dict_get(msg, "name")))
-                    continue;
-
-                /* convert the Note into a Mastodon status */
-                xs *st = mastoapi_status(&snac1, msg);
-
-                if (st != NULL)
-                    out = xs_list_append(out, st);
-
-                cnt++;
-            }
-
-            *body  = xs_json_dumps(out, 4);
+            *body  = timeline_page(&snac1, "private", args, stream);
             *ctype = "application/json";
             status = 200;
+        }
+        else {
+            status = 401; // unauthorized
+        }
+    }
+    else
+    if (xs_startswith(cmd, "/v1/timelines/tag/")) { /** **/
+        /* the entries of the private timeline with a hashtag */
+        if (logged_in) {
+            xs *idx = tag_index(cmd + strlen("/v1/timelines/tag/"));
 
-            srv_debug(2, xs_fmt("mastoapi timeline: returned %d entries", xs_list_len(out)));
+            *body  = timeline_page(&snac1, idx, args, stream);
+            *ctype = "application/json";
+            status = 200;
         }
         else {
             status = 401; // unauthorized
@@ -1293,7 +1904,7 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             limit = 20;
 
         xs *timeline = timeline_instance_list(0, limit);
-        xs *out      = xs_list_new();
+        status_list out;
         xs_list *p   = timeline;
         xs_str *md5;
 
@@ -1301,6 +1912,8 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
         if (logged_in)
             user = &snac1;
 
+        status_list_start(&out, stream);
+
         while (xs_list_iter(&p, &md5) && cnt < limit) {
             xs *msg = NULL;
 
@@ -1317,12 +1930,12 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             xs *st = mastoapi_status(user, msg);
 
             if (st != NULL) {
-                out = xs_list_append(out, st);
+                status_list_add(&out, st);
                 cnt++;
             }
         }
 
-        *body  = xs_json_dumps(out, 4);
+        *body  = status_list_end(&out);
         *ctype = "application/json";
         status = 200;
     }
@@ -1348,62 +1961,11 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
                 if (noti == NULL)
                     continue;
 
-                const char *type  = xs_dict_get(noti, "type");
-                const char *utype = xs_dict_get(noti, "utype");
-                const char *objid = xs_dict_get(noti, "objid");
-                xs *actor = NULL;
-                xs *entry = NULL;
+                xs *mn = mastoapi_notification(&snac1, noti, excl);
 
-                if (!valid_status(actor_get(xs_dict_get(noti, "actor"), &actor)))
+                if (mn == NULL)
                     continue;
 
-                if (objid != NULL && !valid_status(object_get(objid, &entry)))
-                    continue;
-
-                if (is_hidden(&snac1, objid))
-                    continue;
-
-                /* convert the type */
-                if (strcmp(type, "Like") == 0)
-                    type = "favourite";
-                else
-                if (strcmp(type, "Announce") == 0)
-                    type = "reblog";
-                else
-                if (strcmp(type, "Follow") == 0)
-                    type = "follow";
-                else
-                if (strcmp(type, "Create") == 0)
-                    type = "mention";
-                else
-                if (strcmp(type, "Update") == 0 && strcmp(utype, "Question") == 0)
-                    type = "poll";
-                else
-                    continue;
-
-                /* excluded type? */
-                if (!xs_is_null(excl) && xs_list_in(excl, type) != -1)
-                    continue;
-
-                xs *mn = xs_dict_new();
-
-                mn = xs_dict_append(mn, "type", type);
-
-                xs *id = xs_replace(xs_dict_get(noti, "id"), ".", "");
-                mn = xs_dict_append(mn, "id", id);
-
-                mn = xs_dict_append(mn, "created_at", xs_dict_get(noti, "date"));
-
-                xs *acct = mastoapi_account(actor);
-                mn = xs_dict_append(mn, "account", acct);
-
-                if (strcmp(type, "follow") != 0 && !xs_is_null(objid)) {
-                    xs *st = mastoapi_status(&snac1, entry);
-
-                    if (st)
-                        mn = xs_dict_append(mn, "status", st);
-                }
-
                 out = xs_list_append(out, mn);
             }
 
@@ -1690,6 +2252,14 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             const char *q      = xs_dict_get(args, "q");
             const char *type   = xs_dict_get(args, "type");
             const char *offset = xs_dict_get(args, "offset");
+            const char *limit_s = xs_dict_get(args, "limit");
+            int limit = 0;
+
+            if (!xs_is_null(limit_s))
+                limit = atoi(limit_s);
+
+            if (limit <= 0 || limit > 40)
+                limit = 20;
 
             xs *acl = xs_list_new();
             xs *stl = xs_list_new();
@@ -1717,6 +2287,25 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
                 }
             }
 
+            if (!xs_is_null(q) && (xs_is_null(type) || strcmp(type, "statuses") == 0)) {
+                /* search the full text index */
+                int skip = xs_is_null(offset) ? 0 : atoi(offset);
+                xs *list = search_query(&snac1, q, skip < 0 ? 0 : skip, limit);
+                xs_list *p = list;
+                xs_str *v;
+
+                while (xs_list_iter(&p, &v)) {
+                    xs *msg = NULL;
+
+                    if (valid_status(timeline_get_by_md5(&snac1, v, &msg))) {
+                        xs *st = mastoapi_status(&snac1, msg);
+
+                        if (st != NULL)
+                            stl = xs_list_append(stl, st);
+                    }
+                }
+            }
+
             res = xs_dict_append(res, "accounts", acl);
             res = xs_dict_append(res, "statuses", stl);
             res = xs_dict_append(res, "hashtags", htl);
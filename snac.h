@@ -1,7 +1,7 @@
 /* snac - A simple, minimalistic ActivityPub instance */
 /* copyright (c) 2022 - 2023 grunfink et al. / MIT license */
 
-#define VERSION "2.40"
+#define VERSION "2.41-dev"
 
 #define USER_AGENT "snac/" VERSION
 
@@ -47,6 +47,9 @@ int user_open(snac *snac, const char *uid);
 void user_free(snac *snac);
 xs_list *user_list(void);
 int user_open_by_md5(snac *snac, const char *md5);
+int user_open_by_actor(snac *snac, const char *actor);
+int user_persist(snac *snac);
+void user_reg_invalidate(const char *uid);
 
 void snac_debug(snac *snac, int level, xs_str *str);
 #define snac_log(snac, str) snac_debug(snac, 0, str)
@@ -73,6 +76,9 @@ int index_first(const char *fn, char *buf, int size);
 int index_len(const char *fn);
 xs_list *index_list(const char *fn, int max);
 xs_list *index_list_desc(const char *fn, int skip, int show);
+int index_seek(const char *fn, const char *md5);
+xs_list *index_list_range(const char *fn, int *pos, int end, int show);
+int index_upgrade(const char *fn);
 
 int object_add(const char *id, const xs_dict *obj);
 int object_add_ow(const char *id, const xs_dict *obj);
@@ -84,6 +90,13 @@ int object_del(const char *id);
 int object_del_if_unref(const char *id);
 double object_ctime_by_md5(const char *md5);
 double object_ctime(const char *id);
+double object_mtime(const char *id);
+xs_str *object_stamp_by_md5(const char *md5);
+int object_touch(const char *id);
+int object_import_by_md5(const char *md5, const xs_dict *obj,
+                         int refs, double ctime, double mtime);
+int object_pack_compact(void);
+xs_dict *object_cache_stats(void);
 int object_admire(const char *id, const char *actor, int like);
 int object_unadmire(const char *id, const char *actor, int like);
 
@@ -114,9 +127,27 @@ int timeline_add(snac *snac, const char *id, const xs_dict *o_msg);
 void timeline_admire(snac *snac, const char *id, const char *admirer, int like);
 
 xs_list *timeline_top_level(snac *snac, xs_list *list);
+int root_purge(snac *snac);
 xs_list *local_list(snac *snac, int max);
+int timeline_seek(snac *snac, const char *idx_name, const char *md5);
+xs_list *timeline_range(snac *snac, const char *idx_name, int *pos, int end, int show);
 xs_list *timeline_instance_list(int skip, int show);
 
+xs_str *tag_index(const char *tag);
+int tag_add(snac *user, const char *id, const xs_dict *msg);
+int tag_del(snac *user, const char *id, const xs_dict *msg);
+int tag_update(snac *user, const char *id, const xs_dict *o_msg, const xs_dict *msg);
+int tag_purge(snac *user);
+int tag_rebuild(snac *user);
+
+int search_add(snac *snac, const char *id, const xs_dict *msg);
+int search_del(snac *snac, const char *id);
+int search_update(snac *snac, const char *id, const xs_dict *msg);
+int search_flush(snac *snac);
+int search_purge(snac *snac);
+xs_list *search_query(snac *snac, const char *query, int skip, int show);
+int search_rebuild(snac *snac);
+
 int following_add(snac *snac, const char *actor, const xs_dict *msg);
 int following_del(snac *snac, const char *actor);
 int following_check(snac *snac, const char *actor);
@@ -172,9 +203,21 @@ int instance_block(const char *instance);
 int instance_unblock(const char *instance);
 
 void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retries);
+int backoff_secs(int base, int n);
+int host_check(const char *url);
+time_t host_retry_time(const char *url);
+void host_result(const char *url, int status);
+xs_dict *host_list(void);
+
+xs_str *queue_payload_put(const char *body);
+xs_str *queue_payload_get(const char *md5);
+void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries);
 void enqueue_output_raw(const char *keyid, const char *seckey,
-                        xs_dict *msg, xs_str *inbox, int retries);
-void enqueue_output(snac *snac, xs_dict *msg, xs_str *inbox, int retries);
+                        const xs_val *msg, const char *digest,
+                        xs_str *inbox, int retries);
+void enqueue_output_requeue(const xs_dict *q_item, int secs);
+void enqueue_output(snac *snac, const xs_val *msg, const char *digest,
+                    xs_str *inbox, int retries);
 void enqueue_output_by_actor(snac *snac, xs_dict *msg, const xs_str *actor, int retries);
 void enqueue_email(xs_str *msg, int retries);
 void enqueue_telegram(const xs_str *msg, const char *bot, const char *chat_id);
@@ -186,6 +229,9 @@ int was_question_voted(snac *user, const char *id);
 xs_list *user_queue(snac *snac);
 xs_list *queue(void);
 xs_dict *queue_get(const char *fn);
+void queue_sched_start(void);
+void queue_sched_wake(void);
+xs_list *queue_sched_wait(int max_secs);
 xs_dict *dequeue(const char *fn);
 
 void purge(snac *snac);
@@ -203,6 +249,16 @@ xs_dict *http_signed_request(snac *snac, const char *method, const char *url,
                             int *status, xs_str **payload, int *p_size,
                             int timeout);
 int check_signature(snac *snac, xs_dict *req, xs_str **err);
+int flight_begin(const char *key, int *status, xs_val **result);
+void flight_end(const char *key, int status, const xs_val *result);
+
+xs_str *http_sign(const char *keyid, const char *seckey, const char *str);
+int http_verify(const char *keyid, const char *pubkey, const char *str, const char *sig);
+xs_str *http_body_digest(const char *body, int b_size);
+
+void deliver_start(void);
+void deliver_stop(void);
+int deliver_post(const xs_dict *q_item);
 
 void httpd(void);
 
@@ -235,7 +291,7 @@ int activitypub_request(snac *snac, const char *url, xs_dict **data);
 int actor_request(snac *snac, const char *actor, xs_dict **data);
 void timeline_request_replies(snac *user, const char *id);
 int send_to_inbox_raw(const char *keyid, const char *seckey,
-                  const xs_str *inbox, const xs_dict *msg,
+                  const xs_str *inbox, const xs_val *msg, const char *digest,
                   xs_val **payload, int *p_size, int timeout);
 int send_to_inbox(snac *snac, const xs_str *inbox, const xs_dict *msg,
                   xs_val **payload, int *p_size, int timeout);
@@ -246,8 +302,12 @@ int is_msg_public(const xs_dict *msg);
 int is_msg_for_me(snac *snac, const xs_dict *msg);
 
 int process_user_queue(snac *snac);
+void process_output_deferred(const xs_dict *q_item);
+void process_output_status(const xs_dict *q_item, int status,
+                           const xs_str *o_payload, int p_size);
 void process_queue_item(xs_dict *q_item);
 int process_queue(void);
+int process_queues(int max_secs);
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
                             char **body, int *b_size, char **ctype);
@@ -259,10 +319,26 @@ xs_str *not_really_markdown(const char *content, xs_list **attach);
 xs_str *sanitize(const char *content);
 xs_str *encode_html(const char *str);
 
-xs_str *html_timeline(snac *user, const xs_list *list, int local, int skip, int show, int show_more);
+typedef struct {
+    FILE *f;            /* connection */
+    int keep;           /* connection to be kept alive */
+    int started;        /* headers already sent */
+    int size;           /* body bytes sent */
+    xs_sb *copy;        /* if set, the body is also stored here */
+    int held;           /* connection taken over (e.g. for streaming) */
+} http_stream;
+
+void stream_start(http_stream *st, int status, const char *ctype);
+void stream_write(http_stream *st, const char *data, int size);
+void stream_end(http_stream *st);
+
+xs_str *html_timeline(snac *user, const xs_list *list, int local,
+                      int skip, int show, int show_more, const char *query,
+                      http_stream *stream);
 
 int html_get_handler(const xs_dict *req, const char *q_path,
-                     char **body, int *b_size, char **ctype, xs_str **etag);
+                     char **body, int *b_size, char **ctype, xs_str **etag,
+                     http_stream *stream);
 int html_post_handler(const xs_dict *req, const char *q_path,
                       char *payload, int p_size,
                       char **body, int *b_size, char **ctype);
@@ -283,7 +359,7 @@ int oauth_post_handler(const xs_dict *req, const char *q_path,
                        const char *payload, int p_size,
                        char **body, int *b_size, char **ctype);
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype);
+                         char **body, int *b_size, char **ctype, http_stream *stream);
 int mastoapi_post_handler(const xs_dict *req, const char *q_path,
                           const char *payload, int p_size,
                           char **body, int *b_size, char **ctype);
@@ -291,3 +367,6 @@ int mastoapi_put_handler(const xs_dict *req, const char *q_path,
                           const char *payload, int p_size,
                           char **body, int *b_size, char **ctype);
 void mastoapi_purge(void);
+void mastoapi_stream_start(void);
+void mastoapi_stream_stop(void);
+void mastoapi_stream_post(const char *uid, const char *event, const xs_val *data);
@@ -9,6 +9,7 @@
 #include "snac.h"
 
 #include <sys/stat.h>
+#include <sys/time.h>
 
 
 int snac_upgrade(xs_str **error)
@@ -28,139 +29,97 @@ int snac_upgrade(xs_str **error)
 
         srv_log(xs_fmt("disk layout upgrade needed (%1.1lf < %1.1lf)", f, disk_layout));
 
-        if (f < 2.0) {
-            *error = xs_fmt("ERROR: unsupported old disk layout %1.1lf\n", f);
+        if (f < 2.7) {
+            /* the steps from older layouts were written for one object file
+               and one text index per entry, that the 2.8 and 2.9 layouts no
+               longer use, so they must be done by a previous version */
+            *error = xs_fmt("ERROR: unsupported old disk layout %1.1lf; "
+                            "upgrade it to 2.7 with snac 2.40 before using this version\n", f);
             ret    = 0;
             break;
         }
         else
-        if (f < 2.1) {
-            xs *dir = xs_fmt("%s/object", srv_basedir);
-            mkdirx(dir);
-
-            nf = 2.1;
-        }
-        else
-        if (f < 2.2) {
-            xs *users = user_list();
+        if (f < 2.8) {
+            /* move the object files into the object pack */
+            xs *spec = xs_fmt("%s/object/??", srv_basedir);
+            xs *dirs = xs_glob(spec, 0, 0);
             char *p, *v;
+            int cnt = 0;
 
-            p = users;
+            p = dirs;
             while (xs_list_iter(&p, &v)) {
-                snac snac;
-
-                if (user_open(&snac, v)) {
-                    xs *spec = xs_fmt("%s/actors/" "*.json", snac.basedir);
-                    xs *list = xs_glob(spec, 0, 0);
-                    char *g, *fn;
-
-                    g = list;
-                    while (xs_list_iter(&g, &fn)) {
-                        xs *l   = xs_split(fn, "/");
-                        char *b = xs_list_get(l, -1);
-                        xs *dir = xs_fmt("%s/object/%c%c", srv_basedir, b[0], b[1]);
-                        xs *nfn = xs_fmt("%s/%s", dir, b);
-
-                        mkdirx(dir);
-                        rename(fn, nfn);
-                    }
-
-                    xs *odir = xs_fmt("%s/actors", snac.basedir);
-                    rmdir(odir);
-
-                    user_free(&snac);
-                }
-            }
-
-            nf = 2.2;
-        }
-        else
-        if (f < 2.3) {
-            xs *users = user_list();
-            char *p, *v;
-
-            p = users;
-            while (xs_list_iter(&p, &v)) {
-                snac snac;
-
-                if (user_open(&snac, v)) {
-                    char *p, *v;
-                    xs *dir = xs_fmt("%s/hidden", snac.basedir);
-
-                    /* create the hidden directory */
-                    mkdirx(dir);
-
-                    /* rename all muted files incorrectly named .json */
-                    xs *spec = xs_fmt("%s/muted/" "*.json", snac.basedir);
-                    xs *fns  = xs_glob(spec, 0, 0);
-
-                    p = fns;
-                    while (xs_list_iter(&p, &v)) {
-                        xs *nfn = xs_replace(v, ".json", "");
-                        rename(v, nfn);
+                xs *spec2 = xs_fmt("%s/" "*.json", v);
+                xs *files = xs_glob(spec2, 0, 0);
+                char *p2, *v2;
+
+                p2 = files;
+                while (xs_list_iter(&p2, &v2)) {
+                    int n_link;
+                    double mt = mtime_nl(v2, &n_link);
+                    double ct = f_ctime(v2);
+                    FILE *f;
+
+                    if ((f = fopen(v2, "r")) != NULL) {
+                        xs *o = xs_json_load(f);
+                        fclose(f);
+
+                        xs *l   = xs_split(v2, "/");
+                        xs *md5 = xs_replace(xs_list_get(l, -1), ".json", "");
+
+                        /* the extra hard links were the references from the user caches */
+                        if (o != NULL && object_import_by_md5(md5, o, n_link - 1, ct, mt) == 201) {
+                            unlink(v2);
+                            cnt++;
+                        }
+                        else
+                            srv_log(xs_fmt("upgrade: cannot import %s", v2));
                     }
-
-                    user_free(&snac);
                 }
             }
 
-            nf = 2.3;
-        }
-        else
-        if (f < 2.4) {
-            xs *users = user_list();
-            char *p, *v;
-
-            p = users;
-            while (xs_list_iter(&p, &v)) {
-                snac snac;
-
-                if (user_open(&snac, v)) {
-                    xs *dir = xs_fmt("%s/public", snac.basedir);
-                    mkdirx(dir);
-
-                    dir = xs_replace_i(dir, "public", "private");
-                    mkdirx(dir);
-
-                    user_free(&snac);
-                }
-            }
+            srv_log(xs_fmt("upgrade: %d objects moved to the object pack", cnt));
 
-            nf = 2.4;
-        }
-        else
-        if (f < 2.5) {
-            /* upgrade followers */
+            /* the hard links in the user caches of the imported objects
+               are now just references: empty them, but keep their dates
+               (the purge uses them) */
             xs *users = user_list();
-            char *p, *v;
 
             p = users;
             while (xs_list_iter(&p, &v)) {
                 snac snac;
 
                 if (user_open(&snac, v)) {
-                    xs *spec = xs_fmt("%s/followers/" "*.json", snac.basedir);
-                    xs *dir  = xs_glob(spec, 0, 0);
-                    char *p, *v;
-
-                    p = dir;
-                    while (xs_list_iter(&p, &v)) {
-                        FILE *f;
-
-                        if ((f = fopen(v, "r")) != NULL) {
-                            xs *s = xs_readall(f);
-                            xs *o = xs_json_loads(s);
-                            fclose(f);
-
-                            char *type = xs_dict_get(o, "type");
-
-                            if (!xs_is_null(type) && strcmp(type, "Follow") == 0) {
-                                unlink(v);
-
-                                char *actor = xs_dict_get(o, "actor");
-
-                                if (!xs_is_null(actor))
-                                    follower_add(&snac, actor);
+                    const char *caches[] = { "private/" "*.json", "public/" "*.json",
+                        "followers/" "*.json", "pinned/" "*.json",
+                        "following/" "*_a.json", NULL };
+                    int n;
+
+                    for (n = 0; caches[n]; n++) {
+                        xs *spec = xs_fmt("%s/%s", snac.basedir, caches[n]);
+                        xs *fns  = xs_glob(spec, 0, 0);
+                        char *p2, *v2;
+
+                        p2 = fns;
+                        while (xs_list_iter(&p2, &v2)) {
+                            xs *l   = xs_split(v2, "/");
+                            xs *md5 = xs_crop_i(xs_dup(xs_list_get(l, -1)), 0, 32);
+                            struct stat st;
+
+                            /* if the object could not be imported, this
+                               is still one of its links: don't touch it */
+                            if (!object_here_by_md5(md5))
+                                continue;
+
+                            if (stat(v2, &st) != -1 && st.st_size != 0) {
+                                struct timeval tv[2];
+
+                                tv[0].tv_sec  = st.st_atim.tv_sec;
+                                tv[0].tv_usec = 0;
+                                tv[1].tv_sec  = st.st_mtim.tv_sec;
+                                tv[1].tv_usec = 0;
+
+                                if (truncate(v2, 0) != -1)
+                                    utimes(v2, tv);
                             }
                         }
                     }
@@ -169,124 +128,31 @@ int snac_upgrade(xs_str **error)
                 }
             }
 
-            nf = 2.5;
+            nf = 2.8;
         }
         else
-        if (f < 2.6) {
-            /* upgrade local/ to public/ */
-            xs *users = user_list();
+        if (f < 2.9) {
+            /* convert the text indexes to binary */
+            xs *spec  = xs_fmt("%s/object/??" "/" "*.idx", srv_basedir);
+            xs *idxs  = xs_glob(spec, 0, 0);
+            xs *spec2 = xs_fmt("%s/user/*/" "*.idx", srv_basedir);
+            xs *idxs2 = xs_glob(spec2, 0, 0);
+            xs *ipt   = xs_fmt("%s/public.idx", srv_basedir);
             char *p, *v;
+            int cnt = 0;
 
-            p = users;
-            while (xs_list_iter(&p, &v)) {
-                snac snac;
-
-                if (user_open(&snac, v)) {
-                    xs *spec = xs_fmt("%s/local/" "*.json", snac.basedir);
-                    xs *dir  = xs_glob(spec, 0, 0);
-                    char *p, *v;
-
-                    p = dir;
-                    while (xs_list_iter(&p, &v)) {
-                        FILE *f;
-
-                        if ((f = fopen(v, "r")) != NULL) {
-                            xs *s = xs_readall(f);
-                            xs *o = xs_json_loads(s);
-                            fclose(f);
-
-                            xs *meta = xs_dup(xs_dict_get(o, "_snac"));
-                            o = xs_dict_del(o, "_snac");
-
-                            char *id = xs_dict_get(o, "id");
-
-                            /* store object */
-                            object_add_ow(id, o);
+            idxs = xs_list_cat(idxs, idxs2);
+            idxs = xs_list_append(idxs, ipt);
 
-                            /* if it's from us, add to public */
-                            if (xs_startswith(id, snac.actor)) {
-                                char *p, *v;
-
-                                object_user_cache_add(&snac, id, "public");
-
-                                p = xs_dict_get(meta, "announced_by");
-                                while (xs_list_iter(&p, &v))
-                                    object_admire(id, v, 0);
-                                p = xs_dict_get(meta, "liked_by");
-                                while (xs_list_iter(&p, &v))
-                                    object_admire(id, v, 1);
-                            }
-
-                            unlink(v);
-                        }
-                    }
-
-                    xs *od = xs_fmt("%s/local", snac.basedir);
-                    rmdir(od);
-
-                    user_free(&snac);
-                }
-            }
-
-            nf = 2.6;
-        }
-        else
-        if (f < 2.7) {
-            /* upgrade timeline/ to private/ */
-            xs *users = user_list();
-            char *p, *v;
-
-            p = users;
+            p = idxs;
             while (xs_list_iter(&p, &v)) {
-                snac snac;
-
-                if (user_open(&snac, v)) {
-                    xs *spec = xs_fmt("%s/timeline/" "*.json", snac.basedir);
-                    xs *dir  = xs_glob(spec, 0, 0);
-                    char *p, *v;
-
-                    p = dir;
-                    while (xs_list_iter(&p, &v)) {
-                        FILE *f;
-
-                        if ((f = fopen(v, "r")) != NULL) {
-                            xs *s = xs_readall(f);
-                            xs *o = xs_json_loads(s);
-                            fclose(f);
-
-                            xs *meta = xs_dup(xs_dict_get(o, "_snac"));
-                            o = xs_dict_del(o, "_snac");
-
-                            char *id = xs_dict_get(o, "id");
-
-                            /* store object */
-                            object_add_ow(id, o);
-
-                            {
-                                char *p, *v;
-
-                                object_user_cache_add(&snac, id, "private");
-
-                                p = xs_dict_get(meta, "announced_by");
-                                while (xs_list_iter(&p, &v))
-                                    object_admire(id, v, 0);
-                                p = xs_dict_get(meta, "liked_by");
-                                while (xs_list_iter(&p, &v))
-                                    object_admire(id, v, 1);
-                            }
-
-                            unlink(v);
-                        }
-                    }
-
-                    xs *od = xs_fmt("%s/timeline", snac.basedir);
-                    rmdir(od);
-
-                    user_free(&snac);
-                }
+                if (index_upgrade(v) != -1)
+                    cnt++;
             }
 
-            nf = 2.7;
+            srv_log(xs_fmt("upgrade: %d indexes converted", cnt));
+
+            nf = 2.9;
         }
 
         if (f < nf) {
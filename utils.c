@@ -315,22 +315,16 @@ int resetpwd(snac *snac)
 {
     xs *clear_pwd  = NULL;
     xs *hashed_pwd = NULL;
-    xs *fn         = xs_fmt("%s/user.json", snac->basedir);
-    FILE *f;
     int ret = 0;
 
     new_password(snac->uid, &clear_pwd, &hashed_pwd);
 
     snac->config = xs_dict_set(snac->config, "passwd", hashed_pwd);
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(snac->config, 4, f);
-        fclose(f);
-
+    if (user_persist(snac))
         printf("New password for user %s is %s\n", snac->uid, clear_pwd);
-    }
     else {
-        printf("ERROR: cannot write to %s\n", fn);
+        printf("ERROR: cannot write to %s/user.json\n", snac->basedir);
         ret = 1;
     }
 
@@ -7,7 +7,7 @@
 
 #include "snac.h"
 
-int webfinger_request_signed(snac *snac, const char *qs, char **actor, char **user)
+static int _webfinger_request(snac *snac, const char *qs, char **actor, char **user)
 /* queries the webfinger for qs and fills the required fields */
 {
     int status;
@@ -99,6 +99,41 @@ int webfinger_request_signed(snac *snac, const char *qs, char **actor, char **us
 }
 
 
+int webfinger_request_signed(snac *snac, const char *qs, char **actor, char **user)
+/* queries the webfinger for qs and fills the required fields */
+{
+    xs *key = xs_fmt("webfinger:%s", qs);
+    xs *res = NULL;
+    int status;
+
+    if (flight_begin(key, &status, &res)) {
+        xs *a = NULL;
+        xs *u = NULL;
+
+        status = _webfinger_request(snac, qs, &a, &u);
+
+        /* the result is shared as [ actor, user ] */
+        res = xs_list_new();
+        res = xs_list_append(res, a ? a : xs_stock_null);
+        res = xs_list_append(res, u ? u : xs_stock_null);
+
+        flight_end(key, status, res);
+    }
+
+    if (res != NULL && valid_status(status)) {
+        const char *v;
+
+        if (actor != NULL && !xs_is_null(v = xs_list_get(res, 0)))
+            *actor = xs_dup(v);
+
+        if (user != NULL && !xs_is_null(v = xs_list_get(res, 1)))
+            *user = xs_dup(v);
+    }
+
+    return status;
+}
+
+
 int webfinger_request(const char *qs, char **actor, char **user)
 /* queries the webfinger for qs and fills the required fields */
 {
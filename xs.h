@@ -50,6 +50,10 @@ void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char
 #define xs_realloc(ptr, size) _xs_realloc(ptr, size, __FILE__, __LINE__, __FUNCTION__)
 int _xs_blk_size(int sz);
 void _xs_destroy(char **var);
+void xs_arena_begin(void);
+void xs_arena_end(void);
+void xs_arena_pause(void);
+void xs_arena_resume(void);
 #define xs_debug() raise(SIGTRAP)
 xstype xs_type(const xs_val *data);
 int xs_size(const xs_val *data);
@@ -79,6 +83,19 @@ xs_str *xs_strip_chars_i(xs_str *str, const char *chars);
 #define xs_strip_i(str) xs_strip_chars_i(str, " \r\n\t\v\f")
 xs_str *xs_tolower_i(xs_str *str);
 
+typedef struct {
+    xs_str *s;
+    int len;                    /* used bytes (not counting the nul) */
+    int size;                   /* allocated bytes */
+} xs_sb;
+
+void xs_sb_init(xs_sb *b);
+void xs_sb_cat_m(xs_sb *b, const char *mem, int size);
+#define xs_sb_cat(b, str) xs_sb_cat_m(b, str, strlen(str))
+void xs_sb_fmt(xs_sb *b, const char *fmt, ...);
+xs_str *xs_sb_result(xs_sb *b);
+void xs_sb_free(xs_sb *b);
+
 xs_list *xs_list_new(void);
 xs_list *xs_list_append_m(xs_list *list, const char *mem, int dsz);
 #define xs_list_append(list, data) xs_list_append_m(list, data, xs_size(data))
@@ -108,6 +125,16 @@ xs_val *xs_dict_get(const xs_dict *dict, const xs_str *key);
 xs_dict *xs_dict_del(xs_dict *dict, const xs_str *key);
 xs_dict *xs_dict_set(xs_dict *dict, const xs_str *key, const xs_val *data);
 
+typedef struct {
+    const xs_dict *dict;
+    int size;                   /* number of slots (0 if not indexed) */
+    int *slot;                  /* offsets of the keys (0 means empty) */
+} xs_dict_index;
+
+void xs_dict_index_init(xs_dict_index *x, const xs_dict *dict);
+xs_val *xs_dict_index_get(const xs_dict_index *x, const xs_str *key);
+void xs_dict_index_free(xs_dict_index *x);
+
 xs_val *xs_val_new(xstype t);
 xs_number *xs_number_new(double f);
 double xs_number_get(const xs_number *v);
@@ -155,8 +182,185 @@ xs_val xs_stock_1[]     = { XSTYPE_NUMBER, '1', '\0' };
 xs_val xs_stock_list[]  = { XSTYPE_LIST, 0, 0, 5, XSTYPE_EOM };
 xs_val xs_stock_dict[]  = { XSTYPE_DICT, 0, 0, 5, XSTYPE_EOM };
 
+/** arenas **/
+
+/* while an arena is active, the new values created by a thread are carved
+   from big chunks of memory that are released all at once by
+   xs_arena_end(), instead of going through malloc() and free() one by one
+   (which contend with all other threads). Values already on the heap
+   stay there. Anything that must outlive the arena (e.g. stored in a
+   global cache) must be created with the arena paused */
+
+#define XS_ARENA_CHUNK      (256 * 1024)
+#define XS_ARENA_MAX_BLOCK  (32 * 1024)     /* bigger ones go to the heap */
+#define XS_ARENA_MAX_SIZE   (16 * 1024 * 1024)
+
+typedef struct _xs_arena_chunk {
+    struct _xs_arena_chunk *next;
+    size_t size;
+    size_t used;
+    size_t last;                /* offset of the last block */
+    char *data;
+} xs_arena_chunk;
+
+static __thread struct {
+    int active;
+    int paused;
+    size_t total;
+    xs_arena_chunk *chunks;     /* current one first */
+    xs_arena_chunk *spare;      /* kept for the next time */
+} _xs_arena;
+
+
+static xs_arena_chunk *_xs_arena_owner(const void *ptr)
+/* returns the chunk a block comes from, if any */
+{
+    xs_arena_chunk *c;
+
+    for (c = _xs_arena.chunks; c != NULL; c = c->next) {
+        if ((const char *)ptr > c->data && (const char *)ptr < c->data + c->used)
+            return c;
+    }
+
+    return NULL;
+}
+
+
+static void *_xs_arena_alloc(size_t size)
+/* carves a block from the arena, or returns NULL if it shouldn't */
+{
+    xs_arena_chunk *c = _xs_arena.chunks;
+    size_t need;
+
+    if (!_xs_arena.active || _xs_arena.paused || size > XS_ARENA_MAX_BLOCK)
+        return NULL;
+
+    /* blocks are preceded by their size, and aligned */
+    size = (size + 7) & ~7;
+    need = sizeof(size_t) + size;
+
+    if (c == NULL || c->used + need > c->size) {
+        if (_xs_arena.total >= XS_ARENA_MAX_SIZE)
+            return NULL;
+
+        if ((c = _xs_arena.spare) != NULL)
+            _xs_arena.spare = NULL;
+        else {
+            if ((c = malloc(sizeof(xs_arena_chunk) + XS_ARENA_CHUNK)) == NULL)
+                return NULL;
+
+            c->size = XS_ARENA_CHUNK;
+            c->data = (char *)(c + 1);
+        }
+
+        c->used = 0;
+        c->next = _xs_arena.chunks;
+        _xs_arena.chunks = c;
+        _xs_arena.total += c->size;
+    }
+
+    c->last = c->used;
+    memcpy(c->data + c->used, &size, sizeof(size_t));
+    c->used += need;
+
+    return c->data + c->last + sizeof(size_t);
+}
+
+
+static void *_xs_arena_realloc(xs_arena_chunk *c, void *ptr, size_t size)
+/* resizes a block from the arena */
+{
+    char *p = ptr;
+    size_t osize;
+    void *ndata;
+
+    memcpy(&osize, p - sizeof(size_t), sizeof(size_t));
+
+    /* while paused, it always goes to the heap (it may be kept globally) */
+    if (size <= osize && !_xs_arena.paused)
+        return ptr;
+
+    /* the last block of the current chunk can just grow */
+    if (c == _xs_arena.chunks && p == c->data + c->last + sizeof(size_t) &&
+        !_xs_arena.paused && size <= XS_ARENA_MAX_BLOCK) {
+        size_t nsize = (size + 7) & ~7;
+
+        if (c->last + sizeof(size_t) + nsize <= c->size) {
+            memcpy(p - sizeof(size_t), &nsize, sizeof(size_t));
+            c->used = c->last + sizeof(size_t) + nsize;
+
+            return ptr;
+        }
+    }
+
+    /* move it elsewhere (to the heap if it doesn't fit) */
+    if ((ndata = _xs_arena_alloc(size)) == NULL && (ndata = malloc(size)) == NULL) {
+        fprintf(stderr, "**OUT OF MEMORY**\n");
+        abort();
+    }
+
+    memcpy(ndata, ptr, size < osize ? size : osize);
+
+    return ndata;
+}
+
+
+void xs_arena_begin(void)
+/* starts using an arena for the new values of this thread */
+{
+    _xs_arena.active = 1;
+    _xs_arena.paused = 0;
+}
+
+
+void xs_arena_end(void)
+/* releases all the values in the arena of this thread */
+{
+    xs_arena_chunk *c;
+
+    while ((c = _xs_arena.chunks) != NULL) {
+        _xs_arena.chunks = c->next;
+
+        if (_xs_arena.spare == NULL)
+            _xs_arena.spare = c;
+        else
+            free(c);
+    }
+
+    _xs_arena.active = 0;
+    _xs_arena.total  = 0;
+}
+
+
+void xs_arena_pause(void)
+/* makes new values come from the heap (can be nested) */
+{
+    _xs_arena.paused++;
+}
+
+
+void xs_arena_resume(void)
+/* undoes xs_arena_pause() */
+{
+    _xs_arena.paused--;
+}
+
+
 void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char *func)
 {
+    if (_xs_arena.chunks != NULL || (ptr == NULL && _xs_arena.active)) {
+        xs_arena_chunk *c;
+        void *adata;
+
+        if (ptr == NULL) {
+            if ((adata = _xs_arena_alloc(size)) != NULL)
+                return adata;
+        }
+        else
+        if ((c = _xs_arena_owner(ptr)) != NULL)
+            return _xs_arena_realloc(c, ptr, size);
+    }
+
     d_char *ndata = realloc(ptr, size);
 
     if (ndata == NULL) {
@@ -201,6 +405,18 @@ void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char
 
 void *xs_free(void *ptr)
 {
+    if (ptr != NULL && _xs_arena.chunks != NULL) {
+        xs_arena_chunk *c = _xs_arena_owner(ptr);
+
+        if (c != NULL) {
+            /* only the last block can be given back */
+            if (c == _xs_arena.chunks && (char *)ptr == c->data + c->last + sizeof(size_t))
+                c->used = c->last;
+
+            return NULL;
+        }
+    }
+
 #ifdef XS_DEBUG
     if (ptr != NULL) {
         FILE *f = fopen("xs_memory.out", "a");
@@ -586,6 +802,99 @@ xs_str *xs_tolower_i(xs_str *str)
 }
 
 
+/** string builders **/
+
+/* appending to a string with xs_str_cat() means finding its end with
+   strlen() and reallocating it every time; builders keep track of the
+   length and grow geometrically, so building big outputs by pieces
+   is linear. The result is a normal string (it's not copied) */
+
+void xs_sb_init(xs_sb *b)
+/* initializes a string builder */
+{
+    b->len  = 0;
+    b->size = 256;
+    b->s    = xs_realloc(NULL, b->size);
+    b->s[0] = '\0';
+}
+
+
+static void _xs_sb_grow(xs_sb *b, int size)
+/* makes room for size more bytes */
+{
+    int need = b->len + size + 1;
+
+    if (need > b->size) {
+        int nsize = b->size * 2;
+
+        if (nsize < need)
+            nsize = _xs_blk_size(need);
+
+        b->s    = xs_realloc(b->s, nsize);
+        b->size = nsize;
+    }
+}
+
+
+void xs_sb_cat_m(xs_sb *b, const char *mem, int size)
+/* appends a memory block */
+{
+    if (size > 0) {
+        _xs_sb_grow(b, size);
+
+        memcpy(b->s + b->len, mem, size);
+        b->len += size;
+        b->s[b->len] = '\0';
+    }
+}
+
+
+void xs_sb_fmt(xs_sb *b, const char *fmt, ...)
+/* appends a string with printf()-like marks */
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n >= b->size - b->len) {
+        /* it didn't fit; try again */
+        _xs_sb_grow(b, n);
+
+        va_start(ap, fmt);
+        vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+    }
+
+    if (n > 0)
+        b->len += n;
+    else
+        b->s[b->len] = '\0';
+}
+
+
+xs_str *xs_sb_result(xs_sb *b)
+/* returns the built string, leaving the builder empty */
+{
+    xs_str *s = b->s;
+
+    b->s    = NULL;
+    b->len  = 0;
+    b->size = 0;
+
+    return s;
+}
+
+
+void xs_sb_free(xs_sb *b)
+/* frees a builder, dropping the string */
+{
+    xs_free(xs_sb_result(b));
+}
+
+
 /** lists **/
 
 xs_list *xs_list_new(void)
@@ -1024,6 +1333,116 @@ xs_dict *xs_dict_set(xs_dict *dict, const xs_str *key, const xs_val *data)
 }
 
 
+/** dict indexes **/
+
+/* dicts are packed lists of items, so getting a value means walking over
+   all the previous ones (including the sizes of their values, which for
+   strings means a strlen() on each). A dict index is a hash table of the
+   key offsets on the side, for dicts that are read lots of times. The
+   dict is not changed, but it must not be modified while indexed.
+   Small dicts are not worth it, so they are not indexed */
+
+#define XS_DICT_INDEX_MIN 8
+
+static int _xs_dict_index_slot(const xs_dict_index *x, const char *key)
+/* returns the slot for a key (either empty or holding that key) */
+{
+    int i = xs_hash_func(key, strlen(key)) & (x->size - 1);
+
+    while (x->slot[i] && strcmp(x->dict + x->slot[i], key) != 0)
+        i = (i + 1) & (x->size - 1);
+
+    return i;
+}
+
+
+void xs_dict_index_init(xs_dict_index *x, const xs_dict *dict)
+/* builds an index over a dict */
+{
+    XS_ASSERT_TYPE(dict, XSTYPE_DICT);
+
+    xs_dict *p = (xs_dict *)dict;
+    xs_str *k;
+    xs_val *v;
+    int first[XS_DICT_INDEX_MIN];
+    int n = 0;
+
+    x->dict = dict;
+    x->size = 0;
+    x->slot = NULL;
+
+    /* don't bother building a table until the dict is big enough */
+    while (n < XS_DICT_INDEX_MIN && xs_dict_iter(&p, &k, &v))
+        first[n++] = k - dict;
+
+    if (n < XS_DICT_INDEX_MIN)
+        return;
+
+    x->size = 32;
+    x->slot = xs_realloc(NULL, x->size * sizeof(int));
+    memset(x->slot, '\0', x->size * sizeof(int));
+
+    for (n = 0; n < XS_DICT_INDEX_MIN; n++) {
+        int i = _xs_dict_index_slot(x, dict + first[n]);
+
+        /* on repeated keys, the first one wins (as in xs_dict_get()) */
+        if (x->slot[i] == 0)
+            x->slot[i] = first[n];
+    }
+
+    while (xs_dict_iter(&p, &k, &v)) {
+        int i = _xs_dict_index_slot(x, k);
+
+        if (x->slot[i])
+            continue;
+
+        x->slot[i] = k - dict;
+
+        /* keep the load factor under 50% */
+        if (++n * 2 > x->size) {
+            int *old = x->slot;
+            int j;
+
+            x->size *= 2;
+            x->slot = xs_realloc(NULL, x->size * sizeof(int));
+            memset(x->slot, '\0', x->size * sizeof(int));
+
+            for (j = 0; j < x->size / 2; j++) {
+                if (old[j])
+                    x->slot[_xs_dict_index_slot(x, dict + old[j])] = old[j];
+            }
+
+            xs_free(old);
+        }
+    }
+}
+
+
+xs_val *xs_dict_index_get(const xs_dict_index *x, const xs_str *key)
+/* returns the value directed by key, using the index */
+{
+    XS_ASSERT_TYPE(key, XSTYPE_STRING);
+
+    if (x->size == 0)
+        return xs_dict_get(x->dict, key);
+
+    int i = _xs_dict_index_slot(x, key);
+
+    if (x->slot[i] == 0)
+        return NULL;
+
+    return (xs_val *)x->dict + x->slot[i] + strlen(key) + 1;
+}
+
+
+void xs_dict_index_free(xs_dict_index *x)
+/* frees an index (the dict is not touched) */
+{
+    x->slot = xs_free(x->slot);
+    x->size = 0;
+}
+
+
 /** other values **/
 
 xs_val *xs_val_new(xstype t)
@@ -8,6 +8,11 @@ xs_dict *xs_http_request(const char *method, const char *url,
                         const xs_dict *headers,
                         const xs_str *body, int b_size, int *status,
                         xs_str **payload, int *p_size, int timeout);
+void *xs_http_request_new(const char *method, const char *url,
+                        const xs_dict *headers,
+                        const xs_str *body, int b_size, int timeout);
+xs_dict *xs_http_request_end(void *handle, int cc, int *status,
+                        xs_str **payload, int *p_size);
 
 #ifdef XS_IMPLEMENTATION
 
@@ -84,24 +89,37 @@ static int _post_callback(char *buffer, size_t size,
 }
 
 
-xs_dict *xs_http_request(const char *method, const char *url,
+struct _xs_http_ctx {
+    xs_dict *response;
+    struct curl_slist *list;
+    struct _payload_data pd;    /* request body */
+    struct _payload_data ipd;   /* response payload */
+};
+
+
+void *xs_http_request_new(const char *method, const char *url,
                         const xs_dict *headers,
-                        const xs_str *body, int b_size, int *status,
-                        xs_str **payload, int *p_size, int timeout)
-/* does an HTTP request */
+                        const xs_str *body, int b_size, int timeout)
+/* prepares an HTTP request to be run with curl_easy_perform() or a multi
+   handle. The body must not be freed until xs_http_request_end() */
 {
-    xs_dict *response;
+    struct _xs_http_ctx *ctx;
     CURL *curl;
-    struct curl_slist *list = NULL;
     xs_dict *p;
     xs_str *k;
     xs_val *v;
-    long lstatus = 0;
-    struct _payload_data pd;
 
-    response = xs_dict_new();
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        return NULL;
 
-    curl = curl_easy_init();
+    if ((curl = curl_easy_init()) == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->response = xs_dict_new();
+
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, ctx);
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
@@ -119,11 +137,10 @@ xs_dict *xs_http_request(const char *method, const char *url,
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
     /* store response headers here */
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA,     &response);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA,     &ctx->response);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, _header_callback);
 
-    struct _payload_data ipd = { NULL, 0, 0 };
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA,      &ipd);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA,      &ctx->ipd);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,  _data_callback);
 
     if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) {
@@ -137,11 +154,11 @@ xs_dict *xs_http_request(const char *method, const char *url,
             /* add the content-length header */
             curl_easy_setopt(curl, curl_method == CURLOPT_POST ? CURLOPT_POSTFIELDSIZE : CURLOPT_INFILESIZE, b_size);
 
-            pd.data = (char *)body;
-            pd.size = b_size;
-            pd.offset = 0;
+            ctx->pd.data = (char *)body;
+            ctx->pd.size = b_size;
+            ctx->pd.offset = 0;
 
-            curl_easy_setopt(curl, CURLOPT_READDATA,     &pd);
+            curl_easy_setopt(curl, CURLOPT_READDATA,     &ctx->pd);
             curl_easy_setopt(curl, CURLOPT_READFUNCTION, _post_callback);
         }
     }
@@ -151,22 +168,34 @@ xs_dict *xs_http_request(const char *method, const char *url,
     while (xs_dict_iter(&p, &k, &v)) {
         xs *h = xs_fmt("%s: %s", k, v);
 
-        list = curl_slist_append(list, h);
+        ctx->list = curl_slist_append(ctx->list, h);
     }
 
     /* disable server support for 100-continue */
-    list = curl_slist_append(list, "Expect:");
+    ctx->list = curl_slist_append(ctx->list, "Expect:");
 
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ctx->list);
+
+    return curl;
+}
 
-    /* do it */
-    CURLcode cc = curl_easy_perform(curl);
 
+xs_dict *xs_http_request_end(void *handle, int cc, int *status,
+                        xs_str **payload, int *p_size)
+/* collects the result of a request (cc being the CURLcode
+   of the transfer) and frees the handle */
+{
+    CURL *curl = handle;
+    struct _xs_http_ctx *ctx = NULL;
+    long lstatus = 0;
+    xs_dict *response;
+
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&ctx);
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &lstatus);
 
     curl_easy_cleanup(curl);
 
-    curl_slist_free_all(list);
+    curl_slist_free_all(ctx->list);
 
     if (status != NULL) {
         if (lstatus == 0) {
@@ -181,21 +210,52 @@ xs_dict *xs_http_request(const char *method, const char *url,
     }
 
     if (p_size != NULL)
-        *p_size = ipd.size;
+        *p_size = ctx->ipd.size;
 
     if (payload != NULL) {
-        *payload = ipd.data;
+        *payload = ctx->ipd.data;
 
         /* add an asciiz just in case (but not touching p_size) */
-        if (ipd.data != NULL)
-            ipd.data[ipd.size] = '\0';
+        if (ctx->ipd.data != NULL)
+            ctx->ipd.data[ctx->ipd.size] = '\0';
     }
     else
-        xs_free(ipd.data);
+        xs_free(ctx->ipd.data);
+
+    response = ctx->response;
+    free(ctx);
 
     return response;
 }
 
+
+xs_dict *xs_http_request(const char *method, const char *url,
+                        const xs_dict *headers,
+                        const xs_str *body, int b_size, int *status,
+                        xs_str **payload, int *p_size, int timeout)
+/* does an HTTP request */
+{
+    CURL *curl = xs_http_request_new(method, url, headers, body, b_size, timeout);
+
+    if (curl == NULL) {
+        if (status != NULL)
+            *status = -CURLE_OUT_OF_MEMORY;
+
+        if (p_size != NULL)
+            *p_size = 0;
+
+        if (payload != NULL)
+            *payload = NULL;
+
+        return xs_dict_new();
+    }
+
+    /* do it */
+    CURLcode cc = curl_easy_perform(curl);
+
+    return xs_http_request_end(curl, cc, status, payload, p_size);
+}
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* _XS_CURL_H */
@@ -5,13 +5,21 @@
 #define _XS_HTTPD_H
 
 xs_str *xs_url_dec(const char *str);
+xs_str *xs_url_enc(const char *str);
 xs_dict *xs_url_vars(const char *str);
+xs_list *xs_httpd_header(const char *line);
+long xs_httpd_content_length(const char *str);
 xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size);
 void xs_httpd_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size);
+void xs_httpd_response_start(FILE *f, int status, xs_dict *headers);
+void xs_httpd_chunk(FILE *f, const char *data, int size);
+void xs_httpd_response_end(FILE *f);
 
 
 #ifdef XS_IMPLEMENTATION
 
+#include <limits.h>
+
 xs_str *xs_url_dec(const char *str)
 /* decodes an URL */
 {
@@ -41,6 +49,88 @@ xs_str *xs_url_dec(const char *str)
 }
 
 
+xs_str *xs_url_enc(const char *str)
+/* encodes an URL */
+{
+    xs_str *s = xs_str_new(NULL);
+
+    while (*str) {
+        unsigned char uc = *str;
+
+        if (isalnum(uc) || strchr("-._~", uc) != NULL)
+            s = xs_append_m(s, str, 1);
+        else {
+            char tmp[4];
+
+            snprintf(tmp, sizeof(tmp), "%%%02X", uc);
+            s = xs_append_m(s, tmp, 3);
+        }
+
+        str++;
+    }
+
+    return s;
+}
+
+
+xs_list *xs_httpd_header(const char *line)
+/* splits a header line (without the line end) into its lowercased
+   name and its value, or returns NULL if it's malformed */
+{
+    const char *c = strchr(line, ':');
+    const char *p;
+
+    if (c == NULL || c == line)
+        return NULL;
+
+    /* no whitespace or control characters allowed in the name,
+       nor line ends anywhere */
+    for (p = line; p < c; p++) {
+        if ((unsigned char) *p <= ' ' || *p == 0x7f)
+            return NULL;
+    }
+
+    if (strpbrk(c, "\r\n") != NULL)
+        return NULL;
+
+    xs *name  = xs_str_new(NULL);
+    xs *value = xs_str_new(c + 1);
+
+    name  = xs_append_m(name, line, c - line);
+    name  = xs_tolower_i(name);
+    value = xs_strip_chars_i(value, " \t");
+
+    xs_list *l = xs_list_new();
+
+    l = xs_list_append(l, name);
+    l = xs_list_append(l, value);
+
+    return l;
+}
+
+
+long xs_httpd_content_length(const char *str)
+/* parses a Content-Length value; returns -1 if it's not valid */
+{
+    long cl = 0;
+
+    if (*str == '\0')
+        return -1;
+
+    for (; *str; str++) {
+        if (*str < '0' || *str > '9')
+            return -1;
+
+        cl = cl * 10 + (*str - '0');
+
+        if (cl > INT_MAX)
+            return -1;
+    }
+
+    return cl;
+}
+
+
 xs_dict *xs_url_vars(const char *str)
 /* parse url variables */
 {
@@ -205,8 +295,13 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
     xs *p_vars = NULL;
     xs *l1, *l2;
     char *v;
+    int fd = fileno(f);
+
+    /* memory streams (already read requests) have no socket */
+    if (fd != -1)
+        xs_socket_timeout(fd, 2.0, 0.0);
 
-    xs_socket_timeout(fileno(f), 2.0, 0.0);
+    errno = 0;
 
     /* read the first line and split it */
     l1 = xs_strip_i(xs_readline(f));
@@ -236,26 +331,48 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 
     /* read the headers */
     for (;;) {
-        xs *l, *p = NULL;
+        xs *l = xs_readline(f);
+        xs *p = NULL;
+
+        /* eof or a (deprecated and ambiguous) continuation line? bad request */
+        if (l == NULL || *l == '\0' || *l == ' ' || *l == '\t')
+            return xs_free(req);
 
-        l = xs_strip_i(xs_readline(f));
+        l = xs_strip_chars_i(l, "\r\n");
 
         /* done with the header? */
         if (strcmp(l, "") == 0)
             break;
 
         /* split header and content */
-        p = xs_split_n(l, ": ", 1);
+        if ((p = xs_httpd_header(l)) == NULL)
+            return xs_free(req);
+
+        const char *name = xs_list_get(p, 0);
+
+        /* only one content length, please */
+        if (strcmp(name, "content-length") == 0 && xs_dict_get(req, name) != NULL)
+            return xs_free(req);
 
-        if (xs_list_len(p) == 2)
-            req = xs_dict_append(req, xs_tolower_i(xs_list_get(p, 0)), xs_list_get(p, 1));
+        req = xs_dict_append(req, name, xs_list_get(p, 1));
     }
 
-    xs_socket_timeout(fileno(f), 5.0, 0.0);
+    /* chunked (or otherwise encoded) requests are not supported,
+       so their size cannot be known */
+    if (xs_dict_get(req, "transfer-encoding") != NULL)
+        return xs_free(req);
+
+    if (fd != -1)
+        xs_socket_timeout(fd, 5.0, 0.0);
 
     if ((v = xs_dict_get(req, "content-length")) != NULL) {
+        long cl = xs_httpd_content_length(v);
+
+        if (cl < 0)
+            return xs_free(req);
+
         /* if it has a payload, load it */
-        *p_size  = atoi(v);
+        *p_size  = cl;
         *payload = xs_read(f, p_size);
     }
 
@@ -282,8 +399,8 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 }
 
 
-void xs_httpd_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size)
-/* sends an httpd response */
+static void _xs_httpd_status(FILE *f, int status, xs_dict *headers)
+/* sends the status line and the headers */
 {
     xs *proto;
     xs_dict *p;
@@ -297,9 +414,16 @@ void xs_httpd_response(FILE *f, int status, xs_dict *headers, xs_str *body, int
     while (xs_dict_iter(&p, &k, &v)) {
         fprintf(f, "%s: %s\r\n", k, v);
     }
+}
+
+
+void xs_httpd_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size)
+/* sends an httpd response */
+{
+    _xs_httpd_status(f, status, headers);
 
-    if (b_size != 0)
-        fprintf(f, "content-length: %d\r\n", b_size);
+    /* always sent, so that the connection can be kept alive */
+    fprintf(f, "content-length: %d\r\n", b_size);
 
     fprintf(f, "\r\n");
 
@@ -308,6 +432,39 @@ void xs_httpd_response(FILE *f, int status, xs_dict *headers, xs_str *body, int
 }
 
 
+/* a response can also be sent in pieces as they are generated, using
+   the chunked transfer encoding (HTTP/1.1 clients only) */
+
+void xs_httpd_response_start(FILE *f, int status, xs_dict *headers)
+/* starts a chunked response */
+{
+    _xs_httpd_status(f, status, headers);
+
+    fprintf(f, "transfer-encoding: chunked\r\n");
+
+    fprintf(f, "\r\n");
+}
+
+
+void xs_httpd_chunk(FILE *f, const char *data, int size)
+/* sends a chunk of a response */
+{
+    /* an empty chunk would mean the end */
+    if (size > 0) {
+        fprintf(f, "%x\r\n", size);
+        fwrite(data, size, 1, f);
+        fprintf(f, "\r\n");
+    }
+}
+
+
+void xs_httpd_response_end(FILE *f)
+/* ends a chunked response */
+{
+    fprintf(f, "0\r\n\r\n");
+}
+
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* XS_HTTPD_H */
@@ -6,65 +6,85 @@
 
 int xs_json_dump(const xs_val *data, int indent, FILE *f);
 xs_str *xs_json_dumps(const xs_val *data, int indent);
+void xs_json_dump_sb(const xs_val *data, int level, int indent, xs_sb *b);
 xs_val *xs_json_loads(const xs_str *json);
+xs_val *xs_json_loads_sz(const char *json, int size);
 xs_val *xs_json_load(FILE *f);
+xs_val *xs_json_load_file(const char *fn);
 
 
 #ifdef XS_IMPLEMENTATION
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 /** IMPLEMENTATION **/
 
 /** JSON dumps **/
 
-static void _xs_json_dump_str(const char *data, FILE *f)
+static void _xs_json_dump_str(const char *data, xs_sb *b)
 /* dumps a string in JSON format */
 {
+    const char *p = data;
     unsigned char c;
-    fputs("\"", f);
 
-    while ((c = *data)) {
+    xs_sb_cat_m(b, "\"", 1);
+
+    while ((c = *p)) {
+        const char *e = NULL;
+        char tmp[8];
+
         if (c == '\n')
-            fputs("\\n", f);
+            e = "\\n";
         else
         if (c == '\r')
-            fputs("\\r", f);
+            e = "\\r";
         else
         if (c == '\t')
-            fputs("\\t", f);
+            e = "\\t";
         else
         if (c == '\\')
-            fputs("\\\\", f);
+            e = "\\\\";
         else
         if (c == '"')
-            fputs("\\\"", f);
+            e = "\\\"";
         else
-        if (c < 32)
-            fprintf(f, "\\u%04x", (unsigned int) c);
-        else
-            fputc(c, f);
+        if (c < 32) {
+            snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned int) c);
+            e = tmp;
+        }
 
-        data++;
+        if (e != NULL) {
+            /* flush the plain run and add the escape */
+            xs_sb_cat_m(b, data, p - data);
+            xs_sb_cat(b, e);
+            data = p + 1;
+        }
+
+        p++;
     }
 
-    fputs("\"", f);
+    xs_sb_cat_m(b, data, p - data);
+    xs_sb_cat_m(b, "\"", 1);
 }
 
 
-static void _xs_json_indent(int level, int indent, FILE *f)
+static void _xs_json_indent(int level, int indent, xs_sb *b)
 /* adds indentation */
 {
     if (indent) {
         int n;
 
-        fputc('\n', f);
+        xs_sb_cat_m(b, "\n", 1);
 
         for (n = 0; n < level * indent; n++)
-            fputc(' ', f);
+            xs_sb_cat_m(b, " ", 1);
     }
 }
 
 
-static void _xs_json_dump(const xs_val *s_data, int level, int indent, FILE *f)
+static void _xs_json_dump(const xs_val *s_data, int level, int indent, xs_sb *b)
 /* dumps partial data as JSON */
 {
     int c = 0;
@@ -73,66 +93,66 @@ static void _xs_json_dump(const xs_val *s_data, int level, int indent, FILE *f)
 
     switch (xs_type(data)) {
     case XSTYPE_NULL:
-        fputs("null", f);
+        xs_sb_cat(b, "null");
         break;
 
     case XSTYPE_TRUE:
-        fputs("true", f);
+        xs_sb_cat(b, "true");
         break;
 
     case XSTYPE_FALSE:
-        fputs("false", f);
+        xs_sb_cat(b, "false");
         break;
 
     case XSTYPE_NUMBER:
-        fputs(xs_number_str(data), f);
+        xs_sb_cat(b, xs_number_str(data));
         break;
 
     case XSTYPE_LIST:
-        fputc('[', f);
+        xs_sb_cat_m(b, "[", 1);
 
         while (xs_list_iter(&data, &v)) {
             if (c != 0)
-                fputc(',', f);
+                xs_sb_cat_m(b, ",", 1);
 
-            _xs_json_indent(level + 1, indent, f);
-            _xs_json_dump(v, level + 1, indent, f);
+            _xs_json_indent(level + 1, indent, b);
+            _xs_json_dump(v, level + 1, indent, b);
 
             c++;
         }
 
-        _xs_json_indent(level, indent, f);
-        fputc(']', f);
+        _xs_json_indent(level, indent, b);
+        xs_sb_cat_m(b, "]", 1);
 
         break;
 
     case XSTYPE_DICT:
-        fputc('{', f);
+        xs_sb_cat_m(b, "{", 1);
 
         xs_str *k;
         while (xs_dict_iter(&data, &k, &v)) {
             if (c != 0)
-                fputc(',', f);
+                xs_sb_cat_m(b, ",", 1);
 
-            _xs_json_indent(level + 1, indent, f);
+            _xs_json_indent(level + 1, indent, b);
 
-            _xs_json_dump_str(k, f);
-            fputc(':', f);
+            _xs_json_dump_str(k, b);
+            xs_sb_cat_m(b, ":", 1);
 
             if (indent)
-                fputc(' ', f);
+                xs_sb_cat_m(b, " ", 1);
 
-            _xs_json_dump(v, level + 1, indent, f);
+            _xs_json_dump(v, level + 1, indent, b);
 
             c++;
         }
 
-        _xs_json_indent(level, indent, f);
-        fputc('}', f);
+        _xs_json_indent(level, indent, b);
+        xs_sb_cat_m(b, "}", 1);
         break;
 
     case XSTYPE_STRING:
-        _xs_json_dump_str(data, f);
+        _xs_json_dump_str(data, b);
         break;
 
     default:
@@ -144,33 +164,38 @@ static void _xs_json_dump(const xs_val *s_data, int level, int indent, FILE *f)
 xs_str *xs_json_dumps(const xs_val *data, int indent)
 /* dumps data as a JSON string */
 {
-    xs_str *s = NULL;
-    size_t sz;
-    FILE *f;
+    xstype t = xs_type(data);
+    xs_sb b;
 
-    if ((f = open_memstream(&s, &sz)) != NULL) {
-        int r = xs_json_dump(data, indent, f);
-        fclose(f);
+    if (t != XSTYPE_LIST && t != XSTYPE_DICT)
+        return NULL;
 
-        if (!r)
-            s = xs_free(s);
-    }
+    xs_sb_init(&b);
+    _xs_json_dump(data, 0, indent, &b);
 
-    return s;
+    return xs_sb_result(&b);
+}
+
+
+void xs_json_dump_sb(const xs_val *data, int level, int indent, xs_sb *b)
+/* dumps data as JSON into a string builder, as if nested level deep
+   (for building big JSON documents by pieces) */
+{
+    _xs_json_dump(data, level, indent, b);
 }
 
 
 int xs_json_dump(const xs_val *data, int indent, FILE *f)
 /* dumps data into a file as JSON */
 {
-    xstype t = xs_type(data);
+    xs *s = xs_json_dumps(data, indent);
 
-    if (t == XSTYPE_LIST || t == XSTYPE_DICT) {
-        _xs_json_dump(data, 0, indent, f);
-        return 1;
-    }
+    if (s == NULL)
+        return 0;
 
-    return 0;
+    fputs(s, f);
+
+    return 1;
 }
 
 
@@ -178,6 +203,11 @@ int xs_json_dump(const xs_val *data, int indent, FILE *f)
 
 /* this code comes mostly from the Minimum Profit Text Editor (MPDM) */
 
+/* JSON is parsed directly from a contiguous buffer (that is not
+   necessarily nul-terminated) instead of reading from a FILE char
+   by char; strings are allocated just once, as their raw size is
+   always enough for the decoded one */
+
 typedef enum {
     JS_ERROR = -1,
     JS_INCOMPLETE,
@@ -197,16 +227,139 @@ typedef enum {
     JS_OBJECT
 } js_type;
 
+typedef struct {
+    const char *p;      /* current position */
+    const char *e;      /* end of data */
+} js_buf;
+
+
+static int _xs_json_hex4(js_buf *b, unsigned int *cp)
+/* reads up to 4 hex digits */
+{
+    int n;
+
+    *cp = 0;
+
+    for (n = 0; n < 4 && b->p < b->e; n++) {
+        int c = *b->p;
+
+        if (c >= '0' && c <= '9')
+            c -= '0';
+        else
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            c = (c | 0x20) - 'a' + 10;
+        else
+            break;
+
+        *cp = *cp << 4 | c;
+        b->p++;
+    }
+
+    return n > 0;
+}
+
+
+static xs_str *_xs_json_load_str(js_buf *b, js_type *t)
+/* parses a string (the opening quote has already been read) */
+{
+    const char *q = b->p;
+    xs_str *v;
+    char *d;
+
+    /* find the closing quote, to know the raw size */
+    while (q < b->e && *q != '"') {
+        if (*q == '\\')
+            q++;
+
+        q++;
+    }
+
+    if (q >= b->e) {
+        *t = JS_ERROR;
+        return NULL;
+    }
+
+    d = v = xs_realloc(NULL, _xs_blk_size(q - b->p + 1));
+
+    while (b->p < q) {
+        char c = *b->p++;
+
+        if (c == '\\') {
+            unsigned int cp = (unsigned char) *b->p++;
+
+            switch (cp) {
+            case 'n': cp = '\n'; break;
+            case 'r': cp = '\r'; break;
+            case 't': cp = '\t'; break;
+            case 'u': /* Unicode codepoint as an hex char */
+                if (!_xs_json_hex4(b, &cp)) {
+                    *t = JS_ERROR;
+                    break;
+                }
+
+                if (cp >= 0xd800 && cp <= 0xdfff) {
+                    /* it's a surrogate pair */
+                    unsigned int i;
+
+                    cp = (cp & 0x3ff) << 10;
+
+                    /* \u must follow */
+                    if (q - b->p < 2 || b->p[0] != '\\' || b->p[1] != 'u') {
+                        *t = JS_ERROR;
+                        break;
+                    }
+
+                    b->p += 2;
+
+                    if (!_xs_json_hex4(b, &i)) {
+                        *t = JS_ERROR;
+                        break;
+                    }
+
+                    cp |= (i & 0x3ff);
+                    cp += 0x10000;
+                }
+
+                /* replace dangerous control codes with their visual representations */
+                if (cp < ' ' && !strchr("\r\n\t", cp))
+                    cp += 0x2400;
+
+                break;
+            }
+
+            if (*t == JS_ERROR)
+                break;
+
+            /* a NUL cannot be stored in a string: drop it */
+            if (cp != 0)
+                d = _xs_utf8_enc(d, cp);
+        }
+        else
+            *d++ = c;
+    }
+
+    *d = '\0';
+
+    /* skip the closing quote */
+    b->p = q + 1;
+
+    if (*t == JS_ERROR)
+        v = xs_free(v);
+
+    return v;
+}
 
-static xs_val *_xs_json_load_lexer(FILE *f, js_type *t)
+
+static xs_val *_xs_json_load_lexer(js_buf *b, js_type *t)
 {
-    int c;
+    int c = EOF;
     xs_val *v = NULL;
 
     *t = JS_ERROR;
 
     /* skip blanks */
-    while ((c = fgetc(f)) == L' ' || c == L'\t' || c == L'\n' || c == L'\r');
+    while (b->p < b->e && ((c = *b->p++) == ' ' || c == '\t' || c == '\n' || c == '\r'))
+        c = EOF;
 
     if (c == '{')
         *t = JS_OCURLY;
@@ -228,91 +381,54 @@ static xs_val *_xs_json_load_lexer(FILE *f, js_type *t)
     else
     if (c == '"') {
         *t = JS_STRING;
+        v = _xs_json_load_str(b, t);
+    }
+    else
+    if (c == '-' || (c >= '0' && c <= '9') || c == '.') {
+        /* copy the number, as the buffer may not be nul-terminated */
+        char tmp[64];
+        char *end;
+        int n = 0;
 
-        v = xs_str_new(NULL);
-
-        while ((c = fgetc(f)) != '"' && c != EOF && *t != JS_ERROR) {
-            if (c == '\\') {
-                unsigned int cp = fgetc(f);
-
-                switch (cp) {
-                case 'n': cp = '\n'; break;
-                case 'r': cp = '\r'; break;
-                case 't': cp = '\t'; break;
-                case 'u': /* Unicode codepoint as an hex char */
-                    if (fscanf(f, "%04x", &cp) != 1) {
-                        *t = JS_ERROR;
-                        break;
-                    }
-
-                    if (cp >= 0xd800 && cp <= 0xdfff) {
-                        /* it's a surrogate pair */
-                        cp = (cp & 0x3ff) << 10;
-
-                        /* \u must follow */
-                        if (fgetc(f) != '\\' || fgetc(f) != 'u') {
-                            *t = JS_ERROR;
-                            break;
-                        }
-
-                        unsigned int i;
-                        if (fscanf(f, "%04x", &i) != 1) {
-                            *t = JS_ERROR;
-                            break;
-                        }
-
-                        cp |= (i & 0x3ff);
-                        cp += 0x10000;
-                    }
-
-                    /* replace dangerous control codes with their visual representations */
-                    if (cp < ' ' && !strchr("\r\n\t", cp))
-                        cp += 0x2400;
+        b->p--;
 
-                    break;
-                }
+        while (n < (int) sizeof(tmp) - 1 && b->p + n < b->e &&
+               strchr("0123456789+-.eE", b->p[n]) && b->p[n])
+            n++;
 
-                v = xs_utf8_enc(v, cp);
-            }
-            else {
-                char cc = c;
-                v = xs_append_m(v, &cc, 1);
-            }
-        }
+        memcpy(tmp, b->p, n);
+        tmp[n] = '\0';
 
-        if (c == EOF)
-            *t = JS_ERROR;
-    }
-    else
-    if (c == '-' || (c >= '0' && c <= '9') || c == '.') {
-        double d;
+        double d = strtod(tmp, &end);
 
-        ungetc(c, f);
-        if (fscanf(f, "%lf", &d) == 1) {
+        if (end != tmp) {
             *t = JS_NUMBER;
             v = xs_number_new(d);
+            b->p += end - tmp;
         }
     }
     else
     if (c == 't') {
-        if (fgetc(f) == 'r' && fgetc(f) == 'u' && fgetc(f) == 'e') {
+        if (b->e - b->p >= 3 && memcmp(b->p, "rue", 3) == 0) {
             *t = JS_TRUE;
             v = xs_val_new(XSTYPE_TRUE);
+            b->p += 3;
         }
     }
     else
     if (c == 'f') {
-        if (fgetc(f) == 'a' && fgetc(f) == 'l' &&
-            fgetc(f) == 's' && fgetc(f) == 'e') {
+        if (b->e - b->p >= 4 && memcmp(b->p, "alse", 4) == 0) {
             *t = JS_FALSE;
             v = xs_val_new(XSTYPE_FALSE);
+            b->p += 4;
         }
     }
     else
     if (c == 'n') {
-        if (fgetc(f) == 'u' && fgetc(f) == 'l' && fgetc(f) == 'l') {
+        if (b->e - b->p >= 3 && memcmp(b->p, "ull", 3) == 0) {
             *t = JS_NULL;
             v = xs_val_new(XSTYPE_NULL);
+            b->p += 3;
         }
     }
 
@@ -323,10 +439,10 @@ static xs_val *_xs_json_load_lexer(FILE *f, js_type *t)
 }
 
 
-static xs_list *_xs_json_load_array(FILE *f, js_type *t);
-static xs_dict *_xs_json_load_object(FILE *f, js_type *t);
+static xs_list *_xs_json_load_array(js_buf *b, js_type *t);
+static xs_dict *_xs_json_load_object(js_buf *b, js_type *t);
 
-static xs_list *_xs_json_load_array(FILE *f, js_type *t)
+static xs_list *_xs_json_load_array(js_buf *b, js_type *t)
 /* parses a JSON array */
 {
     xs_list *l = xs_list_new();
@@ -336,7 +452,7 @@ static xs_list *_xs_json_load_array(FILE *f, js_type *t)
 
     while (*t == JS_INCOMPLETE) {
         js_type tt;
-        xs *v = _xs_json_load_lexer(f, &tt);
+        xs *v = _xs_json_load_lexer(b, &tt);
 
         if (tt == JS_ERROR)
             break;
@@ -348,16 +464,16 @@ static xs_list *_xs_json_load_array(FILE *f, js_type *t)
 
         if (c > 0) {
             if (tt == JS_COMMA)
-                v = _xs_json_load_lexer(f, &tt);
+                v = _xs_json_load_lexer(b, &tt);
             else
                 break;
         }
 
         if (tt == JS_OBRACK)
-            v = _xs_json_load_array(f, &tt);
+            v = _xs_json_load_array(b, &tt);
         else
         if (tt == JS_OCURLY)
-            v = _xs_json_load_object(f, &tt);
+            v = _xs_json_load_object(b, &tt);
 
         if (tt < JS_VALUE)
             break;
@@ -373,19 +489,17 @@ static xs_list *_xs_json_load_array(FILE *f, js_type *t)
 }
 
 
-static xs_dict *_xs_json_load_object(FILE *f, js_type *t)
+static xs_dict *_xs_json_load_object(js_buf *b, js_type *t)
 /* parses a JSON object */
 {
     xs_dict *d = xs_dict_new();
     int c = 0;
 
-    d = xs_dict_new();
-
     *t = JS_INCOMPLETE;
 
     while (*t == JS_INCOMPLETE) {
         js_type tt;
-        xs *k = _xs_json_load_lexer(f, &tt);
+        xs *k = _xs_json_load_lexer(b, &tt);
         xs *v = NULL;
 
         if (tt == JS_ERROR)
@@ -398,7 +512,7 @@ static xs_dict *_xs_json_load_object(FILE *f, js_type *t)
 
         if (c > 0) {
             if (tt == JS_COMMA)
-                k = _xs_json_load_lexer(f, &tt);
+                k = _xs_json_load_lexer(b, &tt);
             else
                 break;
         }
@@ -406,18 +520,18 @@ static xs_dict *_xs_json_load_object(FILE *f, js_type *t)
         if (tt != JS_STRING)
             break;
 
-        xs_free(_xs_json_load_lexer(f, &tt));
+        xs_free(_xs_json_load_lexer(b, &tt));
 
         if (tt != JS_COLON)
             break;
 
-        v = _xs_json_load_lexer(f, &tt);
+        v = _xs_json_load_lexer(b, &tt);
 
         if (tt == JS_OBRACK)
-            v = _xs_json_load_array(f, &tt);
+            v = _xs_json_load_array(b, &tt);
         else
         if (tt == JS_OCURLY)
-            v = _xs_json_load_object(f, &tt);
+            v = _xs_json_load_object(b, &tt);
 
         if (tt < JS_VALUE)
             break;
@@ -433,34 +547,83 @@ static xs_dict *_xs_json_load_object(FILE *f, js_type *t)
 }
 
 
+xs_val *xs_json_loads_sz(const char *json, int size)
+/* loads a buffer in JSON format */
+{
+    js_buf b = { json, json + size };
+    xs_val *v = NULL;
+    js_type t;
+
+    xs_free(_xs_json_load_lexer(&b, &t));
+
+    if (t == JS_OBRACK)
+        v = _xs_json_load_array(&b, &t);
+    else
+    if (t == JS_OCURLY)
+        v = _xs_json_load_object(&b, &t);
+
+    return v;
+}
+
+
 xs_val *xs_json_loads(const xs_str *json)
 /* loads a string in JSON format and converts to a multiple data */
 {
-    FILE *f;
+    return xs_json_loads_sz(json, strlen(json));
+}
+
+
+xs_val *xs_json_load(FILE *f)
+/* loads a JSON file */
+{
     xs_val *v = NULL;
+    char *buf = NULL;
+    int size  = 0;
+    int n;
+
+    /* read it all */
+    do {
+        char *nbuf = realloc(buf, size + 65536);
+
+        if (nbuf == NULL)
+            break;
+
+        buf   = nbuf;
+        n     = fread(buf + size, 1, 65536, f);
+        size += n;
+    } while (n == 65536);
 
-    if ((f = fmemopen((char *)json, strlen(json), "r")) != NULL) {
-        v = xs_json_load(f);
-        fclose(f);
+    if (buf != NULL) {
+        v = xs_json_loads_sz(buf, size);
+        free(buf);
     }
 
     return v;
 }
 
 
-xs_val *xs_json_load(FILE *f)
-/* loads a JSON file */
+xs_val *xs_json_load_file(const char *fn)
+/* loads a JSON file by mapping it into memory. As its size must not
+   change while being read, only use it on files that are replaced
+   (not rewritten) when updated */
 {
     xs_val *v = NULL;
-    js_type t;
+    struct stat st;
+    int fd;
 
-    xs_free(_xs_json_load_lexer(f, &t));
+    if ((fd = open(fn, O_RDONLY)) == -1)
+        return NULL;
 
-    if (t == JS_OBRACK)
-        v = _xs_json_load_array(f, &t);
-    else
-    if (t == JS_OCURLY)
-        v = _xs_json_load_object(f, &t);
+    if (fstat(fd, &st) != -1 && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (m != MAP_FAILED) {
+            v = xs_json_loads_sz(m, st.st_size);
+            munmap(m, st.st_size);
+        }
+    }
+
+    close(fd);
 
     return v;
 }
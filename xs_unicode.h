@@ -4,6 +4,7 @@
 
 #define _XS_UNICODE_H
 
+ char *_xs_utf8_enc(char buf[4], unsigned int cpoint);
  xs_str *xs_utf8_enc(xs_str *str, unsigned int cpoint);
  unsigned int xs_utf8_dec(char **str);
  unsigned int *_xs_unicode_upper_search(unsigned int cpoint);